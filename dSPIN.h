@@ -53,13 +53,69 @@ dSPIN_support.c - Contains functions used to implement the high-level commands,
    values usable by the dsPIN controller. Also contains the specialized configuration
    function for the dsPIN chip and the onboard peripherals needed to use it.
 dSPIN_main.c - Contains a sanity test routine.
+dSPIN_stepclock.c - Software step clock generator for dSPIN_Step_Clock() mode;
+   plays a table of step times out on the STCK line from a real-time thread.
+dSPIN_predict.c - Host-side copy of the chip's profile generator: predicts when
+   a Move/GoTo/Run/SoftStop ends and where the motor is at any tick.
+dSPIN_poll.c - Status polling scheduler for several axes on one bus; reads
+   each within a staleness bound and densely around predicted events.
+dSPIN_sweep.c - Characterization sweep for the fastest stall-free MAX_SPEED/ACC/
+   KVAL settings, configuration profiles to save them in, and warm attach to a
+   chip that already holds one.
+dSPIN_tune.c - Command line front end to the sweep; writes a profile file.
+dSPIN_program.c - Interpreter for line-oriented motion programs, parsed ahead
+   into a lookahead buffer by a reader thread while motion runs.
+dSPIN_play.c - Runs a motion program from a file or stdin, or a compiled one.
+dSPIN_blend.c - Blends same-direction moves into one motion with Run speed
+   changes at the segment boundaries, ending in a GoTo.
+dSPIN_bytecode.c - Compiles motion programs to pre-encoded SPI frames, and
+   plays a compiled file straight from a memory mapping.
+dSPIN_compile.c - Command line front end to the compiler.
+dSPIN_board.c - Status board: per-axis state published in shared memory under
+   seqlocks, for other processes to read without the bus.
+dSPIN_watch.c - Prints the status board from another process.
+dSPIN_telemetry.c - High-rate telemetry recorder: delta encoded, column-wise
+   chunks written out by a background thread, and a reader for them.
+dSPIN_telecsv.c - Exports a stretch of a telemetry recording as CSV.
+dSPIN_fast.h - Driver template specialized at compile time for one chip's
+   backend, pins and timing, with per-register widths as constants.
+dSPIN_co.h - C++20 coroutine API: motion sequences as coroutines, resumed by
+   one event loop on BUSYN edges and timers.
+dSPIN_home.c - Homing engine: runs GoUntil/ReleaseSW sequences on many axes at
+   once, stepping each on its BUSYN edges, with timeouts.
+dSPIN_ring.c - Command rings in shared memory: other processes submit motion
+   commands without a socket, and get completions back the same way.
+dSPIN_rt.c - Real-time mode: SCHED_FIFO, CPU pinning and locked, prefaulted
+   memory for the timing-critical threads, and a wakeup latency histogram.
+dSPIN_trigger.c - Position triggers: a GPIO edge or callback as an axis crosses
+   given positions, timed from the predicted profile and refined by reads.
+dSPIN_journal.c - Position journal: a memory-mapped file of per-axis homing
+   state, checked against the chips after a restart to skip homing.
+dSPIN_encoder.c - Closed-loop position correction: an external encoder read
+   at a fixed rate against ABS_POS, with lost steps made up once idle.
+dSPIN_limits.c - Soft limits and keep-out zones, some coupled between axes,
+   checked on every motion command; Runs stopped in time short of them.
+dSPIN_path.c - Path simplification: dense toolpath samples cut down within a
+   tolerance, in parallel, to a short motion program of blended moves.
+dSPIN_sim.c/dSPIN_sim.h - Simulated dSPIN chips standing in for wiringPi when
+   built with -DdSPIN_SIM (see "make bench").
+dSPIN_bench.c - Checks and measurements run against the simulator.
  *****************************************************************/
 
+#ifndef dSPIN_H
+#define dSPIN_H
+
 // emulate silly Arduino convention
 typedef unsigned char byte;
 
-// include the wiringPi library for GPIO:
+#include <stdio.h>
+
+// include the wiringPi library for GPIO, or the simulator that stands in for it:
+#ifdef dSPIN_SIM
+#include "dSPIN_sim.h"
+#else
 #include <wiringPi.h>
+#endif
 
 // Pin settings are arbitrary and can be changed to any available
 // GPIO pin.
@@ -69,6 +125,7 @@ typedef unsigned char byte;
 #define dSPIN_MOSI			 27		// Wire this to the SDI line
 #define dSPIN_MISO			 4		// Wire this to the SDO line
 #define dSPIN_CLK 			 17		// Wire this to the CK line
+#define dSPIN_STCK       22   // Wire this to the STCK line
 
 /*SPI clock settings */
 #define dSPIN_SPI_CLOCK_DELAY 1  //Not scientifically derived.
@@ -232,7 +289,7 @@ typedef unsigned char byte;
 #define dSPIN_STATUS_MOT_STATUS_CONST_SPD     (0x0003)<<13 // Motor at constant speed
 
 // Register address redefines.
-//  See the dSPIN_Param_Handler() function for more info about these.
+//  See dSPIN_Regs below and dSPIN_commands.c for more info about these.
 #define dSPIN_ABS_POS              0x01
 #define dSPIN_EL_POS               0x02
 #define dSPIN_MARK                 0x03
@@ -259,6 +316,102 @@ typedef unsigned char byte;
 #define dSPIN_CONFIG               0x18
 #define dSPIN_STATUS               0x19
 
+// Register map: one entry per address, in address order. dSPIN_GetParam(),
+//  dSPIN_SetParam(), dSPIN_fast.h, the bytecode compiler and the simulator
+//  all take a register's frame from here, so a width is only written once.
+//  bits is the register's width and bytes how many bytes follow the command
+//  byte; reset is the power-on value and reserved the bits that have to be
+//  written as zero. Address 0 (and anything past STATUS) isn't a register:
+//  the frame is the command byte alone.
+#define dSPIN_REG_RO 0   // read only
+#define dSPIN_REG_RW 1   // always writable
+#define dSPIN_REG_WS 2   // writable only when the motor is stopped
+#define dSPIN_REG_WH 3   // writable only when the bridges are in HiZ
+
+#define dSPIN_REG_COUNT 0x1A
+
+typedef struct
+{
+  byte addr;
+  byte bits;
+  byte bytes;
+  byte access;             // dSPIN_REG_*
+  unsigned long reset;
+  unsigned long reserved;
+} dSPIN_RegInfo;
+
+static constexpr dSPIN_RegInfo dSPIN_Regs[dSPIN_REG_COUNT] = {
+  { 0x00,              0, 0, dSPIN_REG_RO, 0,      0 },      // NOP
+  { dSPIN_ABS_POS,    22, 3, dSPIN_REG_WS, 0,      0 },
+  { dSPIN_EL_POS,      9, 2, dSPIN_REG_WS, 0,      0 },
+  { dSPIN_MARK,       22, 3, dSPIN_REG_RW, 0,      0 },
+  { dSPIN_SPEED,      20, 3, dSPIN_REG_RO, 0,      0 },
+  { dSPIN_ACC,        12, 2, dSPIN_REG_WS, 0x08A,  0 },
+  { dSPIN_DEC,        12, 2, dSPIN_REG_WS, 0x08A,  0 },
+  { dSPIN_MAX_SPEED,  10, 2, dSPIN_REG_RW, 0x041,  0 },
+  { dSPIN_MIN_SPEED,  13, 2, dSPIN_REG_WS, 0,      0 },      // bit 12 is LSPD_OPT
+  { dSPIN_KVAL_HOLD,   8, 1, dSPIN_REG_RW, 0x29,   0 },
+  { dSPIN_KVAL_RUN,    8, 1, dSPIN_REG_RW, 0x29,   0 },
+  { dSPIN_KVAL_ACC,    8, 1, dSPIN_REG_RW, 0x29,   0 },
+  { dSPIN_KVAL_DEC,    8, 1, dSPIN_REG_RW, 0x29,   0 },
+  { dSPIN_INT_SPD,    14, 2, dSPIN_REG_WH, 0x0408, 0 },
+  { dSPIN_ST_SLP,      8, 1, dSPIN_REG_WH, 0x19,   0 },
+  { dSPIN_FN_SLP_ACC,  8, 1, dSPIN_REG_WH, 0x29,   0 },
+  { dSPIN_FN_SLP_DEC,  8, 1, dSPIN_REG_WH, 0x29,   0 },
+  { dSPIN_K_THERM,     4, 1, dSPIN_REG_RW, 0,      0 },
+  { dSPIN_ADC_OUT,     5, 1, dSPIN_REG_RO, 0,      0 },
+  { dSPIN_OCD_TH,      4, 1, dSPIN_REG_RW, 0x08,   0 },
+  { dSPIN_STALL_TH,    7, 1, dSPIN_REG_RW, 0x40,   0 },
+  { dSPIN_FS_SPD,     10, 2, dSPIN_REG_RW, 0x027,  0 },
+  { dSPIN_STEP_MODE,   8, 1, dSPIN_REG_WH, 0x07,   0x08 },
+  { dSPIN_ALARM_EN,    8, 1, dSPIN_REG_WS, 0xFF,   0 },
+  { dSPIN_CONFIG,     16, 2, dSPIN_REG_WH, 0x2E88, 0x0040 },
+  { dSPIN_STATUS,     16, 2, dSPIN_REG_RO, 0,      0 },
+};
+
+// The entry for a register address.
+static constexpr const dSPIN_RegInfo &dSPIN_RegFor(byte param)
+{
+  return dSPIN_Regs[param < dSPIN_REG_COUNT ? param : 0];
+}
+
+static constexpr unsigned long dSPIN_RegMask(const dSPIN_RegInfo &r)
+{
+  return r.bits ? 0xFFFFFFFFUL >> (32 - r.bits) : 0;
+}
+
+// The value a SetParam frame carries: saturated to the register's width
+//  (a too-large speed becomes the largest one rather than a small one),
+//  reserved bits cleared, and zero for a read-only register. Written as
+//  selects and masks so it compiles without branches.
+static constexpr unsigned long dSPIN_RegEncode(const dSPIN_RegInfo &r, unsigned long v)
+{
+  unsigned long mask = dSPIN_RegMask(r);
+  unsigned long writable = 0UL - (unsigned long)(r.access != dSPIN_REG_RO);
+  return (v > mask ? mask : v) & ~r.reserved & writable;
+}
+
+// The register value in the bytes that came back.
+static constexpr unsigned long dSPIN_RegDecode(const dSPIN_RegInfo &r, unsigned long v)
+{
+  return v & dSPIN_RegMask(r);
+}
+
+// Every entry is at its own address, has the bytes its width needs, and a
+//  power-on value that fits and leaves the reserved bits clear.
+static constexpr bool dSPIN_RegsConsistent()
+{
+  for (int i = 0; i < dSPIN_REG_COUNT; i++)
+  {
+    const dSPIN_RegInfo &r = dSPIN_Regs[i];
+    if (r.addr != i || r.bits > 24 || r.bytes != (r.bits + 7) / 8) return false;
+    if ((r.reset & ~dSPIN_RegMask(r)) || (r.reserved & ~dSPIN_RegMask(r))) return false;
+    if (r.reset & r.reserved) return false;
+  }
+  return true;
+}
+static_assert(dSPIN_RegsConsistent(), "dSPIN_Regs is inconsistent");
+
 //dSPIN commands
 #define dSPIN_NOP                  0x00
 #define dSPIN_SET_PARAM            0x00
@@ -286,7 +439,7 @@ typedef unsigned char byte;
 
 /* dSPIN action options */
 #define ACTION_RESET  0x00
-#define ACTION_COPY   0x01
+#define ACTION_COPY   0x08   // bit 3 of GoUntil/ReleaseSW, next to DIR
 
 /* basic error codes */
 #define dSPIN_STATUS_GOOD 0
@@ -295,15 +448,126 @@ typedef unsigned char byte;
 
 /***************** dSPIN_support.c ***********************/
 
+// Several dSPINs can share the SDI, SDO and CK lines, each with its own CSN
+//  (and optionally BUSYN) line. Axis 0 is the chip on dSPIN_CS/dSPIN_BUSYN.
+#define dSPIN_MAX_AXES 128
+#define dSPIN_NO_PIN   0xFF   // for an axis whose BUSYN line isn't wired
+
+typedef struct
+{
+  byte cs;
+  byte busy;
+} dSPIN_AxisPins;
+
+// Register another dSPIN on its own chip select (and BUSYN, or dSPIN_NO_PIN)
+//  line. Returns the new axis number, or -1 if the table is full.
+int dSPIN_AddAxis(byte cs_pin, byte busy_pin);
+
+// Number of axes registered, including axis 0.
+int dSPIN_Axes();
+
+// The axis on chip select line cs_pin, or -1 if none is.
+int dSPIN_AxisOnPin(byte cs_pin);
+
+// Direct this thread's commands at another axis. All the command functions
+//  below talk to the selected axis.
+void dSPIN_Select(int axis);
+
+// The axis this thread's commands go to.
+int dSPIN_Selected();
+
+// The selected axis' BUSYN pin, or dSPIN_NO_PIN if it isn't wired.
+byte dSPIN_BusyPin();
+
+// Set the selected axis' oscillator frequency as a ratio to the nominal 16MHz
+//  (1.03 for a chip running 3% fast), as dSPIN_CalibrateOsc() measures it.
+//  The unit conversions below and the host side predictions use it from then
+//  on for that axis; 0 goes back to nominal.
+void dSPIN_SetOsc(float ratio);
+
+// The selected axis' oscillator ratio, 1 if it was never set.
+float dSPIN_Osc();
+
+// Measure the selected axis' oscillator by running the motor at stepsPerSec
+//  and timing ABS_POS against the host clock for ms milliseconds, then set
+//  it. Returns the ratio, or 0 if the motor didn't run as asked. The motor
+//  must be free to turn.
+float dSPIN_CalibrateOsc(float stepsPerSec, unsigned int ms);
+
+// Non-zero while the selected axis is busy executing a command.
+int dSPIN_Busy();
+
+// Host monotonic time in nanoseconds; the time base for everything the
+//  library schedules on the host side.
+unsigned long long dSPIN_Now();
+
+// Sleep until dSPIN_Now() reaches ns.
+void dSPIN_SleepUntil(unsigned long long ns);
+
+// Rising edges on BUSYN lines, for waiting on several axes at once. Arm
+//  returns 0 if the pin can't interrupt (or is dSPIN_NO_PIN); poll those.
+//  Wait sleeps until the count has moved past seen, or until dSPIN_Now()
+//  reaches ns, whichever is first.
+int dSPIN_Edge_Arm(byte pin);
+unsigned long dSPIN_Edge_Count();
+void dSPIN_Edge_Wait(unsigned long seen, unsigned long long ns);
+
+// Bus priority classes, highest first. A thread's traffic queues in the class
+//  it set with dSPIN_Bus_SetClass(), dSPIN_BUS_NORMAL if it never did.
+#define dSPIN_BUS_EMERGENCY 0   // hard stops and HiZ
+#define dSPIN_BUS_HIGH      1   // motion commands that mustn't wait
+#define dSPIN_BUS_NORMAL    2
+#define dSPIN_BUS_LOW       3   // status polling, telemetry
+#define dSPIN_BUS_CLASSES   4
+#define dSPIN_ALL_AXES      -1
+
+typedef struct
+{
+  unsigned long frames[dSPIN_BUS_CLASSES];             // bus grants per class
+  unsigned long long wait_ns_max[dSPIN_BUS_CLASSES];   // longest wait for the bus
+  unsigned long long hold_ns_max;                      // longest anyone kept it
+  unsigned long long hold_ns_sum;                      // time it was held, all told
+  unsigned long stops;                                 // emergency commands sent
+  unsigned long long stop_ns_sum, stop_ns_max;         // asked for to sent
+} dSPIN_BusStats;
+
+void dSPIN_Bus_SetClass(int cls);
+int dSPIN_Bus_Class();
+
+// Hold the bus across one frame, or several nested in an outer pair. The
+//  command functions do this themselves.
+void dSPIN_Bus_Begin();
+void dSPIN_Bus_End();
+
+// Ask for dSPIN_HARD_STOP or dSPIN_HARD_HIZ on an axis, or on dSPIN_ALL_AXES,
+//  ahead of everything queued. Returns at once, with -1 if there's no such
+//  axis; safe in a signal handler.
+int dSPIN_Emergency(int axis, byte cmd);
+
+// The same for the selected axis, returning once the command has been sent.
+//  dSPIN_HardStop() and dSPIN_HardHiZ() use this.
+void dSPIN_Bus_Stop(byte cmd);
+
+void dSPIN_Bus_GetStats(dSPIN_BusStats *stats);
+void dSPIN_Bus_ResetStats();
+
 /* Call this first to set up raspi SPI interface and reset dSPIN to
  * ready state.
  */
 int dSPIN_init();
+
+/* The same without the reset: the chips keep their registers and position.
+ *  Check each axis with dSPIN_Attach() before relying on them.
+ */
+int dSPIN_init_warm();
 	
 /* This simple function shifts a byte out over SPI and receives a byte over
  *  SPI.  */
 byte dSPIN_Xfer(byte data);
 
+// The conversions below are for the selected axis' oscillator: the factors
+//  given are for the nominal 250ns tick, and are scaled by dSPIN_Osc().
+
 // The value in the ACC register is [(steps/s/s)*(tick^2)]/(2^-40) where tick is 
 //  250ns (datasheet value)- 0x08A on boot.
 // Multiply desired steps/s/s by .137438 to get an appropriate value for this register.
@@ -355,6 +619,20 @@ unsigned long dSPIN_Param(unsigned long value, byte bit_len);
 //  the dSPIN chip.
 void dSPIN_SetParam(byte param, unsigned long value);
 
+// SetParam with a value known when the program is built, checked against the
+//  register map then rather than saturated at run time:
+//  dSPIN_SET_CONST(dSPIN_STALL_TH, 0x40).
+template <byte Param, unsigned long Value>
+inline void dSPIN_SetConst()
+{
+  static_assert(Param > 0 && Param < dSPIN_REG_COUNT, "not a register");
+  static_assert(dSPIN_Regs[Param].access != dSPIN_REG_RO, "register is read only");
+  static_assert(Value <= dSPIN_RegMask(dSPIN_Regs[Param]), "value too wide for the register");
+  static_assert(!(Value & dSPIN_Regs[Param].reserved), "value sets reserved bits");
+  dSPIN_SetParam(Param, Value);
+}
+#define dSPIN_SET_CONST(param, value) dSPIN_SetConst<(param), (value)>()
+
 // Realize the "get parameter" function, to read from the various registers in
 //  the dSPIN chip.
 unsigned long dSPIN_GetParam(byte param);
@@ -392,6 +670,9 @@ void dSPIN_Move(byte dir, unsigned long n_step);
 //  in the shortest possible fashion.
 void dSPIN_GoTo(unsigned long pos);
 
+// Same as GOTO, but with user constrained rotational direction.
+void dSPIN_GoTo_DIR(byte dir, unsigned long pos);
+
 // GoUntil will set the motor running with direction dir (REV or
 //  FWD) until a falling edge is detected on the SW pin. Depending
 //  on bit SW_MODE in CONFIG, either a hard stop or a soft stop is
@@ -443,3 +724,870 @@ void dSPIN_HardHiZ();
 //  any warning flags and exits any error states. Using GetParam()
 //  to read STATUS does not clear these values.
 int dSPIN_GetStatus();
+
+/************ dSPIN_stepclock.c ***********************/
+
+// Each pulse is scheduled against an absolute deadline. The generator thread
+//  sleeps until dSPIN_STCK_SPIN_NS before the deadline and busy-waits the rest
+//  of the way, which keeps the sleep's wakeup latency out of the pulse timing.
+#define dSPIN_STCK_SPIN_NS   50000  // 50us spin window before each edge
+#define dSPIN_STCK_PULSE_NS  1000   // STCK high time; datasheet minimum is 300ns
+#define dSPIN_STCK_HIST_BINS 64     // lateness histogram, 1us per bin
+
+// Per-pulse timing of the last (or current) step clock run. Lateness is how far
+//  after its deadline each rising edge was actually driven.
+typedef struct
+{
+  unsigned long pulses;            // edges emitted so far
+  long min_ns;                     // smallest lateness seen
+  long max_ns;                     // largest lateness seen
+  double mean_ns;                  // running mean lateness
+  double rms_ns;                   // RMS lateness
+  unsigned long overruns;          // edges that missed the spin window
+  unsigned long hist[dSPIN_STCK_HIST_BINS]; // last bin collects the tail
+} dSPIN_StepClock_Stats;
+
+// Fill table[] with the times (ns from start) of each step of a velocity curve
+//  given in steps/s as a function of seconds, for duration seconds. The curve
+//  is integrated numerically; a step is due each time the integral crosses the
+//  next whole step. Returns the number of entries written (at most max).
+unsigned long dSPIN_StepClock_Table(float (*stepsPerSec)(float t, void *arg), void *arg,
+                                    float duration, unsigned long long *table,
+                                    unsigned long max);
+
+// Put the chip in step clock mode in direction dir and start the generator
+//  thread. table[] holds n step times in ns, relative to the start and
+//  increasing; it must stay valid until the run finishes. A non-zero priority
+//  asks for SCHED_FIFO at that priority. Returns dSPIN_STATUS_GOOD, or
+//  dSPIN_STATUS_FATAL if a run is already active or the thread can't start.
+int dSPIN_StepClock_Start(byte dir, const unsigned long long *table, unsigned long n,
+                          int priority);
+
+// Non-zero while the generator is still emitting pulses.
+int dSPIN_StepClock_Busy();
+
+// Block until every pulse in the table has been sent.
+void dSPIN_StepClock_Wait();
+
+// Abandon the rest of the table. The chip stays in step clock mode.
+void dSPIN_StepClock_Stop();
+
+// Copy out the timing statistics gathered so far.
+void dSPIN_StepClock_GetStats(dSPIN_StepClock_Stats *stats);
+
+/************ dSPIN_predict.c ***********************/
+
+// One tick of the dSPIN's internal oscillator at its nominal 16MHz.
+#define dSPIN_TICK_NS 250
+
+// Everything the chip's profile generator works from: the raw ACC, DEC,
+//  MAX_SPEED, MIN_SPEED, FS_SPD and STEP_MODE registers, plus where the motor
+//  is and what it's doing when the command is issued.
+typedef struct
+{
+  unsigned long acc, dec, max_speed, min_speed, fs_spd, step_mode;
+  unsigned long speed;         // SPEED register
+  long abs_pos;                // ABS_POS, sign extended
+  byte dir;                    // FWD or REV, from STATUS
+} dSPIN_MotionState;
+
+#define dSPIN_PREDICT_SEGMENTS 6
+
+// A predicted profile. Ticks count from the tick the command is accepted.
+typedef struct
+{
+  unsigned long long ticks;      // until the motor stops
+  unsigned long long busy_ticks; // until BUSY is released (for Run, when the
+                                 //  target speed is reached)
+  long distance;                 // microsteps, FWD positive
+  unsigned long peak_speed;      // highest speed, SPEED register units
+  int triangular;                // positioning profile never reached MAX_SPEED
+
+  // The profile itself, used by the dSPIN_Predict*At() functions.
+  byte dir;
+  int ms;
+  int n_seg;
+  struct
+  {
+    unsigned long long n;        // ticks in this segment
+    unsigned long long v;        // speed before the first tick, 2^-40 steps/tick
+    long long s;                 // speed change per tick
+    int sign;                    // -1 while braking against dir
+  } seg[dSPIN_PREDICT_SEGMENTS];
+} dSPIN_Prediction;
+
+// Read the registers the profile generator uses, plus the current speed,
+//  direction and position, from the chip.
+void dSPIN_GetMotionState(dSPIN_MotionState *st);
+
+// Predict the profile of a command issued from state st. These mirror
+//  dSPIN_Move(), dSPIN_GoTo(), dSPIN_Run() and dSPIN_SoftStop().
+void dSPIN_PredictMove(const dSPIN_MotionState *st, byte dir, unsigned long n_step,
+                       dSPIN_Prediction *p);
+void dSPIN_PredictGoTo(const dSPIN_MotionState *st, unsigned long pos, dSPIN_Prediction *p);
+void dSPIN_PredictRun(const dSPIN_MotionState *st, byte dir, unsigned long spd,
+                      dSPIN_Prediction *p);
+void dSPIN_PredictSoftStop(const dSPIN_MotionState *st, dSPIN_Prediction *p);
+
+// Microsteps moved (signed, FWD positive) tick ticks after the command.
+long dSPIN_PredictPosAt(const dSPIN_Prediction *p, unsigned long long tick);
+
+// Speed, in SPEED register units, tick ticks after the command.
+unsigned long dSPIN_PredictSpeedAt(const dSPIN_Prediction *p, unsigned long long tick);
+
+// First tick at which the motor has moved at least offset microsteps (signed,
+//  FWD positive) from where the command started, or ULLONG_MAX if it never
+//  gets there.
+unsigned long long dSPIN_PredictTimeTo(const dSPIN_Prediction *p, long offset);
+
+// Convert a SPEED register value (or SpdCalc() result) back to steps/s, on
+//  the selected axis' oscillator.
+float dSPIN_StepsPerSec(unsigned long spd);
+
+// Convert the selected axis' chip ticks to seconds or nanoseconds.
+float dSPIN_TicksToSec(unsigned long long ticks);
+unsigned long long dSPIN_TicksToNs(unsigned long long ticks);
+
+/***************** dSPIN_poll.c ***********************/
+
+#define dSPIN_POLL_RESERVE    0.25f      // share of the budget kept for event polling
+#define dSPIN_POLL_WINDOW_NS  2000000ULL // dense polling starts this long before an event
+#define dSPIN_POLL_DENSE_NS   250000ULL  // read interval inside that window
+#define dSPIN_POLL_SLACK      4          // reads a routine read may be held up by
+#define dSPIN_POLL_RETRIES    3          // rereads when STATUS changes under a read
+
+// The scheduler's latest view of one axis.
+typedef struct
+{
+  unsigned int status;           // STATUS, read with GetParam so flags stay set
+  long abs_pos;                  // ABS_POS, sign extended
+  unsigned long speed;           // SPEED register
+  unsigned long long stamp_ns;   // dSPIN_Now() when it was read, 0 if never
+  unsigned long polls;
+  unsigned long long max_age_ns; // worst gap between two reads
+} dSPIN_PollState;
+
+typedef struct
+{
+  unsigned long polls;
+  unsigned long misses;          // reads that came after the staleness bound
+  unsigned long long bus_ns;     // time spent on the bus reading
+  unsigned long events;          // predicted events confirmed
+  unsigned long missed_events;   // predictions that never came true
+  unsigned long retries;         // rereads because STATUS changed meanwhile
+  unsigned long long detect_ns_sum, detect_ns_max;  // event to confirming read
+} dSPIN_PollStats;
+
+// Set the bus budget for status reads, and clear the schedule.
+void dSPIN_Poll_Setup(float polls_per_sec);
+
+// Schedule axis with a guaranteed maximum snapshot age. Returns
+//  dSPIN_STATUS_FATAL if the guarantee doesn't fit in the budget.
+int dSPIN_Poll_Axis(int axis, unsigned long max_stale_us);
+
+// Hint that the command just issued on axis follows profile p, so the end of
+//  it is worth catching quickly. Returns dSPIN_STATUS_FATAL for a bad axis.
+int dSPIN_Poll_Expect(int axis, const dSPIN_Prediction *p);
+
+// Hint that something happens on axis at dSPIN_Now() time at_ns.
+int dSPIN_Poll_Event(int axis, unsigned long long at_ns);
+
+// Sleep until the next read is due, do it, and return the axis read (or -1).
+int dSPIN_Poll_Once();
+
+// The latest snapshot of axis; dSPIN_STATUS_FATAL for a bad axis.
+int dSPIN_Poll_Get(int axis, dSPIN_PollState *state);
+void dSPIN_Poll_GetStats(dSPIN_PollStats *stats);
+
+/***************** dSPIN_sweep.c ***********************/
+
+// The registers that make up a configuration profile, as register values,
+//  and the oscillator calibration of the chip they were found on.
+typedef struct
+{
+  unsigned long max_speed, min_speed, acc, dec, fs_spd;
+  unsigned long kval_hold, kval_run, kval_acc, kval_dec;
+  unsigned long ocd_th, stall_th, step_mode, config;
+  double osc;                    // dSPIN_Osc()
+} dSPIN_Profile;
+
+void dSPIN_Profile_Read(dSPIN_Profile *p);
+// Leaves the bridges in HiZ, since STEP_MODE can't be written otherwise.
+void dSPIN_Profile_Apply(const dSPIN_Profile *p);
+int dSPIN_Profile_Save(const char *path, const dSPIN_Profile *p, const char *comment);
+int dSPIN_Profile_Load(const char *path, dSPIN_Profile *p);
+
+// Fingerprint of a profile's register values, to compare a chip against.
+unsigned long dSPIN_Profile_Hash(const dSPIN_Profile *p);
+
+// What dSPIN_Attach() found.
+#define dSPIN_ATTACH_WARM    0   // already configured as p; left as it was
+#define dSPIN_ATTACH_COLD    1   // reset and configured; position lost
+#define dSPIN_ATTACH_FAILED  2   // reset, but the registers didn't take
+
+// After dSPIN_init_warm(): adopt the selected axis as it is if its registers
+//  match p, or reset and configure it from p if they don't.
+int dSPIN_Attach(const dSPIN_Profile *p);
+
+// The grid a characterization sweep covers. Speeds are steps/s and
+//  accelerations steps/s/s, as taken by MaxSpdCalc() and AccCalc().
+typedef struct
+{
+  const float *acc;              // DEC is set to match
+  int n_acc;
+  const byte *kval_run;
+  int n_kval_run;
+  const byte *kval_acc;          // KVAL_DEC is set to match
+  int n_kval_acc;
+  float min_speed, max_speed;    // MAX_SPEED search range
+  unsigned long cruise_steps;    // full steps at speed in each test move
+  unsigned long ref_steps;       // full steps of the move results are ranked by
+  float margin;                  // share of the stall-free speed to keep, e.g. 0.8
+} dSPIN_SweepGrid;
+
+// The outcome for one grid combination.
+typedef struct
+{
+  float acc;
+  byte kval_run, kval_acc;
+  unsigned long max_speed;       // highest clean MAX_SPEED value, 0 if none
+  unsigned int fault;            // STATUS alarms seen above it (set bits)
+  unsigned long long ref_ticks;  // reference move time at the derated speed
+  int tests;                     // test moves run
+} dSPIN_SweepPoint;
+
+// Run the sweep with the motor free to turn. Returns the index of the best
+//  combination in pts (which needs room for every combination) with the
+//  profile to use in *best, or -1 if nothing ran clean.
+int dSPIN_Sweep(const dSPIN_SweepGrid *g, dSPIN_SweepPoint *pts, dSPIN_Profile *best);
+
+/***************** dSPIN_program.c ***********************/
+
+#define dSPIN_PROGRAM_LINE      256  // longest program line, with newline
+#define dSPIN_PROGRAM_LOOKAHEAD 64   // default commands parsed ahead
+#define dSPIN_PROGRAM_POLL_US   200  // BUSY poll interval while waiting
+
+// Program commands; see dSPIN_program.c for the syntax.
+#define dSPIN_OP_END      0
+#define dSPIN_OP_ERROR    1
+#define dSPIN_OP_AXIS     2
+#define dSPIN_OP_MOVE     3
+#define dSPIN_OP_GOTO     4
+#define dSPIN_OP_RUN      5
+#define dSPIN_OP_UNTIL    6
+#define dSPIN_OP_RELEASE  7
+#define dSPIN_OP_HOME     8
+#define dSPIN_OP_MARK     9
+#define dSPIN_OP_ZERO     10
+#define dSPIN_OP_STOP     11
+#define dSPIN_OP_HARDSTOP 12
+#define dSPIN_OP_SOFTHIZ  13
+#define dSPIN_OP_HIZ      14
+#define dSPIN_OP_WAIT     15
+#define dSPIN_OP_DWELL    16
+#define dSPIN_OP_SET      17
+#define dSPIN_OP_BLEND    18
+
+// One parsed command, with its argument already in register units.
+typedef struct
+{
+  int op;                  // dSPIN_OP_*
+  int line;                // source line
+  byte dir;                // FWD or REV
+  byte act;                // ACTION_RESET or ACTION_COPY
+  byte param;              // register, for dSPIN_OP_SET
+  unsigned long value;     // steps, position, speed, axis, ms or register value
+  unsigned long speed;     // MAX_SPEED value for a move, 0 for the current one
+} dSPIN_ProgOp;
+
+typedef struct
+{
+  unsigned long lines;     // lines read, once the reader is done
+  unsigned long ops;       // commands parsed
+  unsigned long executed;
+  unsigned long blended;   // chains of moves run through dSPIN_Blend()
+  int peak;                // most commands waiting in the lookahead at once
+  unsigned long starved;   // times the executor had to wait for the reader
+  unsigned long long starved_ns;
+} dSPIN_ProgramStats;
+
+typedef struct dSPIN_Program dSPIN_Program;
+
+int dSPIN_Program_Parse(char *line, dSPIN_ProgOp *op);
+dSPIN_Program *dSPIN_Program_Open(FILE *in, int lookahead);
+int dSPIN_Program_Step(dSPIN_Program *p);
+int dSPIN_Program_Run(dSPIN_Program *p);
+void dSPIN_Program_GetStats(dSPIN_Program *p, dSPIN_ProgramStats *stats);
+void dSPIN_Program_Close(dSPIN_Program *p);
+
+/***************** dSPIN_blend.c ***********************/
+
+#define dSPIN_BLEND_POLL_US 200  // ABS_POS read interval near a switch point
+#define dSPIN_BLEND_MAX     16   // longest chain the program interpreter blends
+
+// One segment of a path: dir and steps as for dSPIN_Move(), and the speed to
+//  cross it at as a MAX_SPEED value (MaxSpdCalc()), 0 for the current one.
+typedef struct
+{
+  byte dir;
+  unsigned long steps;
+  unsigned long speed;
+} dSPIN_Segment;
+
+typedef struct
+{
+  int chains;              // runs of segments that were blended
+  int commands;            // commands sent
+  unsigned long reads;     // ABS_POS reads spent timing switches
+  long switch_err;         // worst distance from a planned switch, microsteps
+  long end_err;            // worst chain end position error, microsteps
+} dSPIN_BlendStats;
+
+int dSPIN_Blend(const dSPIN_Segment *seg, int n, dSPIN_BlendStats *st);
+
+/***************** dSPIN_bytecode.c ***********************/
+
+// A compiled program is an 8-byte header (dSPIN_BYTECODE_MAGIC, then the
+//  version and three zero bytes) and a list of records: a kind byte, a length
+//  byte and that many bytes of payload.
+#define dSPIN_BYTECODE_MAGIC   "dSBC"
+#define dSPIN_BYTECODE_VERSION 1
+#define dSPIN_BC_END    0      // end of the program
+#define dSPIN_BC_XFER   1      // bytes to send as they are, one frame each
+#define dSPIN_BC_WAIT   2      // wait for BUSY to clear
+#define dSPIN_BC_AXIS   3      // select the axis in the payload byte
+#define dSPIN_BC_DWELL  4      // pause for the payload's ms, MSB first
+
+typedef struct
+{
+  unsigned long size;      // bytes in the file
+  unsigned long records;
+  unsigned long spi_bytes; // bytes sent per run
+  unsigned long waits;
+} dSPIN_BytecodeStats;
+
+typedef struct dSPIN_Bytecode dSPIN_Bytecode;
+
+int dSPIN_Compile(FILE *in, FILE *out, int *line);
+dSPIN_Bytecode *dSPIN_Bytecode_Open(const char *path);
+int dSPIN_Bytecode_Run(const dSPIN_Bytecode *bc);
+void dSPIN_Bytecode_GetStats(const dSPIN_Bytecode *bc, dSPIN_BytecodeStats *stats);
+void dSPIN_Bytecode_Close(dSPIN_Bytecode *bc);
+
+/***************** dSPIN_board.c ***********************/
+
+#define dSPIN_BOARD_NAME  "/dSPIN_board"   // default shared memory name
+#define dSPIN_BOARD_MAGIC 0x6453426FU
+
+// One axis as the status board shows it.
+typedef struct
+{
+  long abs_pos;                  // ABS_POS, sign extended
+  unsigned long speed;           // SPEED register
+  unsigned int status;           // STATUS as read, with GetParam
+  byte mot_status;               // 0 stopped, 1 accelerating, 2 decelerating, 3 constant speed
+  byte dir;                      // FWD or REV
+  byte busy, hiz;
+  unsigned int alarms;           // dSPIN_STATUS_* alarm bits that are active, as set bits
+  unsigned long long stamp_ns;   // dSPIN_Now() of the owner when read, 0 if never
+  unsigned long updates;         // times this axis has been published
+} dSPIN_AxisState;
+
+typedef struct dSPIN_Board dSPIN_Board;
+
+// Owner: create the board in shared memory for axes axes; NULL on failure.
+dSPIN_Board *dSPIN_Board_Create(const char *name, int axes);
+
+// Reader: attach to a board another process created, read-only; NULL if none.
+dSPIN_Board *dSPIN_Board_Attach(const char *name);
+
+// How many axes the board has.
+int dSPIN_Board_Axes(const dSPIN_Board *b);
+
+// Fill st from raw STATUS, ABS_POS and SPEED values.
+void dSPIN_Board_Decode(dSPIN_AxisState *st, unsigned int status, long abs_pos,
+                        unsigned long speed, unsigned long long stamp_ns);
+
+// Owner: publish st for axis; safe from several threads at once.
+void dSPIN_Board_Publish(dSPIN_Board *b, int axis, const dSPIN_AxisState *st);
+
+// Owner: read axis from the chip and publish it.
+void dSPIN_Board_Sample(dSPIN_Board *b, int axis);
+
+// Copy out a consistent snapshot of axis. Returns the retries it took, or -1.
+int dSPIN_Board_Read(const dSPIN_Board *b, int axis, dSPIN_AxisState *st);
+
+// Detach, or for the owner, take the board down too.
+void dSPIN_Board_Close(dSPIN_Board *b);
+
+/***************** dSPIN_telemetry.c ***********************/
+
+#define dSPIN_TELEMETRY_MAGIC   "dSTM"
+#define dSPIN_TELEMETRY_VERSION 1
+#define dSPIN_TELEMETRY_CHUNK   4096   // samples per chunk
+
+// One sample of one axis, in register values.
+typedef struct
+{
+  unsigned long long t_ns;       // dSPIN_Now() when read
+  int axis;
+  unsigned long speed;           // SPEED
+  long abs_pos;                  // ABS_POS, sign extended
+  unsigned int status;           // STATUS, as read with GetParam
+  byte adc;                      // ADC_OUT
+} dSPIN_TeleSample;
+
+typedef struct
+{
+  unsigned long samples;         // recorded
+  unsigned long dropped;         // lost because every chunk was waiting to be written
+  unsigned long chunks;          // written out
+  unsigned long long bytes;      // written out, not counting the file header
+} dSPIN_TelemetryStats;
+
+typedef struct dSPIN_Telemetry dSPIN_Telemetry;
+typedef struct dSPIN_TeleReader dSPIN_TeleReader;
+
+// Start recording to path through chunks (at least 2) buffers; NULL on failure.
+dSPIN_Telemetry *dSPIN_Telemetry_Create(const char *path, int chunks);
+
+// Record one sample; samples come in time order, from one thread.
+void dSPIN_Telemetry_Add(dSPIN_Telemetry *t, const dSPIN_TeleSample *s);
+
+// Read axis from the chip and record it.
+void dSPIN_Telemetry_Sample(dSPIN_Telemetry *t, int axis);
+
+// Copy out the counts so far.
+void dSPIN_Telemetry_GetStats(dSPIN_Telemetry *t, dSPIN_TelemetryStats *stats);
+
+// Write out the rest and close, with the final counts in stats; -1 on a failed write.
+int dSPIN_Telemetry_Close(dSPIN_Telemetry *t, dSPIN_TelemetryStats *stats);
+
+// Open a recording for the samples from from_ns to to_ns; NULL if it isn't one.
+dSPIN_TeleReader *dSPIN_TeleReader_Open(const char *path, unsigned long long from_ns,
+                                        unsigned long long to_ns);
+
+// The next sample in the range: 1, 0 at the end, or -1 if the file is damaged.
+int dSPIN_TeleReader_Next(dSPIN_TeleReader *r, dSPIN_TeleSample *s);
+
+void dSPIN_TeleReader_Close(dSPIN_TeleReader *r);
+
+/***************** dSPIN_home.c ***********************/
+
+// One axis' homing sequence. Each step is skipped when its speed (or the
+//  back-off distance) is 0; the ones left run in this order:
+//  seek      GoUntil towards the switch at seek_speed
+//  backoff   Move backoff microsteps away from it
+//  slow      GoUntil towards it again at slow_speed
+//  release   ReleaseSW away from it at release_speed (via MIN_SPEED)
+//  Every switch edge applies act, so the last step decides where ABS_POS
+//  reads 0 (ACTION_RESET) or what lands in MARK (ACTION_COPY).
+typedef struct
+{
+  byte dir;                      // towards the switch, FWD or REV
+  float seek_speed;              // steps/s
+  unsigned long backoff;         // microsteps
+  float slow_speed;              // steps/s
+  float release_speed;           // steps/s
+  byte act;                      // ACTION_RESET or ACTION_COPY
+  unsigned long timeout_ms;      // for the whole sequence, 0 for none
+} dSPIN_HomeConfig;
+
+// Steps, for dSPIN_HomeResult.step.
+#define dSPIN_HOME_SEEK      0
+#define dSPIN_HOME_BACKOFF   1
+#define dSPIN_HOME_SLOW      2
+#define dSPIN_HOME_RELEASE   3
+#define dSPIN_HOME_DONE      4
+
+// Results.
+#define dSPIN_HOME_OK        0
+#define dSPIN_HOME_TIMEOUT   1   // the sequence ran out of time; hard stopped
+#define dSPIN_HOME_NO_SWITCH 2   // a GoUntil ended without the switch closing,
+                                 //  or the switch was open for ReleaseSW
+#define dSPIN_HOME_ON_SWITCH 3   // still on the switch after backing off
+#define dSPIN_HOME_ALARM     4   // an alarm went off or a command was refused
+
+typedef struct
+{
+  int result;                    // dSPIN_HOME_*
+  int step;                      // step it ended in
+  unsigned int status;           // last STATUS read, as GetStatus() returned it
+  long pos;                      // ABS_POS when done, or MARK for ACTION_COPY
+  unsigned long long ns;         // from start to done or failure
+} dSPIN_HomeResult;
+
+// How often an axis without a BUSYN line is polled while homing.
+#define dSPIN_HOME_POLL_US   2000
+
+// Home n axes at once, axes[i] with cfg[i], and fill in res[i]. Steps
+//  advance on BUSYN rising edges (wiringPiISR()); axes with no BUSYN line
+//  are polled instead. Returns the number of axes that failed.
+int dSPIN_Home(const int *axes, const dSPIN_HomeConfig *cfg, dSPIN_HomeResult *res, int n);
+
+/***************** dSPIN_ring.c ***********************/
+
+#define dSPIN_RING_NAME    "/dSPIN_ring"   // default shared memory name
+#define dSPIN_RING_MAGIC   0x6453526EU
+#define dSPIN_RING_SLOTS   256             // commands in flight per client; a power of 2
+#define dSPIN_RING_SPIN_NS 50000           // spin this long before sleeping, with >1 CPU
+
+// Operations.
+#define dSPIN_RING_RUN       1             // arg is the speed, as for dSPIN_Run()
+#define dSPIN_RING_MOVE      2             // arg is microsteps
+#define dSPIN_RING_GOTO      3             // arg is the position
+#define dSPIN_RING_SOFT_STOP 4
+#define dSPIN_RING_HARD_STOP 5
+#define dSPIN_RING_SOFT_HIZ  6
+#define dSPIN_RING_HARD_HIZ  7
+#define dSPIN_RING_BARRIER   0x80          // or'ed into a Run or GoTo: never coalesce it
+
+// Results.
+#define dSPIN_RING_DONE      0             // sent to the chip
+#define dSPIN_RING_INVALID   1             // refused by the owner
+#define dSPIN_RING_COALESCED 2             // superseded by a later setpoint; not sent
+#define dSPIN_RING_LIMITED   3             // refused by the axis' limits; not sent
+
+typedef struct
+{
+  unsigned int seq;
+  unsigned short axis;
+  byte op;                       // dSPIN_RING_*
+  byte dir;                      // FWD or REV
+  unsigned int arg;
+  unsigned long long submit_ns;  // CLOCK_MONOTONIC when submitted
+} dSPIN_RingCmd;
+
+typedef struct
+{
+  unsigned int seq;              // of the command
+  unsigned short axis;
+  byte op;
+  byte result;                   // dSPIN_RING_DONE etc.
+  unsigned long long submit_ns;  // CLOCK_MONOTONIC when submitted
+  unsigned long long bus_ns;     //  and when the owner took it to the bus (0 if it didn't)
+} dSPIN_RingDone;
+
+typedef struct
+{
+  unsigned long served;          // commands taken, coalesced ones included
+  unsigned long coalesced;       // Runs and GoTos superseded before they were sent
+  unsigned long setpoints;       // Runs and GoTos sent
+  unsigned long long age_ns_sum; //  and how long they'd waited, from submission
+  unsigned long long age_ns_max;
+} dSPIN_RingStats;
+
+typedef struct dSPIN_Ring dSPIN_Ring;
+
+// Owner: create the segment for clients clients and axes axes; NULL on failure.
+dSPIN_Ring *dSPIN_Ring_Create(const char *name, int clients, int axes);
+
+// Client: attach to the owner's segment and claim a pair of rings; NULL if none is free.
+dSPIN_Ring *dSPIN_Ring_Attach(const char *name);
+
+// How many axes the owner takes commands for.
+int dSPIN_Ring_Axes(const dSPIN_Ring *r);
+
+// Client: queue a command. Returns its sequence number, -1 if invalid, -2 if full.
+int dSPIN_Ring_Submit(dSPIN_Ring *r, byte op, int axis, byte dir, unsigned long arg);
+
+// Client: collect up to max completions, waiting up to timeout_ms for the first.
+int dSPIN_Ring_Reap(dSPIN_Ring *r, dSPIN_RingDone *done, int max, int timeout_ms);
+
+// Owner: wait up to timeout_ms for commands and carry out all there are.
+int dSPIN_Ring_Serve(dSPIN_Ring *r, int timeout_ms);
+
+// Commands the owner has carried out so far, coalesced ones included.
+unsigned long dSPIN_Ring_Served(const dSPIN_Ring *r);
+
+// Owner: copy out, or clear, the coalescing and setpoint age counts.
+void dSPIN_Ring_GetStats(const dSPIN_Ring *r, dSPIN_RingStats *stats);
+void dSPIN_Ring_ResetStats(dSPIN_Ring *r);
+
+// Give the client's rings back, or for the owner, take the segment down.
+void dSPIN_Ring_Close(dSPIN_Ring *r);
+
+/***************** dSPIN_rt.c ***********************/
+
+// Real-time mode, off until dSPIN_RT_Setup(). The library's timing-critical
+//  threads (the bus stopper and the step clock generator) join it as they
+//  start; application threads that drive the bus join with dSPIN_RT_Thread().
+#define dSPIN_RT_HIST_BINS 1000    // wakeup latency histogram, 1us per bin
+
+// Thread roles. A role runs at dSPIN_RTConfig.priority plus its number.
+#define dSPIN_RT_CONTROL   0       // application threads on the bus
+#define dSPIN_RT_STEPCLOCK 1       // the step clock generator
+#define dSPIN_RT_BUS       2       // the emergency stop thread
+
+// What was granted. Anything else was refused (for want of CAP_SYS_NICE or
+//  RLIMIT_MEMLOCK, usually) and left as it was.
+#define dSPIN_RT_GOT_FIFO  0x01    // SCHED_FIFO at the role's priority
+#define dSPIN_RT_GOT_CPUS  0x02    // pinned to the configured CPUs
+#define dSPIN_RT_GOT_LOCK  0x04    // memory locked, now and from now on
+#define dSPIN_RT_GOT_HEAP  0x08    // heap faulted in and kept
+#define dSPIN_RT_GOT_STACK 0x10    // stack faulted in
+
+typedef struct
+{
+  int priority;                    // SCHED_FIFO priority; 0 leaves scheduling alone
+  unsigned long cpus;              // bit n allows CPU n; 0 leaves affinity alone
+  int lock;                        // mlockall() the process
+  unsigned long heap_kb;           // heap to fault in up front and never give back
+  unsigned long stack_kb;          // stack each real-time thread faults in
+} dSPIN_RTConfig;
+
+// How late a thread woke from absolute sleeps.
+typedef struct
+{
+  unsigned long samples;
+  long min_ns;
+  long max_ns;
+  double mean_ns;
+  long p50_ns, p99_ns, p999_ns;    // to the bin, or max_ns past the last one
+  unsigned long overflow;          // samples past the last bin
+  unsigned long hist[dSPIN_RT_HIST_BINS]; // last bin collects the tail
+} dSPIN_RTLatency;
+
+// Call before dSPIN_init(). Returns the dSPIN_RT_GOT_* granted.
+int dSPIN_RT_Setup(const dSPIN_RTConfig *cfg);
+int dSPIN_RT_Enabled();
+// Make the calling thread a real-time thread of the given role. Returns the
+//  dSPIN_RT_GOT_* granted; 0 if real-time mode is off.
+int dSPIN_RT_Thread(int role);
+// Sleep samples times for period_us each in a thread of the given role, and
+//  histogram how late it woke. Returns what that thread was granted, or -1.
+int dSPIN_RT_Latency(int role, unsigned long period_us, unsigned long samples,
+                     dSPIN_RTLatency *lat);
+
+/***************** dSPIN_trigger.c ***********************/
+
+#define dSPIN_TRIG_MAX     32      // triggers per move
+#define dSPIN_TRIG_LEAD_US 20000   // first ABS_POS read this far ahead of a crossing
+#define dSPIN_TRIG_SPIN_NS 90000   // last stretch before a trigger; wiringPi
+                                   //  busy-waits delays under 100us
+
+// Results.
+#define dSPIN_TRIG_FIRED     0
+#define dSPIN_TRIG_UNREACHED 1     // the motion never gets there
+#define dSPIN_TRIG_REFUSED   2     // the limits refused the command; nothing moved
+
+// One trigger. Times are on the dSPIN_Now() clock.
+typedef struct
+{
+  long pos;                        // ABS_POS to fire at; set by the caller
+  int result;                      // dSPIN_TRIG_*
+  int reads;                       // ABS_POS reads spent refining it
+  unsigned long long predicted_ns; // crossing time from the profile alone
+  unsigned long long refined_ns;   // what it was timed for after the reads
+  unsigned long long fired_ns;     // when it went out
+  long long error_ns;              // fired_ns less the crossing time, as
+                                   //  measured by a read straight after
+} dSPIN_TrigEvent;
+
+int dSPIN_Trigger_Move(byte dir, unsigned long n_step, dSPIN_TrigEvent *ev, int n, byte pin,
+                       void (*fire)(int i, void *arg), void *arg);
+int dSPIN_Trigger_GoTo(unsigned long pos, dSPIN_TrigEvent *ev, int n, byte pin,
+                       void (*fire)(int i, void *arg), void *arg);
+
+/***************** dSPIN_journal.c ***********************/
+
+// Record flags.
+#define dSPIN_JOURNAL_HOMED   0x01   // homed, and nothing has cast doubt on it since
+#define dSPIN_JOURNAL_MOVING  0x02   // a command was sent and hasn't been seen to end
+#define dSPIN_JOURNAL_UNKNOWN 0x04   //  and where it ends couldn't be known ahead
+
+// What dSPIN_Journal_Check() found.
+#define dSPIN_JOURNAL_OK         0   // where the journal says; no need to home
+#define dSPIN_JOURNAL_MOVING_NOW 1   // still on its way; check again once it's idle
+#define dSPIN_JOURNAL_NO_RECORD  2   // never homed, or the record was lost
+#define dSPIN_JOURNAL_POWER      3   // undervoltage latched: power dropped or reset
+#define dSPIN_JOURNAL_ALARM      4   // step loss, overcurrent or thermal shutdown
+#define dSPIN_JOURNAL_CONFIG     5   // the registers aren't what it was homed with
+#define dSPIN_JOURNAL_POSITION   6   // ABS_POS or MARK isn't where it was left
+
+typedef struct
+{
+  unsigned int seq;                // update count
+  unsigned int epoch;              // times homed
+  unsigned int flags;              // dSPIN_JOURNAL_HOMED etc.
+  unsigned long config_hash;       // dSPIN_Profile_Hash() it was homed with
+  long abs_pos, mark;              // as last seen
+  long target;                     // where the last positioning command ends
+  unsigned int status;             // STATUS as last seen
+  unsigned long long wall_ns;      // CLOCK_REALTIME of the update
+} dSPIN_JournalRec;
+
+typedef struct dSPIN_Journal dSPIN_Journal;
+
+// Open or create the journal at path for axes axes; NULL if it can't be mapped.
+dSPIN_Journal *dSPIN_Journal_Open(const char *path, int axes);
+
+// The latest record of axis. Returns 0 if it has none.
+int dSPIN_Journal_Read(const dSPIN_Journal *j, int axis, dSPIN_JournalRec *rec);
+
+// The axis was just homed: reads it and clears its STATUS flags, so a later
+//  power drop shows.
+void dSPIN_Journal_Homed(dSPIN_Journal *j, int axis, unsigned long config_hash);
+
+// A positioning command ending at target is about to go out. No bus traffic.
+void dSPIN_Journal_Moving(dSPIN_Journal *j, int axis, long target);
+
+// Something whose end can't be known ahead is about to move axis. No bus traffic.
+void dSPIN_Journal_Free(dSPIN_Journal *j, int axis);
+
+// Record what a dSPIN_GetStatus() poll found. No bus traffic.
+void dSPIN_Journal_Note(dSPIN_Journal *j, int axis, unsigned int status, long abs_pos, long mark);
+
+// After a restart: dSPIN_JOURNAL_OK if homing can be skipped, else why not.
+int dSPIN_Journal_Check(dSPIN_Journal *j, int axis);
+
+// Flush the journal to disk.
+void dSPIN_Journal_Sync(dSPIN_Journal *j);
+
+void dSPIN_Journal_Close(dSPIN_Journal *j);
+
+
+/***************** dSPIN_encoder.c ***********************/
+
+// A position source. read() stores the count in *counts and returns 0, or
+//  non-zero if it can't be read; it must not touch the bus.
+typedef struct
+{
+  int (*read)(void *arg, long *counts);
+  void *arg;
+  float usteps_per_count;          // negative if it counts against FWD
+} dSPIN_EncoderSource;
+
+typedef struct
+{
+  unsigned long passes;            // reads that made it
+  unsigned long read_errors;
+  unsigned long late;              // passes that started a period or more late
+  unsigned long corrections;       // corrective ABS_POS/GoTo pairs sent
+  unsigned long long corrected_usteps;  //  and the errors they made up
+  unsigned long refused;           // corrective GoTos the limits refused
+  long err_last, err_max;          // encoder less ABS_POS, microsteps; max of |err|
+  unsigned long long err_abs_sum;
+  double err_sq_sum;
+  unsigned long long lat_ns_sum;   // first read to last frame, per pass
+  unsigned long long lat_ns_max;
+} dSPIN_EncoderStats;
+
+typedef struct dSPIN_Encoder dSPIN_Encoder;
+
+// Fill in src for a counter read as decimal text from path; -1 if it can't be opened.
+int dSPIN_Encoder_File(const char *path, float usteps_per_count, dSPIN_EncoderSource *src);
+void dSPIN_Encoder_FileClose(dSPIN_EncoderSource *src);
+
+// Close the loop on axis, zeroed against ABS_POS as it is; NULL if src can't be read.
+dSPIN_Encoder *dSPIN_Encoder_Open(int axis, const dSPIN_EncoderSource *src, long deadband);
+
+// One pass. Returns 1 if a correction went out, 0 if not, -1 on a read error.
+int dSPIN_Encoder_Step(dSPIN_Encoder *e);
+
+// Run a pass every period_us for ms milliseconds (0: until dSPIN_Encoder_Stop()).
+void dSPIN_Encoder_Run(dSPIN_Encoder *e, unsigned long period_us, unsigned long ms);
+
+// Make dSPIN_Encoder_Run() return after its current pass, from another thread.
+void dSPIN_Encoder_Stop(dSPIN_Encoder *e);
+
+// Copy out, or clear, the pass and error statistics.
+void dSPIN_Encoder_GetStats(const dSPIN_Encoder *e, dSPIN_EncoderStats *stats);
+void dSPIN_Encoder_ResetStats(dSPIN_Encoder *e);
+
+// Does not close the source.
+void dSPIN_Encoder_Close(dSPIN_Encoder *e);
+
+
+/***************** dSPIN_limits.c ***********************/
+
+#define dSPIN_LIMITS_PERIOD_US 5000   // dSPIN_Limits_Poll() period assumed until it's called
+#define dSPIN_LIMITS_SLACK_US  1000   // on top of that, for the reads and a late poll
+
+// Why a command was refused.
+#define dSPIN_LIMIT_OK      0
+#define dSPIN_LIMIT_RANGE   1   // it would leave the axis' range
+#define dSPIN_LIMIT_ZONE    2   // it would enter a keep-out zone
+#define dSPIN_LIMIT_COUPLED 3   //  one that applies while another axis is nearby
+#define dSPIN_LIMIT_ROOM    4   // a Run with no room to stop before a limit
+
+// A keep-out zone, lo to hi inclusive in ABS_POS. With other set to an axis,
+//  it only applies while that axis may be between other_lo and other_hi.
+typedef struct
+{
+  long lo, hi;
+  int id;                          // reported when it refuses a command
+  int other;                       // -1, or the axis it's coupled to
+  long other_lo, other_hi;
+} dSPIN_Zone;
+
+typedef struct
+{
+  unsigned long checks;            // commands checked
+  unsigned long refused;
+  unsigned long stops;             // Runs the watchdog stopped
+} dSPIN_LimitStats;
+
+// Give axis n keep-out zones, replacing any it had. Returns 0, or -1.
+int dSPIN_Limits_Set(int axis, const dSPIN_Zone *zones, int n);
+
+// Keep axis between ABS_POS lo and hi inclusive.
+void dSPIN_Limits_Range(int axis, long lo, long hi);
+
+// Take axis' range and zones away.
+void dSPIN_Limits_Clear(int axis);
+
+// Re-read axis' DEC, STEP_MODE and oscillator after changing any of them.
+void dSPIN_Limits_Refresh(int axis);
+
+// Check a path from ABS_POS from to to without bus traffic: dSPIN_LIMIT_OK or why not.
+int dSPIN_Limits_Check(int axis, long from, long to, int *id);
+
+// The motion commands call this before they send anything.
+int dSPIN_Limits_Allow(byte op, unsigned long arg);
+
+// Non-zero once any axis has limits.
+int dSPIN_Limits_Active();
+
+// Why this thread's last motion command was refused, or dSPIN_LIMIT_OK.
+int dSPIN_Limits_Last(int *id);
+
+// The watchdog, every period_us: stops Runs closing on a limit. Returns the stops.
+int dSPIN_Limits_Poll(unsigned long period_us);
+
+// Copy out, or clear, the check and refusal counts.
+void dSPIN_Limits_GetStats(dSPIN_LimitStats *stats);
+void dSPIN_Limits_ResetStats();
+
+
+/***************** dSPIN_path.c ***********************/
+
+#define dSPIN_PATH_CHUNK       65536   // samples simplified together
+#define dSPIN_PATH_MAX_THREADS 64
+
+typedef struct
+{
+  double tolerance;                // microsteps the motor may stray from the path
+  int usteps;                      // microsteps per step, for the move speeds
+  int chunk;                       // samples per chunk, 0 for dSPIN_PATH_CHUNK
+  int threads;                     // workers, 0 for one per core
+} dSPIN_PathConfig;
+
+typedef struct
+{
+  unsigned long lines, points;     // lines read, samples among them
+  unsigned long chunks;
+  int threads;
+  unsigned long vertices;          // samples kept, past the first
+  unsigned long commands;          // goto, moves and dwells written
+  double max_dev;                  // furthest a sample is from the output, microsteps
+  long start, end;                 // first and last position
+  unsigned long bad_line;          // line that isn't a sample, 0 if none
+  unsigned long long elapsed_ns;
+} dSPIN_PathStats;
+
+// Write a motion program following the path read from in to within the tolerance.
+//  Returns 0, or -1 on a bad line (st->bad_line) or when memory or threads run out.
+int dSPIN_Path_Simplify(FILE *in, FILE *out, const dSPIN_PathConfig *cfg, dSPIN_PathStats *st);
+
+#endif
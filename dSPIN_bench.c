@@ -0,0 +1,3308 @@
+//dSPIN_bench.c - Checks and measurements of the library run against the
+//										simulated dSPIN (build with "make bench").
+//  usage: bench <name> [args]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "dSPIN.h"
+#include "dSPIN_fast.h"
+#include "dSPIN_co.h"
+#include <dirent.h>
+#include <malloc.h>
+
+int bench_stepclock(int argc, char* argv[]);
+int bench_predict(int argc, char* argv[]);
+int bench_poll(int argc, char* argv[]);
+int bench_sweep(int argc, char* argv[]);
+int bench_program(int argc, char* argv[]);
+int bench_blend(int argc, char* argv[]);
+int bench_bytecode(int argc, char* argv[]);
+int bench_bus(int argc, char* argv[]);
+int bench_board(int argc, char* argv[]);
+int bench_telemetry(int argc, char* argv[]);
+int bench_osc(int argc, char* argv[]);
+int bench_fast(int argc, char* argv[]);
+int bench_home(int argc, char* argv[]);
+int bench_attach(int argc, char* argv[]);
+int bench_co(int argc, char* argv[]);
+int bench_regs(int argc, char* argv[]);
+int bench_ring(int argc, char* argv[]);
+int bench_soak(int argc, char* argv[]);
+int bench_rt(int argc, char* argv[]);
+int bench_trigger(int argc, char* argv[]);
+int bench_journal(int argc, char* argv[]);
+int bench_encoder(int argc, char* argv[]);
+int bench_limits(int argc, char* argv[]);
+int bench_path(int argc, char* argv[]);
+
+struct bench {
+	const char *name;
+	int (*fn)(int argc, char* argv[]);
+	const char *help;
+};
+
+static const struct bench benches[] = {
+	{ "stepclock", bench_stepclock, "[rate] [seconds]  play a cam profile on STCK, report jitter" },
+	{ "predict", bench_predict, "[moves]  compare predicted profiles with the simulated chip" },
+	{ "poll", bench_poll, "[axes] [polls/s] [stale ms] [seconds]  adaptive vs round-robin status polling" },
+	{ "sweep", bench_sweep, "[profile]  characterization sweep against a motor model" },
+	{ "program", bench_program, "[commands] [lookahead]  stream a long motion program through a pipe" },
+	{ "blend", bench_blend, "[segments]  blended vs stop-and-go same-direction moves" },
+	{ "bytecode", bench_bytecode, "[commands] [cycles]  compiled vs interpreted program, cycle after cycle" },
+	{ "bus", bench_bus, "[seconds] [pollers]  bus priority and emergency stop latency under load" },
+	{ "board", bench_board, "[seconds] [readers]  shared status board: torn reads and writer latency" },
+	{ "telemetry", bench_telemetry, "[seconds] [axes] [rate]  telemetry size, sampler latency, exact readback" },
+	{ "osc", bench_osc, "[calibration ms]  speed and move time errors before and after oscillator calibration" },
+	{ "fast", bench_fast, "[frames]  templated driver against the generic one: same frames, cost per frame" },
+	{ "home", bench_home, "[axes]  concurrent homing engine against homing one axis at a time" },
+	{ "attach", bench_attach, "[axes]  warm attach after a restart against reset, configure and home" },
+	{ "co", bench_co, "[axes] [watchers]  many coroutine motion sequences on one thread" },
+	{ "regs", bench_regs, "every register against the register map: power-on values, widths, LSPD_OPT" },
+	{ "ring", bench_ring, "[commands]  shared-memory command ring from another process against a pipe" },
+	{ "soak", bench_soak, "[axes] [threads] [seconds] [mix]  many axes and client threads under mixed load" },
+	{ "rt", bench_rt, "[samples] [period us] [priority]  wakeup latency with and without real-time mode" },
+	{ "trigger", bench_trigger, "[triggers] [osc]  position triggers on a move: profile-only vs refined timing" },
+	{ "journal", bench_journal, "[updates]  position journal: update cost, a killed writer, checks after a restart" },
+	{ "encoder", bench_encoder, "[moves] [slip]  closed loop on a simulated encoder: injected slip made up" },
+	{ "limits", bench_limits, "[zones]  soft limits and keep-out zones: check cost, refusals, Runs stopped short" },
+	{ "path", bench_path, "[samples] [tolerance]  simplify a dense toolpath in parallel and play it back" },
+};
+
+#define N_BENCHES (sizeof(benches)/sizeof(benches[0]))
+
+int main(int argc, char* argv[]){
+	if(argc>1){
+		for(unsigned i=0; i<N_BENCHES; i++)
+			if(!strcmp(argv[1], benches[i].name))
+				return benches[i].fn(argc-1, argv+1);
+	}
+	fprintf(stderr, "usage: %s <bench> [args]\n", argv[0]);
+	for(unsigned i=0; i<N_BENCHES; i++)
+		fprintf(stderr, "  %-10s %s\n", benches[i].name, benches[i].help);
+	return 1;
+}
+
+
+/******************** stepclock ********************/
+
+// Electronic cam: the base rate with a +/-50% sinusoidal modulation at 2Hz,
+//  something the internal profile generator can't produce.
+static float cam(float t, void *arg){
+	float rate = *(float *)arg;
+	return rate * (1.0f + 0.5f * sinf(2.0f * (float)M_PI * 2.0f * t));
+}
+
+int bench_stepclock(int argc, char* argv[]){
+	float rate = argc>1 ? atof(argv[1]) : 2000;
+	float seconds = argc>2 ? atof(argv[2]) : 1;
+	unsigned long max = (unsigned long)(rate * seconds * 2) + 16;
+	unsigned long long *table = (unsigned long long *)malloc(max * sizeof(*table));
+
+	dSPIN_init();
+	dSPIN_GetStatus();
+	unsigned long n = dSPIN_StepClock_Table(cam, &rate, seconds, table, max);
+	printf("stepclock: %lu steps over %.2fs, mean %.0f steps/s\n", n, seconds, n/seconds);
+
+	dSPIN_Sim_State before, after;
+	dSPIN_Sim_Peek(0, &before);
+	if(dSPIN_StepClock_Start(FWD, table, n, 80) != dSPIN_STATUS_GOOD){
+		fprintf(stderr, "stepclock: failed to start\n");
+		return 1;
+	}
+	dSPIN_StepClock_Wait();
+	dSPIN_Sim_Peek(0, &after);
+
+	dSPIN_StepClock_Stats st;
+	dSPIN_StepClock_GetStats(&st);
+	printf("pulses %lu, chip saw %llu edges, ABS_POS moved %lld\n", st.pulses,
+	       after.stck_edges - before.stck_edges, after.phys_pos - before.phys_pos);
+	printf("lateness ns: min %ld  mean %.0f  rms %.0f  max %ld  overruns %lu\n",
+	       st.min_ns, st.mean_ns, st.rms_ns, st.max_ns, st.overruns);
+	printf("histogram (us: count):");
+	for(int i=0; i<dSPIN_STCK_HIST_BINS; i++)
+		if(st.hist[i]) printf(" %d:%lu", i, st.hist[i]);
+	printf("\n");
+
+	free(table);
+	int ok = st.pulses == n && (long long)n == after.phys_pos - before.phys_pos
+	         && (after.status & dSPIN_STATUS_SCK_MOD);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** predict ********************/
+
+// Advance the virtual clock until device dev has run to tick t.
+static void run_to_tick(int dev, unsigned long long t){
+	dSPIN_Sim_State s;
+	dSPIN_Sim_Peek(dev, &s);
+	if(t > s.ticks) dSPIN_Sim_Advance((t - s.ticks) * dSPIN_TICK_NS);
+}
+
+static long lldiff(long long a, long long b){
+	return (long)(a > b ? a - b : b - a);
+}
+
+int bench_predict(int argc, char* argv[]){
+	int moves = argc>1 ? atoi(argv[1]) : 200;
+	long worst_ticks = 0, worst_pos = 0, worst_run = 0;
+	srand(1);
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+
+	for(int i=0; i<moves; i++){
+		// Random but sane settings; registers that need HiZ get it first.
+		dSPIN_HardHiZ();
+		dSPIN_SetParam(dSPIN_STEP_MODE, rand() % 8);
+		dSPIN_SetParam(dSPIN_ACC, 1 + rand() % 0x400);
+		dSPIN_SetParam(dSPIN_DEC, 1 + rand() % 0x400);
+		dSPIN_SetParam(dSPIN_MAX_SPEED, 8 + rand() % 0x200);
+		dSPIN_SetParam(dSPIN_MIN_SPEED, rand() % 2 ? 0 : rand() % 0x100);
+
+		dSPIN_MotionState st;
+		dSPIN_Prediction p;
+		dSPIN_Sim_State a, b, at;
+		dSPIN_GetMotionState(&st);
+		unsigned long n = 1 + rand() % 20000;
+		byte dir = rand() % 2 ? FWD : REV;
+		dSPIN_PredictMove(&st, dir, n, &p);
+		dSPIN_Sim_Peek(0, &at);
+		dSPIN_Move(dir, n);
+		dSPIN_Sim_Peek(0, &a);
+
+		// Position at a few points along the way.
+		for(int k=1; k<4; k++){
+			run_to_tick(0, a.start_tick + p.ticks * k / 4);
+			dSPIN_Sim_Peek(0, &b);
+			long e = labs((long)(b.phys_pos - at.phys_pos) - dSPIN_PredictPosAt(&p, b.ticks - a.start_tick));
+			if(e > worst_pos) worst_pos = e;
+		}
+		run_to_tick(0, a.start_tick + p.ticks + 100000);
+		dSPIN_Sim_Peek(0, &b);
+		long e = lldiff(b.stop_tick - b.start_tick, p.ticks);
+		if(e > worst_ticks) worst_ticks = e;
+		if(e > 4)
+			printf("move %d: %s %lu, predicted %llu ticks, chip took %llu\n", i,
+			       dir == FWD ? "FWD" : "REV", n, p.ticks, b.stop_tick - b.start_tick);
+
+		// Now a Run, and a SoftStop from speed.
+		dSPIN_GetMotionState(&st);
+		unsigned long spd = SpdCalc(50 + rand() % 1500);
+		dSPIN_PredictRun(&st, dir, spd, &p);
+		dSPIN_Sim_Peek(0, &at);
+		dSPIN_Run(dir, spd);
+		dSPIN_Sim_Peek(0, &a);
+		run_to_tick(0, a.start_tick + p.busy_ticks + 1000);
+		dSPIN_Sim_Peek(0, &b);
+		e = labs((long)(b.phys_pos - at.phys_pos) - dSPIN_PredictPosAt(&p, b.ticks - a.start_tick));
+		if(e > worst_pos) worst_pos = e;
+		// Then either brake, or GoTo somewhere straight from speed (possibly
+		//  behind us, which makes the chip turn round).
+		dSPIN_GetMotionState(&st);
+		unsigned long pos = (unsigned long)(st.abs_pos + (rand() % 40000) - 20000) & 0x3FFFFF;
+		if(i%2) dSPIN_GoTo(pos);
+		else dSPIN_SoftStop();
+		dSPIN_Sim_Peek(0, &a);
+		// The motor kept going while the registers were read; predict from
+		//  where it really was when the command landed.
+		st.abs_pos = a.start_pos;
+		if(i%2) dSPIN_PredictGoTo(&st, pos, &p);
+		else dSPIN_PredictSoftStop(&st, &p);
+		run_to_tick(0, a.start_tick + p.ticks + 100000);
+		dSPIN_Sim_Peek(0, &b);
+		// From speed the chip is part way through a microstep that can't be
+		//  read back, so allow the time of one microstep at the final speed.
+		e = lldiff(b.stop_tick - b.start_tick, p.ticks);
+		if(i%2){
+			unsigned long floor_spd = st.min_speed << 4 > 336 ? st.min_speed << 4 : 336;
+			long slack = (long)((1ULL << 28) / ((unsigned long long)floor_spd << (st.step_mode & 7)));
+			e = e > slack ? e - slack : 0;
+		}
+		if(e > worst_run) worst_run = e;
+		e = labs(b.abs_pos - (a.start_pos + p.distance));
+		if(e > worst_pos) worst_pos = e;
+	}
+	printf("predict: %d moves; worst error %ld ticks (Move), %ld ticks beyond one microstep (GoTo/SoftStop from speed), %ld microsteps\n",
+	       moves, worst_ticks, worst_run, worst_pos);
+	int ok = worst_ticks <= 4 && worst_run <= 4 && worst_pos <= 1;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** poll ********************/
+
+// A sequencer driving every other axis through random moves and pauses; it
+//  may only start an axis' next move once a status read shows the last one
+//  finished, so how quickly the end of a move is noticed is what matters.
+//  The other axes stay parked and only need their staleness bound kept.
+struct poll_job {
+	int active, moving;
+	unsigned long long next_ns;   // when to start the next move
+	dSPIN_MotionState st;         // the axis' settings, at rest
+};
+
+struct poll_result {
+	unsigned long polls, moves;
+	double detect_mean_ms, detect_max_ms, stale_max_ms;
+};
+
+static void poll_read(int axis, dSPIN_PollState *s){
+	dSPIN_Select(axis);
+	s->status = dSPIN_GetParam(dSPIN_STATUS);
+	s->abs_pos = dSPIN_GetParam(dSPIN_ABS_POS);
+	s->speed = dSPIN_GetParam(dSPIN_SPEED);
+}
+
+static void poll_run(int n, float budget, unsigned long stale_us, float seconds,
+                     int adaptive, struct poll_result *r){
+	struct poll_job *job = (struct poll_job *)calloc(n, sizeof(*job));
+	unsigned long long *seen = (unsigned long long *)calloc(n, sizeof(*seen));
+	unsigned long long spacing = (unsigned long long)(1e9 / budget), next = dSPIN_Now();
+	unsigned long long end = dSPIN_Now() + (unsigned long long)(seconds * 1e9);
+	double detect_sum = 0;
+	int rr = 0;
+	memset(r, 0, sizeof(*r));
+	srand(7);
+
+	if(adaptive) dSPIN_Poll_Setup(budget);
+	for(int i=0; i<n; i++){
+		dSPIN_Select(i);
+		dSPIN_SetParam(dSPIN_ACC, 0x40 + rand() % 0x100);
+		dSPIN_SetParam(dSPIN_DEC, 0x40 + rand() % 0x100);
+		dSPIN_SetParam(dSPIN_MAX_SPEED, 0x20 + rand() % 0x80);
+		dSPIN_GetMotionState(&job[i].st);
+		job[i].active = i % 2 == 0;
+		job[i].next_ns = dSPIN_Now() + (rand() % 1000) * 1000000ULL;
+		seen[i] = dSPIN_Now();
+		if(adaptive && dSPIN_Poll_Axis(i, stale_us) != dSPIN_STATUS_GOOD){
+			fprintf(stderr, "poll: %d axes at %lums don't fit in %.0f polls/s\n",
+			        n, stale_us / 1000, budget);
+			exit(1);
+		}
+	}
+
+	while(dSPIN_Now() < end){
+		// Start moves that are due.
+		for(int i=0; i<n; i++){
+			struct poll_job *j = &job[i];
+			if(!j->active || j->moving || dSPIN_Now() < j->next_ns) continue;
+			dSPIN_Prediction p;
+			byte dir = rand() % 2 ? FWD : REV;
+			unsigned long steps = 2000 + rand() % 30000;
+			dSPIN_Select(i);
+			dSPIN_Move(dir, steps);
+			if(adaptive){
+				dSPIN_PredictMove(&j->st, dir, steps, &p);
+				dSPIN_Poll_Expect(i, &p);
+			}
+			j->moving = 1;
+		}
+
+		// One status read, chosen by the scheduler or round robin.
+		int axis;
+		dSPIN_PollState s;
+		if(adaptive){
+			axis = dSPIN_Poll_Once();
+			dSPIN_Poll_Get(axis, &s);
+		}else{
+			axis = rr;
+			rr = (rr + 1) % n;
+			dSPIN_SleepUntil(next);
+			poll_read(axis, &s);
+			next += spacing;
+		}
+		unsigned long long now = dSPIN_Now();
+		double age = (now - seen[axis]) / 1e6;
+		if(age > r->stale_max_ms) r->stale_max_ms = age;
+		seen[axis] = now;
+		r->polls++;
+
+		struct poll_job *j = &job[axis];
+		if(j->moving && (s.status & dSPIN_STATUS_BUSY)){
+			// Finished. Work out from the model when it really stopped.
+			dSPIN_Sim_State sim;
+			dSPIN_Sim_Peek(axis, &sim);
+			double late = (sim.ticks - sim.stop_tick) * dSPIN_TICK_NS / 1e6;
+			detect_sum += late;
+			if(late > r->detect_max_ms) r->detect_max_ms = late;
+			r->moves++;
+			j->moving = 0;
+			j->next_ns = now + (rand() % 500) * 1000000ULL;
+		}
+	}
+	r->detect_mean_ms = r->moves ? detect_sum / r->moves : 0;
+	for(int i=0; i<n; i++){
+		// Let everything come to rest for the next run.
+		dSPIN_Select(i);
+		while(dSPIN_Busy()) dSPIN_Sim_Advance(1000000);
+	}
+	dSPIN_Select(0);
+	free(job);
+	free(seen);
+}
+
+int bench_poll(int argc, char* argv[]){
+	int n = argc>1 ? atoi(argv[1]) : 32;
+	float budget = argc>2 ? atof(argv[2]) : 1000;
+	unsigned long stale_us = (argc>3 ? atof(argv[3]) : 50) * 1000;
+	float seconds = argc>4 ? atof(argv[4]) : 60;
+	if(n < 1 || n > dSPIN_MAX_AXES) n = 32;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<n; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	for(int i=0; i<n; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+	}
+
+	struct poll_result fixed, adapt;
+	poll_run(n, budget, stale_us, seconds, 0, &fixed);
+	poll_run(n, budget, stale_us, seconds, 1, &adapt);
+	dSPIN_PollStats ps;
+	dSPIN_Poll_GetStats(&ps);
+
+	printf("poll: %d axes (%d moving), %.0f reads/s, %lums staleness bound, %.0fs\n",
+	       n, (n + 1) / 2, budget, stale_us / 1000, seconds);
+	printf("%-12s %8s %6s %14s %14s %14s\n", "", "reads", "moves", "detect mean ms",
+	       "detect max ms", "worst age ms");
+	printf("%-12s %8lu %6lu %14.2f %14.2f %14.2f\n", "round-robin", fixed.polls, fixed.moves,
+	       fixed.detect_mean_ms, fixed.detect_max_ms, fixed.stale_max_ms);
+	printf("%-12s %8lu %6lu %14.2f %14.2f %14.2f\n", "adaptive", adapt.polls, adapt.moves,
+	       adapt.detect_mean_ms, adapt.detect_max_ms, adapt.stale_max_ms);
+	printf("adaptive: %lu bound misses, %lu events confirmed, %lu predictions missed, "
+	       "%lu reads retried\n", ps.misses, ps.events, ps.missed_events, ps.retries);
+
+	// Axes that can't exist are turned away.
+	dSPIN_PollState s;
+	dSPIN_Prediction p = { 0 };
+	int bad = dSPIN_Poll_Get(-1, &s) == dSPIN_STATUS_FATAL
+	          && dSPIN_Poll_Get(dSPIN_MAX_AXES, &s) == dSPIN_STATUS_FATAL
+	          && dSPIN_Poll_Event(dSPIN_MAX_AXES, 0) == dSPIN_STATUS_FATAL
+	          && dSPIN_Poll_Expect(-1, &p) == dSPIN_STATUS_FATAL;
+	int ok = ps.misses == 0 && adapt.stale_max_ms <= stale_us / 1000.0
+	         && adapt.detect_mean_ms < fixed.detect_mean_ms && bad;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** sweep ********************/
+
+// A motor whose torque falls off as back EMF eats into the drive voltage, on
+//  a load that needs more torque the harder it's accelerated. Torque is in
+//  units of what full KVAL gives at standstill.
+struct motor {
+	float bemf_speed;   // steps/s at which back EMF cancels full KVAL
+	float load;         // torque the load takes at any speed
+	float inertia;      // extra torque per steps/s/s
+	float amps;         // phase current at standstill, full KVAL
+	byte hot_kval;      // KVAL_RUN above which the driver runs hot
+};
+
+static unsigned int motor_model(int dev, const dSPIN_Sim_Load *op, void *arg){
+	const struct motor *m = (const struct motor *)arg;
+	float k = op->kval / 255.0f;
+	float torque = k - op->speed / m->bemf_speed;
+	unsigned int bits = 0;
+	if(torque < m->load + m->inertia * fabsf(op->accel))
+		bits |= dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B;
+	if(m->amps * k > 0.375f * (op->ocd_th + 1))
+		bits |= dSPIN_STATUS_OCD;
+	if(op->accel == 0 && op->kval > m->hot_kval)
+		bits |= dSPIN_STATUS_TH_WRN;
+	return bits;
+}
+
+// The highest MAX_SPEED register value the model says runs clean, from the
+//  same sums: 15.2588 steps/s per MAX_SPEED count, 14.5519 steps/s/s per ACC
+//  count.
+static long motor_limit(const struct motor *m, const dSPIN_SweepPoint *pt, byte ocd_th){
+	float kr = pt->kval_run / 255.0f, ka = pt->kval_acc / 255.0f;
+	if(m->amps * kr > 0.375f * (ocd_th + 1) || m->amps * ka > 0.375f * (ocd_th + 1)
+	   || pt->kval_run > m->hot_kval)
+		return 0;
+	float a = AccCalc(pt->acc) * 14.5519f;
+	float v = (kr - m->load) * m->bemf_speed;
+	float va = (ka - m->load - m->inertia * a) * m->bemf_speed;
+	if(va < v) v = va;
+	return v > 0 ? (long)ceilf(v / 15.2588f) - 1 : 0;
+}
+
+int bench_sweep(int argc, char* argv[]){
+	const char *path = argc>1 ? argv[1] : "/tmp/dSPIN.profile";
+	static const float accs[] = { 500, 1000, 2000, 4000 };
+	static const byte kval_runs[] = { 0x60, 0x80, 0xA0, 0xC0 };
+	static const byte kval_accs[] = { 0x80, 0xA0, 0xC0, 0xE0 };
+	struct motor m = { 2000, 0.15f, 0.0001f, 5.0f, 0xB0 };
+	dSPIN_SweepGrid g;
+	g.acc = accs;           g.n_acc = 4;
+	g.kval_run = kval_runs; g.n_kval_run = 4;
+	g.kval_acc = kval_accs; g.n_kval_acc = 4;
+	g.min_speed = 50;
+	g.max_speed = 1500;
+	g.cruise_steps = 200;
+	g.ref_steps = 2000;
+	g.margin = 0.8f;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+	dSPIN_Sim_SetStallModel(0, motor_model, &m);
+
+	dSPIN_SweepPoint pts[64];
+	dSPIN_Profile best, loaded, readback;
+	unsigned long long t0 = dSPIN_Now();
+	int win = dSPIN_Sweep(&g, pts, &best);
+	double secs = (dSPIN_Now() - t0) / 1e9;
+
+	// Every combination should have landed on the model's limit, within the
+	//  one count the ramp arithmetic can shift it by.
+	int wrong = 0, tests = 0;
+	byte ocd_th = dSPIN_GetParam(dSPIN_OCD_TH);
+	for(int i=0; i<64; i++){
+		long want = motor_limit(&m, &pts[i], ocd_th);
+		long lo = MaxSpdCalc(g.min_speed), hi = MaxSpdCalc(g.max_speed);
+		if(want < lo) want = 0;
+		if(want > hi) want = hi;
+		tests += pts[i].tests;
+		if(labs((long)pts[i].max_speed - want) > 1){
+			wrong++;
+			printf("acc %.0f kval_run %02X kval_acc %02X: found %lu, model says %ld (fault %X)\n",
+			       pts[i].acc, pts[i].kval_run, pts[i].kval_acc, pts[i].max_speed, want, pts[i].fault);
+		}
+	}
+	printf("sweep: 64 combinations, %d test moves, %.0fs of motor time\n", tests, secs);
+	if(win >= 0)
+		printf("best: acc %.0f steps/s/s, KVAL_RUN %02X, KVAL_ACC/DEC %02X, %.0f steps/s clean, "
+		       "%.0f steps/s after margin; %d-step move in %.3fs\n",
+		       pts[win].acc, pts[win].kval_run, pts[win].kval_acc, pts[win].max_speed * 15.2588,
+		       best.max_speed * 15.2588, (int)g.ref_steps, dSPIN_TicksToSec(pts[win].ref_ticks));
+
+	// The profile has to survive a trip through a file and onto the chip, and
+	//  run clean once it's there.
+	memset(&loaded, 0, sizeof(loaded));
+	int io = dSPIN_Profile_Save(path, &best, "bench sweep") == dSPIN_STATUS_GOOD
+	         && dSPIN_Profile_Load(path, &loaded) == dSPIN_STATUS_GOOD
+	         && !memcmp(&best, &loaded, sizeof(best));
+	dSPIN_Profile_Apply(&loaded);
+	dSPIN_Profile_Read(&readback);
+	io = io && !memcmp(&best, &readback, sizeof(best));
+	dSPIN_GetStatus();
+	dSPIN_Move(FWD, g.ref_steps << (readback.step_mode & dSPIN_STEP_MODE_STEP_SEL));
+	while(dSPIN_Busy()) delay(1);
+	unsigned int faults = ~dSPIN_GetStatus() & (dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B
+	                                             | dSPIN_STATUS_OCD | dSPIN_STATUS_TH_WRN);
+	printf("profile %s: round trip %s, test move %s\n", path, io ? "ok" : "FAILED",
+	       faults ? "faulted" : "clean");
+
+	int ok = win >= 0 && wrong == 0 && io && !faults;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** program ********************/
+
+// Writes a long random program into a pipe, keeping track of where it leaves
+//  the motor.
+struct prog_writer {
+	FILE *out;
+	long commands;
+	long end_pos;
+};
+
+static void *prog_write(void *arg){
+	struct prog_writer *w = (struct prog_writer *)arg;
+	long pos = 0;
+	srand(3);
+	fprintf(w->out, "# generated by bench program\n"
+	                "hiz\nset STEP_MODE 0  ; full steps\n"
+	                "set MAX_SPEED 3000\nset ACC 40000\nset DEC 40000 ; fast ramps\n\n");
+	for(long i=0; i<w->commands; i++){
+		long n = 1 + rand() % 400;
+		switch(rand() % 8){
+		case 0: case 1: case 2:
+			fprintf(w->out, "move %ld\n", n); pos += n; break;
+		case 3:
+			fprintf(w->out, "MOVE rev %ld\n", n); pos -= n; break;
+		case 4:
+			fprintf(w->out, "goto %ld\n", n - 200); pos = n - 200; break;
+		case 5:
+			fprintf(w->out, "  dwell 2   # settle\n"); break;
+		case 6:
+			// A run leaves the position unknown; stop and re-zero afterwards.
+			fprintf(w->out, "run %ld\nwait\nstop\nwait\nzero\n", n + 100); pos = 0; i += 4; break;
+		case 7:
+			fprintf(w->out, "set KVAL_RUN 0x%02lX\n", 0x40 + n % 0x80); break;
+		}
+	}
+	fclose(w->out);
+	w->end_pos = pos;
+	return NULL;
+}
+
+int bench_program(int argc, char* argv[]){
+	long commands = argc>1 ? atol(argv[1]) : 20000;
+	int lookahead = argc>2 ? atoi(argv[2]) : dSPIN_PROGRAM_LOOKAHEAD;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+
+	int fd[2];
+	if(pipe(fd)){
+		perror("pipe");
+		return 1;
+	}
+	struct prog_writer w = { fdopen(fd[1], "w"), commands, 0 };
+	pthread_t writer;
+	pthread_create(&writer, NULL, prog_write, &w);
+	FILE *in = fdopen(fd[0], "r");
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	unsigned long long v0 = dSPIN_Now();
+	dSPIN_Program *p = dSPIN_Program_Open(in, lookahead);
+	int err = dSPIN_Program_Run(p);
+	dSPIN_ProgramStats st;
+	dSPIN_Program_GetStats(p, &st);
+	dSPIN_Program_Close(p);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_join(writer, NULL);
+	fclose(in);
+	double real = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	long pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	if(pos & 0x200000) pos -= 0x400000;
+
+	printf("program: %lu lines, %lu commands through a %d-command lookahead (peak %d)\n",
+	       st.lines, st.executed, lookahead, st.peak);
+	printf("%.1fs of motion run in %.2fs, %.1fus per command; waited for the reader %lu times (%.1fms)\n",
+	       (dSPIN_Now() - v0) / 1e9, real, real * 1e6 / st.executed, st.starved, st.starved_ns / 1e6);
+	printf("final ABS_POS %ld, program says %ld\n", pos, w.end_pos);
+
+	// A bad line stops the program there and is reported.
+	char bad[] = "move 10\nmove sideways 3\nmove 10\n";
+	FILE *f = fmemopen(bad, strlen(bad), "r");
+	p = dSPIN_Program_Open(f, 4);
+	int bad_err = dSPIN_Program_Run(p);
+	dSPIN_ProgramStats bst;
+	dSPIN_Program_GetStats(p, &bst);
+	dSPIN_Program_Close(p);
+	fclose(f);
+
+	// ABS_POS and MARK take negative values; other registers refuse them.
+	char neg[] = "wait\nset ABS_POS -100\nset MARK -100\nset KVAL_RUN -1\n";
+	f = fmemopen(neg, strlen(neg), "r");
+	p = dSPIN_Program_Open(f, 4);
+	int neg_err = dSPIN_Program_Run(p);
+	dSPIN_ProgramStats nst;
+	dSPIN_Program_GetStats(p, &nst);
+	dSPIN_Program_Close(p);
+	fclose(f);
+	unsigned long neg_abs = dSPIN_GetParam(dSPIN_ABS_POS), neg_mark = dSPIN_GetParam(dSPIN_MARK);
+	printf("set ABS_POS -100: 0x%06lx, MARK -100: 0x%06lx\n", neg_abs, neg_mark);
+
+	// Positions past either end of ABS_POS, fractional steps and a sign
+	//  fighting a written-out direction don't parse; the ends themselves do.
+	static const char *refuse[] = { "goto 2097152", "goto -2097153", "set ABS_POS 2097152",
+	                                "set MARK -2097153", "goto 10.5", "move 1.5", "move -2.5",
+	                                "move FWD -10", "move rev -10" };
+	static const char *accept[] = { "goto 2097151", "goto -2097152", "set MARK -2097152", "move -10" };
+	int misparsed = 0;
+	for(unsigned i=0; i<sizeof(refuse)/sizeof(refuse[0]); i++){
+		char l[64];
+		strcpy(l, refuse[i]);
+		dSPIN_ProgOp op;
+		if(dSPIN_Program_Parse(l, &op) >= 0){
+			printf("\"%s\" parsed\n", refuse[i]);
+			misparsed++;
+		}
+	}
+	for(unsigned i=0; i<sizeof(accept)/sizeof(accept[0]); i++){
+		char l[64];
+		strcpy(l, accept[i]);
+		dSPIN_ProgOp op;
+		if(dSPIN_Program_Parse(l, &op) < 0){
+			printf("\"%s\" refused\n", accept[i]);
+			misparsed++;
+		}
+	}
+
+	int ok = err == dSPIN_STATUS_GOOD && pos == w.end_pos && st.peak <= lookahead
+	         && bad_err == dSPIN_STATUS_FATAL && bst.executed == 1
+	         && neg_err == dSPIN_STATUS_FATAL && nst.executed == 3
+	         && neg_abs == (0x400000UL - 100) && neg_mark == (0x400000UL - 100) && misparsed == 0;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** blend ********************/
+
+// Pick-and-place style paths: runs of 2-6 same-direction segments at
+//  different speeds, then a turn back.
+static int blend_path(dSPIN_Segment *seg, int n){
+	byte dir = FWD;
+	int i = 0;
+	while(i < n){
+		int run = 2 + rand() % 5;
+		for(int k=0; k<run && i<n; k++, i++){
+			seg[i].dir = dir;
+			seg[i].steps = 100 + rand() % 700;
+			seg[i].speed = MaxSpdCalc(800 + rand() % 1200);
+		}
+		dir = dir == FWD ? REV : FWD;
+	}
+	return n;
+}
+
+static long blend_abs_pos(){
+	long p = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	return p & 0x200000 ? p - 0x400000 : p;
+}
+
+int bench_blend(int argc, char* argv[]){
+	int n = argc>1 ? atoi(argv[1]) : 400;
+	dSPIN_Segment *seg = (dSPIN_Segment *)malloc(n * sizeof(*seg));
+	srand(5);
+	blend_path(seg, n);
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+	dSPIN_HardHiZ();
+	dSPIN_SetParam(dSPIN_STEP_MODE, dSPIN_STEP_SEL_1_8);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(2000));
+	dSPIN_SetParam(dSPIN_ACC, AccCalc(4000));
+	dSPIN_SetParam(dSPIN_DEC, DecCalc(4000));
+	int ms = 8;
+	for(int i=0; i<n; i++) seg[i].steps *= ms;
+
+	// Stop and go, the way dSPIN_test.c sequences moves.
+	long p0 = blend_abs_pos(), want = p0;
+	unsigned long long t0 = dSPIN_Now();
+	for(int i=0; i<n; i++){
+		dSPIN_SetParam(dSPIN_MAX_SPEED, seg[i].speed);
+		dSPIN_Move(seg[i].dir, seg[i].steps);
+		while(dSPIN_Busy()) delayMicroseconds(200);
+		dSPIN_SoftStop();
+		while(dSPIN_Busy()) delayMicroseconds(200);
+		want += seg[i].dir == FWD ? (long)seg[i].steps : -(long)seg[i].steps;
+	}
+	double t_stop = (dSPIN_Now() - t0) / 1e9;
+	long p1 = blend_abs_pos();
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(2000));
+
+	// Blended, over the same path again.
+	dSPIN_BlendStats st;
+	t0 = dSPIN_Now();
+	dSPIN_Blend(seg, n, &st);
+	double t_blend = (dSPIN_Now() - t0) / 1e9;
+	long p2 = blend_abs_pos();
+	long want2 = p1 + (want - p0);
+
+	// The last stretch before a switch is slept off on an extrapolation, and
+	//  is under two polls long; a switch should land within that much travel
+	//  at the top speed.
+	long bound = (long)(2000.0 * ms * 2 * dSPIN_BLEND_POLL_US * 1e-6) + 1;
+	printf("blend: %d segments, %d same-direction chains\n", n, st.chains);
+	printf("stop-and-go %.2fs, blended %.2fs: %.1f%% less\n", t_stop, t_blend,
+	       100.0 * (t_stop - t_blend) / t_stop);
+	printf("%d commands, %lu ABS_POS reads; worst switch error %ld microsteps (bound %ld), "
+	       "worst chain end error %ld\n", st.commands, st.reads, st.switch_err, bound, st.end_err);
+	printf("end position: stop-and-go %ld (want %ld), blended %ld (want %ld)\n", p1, want, p2, want2);
+	free(seg);
+
+	// A keep-out zone where a chain would end: the GoTo is refused, and the
+	//  chain has to stop short of the zone rather than carry on in its Run,
+	//  here and through the program interpreter.
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(400));
+	dSPIN_SetParam(dSPIN_ACC, AccCalc(200));
+	dSPIN_SetParam(dSPIN_DEC, DecCalc(200));
+	dSPIN_ResetPos();
+	dSPIN_Zone zone = { 40000, 50000, 7, -1, 0, 0 };
+	dSPIN_Limits_Set(0, &zone, 1);
+	dSPIN_Segment into[3];
+	for(int i=0; i<3; i++){
+		into[i].dir = FWD;
+		into[i].steps = 15000;
+		into[i].speed = 0;
+	}
+	dSPIN_BlendStats zst;
+	int zone_err = dSPIN_Blend(into, 3, &zst);
+	int zone_id, zone_why = dSPIN_Limits_Last(&zone_id);
+	long zone_pos = blend_abs_pos();
+	int zone_busy = dSPIN_Busy();
+
+	// One that ends short of it has to get there. The last segment is fast
+	//  and too short to speed up in, so the GoTo has to go out before its
+	//  boundary to be able to stop at the end, not coast on towards the zone.
+	dSPIN_ResetPos();
+	into[0].steps = into[1].steps = 18500;
+	into[2].steps = 2500;
+	into[0].speed = into[1].speed = MaxSpdCalc(100);
+	int short_err = dSPIN_Blend(into, 3, &zst);
+	long short_pos = blend_abs_pos();
+
+	dSPIN_ResetPos();
+	char into_text[] = "blend on\nmove 15000\nmove 15000\nmove 15000\nmove 100\n";
+	FILE *f = fmemopen(into_text, strlen(into_text), "r");
+	dSPIN_Program *p = dSPIN_Program_Open(f, 8);
+	int prog_err = dSPIN_Program_Run(p);
+	dSPIN_ProgramStats pst;
+	dSPIN_Program_GetStats(p, &pst);
+	dSPIN_Program_Close(p);
+	fclose(f);
+	long prog_pos = blend_abs_pos();
+	dSPIN_Limits_Clear(0);
+	printf("chain into a zone: %s (%d, zone %d), stopped at %ld; program %s at %ld after %lu commands\n",
+	       zone_err == dSPIN_STATUS_GOOD ? "went through" : "refused", zone_why, zone_id, zone_pos,
+	       prog_err == dSPIN_STATUS_GOOD ? "ran to the end" : "stopped", prog_pos, pst.executed);
+	printf("chain short of a zone: %s, ended at %ld (want 39500)\n",
+	       short_err == dSPIN_STATUS_GOOD ? "went through" : "refused", short_pos);
+
+	int ok = p1 == want && p2 == want2 && st.end_err == 0 && st.switch_err <= bound
+	         && t_blend < t_stop
+	         && zone_err == dSPIN_STATUS_FATAL && zone_why == dSPIN_LIMIT_ZONE && zone_id == 7
+	         && zone_pos < 40000 && !zone_busy
+	         && prog_err == dSPIN_STATUS_FATAL && prog_pos < 40000 && pst.executed == 1
+	         && short_err == dSPIN_STATUS_GOOD && short_pos == 39500;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** bytecode ********************/
+
+static double cpu_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_bytecode(int argc, char* argv[]){
+	long commands = argc>1 ? atol(argv[1]) : 5000;
+	int cycles = argc>2 ? atoi(argv[2]) : 5;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+
+	// The job, as text in memory.
+	char *text;
+	size_t text_len;
+	struct prog_writer w = { open_memstream(&text, &text_len), commands, 0 };
+	prog_write(&w);
+
+	// Interpreted, the way play runs a program.
+	long pos_i = 0;
+	int err_i = dSPIN_STATUS_GOOD;
+	double cpu = cpu_now();
+	unsigned long long v0 = dSPIN_Now();
+	for(int c=0; c<cycles; c++){
+		dSPIN_ResetPos();
+		FILE *in = fmemopen(text, text_len, "r");
+		dSPIN_Program *p = dSPIN_Program_Open(in, dSPIN_PROGRAM_LOOKAHEAD);
+		if(dSPIN_Program_Run(p) != dSPIN_STATUS_GOOD) err_i = dSPIN_STATUS_FATAL;
+		dSPIN_Program_Close(p);
+		fclose(in);
+		pos_i = blend_abs_pos();
+	}
+	double cpu_i = (cpu_now() - cpu) / cycles;
+	double motion_i = (dSPIN_Now() - v0) / 1e9 / cycles;
+
+	// What the interpreter redoes every cycle and the compiled job doesn't.
+	FILE *in = fmemopen(text, text_len, "r");
+	char line[dSPIN_PROGRAM_LINE];
+	dSPIN_ProgOp op;
+	cpu = cpu_now();
+	while(fgets(line, sizeof(line), in)) dSPIN_Program_Parse(line, &op);
+	double parse = cpu_now() - cpu;
+	fclose(in);
+
+	char path[] = "/tmp/dSPIN_bytecode_XXXXXX";
+	int fd = mkstemp(path);
+	FILE *out = fdopen(fd, "wb");
+	in = fmemopen(text, text_len, "r");
+	int bad_line;
+	cpu = cpu_now();
+	int err_c = dSPIN_Compile(in, out, &bad_line);
+	fclose(out);
+	double compile = cpu_now() - cpu;
+	fclose(in);
+
+	// Compiled.
+	long pos_c = 0;
+	dSPIN_Bytecode *bc = dSPIN_Bytecode_Open(path);
+	dSPIN_BytecodeStats st;
+	memset(&st, 0, sizeof(st));
+	double cpu_c = 0, motion_c = 0;
+	if(bc){
+		dSPIN_Bytecode_GetStats(bc, &st);
+		cpu = cpu_now();
+		v0 = dSPIN_Now();
+		for(int c=0; c<cycles; c++){
+			dSPIN_ResetPos();
+			dSPIN_Bytecode_Run(bc);
+			pos_c = blend_abs_pos();
+		}
+		cpu_c = (cpu_now() - cpu) / cycles;
+		motion_c = (dSPIN_Now() - v0) / 1e9 / cycles;
+		dSPIN_Bytecode_Close(bc);
+	}
+
+	// A cut-short file is refused when it's opened, not halfway through a run.
+	truncate(path, st.size - 1);
+	dSPIN_Bytecode *cut = dSPIN_Bytecode_Open(path);
+	if(cut) dSPIN_Bytecode_Close(cut);
+	unlink(path);
+	// So is blending, which can't be planned ahead.
+	char blend[] = "move 10\nblend on\nmove 10\n";
+	in = fmemopen(blend, strlen(blend), "r");
+	out = fopen("/dev/null", "wb");
+	int blend_err = dSPIN_Compile(in, out, &bad_line);
+	fclose(out);
+	fclose(in);
+	// And an axis that isn't there.
+	char axis[] = "move 10\nwait\naxis 5\nmove 10\n";
+	int axis_line;
+	in = fmemopen(axis, strlen(axis), "r");
+	out = fopen("/dev/null", "wb");
+	int axis_err = dSPIN_Compile(in, out, &axis_line);
+	fclose(out);
+	fclose(in);
+
+	printf("bytecode: %ld-command job, %zu bytes of text, %lu bytes compiled "
+	       "(%lu records, %lu SPI bytes, %lu waits); compiled in %.1fms\n",
+	       commands, text_len, st.size, st.records, st.spi_bytes, st.waits, compile * 1e3);
+	printf("per cycle: interpreted %.1fms CPU, compiled %.1fms CPU (parsing and conversion alone: %.1fms)\n",
+	       cpu_i * 1e3, cpu_c * 1e3, parse * 1e3);
+	printf("motion per cycle: interpreted %.3fs, compiled %.3fs; end position %ld, %ld (want %ld)\n",
+	       motion_i, motion_c, pos_i, pos_c, w.end_pos);
+	printf("truncated file %s, blending %s (line %d), axis 5 %s (line %d)\n",
+	       cut ? "accepted" : "refused", blend_err == dSPIN_STATUS_GOOD ? "compiled" : "refused",
+	       bad_line, axis_err == dSPIN_STATUS_GOOD ? "compiled" : "refused", axis_line);
+	free(text);
+
+	int ok = err_i == dSPIN_STATUS_GOOD && err_c == dSPIN_STATUS_GOOD && bc != NULL
+	         && pos_i == w.end_pos && pos_c == w.end_pos && cpu_c < cpu_i
+	         && fabs(motion_c - motion_i) < 0.01 * motion_i
+	         && cut == NULL && blend_err != dSPIN_STATUS_GOOD && bad_line == 2
+	         && axis_err != dSPIN_STATUS_GOOD && axis_line == 3;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** bus ********************/
+
+// Threads of every class hammer the bus on their own axes while a timer
+//  signal asks for hard stops. Each thread checks that what it reads back is
+//  what it wrote, which interleaved frames would break.
+static volatile int bus_quit;
+static int bus_requests;
+
+struct bus_worker {
+	pthread_t t;
+	int axis, cls;
+	unsigned long ops, errors;
+};
+
+static void *bus_work(void *arg){
+	struct bus_worker *w = (struct bus_worker *)arg;
+	dSPIN_Select(w->axis);
+	dSPIN_Bus_SetClass(w->cls);
+	if(w->cls == dSPIN_BUS_HIGH){
+		// The real-time thread a machine would run its motion from.
+		struct sched_param sp;
+		sp.sched_priority = 50;
+		if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+			fprintf(stderr, "bus: SCHED_FIFO refused, high thread at normal priority\n");
+	}
+	unsigned int seed = w->axis * 7 + w->cls;
+	while(!bus_quit){
+		unsigned long mark = rand_r(&seed) & 0x3FFFFF;
+		switch(w->cls){
+		case dSPIN_BUS_HIGH:
+			// A motion command now and then.
+			dSPIN_Run(rand_r(&seed) & 1 ? FWD : REV, SpdCalc(200 + rand_r(&seed) % 800));
+			usleep(500);
+			break;
+		case dSPIN_BUS_NORMAL:
+			dSPIN_SetParam(dSPIN_MARK, mark);
+			if(dSPIN_GetParam(dSPIN_MARK) != mark) w->errors++;
+			break;
+		case dSPIN_BUS_LOW:
+			// Status bursts, held as one transaction. CONFIG is never written.
+			dSPIN_Bus_Begin();
+			for(int i=0; i<6; i++){
+				dSPIN_GetParam(dSPIN_ABS_POS);
+				dSPIN_GetParam(dSPIN_SPEED);
+			}
+			if(dSPIN_GetParam(dSPIN_CONFIG) != 0x2E88) w->errors++;
+			dSPIN_Bus_End();
+			break;
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void bus_alarm(int sig){
+	int n = __atomic_add_fetch(&bus_requests, 1, __ATOMIC_RELAXED);
+	dSPIN_Emergency(n % 4, n % 8 ? dSPIN_HARD_STOP : dSPIN_HARD_HIZ);
+}
+
+int bench_bus(int argc, char* argv[]){
+	float seconds = argc>1 ? atof(argv[1]) : 5;
+	int pollers = argc>2 ? atoi(argv[2]) : 4;
+	if(pollers < 1) pollers = 1;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_REAL);
+	dSPIN_init();
+	for(int i=1; i<4; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	for(int i=0; i<4; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+	}
+	dSPIN_Select(0);
+
+	// One HIGH thread, a NORMAL one per axis (only it writes MARK there), and
+	//  the LOW pollers spread over the axes.
+	int n = 1 + 4 + pollers;
+	struct bus_worker *w = (struct bus_worker *)calloc(n, sizeof(*w));
+	w[0].axis = 0; w[0].cls = dSPIN_BUS_HIGH;
+	for(int i=0; i<4; i++){ w[1 + i].axis = i; w[1 + i].cls = dSPIN_BUS_NORMAL; }
+	for(int i=0; i<pollers; i++){ w[5 + i].axis = i % 4; w[5 + i].cls = dSPIN_BUS_LOW; }
+
+	dSPIN_Bus_ResetStats();
+	bus_quit = 0;
+	for(int i=0; i<n; i++) pthread_create(&w[i].t, NULL, bus_work, &w[i]);
+	signal(SIGALRM, bus_alarm);
+	struct itimerval it = { { 0, 2000 }, { 0, 2000 } };
+	setitimer(ITIMER_REAL, &it, NULL);
+	// The alarms cut sleeps short.
+	unsigned long long end = dSPIN_Now() + (unsigned long long)(seconds * 1e9);
+	while(dSPIN_Now() < end) usleep(10000);
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_REAL, &it, NULL);
+	bus_quit = 1;
+	for(int i=0; i<n; i++) pthread_join(w[i].t, NULL);
+	// Let the stopper see to a request that came in last.
+	usleep(10000);
+	// An axis that isn't there is turned away, not queued.
+	int stray = dSPIN_Emergency(dSPIN_MAX_AXES, dSPIN_HARD_STOP) < 0 && dSPIN_Emergency(-2, dSPIN_HARD_STOP) < 0;
+	usleep(10000);
+
+	dSPIN_BusStats st;
+	dSPIN_Bus_GetStats(&st);
+	unsigned long ops[dSPIN_BUS_CLASSES] = { 0 }, errors = 0;
+	for(int i=0; i<n; i++){
+		ops[w[i].cls] += w[i].ops;
+		errors += w[i].errors;
+	}
+	static const char *names[] = { "emergency", "high", "normal", "low" };
+	printf("bus: %.0fs, 1 high, 4 normal, %d low-priority threads on 4 axes; %lu read-back errors\n",
+	       seconds, pollers, errors);
+	for(int c=0; c<dSPIN_BUS_CLASSES; c++)
+		printf("  %-9s %8lu grants, worst wait %8.1fus\n", names[c], st.frames[c], st.wait_ns_max[c] / 1e3);
+	printf("longest hold %.1fus\n", st.hold_ns_max / 1e3);
+	printf("emergency: %d asked for, %lu sent; latency mean %.1fus, worst %.1fus\n", bus_requests,
+	       st.stops, st.stops ? st.stop_ns_sum / 1e3 / st.stops : 0.0, st.stop_ns_max / 1e3);
+	free(w);
+
+	int ok = errors == 0 && st.stops == (unsigned long)bus_requests && bus_requests > 0 && stray
+	         && st.wait_ns_max[dSPIN_BUS_HIGH] < st.wait_ns_max[dSPIN_BUS_LOW];
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** board ********************/
+
+#define BOARD_AXES 8
+
+// A synthetic state whose fields all follow from n, so a reader can tell a
+//  torn snapshot from a whole one.
+static void board_fake(dSPIN_AxisState *st, unsigned long n){
+	memset(st, 0, sizeof(*st));
+	st->abs_pos = (long)n;
+	st->speed = (n * 7) & 0xFFFFF;
+	st->status = n & 0xFFFF;
+	st->stamp_ns = n * 1000;
+}
+
+struct board_tally {
+	unsigned long reads, torn, retries;
+};
+
+// Reader process: snapshot every axis until the board says stop, checking
+//  each, and report through fd.
+static void board_reader(const char *name, int fd){
+	dSPIN_Board *b = dSPIN_Board_Attach(name);
+	struct board_tally t = { 0, 0, 0 };
+	unsigned long last[BOARD_AXES] = { 0 };
+	dSPIN_AxisState st;
+	while(b){
+		// Axis 0's speed set to all ones means stop.
+		for(int i=0; i<BOARD_AXES; i++){
+			t.retries += dSPIN_Board_Read(b, i, &st);
+			t.reads++;
+			if(i == 0 && st.speed == 0xFFFFFFFF) goto done;
+			unsigned long n = (unsigned long)st.abs_pos;
+			if(st.stamp_ns == 0) continue;
+			if(st.speed != ((n * 7) & 0xFFFFF) || st.status != (n & 0xFFFF)
+			   || st.stamp_ns != n * 1000 || st.updates < last[i])
+				t.torn++;
+			last[i] = st.updates;
+		}
+	}
+done:
+	if(write(fd, &t, sizeof(t)) != sizeof(t)) t.reads = 0;
+	if(b) dSPIN_Board_Close(b);
+	_exit(0);
+}
+
+// Publish fake states to every axis for a while with readers running;
+//  returns the median time to publish all axes, in ns.
+static double board_run(const char *name, dSPIN_Board *b, float seconds, int readers,
+                        struct board_tally *sum, double *mean){
+	int fd[2];
+	if(pipe(fd)) return -1;
+	pid_t *pid = (pid_t *)calloc(readers + 1, sizeof(pid_t));
+	for(int i=0; i<readers; i++)
+		if((pid[i] = fork()) == 0) board_reader(name, fd[1]);
+
+	static unsigned long hist[4096];
+	memset(hist, 0, sizeof(hist));
+	unsigned long rounds = 0, n = 1;
+	double total = 0;
+	dSPIN_AxisState st;
+	unsigned long long end = dSPIN_Now() + (unsigned long long)(seconds * 1e9);
+	while(dSPIN_Now() < end){
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(int i=0; i<BOARD_AXES; i++){
+			board_fake(&st, n++);
+			dSPIN_Board_Publish(b, i, &st);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		long ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+		hist[ns < 4095 ? ns : 4095]++;
+		total += ns;
+		rounds++;
+	}
+	st.speed = 0xFFFFFFFF;
+	dSPIN_Board_Publish(b, 0, &st);
+
+	memset(sum, 0, sizeof(*sum));
+	for(int i=0; i<readers; i++){
+		struct board_tally t;
+		if(read(fd[0], &t, sizeof(t)) == sizeof(t)){
+			sum->reads += t.reads;
+			sum->torn += t.torn;
+			sum->retries += t.retries;
+		}
+		waitpid(pid[i], NULL, 0);
+	}
+	close(fd[0]);
+	close(fd[1]);
+	free(pid);
+	*mean = total / rounds;
+	unsigned long half = rounds / 2, seen = 0;
+	for(int i=0; i<4096; i++)
+		if((seen += hist[i]) > half) return i;
+	return 4095;
+}
+
+int bench_board(int argc, char* argv[]){
+	float seconds = argc>1 ? atof(argv[1]) : 2;
+	int readers = argc>2 ? atoi(argv[2]) : 4;
+	char name[64];
+	snprintf(name, sizeof(name), "/dSPIN_bench_board_%d", (int)getpid());
+
+	// The real thing first: publish the simulated chips and check that a
+	//  reader sees what's in their registers.
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<BOARD_AXES; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	dSPIN_Board *b = dSPIN_Board_Create(name, BOARD_AXES);
+	dSPIN_Board *r = dSPIN_Board_Attach(name);
+	if(b == NULL || r == NULL){
+		perror(name);
+		return 1;
+	}
+	for(int i=0; i<BOARD_AXES; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+		dSPIN_Run(i & 1 ? REV : FWD, SpdCalc(100 + 50 * i));
+	}
+	delay(500);
+	int wrong = 0;
+	for(int i=0; i<BOARD_AXES; i++){
+		dSPIN_Board_Sample(b, i);
+		dSPIN_AxisState st;
+		dSPIN_Board_Read(r, i, &st);
+		dSPIN_Select(i);
+		dSPIN_Sim_State sim;
+		dSPIN_Sim_Peek(i, &sim);
+		// The chip keeps stepping while it's read, so ABS_POS can be a step on.
+		long moved = labs(sim.abs_pos - st.abs_pos);
+		if(moved > 2 || st.speed != sim.speed || st.status != sim.status
+		   || st.dir != (i & 1 ? REV : FWD) || st.busy || st.mot_status != 3 || st.alarms
+		   || st.updates != 1)
+			wrong++;
+	}
+	dSPIN_Board_Close(r);
+	printf("board: %d simulated axes published, %d read back wrong\n", BOARD_AXES, wrong);
+
+	// Then a writer flat out against 0 and then several reader processes,
+	//  timed for real.
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_REAL);
+	struct board_tally none, some;
+	double mean0, mean1;
+	double med0 = board_run(name, b, seconds, 0, &none, &mean0);
+	double med1 = board_run(name, b, seconds, readers, &some, &mean1);
+	dSPIN_Board_Close(b);
+	printf("publishing %d axes: median %.0fns (mean %.0fns) alone, median %.0fns (mean %.0fns) "
+	       "with %d readers\n", BOARD_AXES, med0, mean0, med1, mean1, readers);
+	printf("readers: %lu snapshots, %lu torn, %lu retries (%.3f%%)\n", some.reads, some.torn,
+	       some.retries, some.reads ? 100.0 * some.retries / some.reads : 0.0);
+
+	int ok = wrong == 0 && some.torn == 0 && (readers == 0 || some.reads > 0)
+	         && med1 <= 2 * med0 + 100;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** telemetry ********************/
+
+#define TELE_BENCH_HEADER 8
+
+static int tele_same(const dSPIN_TeleSample *a, const dSPIN_TeleSample *b){
+	return a->t_ns == b->t_ns && a->axis == b->axis && a->speed == b->speed
+	       && a->abs_pos == b->abs_pos && a->status == b->status && a->adc == b->adc;
+}
+
+// Read back from..to and count the samples that differ from rec[] in that range.
+static long tele_check(const char *path, const dSPIN_TeleSample *rec, long n,
+                       unsigned long long from, unsigned long long to, long *got){
+	dSPIN_TeleReader *r = dSPIN_TeleReader_Open(path, from, to);
+	if(r == NULL) return -1;
+	dSPIN_TeleSample s;
+	long i = 0, wrong = 0;
+	while(i < n && rec[i].t_ns < from) i++;
+	*got = 0;
+	while(dSPIN_TeleReader_Next(r, &s) > 0){
+		if(i >= n || rec[i].t_ns > to || !tele_same(&s, &rec[i])) wrong++;
+		i++;
+		(*got)++;
+	}
+	dSPIN_TeleReader_Close(r);
+	return wrong;
+}
+
+int bench_telemetry(int argc, char* argv[]){
+	float seconds = argc>1 ? atof(argv[1]) : 10;
+	int axes = argc>2 ? atoi(argv[2]) : 8;
+	float rate = argc>3 ? atof(argv[3]) : 1000;
+	if(axes < 1 || axes > dSPIN_MAX_AXES) axes = 8;
+	long rounds = (long)(seconds * rate);
+	long n = rounds * axes;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<axes; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	dSPIN_TeleSample *rec = (dSPIN_TeleSample *)malloc(n * sizeof(*rec));
+	unsigned long *lat = (unsigned long *)malloc(n * sizeof(*lat));
+	char path[] = "/tmp/dSPIN_telemetry_XXXXXX";
+	close(mkstemp(path));
+	dSPIN_Telemetry *t = dSPIN_Telemetry_Create(path, 16);
+	if(rec == NULL || lat == NULL || t == NULL){
+		perror(path);
+		return 1;
+	}
+
+	// Every axis runs, changes speed now and then and sometimes reverses or
+	//  stops, sampled at rate all the while.
+	unsigned long long text = 0;
+	long k = 0;
+	for(long round=0; round<rounds; round++){
+		for(int i=0; i<axes; i++){
+			dSPIN_Select(i);
+			if(round % (long)(rate / 2 + 1) == 0){
+				int what = (round / (long)(rate / 2 + 1) + i) % 5;
+				if(what == 4) dSPIN_SoftStop();
+				else dSPIN_Run(what & 1 ? REV : FWD, SpdCalc(50 + 60 * i + 100 * what));
+			}
+			dSPIN_TeleSample *s = &rec[k];
+			s->speed = dSPIN_GetParam(dSPIN_SPEED);
+			s->abs_pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+			if(s->abs_pos & 0x200000) s->abs_pos -= 0x400000;
+			s->status = dSPIN_GetParam(dSPIN_STATUS);
+			s->adc = (byte)dSPIN_GetParam(dSPIN_ADC_OUT);
+			s->t_ns = dSPIN_Now();
+			s->axis = i;
+			// What printing it would cost, as dSPIN_run.c would.
+			char line[96];
+			text += snprintf(line, sizeof(line), "%llu %d %ld %lu %04X %u\n", s->t_ns, s->axis,
+			                 s->abs_pos, s->speed, s->status, s->adc);
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			dSPIN_Telemetry_Add(t, s);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			lat[k++] = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+		}
+		delayMicroseconds((unsigned int)(1e6 / rate));
+	}
+	dSPIN_TelemetryStats st;
+	int err = dSPIN_Telemetry_Close(t, &st);
+
+	// Sampler latency, median and worst.
+	unsigned long *hist = (unsigned long *)calloc(4096, sizeof(unsigned long));
+	unsigned long worst = 0;
+	for(long j=0; j<k; j++){
+		hist[lat[j] < 4095 ? lat[j] : 4095]++;
+		if(lat[j] > worst) worst = lat[j];
+	}
+	long med = 0;
+	for(unsigned long seen = 0; med < 4095 && (seen += hist[med]) <= (unsigned long)k / 2; med++);
+	free(hist);
+
+	long got_all, got_part;
+	long wrong_all = tele_check(path, rec, k, 0, ~0ULL, &got_all);
+	unsigned long long t0 = rec[0].t_ns, span = rec[k - 1].t_ns - t0;
+	unsigned long long from = t0 + span / 3, to = t0 + 2 * span / 3;
+	long want_part = 0;
+	for(long j=0; j<k; j++) want_part += rec[j].t_ns >= from && rec[j].t_ns <= to;
+	long wrong_part = tele_check(path, rec, k, from, to, &got_part);
+	// And a damaged file is reported, not read as something else.
+	truncate(path, TELE_BENCH_HEADER + st.bytes - 1);
+	long got_cut;
+	tele_check(path, rec, k, 0, ~0ULL, &got_cut);
+	unlink(path);
+
+	double per = (double)(st.bytes + TELE_BENCH_HEADER) / k;
+	printf("telemetry: %ld samples of %d axes at %.0f/s, %lu chunks, %lu dropped\n", k, axes, rate,
+	       st.chunks, st.dropped);
+	printf("size: %.2f bytes/sample (%.2f as text, %d in memory), %.1fx smaller than text\n",
+	       per, (double)text / k, (int)sizeof(dSPIN_TeleSample), text / per / k);
+	printf("sampler: median %ldns, worst %luns per sample\n", med, worst);
+	printf("read back: %ld/%ld wrong, range %ld/%ld samples, %ld wrong; cut file: %ld read\n",
+	       wrong_all, got_all, got_part, want_part, wrong_part, got_cut);
+
+	int ok = err == 0 && st.dropped == 0 && got_all == k && wrong_all == 0 && got_part == want_part
+	         && wrong_part == 0 && got_cut < k && per * 4 < (double)text / k;
+	free(rec);
+	free(lat);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** osc ********************/
+
+// Run axis at 300 steps/s for a second and return how far off the speed
+//  was, as a fraction.
+static double osc_speed_err(int axis){
+	dSPIN_Sim_State a, b;
+	int ms = 1 << (dSPIN_GetParam(dSPIN_STEP_MODE) & dSPIN_STEP_MODE_STEP_SEL);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(1000));
+	dSPIN_Run(FWD, SpdCalc(300));
+	while(dSPIN_Busy()) delay(1);
+	dSPIN_Sim_Peek(axis, &a);
+	unsigned long long t0 = dSPIN_Now();
+	delay(1000);
+	dSPIN_Sim_Peek(axis, &b);
+	double v = (b.phys_pos - a.phys_pos) / (double)ms / ((dSPIN_Now() - t0) * 1e-9);
+	dSPIN_SoftStop();
+	while(dSPIN_Busy()) delay(1);
+	return v / 300 - 1;
+}
+
+// Move axis 2000 steps and return how far off the predicted time was.
+static double osc_time_err(){
+	int ms = 1 << (dSPIN_GetParam(dSPIN_STEP_MODE) & dSPIN_STEP_MODE_STEP_SEL);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(400));
+	dSPIN_SetParam(dSPIN_ACC, AccCalc(1000));
+	dSPIN_SetParam(dSPIN_DEC, DecCalc(1000));
+	dSPIN_MotionState st;
+	dSPIN_Prediction p;
+	dSPIN_GetMotionState(&st);
+	dSPIN_PredictMove(&st, FWD, 2000 * ms, &p);
+	unsigned long long t0 = dSPIN_Now();
+	dSPIN_Move(FWD, 2000 * ms);
+	while(dSPIN_Busy()) delay(1);
+	return (dSPIN_Now() - t0) / (double)dSPIN_TicksToNs(p.ticks) - 1;
+}
+
+int bench_osc(int argc, char* argv[]){
+	unsigned int cal_ms = argc>1 ? atoi(argv[1]) : 2000;
+	static const double ratios[] = { 0.94, 0.97, 1.0, 1.02, 1.06 };
+	const int n = sizeof(ratios) / sizeof(ratios[0]);
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<n; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	printf("%8s %9s %12s %12s %12s %12s\n", "osc", "measured", "speed err", "time err",
+	       "speed after", "time after");
+	double worst_cal = 0, worst_after = 0;
+	for(int i=0; i<n; i++){
+		dSPIN_Sim_SetOscillator(i, ratios[i]);
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+		double v0 = osc_speed_err(i), t0 = osc_time_err();
+		float r = dSPIN_CalibrateOsc(200, cal_ms);
+		double v1 = osc_speed_err(i), t1 = osc_time_err();
+		printf("%8.3f %9.5f %11.2f%% %11.2f%% %11.3f%% %11.3f%%\n", ratios[i], r, v0 * 100,
+		       t0 * 100, v1 * 100, t1 * 100);
+		worst_cal = fmax(worst_cal, fabs(r - ratios[i]));
+		worst_after = fmax(worst_after, fmax(fabs(v1), fabs(t1)));
+	}
+	printf("worst calibration error %.5f, worst speed/time error after %.3f%%\n", worst_cal,
+	       worst_after * 100);
+	int ok = worst_cal < 0.001 && worst_after < 0.005;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** fast ********************/
+
+// MISO wired straight to MOSI, with no simulator behind it: what's left is
+//  the cost of the driver itself.
+struct fast_loopback {
+	static volatile int line;
+	static inline void write(int pin, int value){ if(pin == dSPIN_MOSI) line = value; }
+	static inline int read(int pin){ return line; }
+	static inline void wait_us(unsigned int us){ }
+};
+volatile int fast_loopback::line;
+
+typedef dSPIN_Fast<dSPIN_WiringPi> fast_sim;
+typedef dSPIN_Fast<fast_loopback, dSPIN_DefaultPins, 0, 0> fast_loop;
+typedef dSPIN_Fast<fast_loopback, dSPIN_DefaultPins, 0, 0, false> fast_bare;
+
+// Write v to Param one way and read it back the other, both ways round.
+template <byte Param>
+static int fast_check(unsigned long v){
+	int wrong = 0;
+	fast_sim::set<Param>(v);
+	wrong += fast_sim::get<Param>() != dSPIN_GetParam(Param);
+	dSPIN_SetParam(Param, v + 1);
+	wrong += fast_sim::get<Param>() != dSPIN_GetParam(Param);
+	return wrong;
+}
+
+int bench_fast(int argc, char* argv[]){
+	long frames = argc>1 ? atol(argv[1]) : 200000;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+
+	// Same frames: every register reads the same either way, writes land the
+	//  same, wide ones saturate the same, and motion commands do the same.
+	int wrong = 0;
+	wrong += fast_check<dSPIN_ABS_POS>(0x12345) + fast_check<dSPIN_ABS_POS>(0x7FFFFFF);
+	wrong += fast_check<dSPIN_EL_POS>(0x1AB) + fast_check<dSPIN_MARK>(0x3FFFF0);
+	wrong += fast_check<dSPIN_ACC>(0x123) + fast_check<dSPIN_DEC>(0x1FFF);
+	wrong += fast_check<dSPIN_MAX_SPEED>(0x2A) + fast_check<dSPIN_MIN_SPEED>(0x100);
+	wrong += fast_check<dSPIN_FS_SPD>(0x3FF) + fast_check<dSPIN_KVAL_HOLD>(0x30);
+	wrong += fast_check<dSPIN_KVAL_RUN>(0x80) + fast_check<dSPIN_INT_SPD>(0x2000);
+	wrong += fast_check<dSPIN_ST_SLP>(0x20) + fast_check<dSPIN_K_THERM>(0x1F);
+	wrong += fast_check<dSPIN_OCD_TH>(0x0A) + fast_check<dSPIN_STALL_TH>(0x90);
+	wrong += fast_check<dSPIN_ALARM_EN>(0xEF) + fast_check<dSPIN_CONFIG>(0x2E88);
+	wrong += fast_sim::get<dSPIN_STATUS>() != dSPIN_GetParam(dSPIN_STATUS);
+	wrong += fast_sim::get<dSPIN_ADC_OUT>() != dSPIN_GetParam(dSPIN_ADC_OUT);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(1000));
+	dSPIN_SetParam(dSPIN_ACC, 0xFFF);
+	dSPIN_SetParam(dSPIN_DEC, 0xFFF);
+	dSPIN_ResetPos();
+	fast_sim::move(FWD, 1000);
+	while(fast_sim::busy()) delay(1);
+	fast_sim::go_to(0x3FFFFF + 5);
+	while(dSPIN_Busy()) delay(1);
+	wrong += dSPIN_GetParam(dSPIN_ABS_POS) != 0x3FFFFF;
+	fast_sim::run(REV, SpdCalc(300));
+	delay(100);
+	wrong += fast_sim::get<dSPIN_SPEED>() != dSPIN_GetParam(dSPIN_SPEED);
+	fast_sim::soft_stop();
+	while(dSPIN_Busy()) delay(1);
+	wrong += (fast_sim::get_status() & 0xFFFF) != (dSPIN_GetStatus() & 0xFFFF);
+	for(int b=0; b<256; b++) wrong += fast_bare::xfer((byte)b) != b;
+
+	// Cost of an ABS_POS read, all four bytes of it, best of a few interleaved
+	//  rounds. On the simulator both drivers mostly wait on its pin handling.
+	double cpu, generic = 1e30, fast = 1e30;
+	unsigned long sum = 0;
+	for(int round=0; round<5; round++){
+		cpu = cpu_now();
+		for(long i=0; i<frames / 5; i++) sum += dSPIN_GetParam(dSPIN_ABS_POS);
+		generic = fmin(generic, (cpu_now() - cpu) / (frames / 5) * 1e9);
+		cpu = cpu_now();
+		for(long i=0; i<frames / 5; i++) sum += fast_sim::get<dSPIN_ABS_POS>();
+		fast = fmin(fast, (cpu_now() - cpu) / (frames / 5) * 1e9);
+	}
+
+	// With the pins looped back and no clock delays, what's left is each
+	//  driver's own cost: the generic one through the digitalWrite()/
+	//  digitalRead() calls, the template with its backend inlined. Both take
+	//  the bus for every frame; the unlocked template shows what that costs.
+	dSPIN_Sim_SetLoopback(1);
+	long loop_frames = frames * 10;
+	double generic_loop = 1e30, fast_loop_ns = 1e30, bare = 1e30;
+	for(int round=0; round<5; round++){
+		cpu = cpu_now();
+		for(long i=0; i<loop_frames / 5; i++) sum += dSPIN_GetParam(dSPIN_ABS_POS);
+		generic_loop = fmin(generic_loop, (cpu_now() - cpu) / (loop_frames / 5) * 1e9);
+		cpu = cpu_now();
+		for(long i=0; i<loop_frames / 5; i++) sum += fast_loop::get<dSPIN_ABS_POS>();
+		fast_loop_ns = fmin(fast_loop_ns, (cpu_now() - cpu) / (loop_frames / 5) * 1e9);
+		cpu = cpu_now();
+		for(long i=0; i<loop_frames / 5; i++) sum += fast_bare::get<dSPIN_ABS_POS>();
+		bare = fmin(bare, (cpu_now() - cpu) / (loop_frames / 5) * 1e9);
+	}
+	dSPIN_Sim_SetLoopback(0);
+
+	printf("fast: %d mismatches against the generic driver (checksum %lu)\n", wrong, sum & 0xFF);
+	printf("ABS_POS read on the simulator: generic %.0fns, templated %.0fns (%.1f%% less)\n",
+	       generic, fast, 100 * (1 - fast / generic));
+	printf("pins looped back: generic %.1fns, templated %.1fns (%.1f%% less), "
+	       "templated without the bus lock %.1fns\n", generic_loop, fast_loop_ns,
+	       100 * (1 - fast_loop_ns / generic_loop), bare);
+	int ok = wrong == 0 && fast_loop_ns * 2 < generic_loop;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** home ********************/
+
+// Where axis i's switch closes: it's closed from there on in REV.
+static long long home_edge(int i){
+	return -(50 + 25 * i) * 128LL;
+}
+
+// The usual hand-written homing script, one axis after the other.
+static void home_by_hand(const dSPIN_HomeConfig *c){
+	byte away = c->dir == FWD ? REV : FWD;
+	dSPIN_GoUntil(c->act, c->dir, SpdCalc(c->seek_speed));
+	while(dSPIN_Busy()) delay(1);
+	dSPIN_Move(away, c->backoff);
+	while(dSPIN_Busy()) delay(1);
+	dSPIN_GoUntil(c->act, c->dir, SpdCalc(c->slow_speed));
+	while(dSPIN_Busy()) delay(1);
+	unsigned long min = dSPIN_GetParam(dSPIN_MIN_SPEED);
+	dSPIN_SetParam(dSPIN_MIN_SPEED, MinSpdCalc(c->release_speed));
+	dSPIN_ReleaseSW(c->act, away);
+	while(dSPIN_Busy()) delay(1);
+	dSPIN_SetParam(dSPIN_MIN_SPEED, min);
+}
+
+int bench_home(int argc, char* argv[]){
+	int axes = argc>1 ? atoi(argv[1]) : 12;
+	if(axes < 2 || axes > 100) axes = 12;
+	int n = axes + 1;  // and one whose switch never closes
+
+	// Every axis but the last has a BUSYN line; the last one gets polled.
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<n; i++){
+		byte busy = i < n - 1 ? 150 + i : dSPIN_NO_PIN;
+		dSPIN_Sim_AddDevice(100 + i, busy, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, busy);
+	}
+
+	// Odd axes soft stop on the switch and need a longer back-off for it;
+	//  every third one copies into MARK instead of resetting ABS_POS.
+	int *ax = (int *)malloc(n * sizeof(int));
+	dSPIN_HomeConfig *cfg = (dSPIN_HomeConfig *)calloc(n, sizeof(dSPIN_HomeConfig));
+	dSPIN_HomeResult *res = (dSPIN_HomeResult *)calloc(n, sizeof(dSPIN_HomeResult));
+	for(int i=0; i<n; i++){
+		ax[i] = i;
+		cfg[i].dir = REV;
+		cfg[i].seek_speed = 400;
+		cfg[i].backoff = (i & 1 ? 80 : 20) * 128;
+		cfg[i].slow_speed = 50;
+		cfg[i].release_speed = 10;
+		cfg[i].act = i % 3 == 2 ? ACTION_COPY : ACTION_RESET;
+		cfg[i].timeout_ms = i < axes ? 10000 : 2500;
+		dSPIN_Select(i);
+		dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(600));
+		if(i & 1) dSPIN_SetParam(dSPIN_CONFIG, dSPIN_GetParam(dSPIN_CONFIG) | dSPIN_CONFIG_SW_USER);
+		if(i < axes) dSPIN_Sim_SetSwitch(i, home_edge(i) - 1000000, home_edge(i));
+		dSPIN_GetStatus();
+	}
+
+	// One at a time, then back to where they started.
+	unsigned long long t0 = dSPIN_Now();
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		home_by_hand(&cfg[i]);
+	}
+	unsigned long long by_hand = dSPIN_Now() - t0;
+	int wrong = 0;
+	long long hand_pos[100];
+	for(int i=0; i<axes; i++){
+		dSPIN_Sim_State st;
+		dSPIN_Sim_Peek(i, &st);
+		hand_pos[i] = st.phys_pos;
+		dSPIN_Select(i);
+		dSPIN_Move(FWD, (unsigned long)-st.phys_pos);
+		while(dSPIN_Busy()) delay(1);
+		dSPIN_GetStatus();
+	}
+
+	t0 = dSPIN_Now();
+	int failed = dSPIN_Home(ax, cfg, res, n);
+	unsigned long long engine = dSPIN_Now() - t0;
+
+	printf("%4s %8s %6s %9s %10s %10s\n", "axis", "result", "step", "pos", "time ms", "edge");
+	for(int i=0; i<n; i++){
+		dSPIN_Sim_State st;
+		dSPIN_Sim_Peek(i, &st);
+		printf("%4d %8d %6d %9ld %10.1f %10lld\n", i, res[i].result, res[i].step, res[i].pos,
+		       res[i].ns / 1e6, i < axes ? home_edge(i) : 0);
+		if(i == n - 1){
+			// No switch: it must time out, on time, and be left stopped.
+			wrong += res[i].result != dSPIN_HOME_TIMEOUT || st.busy
+			         || res[i].ns < 2500000000ULL || res[i].ns > 2510000000ULL;
+			continue;
+		}
+		// Stopped right where the switch opened, with ABS_POS or MARK
+		//  saying so, and where the script left it.
+		long want = cfg[i].act == ACTION_COPY ? (long)(home_edge(i) + 1) : 0;
+		wrong += res[i].result != dSPIN_HOME_OK || res[i].step != dSPIN_HOME_DONE
+		         || st.phys_pos != home_edge(i) + 1 || st.phys_pos != hand_pos[i]
+		         || res[i].pos != want || st.busy;
+		if(cfg[i].act == ACTION_RESET) wrong += st.abs_pos != 0;
+		dSPIN_Select(i);
+		wrong += (dSPIN_GetParam(dSPIN_MIN_SPEED) & 0xFFF) != 0;
+	}
+	printf("home: %d axes one at a time %.2fs, all at once %.2fs (%.1fx), %d failed as expected\n",
+	       axes, by_hand / 1e9, engine / 1e9, (double)by_hand / engine, failed);
+
+	// SPEED is 20 bits: asking GoUntil for more runs it flat out, not at
+	//  whatever bits are left.
+	dSPIN_Select(n - 1);
+	dSPIN_GoUntil(ACTION_RESET, FWD, 0x100000);
+	delay(500);
+	dSPIN_Sim_State fast;
+	dSPIN_Sim_Peek(n - 1, &fast);
+	dSPIN_HardStop();
+	unsigned long top = dSPIN_GetParam(dSPIN_MAX_SPEED) << 10;
+	printf("GoUntil at 0x100000: SPEED 0x%05lx, MAX_SPEED allows 0x%05lx\n", fast.speed, top);
+	int ok = wrong == 0 && failed == 1 && engine * 3 < by_hand && fast.speed + (top >> 4) >= top;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	free(ax);
+	free(cfg);
+	free(res);
+	return ok ? 0 : 1;
+}
+
+
+/******************** attach ********************/
+
+int bench_attach(int argc, char* argv[]){
+	int axes = argc>1 ? atoi(argv[1]) : 4;
+	if(axes < 3 || axes > 100) axes = 4;
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/dSPIN_bench_attach_%d.prof", (int)getpid());
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<axes; i++){
+		dSPIN_Sim_AddDevice(100 + i, 150 + i, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, 150 + i);
+	}
+	// And one whose chip never answers.
+	int dead = dSPIN_AddAxis(99, dSPIN_NO_PIN);
+
+	// The machine's profile, on chips 2% fast.
+	dSPIN_Profile prof, loaded;
+	dSPIN_GetStatus();
+	dSPIN_Profile_Read(&prof);
+	prof.max_speed = MaxSpdCalc(800);
+	prof.acc = prof.dec = AccCalc(3000);
+	prof.kval_run = prof.kval_acc = prof.kval_dec = 0x50;
+	prof.stall_th = 0x30;
+	prof.config |= dSPIN_CONFIG_SW_USER;
+	prof.osc = 1.02;
+	dSPIN_Profile_Save(path, &prof, "bench attach");
+
+	int *ax = (int *)malloc(axes * sizeof(int));
+	dSPIN_HomeConfig *cfg = (dSPIN_HomeConfig *)calloc(axes, sizeof(dSPIN_HomeConfig));
+	dSPIN_HomeResult *res = (dSPIN_HomeResult *)calloc(axes, sizeof(dSPIN_HomeResult));
+	for(int i=0; i<axes; i++){
+		ax[i] = i;
+		cfg[i].dir = REV;
+		cfg[i].seek_speed = 400;
+		cfg[i].backoff = 80 * 128;
+		cfg[i].slow_speed = 50;
+		cfg[i].release_speed = 10;
+		cfg[i].act = ACTION_RESET;
+		cfg[i].timeout_ms = 10000;
+		dSPIN_Sim_SetOscillator(i, 1.02);
+		dSPIN_Sim_SetSwitch(i, -4000000, -(200 + 100 * i) * 128LL);
+	}
+
+	// Cold start, as every start used to be: reset, configure, home, and go
+	//  to work positions.
+	int wrong = 0;
+	unsigned long long t0 = dSPIN_Now();
+	dSPIN_init();
+	dSPIN_Profile_Load(path, &loaded);
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		wrong += dSPIN_Attach(&loaded) != dSPIN_ATTACH_COLD;
+	}
+	wrong += dSPIN_Home(ax, cfg, res, axes) != 0;
+	unsigned long long cold = dSPIN_Now() - t0;
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		dSPIN_Move(FWD, 1000 * (i + 1));
+		while(dSPIN_Busy()) delay(1);
+		dSPIN_GetStatus();
+	}
+
+	// The program restarts: the host forgets the calibration, the chips
+	//  remember everything.
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		dSPIN_SetOsc(0);
+	}
+	t0 = dSPIN_Now();
+	dSPIN_init_warm();
+	dSPIN_Profile_Load(path, &loaded);
+	int warm_ok = 0;
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		warm_ok += dSPIN_Attach(&loaded) == dSPIN_ATTACH_WARM;
+	}
+	unsigned long long warm = dSPIN_Now() - t0;
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		wrong += (long)dSPIN_GetParam(dSPIN_ABS_POS) != 1000 * (i + 1) || dSPIN_Osc() != 1.02f;
+	}
+	wrong += warm_ok != axes;
+
+	// Someone changed a register on axis 1, and axis 2 was power cycled and
+	//  then configured by hand without clearing UVLO: both need a cold start.
+	dSPIN_Select(1);
+	dSPIN_SetParam(dSPIN_STALL_TH, 0x7F);
+	dSPIN_Select(2);
+	dSPIN_ResetDev();
+	dSPIN_Profile_Apply(&loaded);
+	int got[3];
+	for(int i=1; i<3; i++){
+		dSPIN_Select(i);
+		got[i] = dSPIN_Attach(&loaded);
+		dSPIN_Profile readback;
+		dSPIN_Profile_Read(&readback);
+		wrong += got[i] != dSPIN_ATTACH_COLD || dSPIN_GetParam(dSPIN_ABS_POS) != 0
+		         || dSPIN_Profile_Hash(&readback) != dSPIN_Profile_Hash(&loaded);
+	}
+	dSPIN_Select(dead);
+	int dead_got = dSPIN_Attach(&loaded);
+	wrong += dead_got != dSPIN_ATTACH_FAILED;
+
+	printf("attach: %d axes, cold start with homing %.3fs, warm attach %.3fms (%d/%d warm)\n",
+	       axes, cold / 1e9, warm / 1e6, warm_ok, axes);
+	printf("changed register: %s, power cycled: %s, no chip: %s\n",
+	       got[1] == dSPIN_ATTACH_COLD ? "cold" : "WRONG", got[2] == dSPIN_ATTACH_COLD ? "cold" : "WRONG",
+	       dead_got == dSPIN_ATTACH_FAILED ? "failed" : "WRONG");
+	unlink(path);
+	free(ax);
+	free(cfg);
+	free(res);
+	int ok = wrong == 0 && warm * 100 < cold;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** co ********************/
+
+static int threads_now(){
+	int n = 0;
+	DIR *d = opendir("/proc/self/task");
+	if(d == NULL) return -1;
+	struct dirent *e;
+	while((e = readdir(d)) != NULL) n += e->d_name[0] != '.';
+	closedir(d);
+	return n;
+}
+
+// Out and back with a pause, as a sequence of its own.
+static dSPIN_Task co_out_and_back(dSPIN_CoAxis a, unsigned long steps){
+	co_await a.move(FWD, steps);
+	co_await a.loop.sleep_us(20000);
+	co_await a.go_home();
+	co_return (long)co_await a.get(dSPIN_ABS_POS) == 0 ? 0 : 1;
+}
+
+static dSPIN_Task co_motion(dSPIN_CoAxis a, int i){
+	int bad = co_await co_out_and_back(a, 20000 + 100 * i);
+	co_await a.run(REV, SpdCalc(200 + i));
+	co_await a.loop.sleep_us(50000);
+	co_await a.soft_stop();
+	co_await a.go_to(500);
+	bad += co_await a.get(dSPIN_ABS_POS) != 500;
+	co_return bad;
+}
+
+// Reads STATUS of an axis on a timer, like a panel would.
+static dSPIN_Task co_watcher(dSPIN_CoAxis a, int reads, unsigned long us, long *count){
+	for(int i=0; i<reads; i++){
+		co_await a.status();
+		(*count)++;
+		co_await a.loop.sleep_us(us);
+	}
+	co_return 0;
+}
+
+int bench_co(int argc, char* argv[]){
+	int axes = argc>1 ? atoi(argv[1]) : 100;
+	int watchers = argc>2 ? atoi(argv[2]) : 200;
+	if(axes < 1 || axes > dSPIN_MAX_AXES - 1) axes = 100;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	// Every fourth axis has no BUSYN line and gets polled.
+	for(int i=1; i<axes; i++){
+		byte busy = i % 4 == 3 ? dSPIN_NO_PIN : (byte)(130 + i);
+		dSPIN_Sim_AddDevice(30 + i, busy, dSPIN_NO_PIN);
+		dSPIN_AddAxis(30 + i, busy);
+	}
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+	}
+
+	// One sequence alone, for its duration.
+	dSPIN_Loop solo;
+	int id = solo.spawn(co_motion(dSPIN_CoAxis(solo, 0), 0));
+	unsigned long long t0 = dSPIN_Now();
+	solo.run();
+	unsigned long long one = dSPIN_Now() - t0;
+	int bad = solo.result(id);
+
+	// All of them at once, on this thread.
+	dSPIN_Loop loop;
+	long reads = 0;
+	for(int i=0; i<axes; i++) loop.spawn(co_motion(dSPIN_CoAxis(loop, i), i));
+	for(int i=0; i<watchers; i++)
+		loop.spawn(co_watcher(dSPIN_CoAxis(loop, i % axes), 50, 3000 + 17 * i, &reads));
+	int threads = threads_now();
+	t0 = dSPIN_Now();
+	loop.run();
+	unsigned long long all = dSPIN_Now() - t0;
+	for(int i=0; i<axes + watchers; i++) bad += loop.result(i);
+	// Every axis ended up at 500, idle.
+	for(int i=0; i<axes; i++){
+		dSPIN_Sim_State st;
+		dSPIN_Sim_Peek(i, &st);
+		bad += st.abs_pos != 500 || st.busy;
+	}
+	int threads_after = threads_now();
+
+	printf("co: one sequence %.3fs; %d motion sequences and %d watchers %.3fs on one loop\n",
+	       one / 1e9, axes, watchers, all / 1e9);
+	// Besides this one, the threads are the bus' emergency stopper and the
+	//  simulator's interrupt thread.
+	printf("%ld STATUS reads, %lu wakeups, %d threads while running and %d after\n",
+	       reads, loop.wakes(), threads, threads_after);
+	int ok = bad == 0 && reads == 50L * watchers && threads_after == threads && threads <= 3
+	         && all < one * 3 / 2;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** regs ********************/
+
+int bench_regs(int argc, char* argv[]){
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+
+	// Power-on values, as the register map has them. SPEED, ADC_OUT and
+	//  STATUS are measurements rather than stored values.
+	int wrong_reset = 0, wrong_rw = 0, checks = 0;
+	for(int p=1; p<dSPIN_REG_COUNT; p++){
+		const dSPIN_RegInfo &r = dSPIN_Regs[p];
+		if(r.access == dSPIN_REG_RO) continue;
+		unsigned long got = dSPIN_GetParam(p);
+		if(got != r.reset){
+			printf("reg 0x%02X: power-on 0x%lX, map says 0x%lX\n", p, got, r.reset);
+			wrong_reset++;
+		}
+	}
+
+	// Every writable register, written and read back with values in range,
+	//  at the edge, past it and with reserved bits set: what comes back is
+	//  what dSPIN_RegEncode() says went out. The bridges are in HiZ after
+	//  reset, so every class of register can be written.
+	for(int p=1; p<dSPIN_REG_COUNT; p++){
+		const dSPIN_RegInfo &r = dSPIN_Regs[p];
+		if(r.access == dSPIN_REG_RO) continue;
+		unsigned long mask = dSPIN_RegMask(r);
+		unsigned long vals[] = { 0, 1, r.reset, mask, mask + 1, 0xFFFFFFFFUL,
+		                         (0x5A5A5AUL & mask) | r.reserved };
+		for(unsigned k=0; k<sizeof(vals)/sizeof(vals[0]); k++){
+			dSPIN_SetParam(p, vals[k]);
+			unsigned long got = dSPIN_GetParam(p);
+			checks++;
+			if(got != dSPIN_RegEncode(r, vals[k])){
+				printf("reg 0x%02X: wrote 0x%lX, read 0x%lX\n", p, vals[k], got);
+				wrong_rw++;
+			}
+		}
+		dSPIN_SetParam(p, r.reset);
+	}
+	int flags = dSPIN_GetStatus() & (dSPIN_STATUS_WRONG_CMD | dSPIN_STATUS_NOTPERF_CMD);
+
+	// MIN_SPEED is 13 bits wide: LSPD_OPT comes through a SetParam along
+	//  with the speed, and SetLSPDOpt() sets it alone.
+	dSPIN_SetParam(dSPIN_MIN_SPEED, 0x1000 | MinSpdCalc(20));
+	int lspd = dSPIN_GetParam(dSPIN_MIN_SPEED) == (0x1000 | MinSpdCalc(20));
+	SetLSPDOpt(true);
+	lspd &= dSPIN_GetParam(dSPIN_MIN_SPEED) == 0x1000;
+	SetLSPDOpt(false);
+	lspd &= dSPIN_GetParam(dSPIN_MIN_SPEED) == 0;
+
+	// Checked when built.
+	dSPIN_SET_CONST(dSPIN_STALL_TH, 0x40);
+	dSPIN_SET_CONST(dSPIN_CONFIG, dSPIN_CONFIG_INT_16MHZ_OSCOUT_2MHZ | dSPIN_CONFIG_SW_USER);
+	int consts = dSPIN_GetParam(dSPIN_STALL_TH) == 0x40
+	             && dSPIN_GetParam(dSPIN_CONFIG) == (dSPIN_CONFIG_INT_16MHZ_OSCOUT_2MHZ | dSPIN_CONFIG_SW_USER);
+
+	printf("regs: power-on values %d wrong; %d writes read back, %d wrong; status flags 0x%04X\n",
+	       wrong_reset, checks, wrong_rw, flags);
+	printf("LSPD_OPT %s, compile-time checked writes %s\n", lspd ? "kept" : "LOST", consts ? "ok" : "WRONG");
+	int ok = wrong_reset == 0 && wrong_rw == 0 && flags == 0 && lspd && consts;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** ring ********************/
+
+#define RING_AXES  4
+#define RING_BURST 2000   // fits in a pipe, so the pipe client never blocks
+
+static unsigned long long mono_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int ull_cmp(const void *a, const void *b){
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+// What a client process reports: submit-to-bus latency one command at a
+//  time, and the time per command for a burst.
+struct ring_lat {
+	unsigned long long p50, p99, max;
+	double burst_ns;
+	int bad;
+};
+
+static void ring_summary(unsigned long long *ns, int n, struct ring_lat *l){
+	qsort(ns, n, sizeof(ns[0]), ull_cmp);
+	l->p50 = ns[n / 2];
+	l->p99 = ns[n * 99 / 100];
+	l->max = ns[n - 1];
+}
+
+// The command a client sends n-th: Run alternating direction and speed on
+//  each axis in turn.
+static void ring_nth(int n, byte *op, int *axis, byte *dir, unsigned long *arg){
+	*op = dSPIN_RING_RUN;
+	*axis = n % RING_AXES;
+	*dir = n / RING_AXES & 1 ? REV : FWD;
+	*arg = 2000 + 100 * (n % 7);
+}
+
+// Client process on the ring: one command at a time, waiting for each to
+//  complete, then a burst; the results go back through fd.
+static void ring_client(const char *name, int count, int fd){
+	struct ring_lat l = { 0, 0, 0, 0, 1 };
+	unsigned long long *ns = (unsigned long long *)calloc(count, sizeof(*ns));
+	dSPIN_Ring *r = dSPIN_Ring_Attach(name);
+	if(r){
+		l.bad = 0;
+		byte op, dir;
+		int axis;
+		unsigned long arg;
+		dSPIN_RingDone d[64];
+		for(int i=0; i<count && !l.bad; i++){
+			ring_nth(i, &op, &axis, &dir, &arg);
+			int seq = dSPIN_Ring_Submit(r, op, axis, dir, arg);
+			if(seq < 0 || dSPIN_Ring_Reap(r, d, 1, 1000) != 1 || (int)d[0].seq != seq
+			   || d[0].result != dSPIN_RING_DONE)
+				l.bad++;
+			ns[i] = d[0].bus_ns - d[0].submit_ns;
+		}
+		if(!l.bad) ring_summary(ns, count, &l);
+
+		unsigned long long t0 = mono_ns();
+		int reaped = 0;
+		for(int i=0; i<RING_BURST && !l.bad;){
+			ring_nth(i, &op, &axis, &dir, &arg);
+			int seq = dSPIN_Ring_Submit(r, op, axis, dir, arg);
+			if(seq >= 0) i++;
+			else if(seq == -2) reaped += dSPIN_Ring_Reap(r, d, 64, 1000);
+			else l.bad++;
+		}
+		while(reaped < RING_BURST && !l.bad){
+			int n = dSPIN_Ring_Reap(r, d, 64, 1000);
+			if(n == 0) l.bad++;
+			reaped += n;
+		}
+		l.burst_ns = (double)(mono_ns() - t0) / RING_BURST;
+		dSPIN_Ring_Close(r);
+	}
+	if(write(fd, &l, sizeof(l)) != sizeof(l)) l.bad = 1;
+	_exit(0);
+}
+
+struct setpoint_res {
+	int bad;
+	int coalesced;                   // completions that came back coalesced
+	int last_done;                   // axes whose last setpoint was sent
+};
+
+// Client process streaming a burst of Run setpoints without waiting, with
+//  flags or'ed into each.
+static void setpoint_client(const char *name, byte flags, int fd){
+	struct setpoint_res res = { 1, 0, 0 };
+	static byte result[RING_BURST];
+	int last[RING_AXES], first = -1;
+	dSPIN_Ring *r = dSPIN_Ring_Attach(name);
+	if(r){
+		res.bad = 0;
+		byte op, dir;
+		int axis;
+		unsigned long arg;
+		dSPIN_RingDone d[64];
+		int reaped = 0, n;
+		for(int i=0; i<RING_BURST || reaped<RING_BURST;){
+			if(i < RING_BURST){
+				ring_nth(i, &op, &axis, &dir, &arg);
+				int seq = dSPIN_Ring_Submit(r, op | flags, axis, dir, arg);
+				if(seq == -1) break;
+				if(seq >= 0){
+					if(first < 0) first = seq;
+					last[axis] = seq;
+					i++;
+					continue;
+				}
+			}
+			if((n = dSPIN_Ring_Reap(r, d, 64, 1000)) == 0) break;
+			for(int k=0; k<n; k++) result[d[k].seq - first] = d[k].result;
+			reaped += n;
+		}
+		res.bad = reaped != RING_BURST;
+		for(int i=0; i<RING_BURST && !res.bad; i++) res.coalesced += result[i] == dSPIN_RING_COALESCED;
+		for(int a=0; a<RING_AXES && !res.bad; a++) res.last_done += result[last[a] - first] == dSPIN_RING_DONE;
+		dSPIN_Ring_Close(r);
+	}
+	if(write(fd, &res, sizeof(res)) != sizeof(res)) res.bad = 1;
+	_exit(0);
+}
+
+// The same over a pair of pipes, for comparison: the client writes each
+//  command and reads its completion back.
+static void pipe_client(int cmd_fd, int done_fd, int count, int fd){
+	struct ring_lat l = { 0, 0, 0, 0, 0 };
+	unsigned long long *ns = (unsigned long long *)calloc(count, sizeof(*ns));
+	dSPIN_RingCmd c;
+	dSPIN_RingDone d[64];
+	unsigned long long t0 = 0;
+	memset(&c, 0, sizeof(c));
+	for(int i=0; i<count + RING_BURST && !l.bad; i++){
+		int axis;
+		unsigned long arg;
+		ring_nth(i, &c.op, &axis, &c.dir, &arg);
+		c.axis = axis;
+		c.arg = arg;
+		c.seq = i;
+		c.submit_ns = mono_ns();
+		if(write(cmd_fd, &c, sizeof(c)) != sizeof(c)) l.bad++;
+		if(i < count){
+			if(read(done_fd, d, sizeof(d[0])) != sizeof(d[0]) || d[0].seq != (unsigned int)i) l.bad++;
+			ns[i] = d[0].bus_ns - d[0].submit_ns;
+			if(i == count - 1){
+				ring_summary(ns, count, &l);
+				t0 = mono_ns();
+			}
+		}
+	}
+	// Then the burst's completions.
+	for(int got = 0; got < RING_BURST * (int)sizeof(d[0]) && !l.bad;){
+		ssize_t n = read(done_fd, d, sizeof(d));
+		if(n <= 0) l.bad++;
+		else got += n;
+	}
+	l.burst_ns = (double)(mono_ns() - t0) / RING_BURST;
+	close(cmd_fd);
+	if(write(fd, &l, sizeof(l)) != sizeof(l)) l.bad = 1;
+	_exit(0);
+}
+
+int bench_ring(int argc, char* argv[]){
+	int count = argc>1 ? atoi(argv[1]) : 5000;
+	if(count < 100) count = 100;
+	char name[64];
+	snprintf(name, sizeof(name), "/dSPIN_bench_ring_%d", (int)getpid());
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_REAL);
+	dSPIN_init();
+	for(int i=1; i<RING_AXES; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	for(int i=0; i<RING_AXES; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+	}
+	dSPIN_Select(0);
+	dSPIN_Ring *r = dSPIN_Ring_Create(name, 2, RING_AXES);
+	dSPIN_Ring *c = dSPIN_Ring_Attach(name);
+	if(r == NULL || c == NULL){
+		perror(name);
+		return 1;
+	}
+
+	// In this process first: bad commands are refused at submission, a full
+	//  ring says so, and a full ring's worth comes back in order. Only the
+	//  last Run on each axis is sent, and every axis is left running the way
+	//  it was last told.
+	int wrong = 0;
+	wrong += dSPIN_Ring_Submit(c, dSPIN_RING_RUN, RING_AXES, FWD, 100) != -1;
+	wrong += dSPIN_Ring_Submit(c, dSPIN_RING_MOVE, 0, FWD, 0x400000) != -1;
+	wrong += dSPIN_Ring_Submit(c, 99, 0, FWD, 0) != -1;
+	wrong += dSPIN_Ring_Submit(c, dSPIN_RING_GOTO, 0, 7, 0) != -1;
+	int first = -1, full = 0;
+	for(int i=0; i<dSPIN_RING_SLOTS + 1; i++){
+		byte op, dir;
+		int axis;
+		unsigned long arg;
+		ring_nth(i, &op, &axis, &dir, &arg);
+		int seq = dSPIN_Ring_Submit(c, op, axis, dir, arg);
+		if(i == 0) first = seq;
+		if(seq == -2) full++;
+	}
+	wrong += full != 1 || first < 0;
+	int served = dSPIN_Ring_Serve(r, 0);
+	static dSPIN_RingDone done[dSPIN_RING_SLOTS];
+	int got = dSPIN_Ring_Reap(c, done, dSPIN_RING_SLOTS, 0);
+	wrong += served != dSPIN_RING_SLOTS || got != dSPIN_RING_SLOTS;
+	for(int i=0; i<got; i++)
+		wrong += (int)done[i].seq != first + i || done[i].result !=
+		         (i >= got - RING_AXES ? dSPIN_RING_DONE : dSPIN_RING_COALESCED);
+	delay(200);
+	for(int i=0; i<RING_AXES; i++){
+		byte op, dir;
+		int axis;
+		unsigned long arg;
+		ring_nth(dSPIN_RING_SLOTS - RING_AXES + i, &op, &axis, &dir, &arg);
+		dSPIN_Sim_State st;
+		dSPIN_Sim_Peek(axis, &st);
+		wrong += (st.status & dSPIN_STATUS_DIR ? FWD : REV) != dir || st.mode != dSPIN_SIM_RUN;
+	}
+	wrong += dSPIN_Ring_Reap(c, done, 1, 20) != 0;
+	dSPIN_Ring_Close(c);
+
+	// A client that dies holding a pair of rings doesn't keep it.
+	pid_t pid = fork();
+	if(pid == 0){
+		dSPIN_Ring_Attach(name);
+		dSPIN_Ring_Attach(name);
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+	dSPIN_Ring *again = dSPIN_Ring_Attach(name);
+	int reclaimed = again != NULL;
+	if(again) dSPIN_Ring_Close(again);
+
+	// Then a client in another process: the ring against a pair of pipes.
+	int fd[2];
+	if(pipe(fd)) return 1;
+	struct ring_lat ring_l, pipe_l;
+	unsigned long before = dSPIN_Ring_Served(r);
+	if((pid = fork()) == 0) ring_client(name, count, fd[1]);
+	while(waitpid(pid, NULL, WNOHANG) == 0) dSPIN_Ring_Serve(r, 100);
+	wrong += read(fd[0], &ring_l, sizeof(ring_l)) != sizeof(ring_l) || ring_l.bad;
+	wrong += dSPIN_Ring_Served(r) - before != (unsigned long)(count + RING_BURST);
+
+	// Setpoints streamed faster than the bus takes them, as barriers and
+	//  then free to coalesce.
+	struct setpoint_res sp[2];
+	dSPIN_RingStats st1[2];
+	for(int k=0; k<2; k++){
+		dSPIN_Ring_ResetStats(r);
+		if((pid = fork()) == 0) setpoint_client(name, k == 0 ? dSPIN_RING_BARRIER : 0, fd[1]);
+		while(waitpid(pid, NULL, WNOHANG) == 0) dSPIN_Ring_Serve(r, 100);
+		wrong += read(fd[0], &sp[k], sizeof(sp[k])) != sizeof(sp[k]) || sp[k].bad;
+		dSPIN_Ring_GetStats(r, &st1[k]);
+		wrong += st1[k].coalesced != (unsigned long)sp[k].coalesced;
+		wrong += st1[k].served != RING_BURST;
+		wrong += sp[k].last_done != RING_AXES;
+	}
+	wrong += st1[0].coalesced != 0 || st1[1].coalesced == 0;
+
+	int cmd_fd[2], done_fd[2];
+	if(pipe(cmd_fd) || pipe(done_fd)) return 1;
+	if((pid = fork()) == 0){
+		close(cmd_fd[0]);
+		close(done_fd[1]);
+		pipe_client(cmd_fd[1], done_fd[0], count, fd[1]);
+	}
+	close(cmd_fd[1]);
+	close(done_fd[0]);
+	dSPIN_RingCmd cmd;
+	while(read(cmd_fd[0], &cmd, sizeof(cmd)) == sizeof(cmd)){
+		dSPIN_RingDone d;
+		d.bus_ns = mono_ns();
+		d.seq = cmd.seq;
+		d.axis = cmd.axis;
+		d.op = cmd.op;
+		d.result = dSPIN_RING_DONE;
+		d.submit_ns = cmd.submit_ns;
+		dSPIN_Select(cmd.axis);
+		dSPIN_Run(cmd.dir, cmd.arg);
+		if(write(done_fd[1], &d, sizeof(d)) != sizeof(d)) break;
+	}
+	waitpid(pid, NULL, 0);
+	wrong += read(fd[0], &pipe_l, sizeof(pipe_l)) != sizeof(pipe_l) || pipe_l.bad;
+	close(cmd_fd[0]);
+	close(done_fd[1]);
+	close(fd[0]);
+	close(fd[1]);
+	dSPIN_Ring_Close(r);
+	dSPIN_Select(0);
+
+	printf("ring: 4 bad commands refused, full at %d, %d served in order, dead client's rings %s\n",
+	       dSPIN_RING_SLOTS, got, reclaimed ? "reclaimed" : "STUCK");
+	printf("submit to bus, %d commands one at a time: ring median %.1fus p99 %.1fus max %.1fus; "
+	       "pipe median %.1fus p99 %.1fus max %.1fus\n", count,
+	       ring_l.p50 / 1e3, ring_l.p99 / 1e3, ring_l.max / 1e3,
+	       pipe_l.p50 / 1e3, pipe_l.p99 / 1e3, pipe_l.max / 1e3);
+	printf("burst of %d: ring %.2fus per command, pipe %.2fus\n",
+	       RING_BURST, ring_l.burst_ns / 1e3, pipe_l.burst_ns / 1e3);
+	double age[2];
+	for(int k=0; k<2; k++){
+		age[k] = st1[k].setpoints ? (double)st1[k].age_ns_sum / st1[k].setpoints : 0;
+		printf("%d setpoints %s: %lu sent, %lu coalesced, age mean %.1fus max %.1fus\n",
+		       RING_BURST, k == 0 ? "as barriers" : "coalescing", st1[k].setpoints,
+		       st1[k].coalesced, age[k] / 1e3, st1[k].age_ns_max / 1e3);
+	}
+	int ok = wrong == 0 && reclaimed && ring_l.p50 < 20000 && ring_l.burst_ns < pipe_l.burst_ns
+	         && age[1] < age[0];
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** soak ********************/
+
+#define SOAK_HIST 20000   // latency histogram, 1us buckets
+
+enum { SOAK_MOTION, SOAK_CONFIG, SOAK_STATUS, SOAK_KINDS };
+
+struct soak_worker {
+	pthread_t t;
+	int id, threads, axes;
+	const int *mix;               // weights of motion, config and status traffic
+	volatile int *stop;
+	unsigned int seed;
+	unsigned long ops[SOAK_KINDS];
+	unsigned long errors;
+	unsigned long long max_ns;
+	unsigned long *hist;
+};
+
+// One client thread. Motion and configuration go to the axes it owns (every
+//  threads-th one from id), so it can check what it wrote; status reads go
+//  anywhere.
+static void *soak_thread(void *arg){
+	struct soak_worker *w = (struct soak_worker *)arg;
+	int owned = (w->axes - w->id + w->threads - 1) / w->threads;
+	int total = w->mix[0] + w->mix[1] + w->mix[2];
+	while(!*w->stop){
+		int r = rand_r(&w->seed) % total;
+		int kind = r < w->mix[0] ? SOAK_MOTION : r < w->mix[0] + w->mix[1] ? SOAK_CONFIG : SOAK_STATUS;
+		int axis = w->id + w->threads * (rand_r(&w->seed) % owned);
+		unsigned int v = rand_r(&w->seed);
+		unsigned long long t0 = mono_ns();
+		switch(kind){
+		case SOAK_MOTION:
+			dSPIN_Select(axis);
+			switch(v % 4){
+			case 0: dSPIN_Move(v & 16 ? FWD : REV, 10 + v % 1000); break;
+			case 1: dSPIN_Run(v & 16 ? FWD : REV, SpdCalc(50 + v % 450)); break;
+			case 2: dSPIN_GoTo(v % 20000); break;
+			case 3: dSPIN_SoftStop(); break;
+			}
+			break;
+		case SOAK_CONFIG:
+			dSPIN_Select(axis);
+			dSPIN_SetParam(dSPIN_KVAL_RUN, v & 0xFF);
+			w->errors += dSPIN_GetParam(dSPIN_KVAL_RUN) != (v & 0xFF);
+			break;
+		case SOAK_STATUS:
+			dSPIN_Select(v % w->axes);
+			if(v & 1) w->errors += (dSPIN_GetStatus() & dSPIN_STATUS_WRONG_CMD) != 0;
+			else dSPIN_GetParam(dSPIN_ABS_POS);
+			break;
+		}
+		unsigned long long ns = mono_ns() - t0;
+		w->hist[ns / 1000 < SOAK_HIST ? ns / 1000 : SOAK_HIST - 1]++;
+		if(ns > w->max_ns) w->max_ns = ns;
+		w->ops[kind]++;
+	}
+	return NULL;
+}
+
+struct soak_poller {
+	pthread_t t;
+	int axes;
+	volatile int *stop;
+};
+
+// Continuous status polling over every axis, at low bus priority.
+static void *soak_poll(void *arg){
+	struct soak_poller *p = (struct soak_poller *)arg;
+	dSPIN_Bus_SetClass(dSPIN_BUS_LOW);
+	while(!*p->stop) dSPIN_Poll_Once();
+	return NULL;
+}
+
+static long rss_kb(){
+	long pages = 0, rss = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f == NULL) return 0;
+	if(fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+	fclose(f);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Bytes the process has allocated and not freed.
+static long heap_bytes(){
+	struct mallinfo2 mi = mallinfo2();
+	return (long)(mi.uordblks + mi.hblkhd);
+}
+
+struct soak_row {
+	double ops_per_s;
+	double p50_us, p99_us, p999_us, max_us;
+	double bus_use;
+	unsigned long errors, poll_misses;
+	long rss_kb, rss_growth_kb, heap_growth;
+};
+
+static double soak_pct(const unsigned long *hist, unsigned long n, double q){
+	unsigned long want = (unsigned long)(n * q), seen = 0;
+	for(int i=0; i<SOAK_HIST; i++){
+		seen += hist[i];
+		if(seen > want) return i + 0.5;
+	}
+	return SOAK_HIST;
+}
+
+// Run threads clients and the poller on the first axes axes for seconds.
+static void soak_step(int axes, int threads, float seconds, const int *mix, float polls,
+                      struct soak_row *row){
+	volatile int stop = 0;
+	struct soak_worker *w = (struct soak_worker *)calloc(threads, sizeof(*w));
+	// Touched now, so that its pages don't show up as growth.
+	unsigned long *hist = (unsigned long *)malloc((size_t)threads * SOAK_HIST * sizeof(*hist));
+	memset(hist, 0, (size_t)threads * SOAK_HIST * sizeof(*hist));
+	dSPIN_Poll_Setup(polls);
+	unsigned long stale_us = (unsigned long)(2e6 * axes / (polls * (1 - dSPIN_POLL_RESERVE)));
+	for(int i=0; i<axes; i++) dSPIN_Poll_Axis(i, stale_us);
+	dSPIN_PollStats ps0, ps1;
+	dSPIN_Poll_GetStats(&ps0);
+	dSPIN_BusStats bs0, bs1;
+	dSPIN_Bus_GetStats(&bs0);
+
+	unsigned long long t0 = mono_ns();
+	struct soak_poller poller = { 0, axes, &stop };
+	pthread_create(&poller.t, NULL, soak_poll, &poller);
+	for(int i=0; i<threads; i++){
+		w[i].id = i;
+		w[i].threads = threads;
+		w[i].axes = axes;
+		w[i].mix = mix;
+		w[i].stop = &stop;
+		w[i].seed = 1 + i * 7919 + axes;
+		w[i].hist = hist + (size_t)i * SOAK_HIST;
+		pthread_create(&w[i].t, NULL, soak_thread, &w[i]);
+	}
+	// Memory is measured once everything is up and running, so that thread
+	//  stacks and the like don't count as growth. Resident size still moves
+	//  a little as threads reach deeper into their stacks; the heap shouldn't.
+	delay((unsigned int)(seconds * 200));
+	long rss0 = rss_kb(), heap0 = heap_bytes();
+	delay((unsigned int)(seconds * 800));
+	row->rss_kb = rss_kb();
+	row->rss_growth_kb = row->rss_kb - rss0;
+	row->heap_growth = heap_bytes() - heap0;
+	stop = 1;
+	for(int i=0; i<threads; i++) pthread_join(w[i].t, NULL);
+	pthread_join(poller.t, NULL);
+	double wall = (mono_ns() - t0) / 1e9;
+
+	dSPIN_Bus_GetStats(&bs1);
+	dSPIN_Poll_GetStats(&ps1);
+	unsigned long n = 0;
+	row->ops_per_s = row->p50_us = row->p99_us = row->p999_us = row->max_us = row->bus_use = 0;
+	row->errors = row->poll_misses = 0;
+	for(int i=0; i<threads; i++){
+		for(int k=0; k<SOAK_KINDS; k++) n += w[i].ops[k];
+		row->errors += w[i].errors;
+		if(w[i].max_ns / 1e3 > row->max_us) row->max_us = w[i].max_ns / 1e3;
+		if(i > 0)
+			for(int b=0; b<SOAK_HIST; b++) hist[b] += w[i].hist[b];
+	}
+	row->ops_per_s = n / wall;
+	row->p50_us = soak_pct(hist, n, 0.5);
+	row->p99_us = soak_pct(hist, n, 0.99);
+	row->p999_us = soak_pct(hist, n, 0.999);
+	row->bus_use = (bs1.hold_ns_sum - bs0.hold_ns_sum) / 1e9 / wall;
+	row->poll_misses = ps1.misses - ps0.misses;
+	free(hist);
+	free(w);
+}
+
+int bench_soak(int argc, char* argv[]){
+	int max_axes = argc>1 ? atoi(argv[1]) : 64;
+	int max_threads = argc>2 ? atoi(argv[2]) : 8;
+	float seconds = argc>3 ? atof(argv[3]) : 1;
+	int mix[3] = { 20, 10, 70 };
+	if(argc>4 && sscanf(argv[4], "%d:%d:%d", &mix[0], &mix[1], &mix[2]) != 3) mix[0] = -1;
+	if(max_axes < 1 || max_axes > dSPIN_MAX_AXES) max_axes = 64;
+	if(max_threads < 1 || max_threads > max_axes) max_threads = max_axes < 8 ? max_axes : 8;
+	if(mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] == 0){
+		fprintf(stderr, "soak: mix is motion:config:status weights, e.g. 20:10:70\n");
+		return 1;
+	}
+	float polls = 2000;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_REAL);
+	dSPIN_init();
+	for(int i=1; i<max_axes; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	for(int i=0; i<max_axes; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+	}
+	dSPIN_Select(0);
+
+	printf("soak: up to %d axes and %d client threads, %.1fs a step, mix %d:%d:%d "
+	       "motion:config:status, %.0f polls/s alongside\n",
+	       max_axes, max_threads, seconds, mix[0], mix[1], mix[2], polls);
+	printf("%5s %7s %10s %8s %8s %8s %9s %6s %11s %8s %9s %9s %7s\n", "axes", "threads", "ops/s",
+	       "p50 us", "p99 us", "p99.9 us", "max us", "bus %", "poll misses", "RSS KB",
+	       "growth KB", "heap +B", "errors");
+	struct soak_row row;
+	unsigned long errors = 0;
+	long heap = 0;
+	int a = max_axes < 8 ? max_axes : 8;
+	for(;;){
+		for(int t=1;; t *= 2){
+			if(t > max_threads || t > a) t = max_threads < a ? max_threads : a;
+			soak_step(a, t, seconds, mix, polls, &row);
+			errors += row.errors;
+			heap += row.heap_growth;
+			printf("%5d %7d %10.0f %8.1f %8.1f %8.1f %9.1f %6.1f %11lu %8ld %9ld %9ld %7lu\n", a, t,
+			       row.ops_per_s, row.p50_us, row.p99_us, row.p999_us, row.max_us,
+			       100 * row.bus_use, row.poll_misses, row.rss_kb, row.rss_growth_kb,
+			       row.heap_growth, row.errors);
+			if(t == max_threads || t == a) break;
+		}
+		if(a == max_axes) break;
+		a = a * 2 < max_axes ? a * 2 : max_axes;
+	}
+
+	// The biggest configuration again, now that every thread stack and page
+	//  has been touched once.
+	int t = max_threads < max_axes ? max_threads : max_axes;
+	soak_step(max_axes, t, seconds, mix, polls, &row);
+	errors += row.errors;
+	heap += row.heap_growth;
+	printf("%5d %7d %10.0f %8.1f %8.1f %8.1f %9.1f %6.1f %11lu %8ld %9ld %9ld %7lu  (again)\n",
+	       max_axes, t, row.ops_per_s, row.p50_us, row.p99_us, row.p999_us, row.max_us,
+	       100 * row.bus_use, row.poll_misses, row.rss_kb, row.rss_growth_kb, row.heap_growth,
+	       row.errors);
+	// Resident size is shown, but it's the heap that has to stand still: RSS
+	//  rises and falls by a few pages as thread stacks are handed back and reused.
+	int ok = errors == 0 && heap == 0 && row.ops_per_s > 0;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** rt ********************/
+
+// A number from /proc/self/status, in kB.
+static long proc_status_kb(const char *key){
+	FILE *f = fopen("/proc/self/status", "r");
+	char line[256];
+	long kb = -1;
+	size_t n = strlen(key);
+	while(f && fgets(line, sizeof(line), f))
+		if(!strncmp(line, key, n) && line[n] == ':') kb = atol(line + n + 1);
+	if(f) fclose(f);
+	return kb;
+}
+
+static long minor_faults(){
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+static void rt_row(const char *name, int got, const dSPIN_RTLatency *l){
+	printf("%-10s %5s %5s %8lu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", name,
+	       got & dSPIN_RT_GOT_FIFO ? "yes" : "no", got & dSPIN_RT_GOT_CPUS ? "yes" : "no",
+	       l->samples, l->min_ns / 1000.0, l->mean_ns / 1000.0, l->p50_ns / 1000.0,
+	       l->p99_ns / 1000.0, l->p999_ns / 1000.0, l->max_ns / 1000.0);
+}
+
+static int rt_sane(const dSPIN_RTLatency *l, unsigned long samples){
+	unsigned long n = 0;
+	for(int b=0; b<dSPIN_RT_HIST_BINS; b++) n += l->hist[b];
+	return l->samples == samples && n == samples && l->min_ns <= l->p50_ns + 1000
+	       && l->p50_ns <= l->p99_ns && l->p99_ns <= l->p999_ns && l->p999_ns <= l->max_ns;
+}
+
+int bench_rt(int argc, char* argv[]){
+	unsigned long samples = argc>1 ? atol(argv[1]) : 2000;
+	unsigned long period = argc>2 ? atol(argv[2]) : 500;
+	int priority = argc>3 ? atoi(argv[3]) : 80;
+	if(samples < 1) samples = 2000;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("rt: %lu wakeups every %luus, then again at SCHED_FIFO %d on CPU %ld with memory locked\n",
+	       samples, period, priority, cpus - 1);
+	static dSPIN_RTLatency plain, rt;
+	int got_plain = dSPIN_RT_Latency(dSPIN_RT_CONTROL, period, samples, &plain);
+
+	dSPIN_RTConfig cfg;
+	cfg.priority = priority;
+	cfg.cpus = 1UL << (cpus - 1);
+	cfg.lock = 1;
+	cfg.heap_kb = 4096;
+	cfg.stack_kb = 256;
+	int got = dSPIN_RT_Setup(&cfg);
+	dSPIN_init();
+	dSPIN_GetStatus();
+	printf("granted:%s%s%s%s%s\n", got & dSPIN_RT_GOT_FIFO ? " fifo" : "",
+	       got & dSPIN_RT_GOT_CPUS ? " cpus" : "", got & dSPIN_RT_GOT_LOCK ? " lock" : "",
+	       got & dSPIN_RT_GOT_HEAP ? " heap" : "", got & dSPIN_RT_GOT_STACK ? " stack" : "");
+
+	// Locked memory shows up as such, and an allocation that fits in the
+	//  heap set aside doesn't fault.
+	long locked = proc_status_kb("VmLck");
+	long f0 = minor_faults();
+	char *p = (char *)malloc(1024 * 1024);
+	memset(p, 1, 1024 * 1024);
+	free(p);
+	long faults = minor_faults() - f0;
+	printf("locked %ld kB, 1MB allocation took %ld page faults\n", locked, faults);
+
+	// The step clock generator joins by itself; it's given no priority here.
+	unsigned long long table[200];
+	for(int i=0; i<200; i++) table[i] = (i + 1) * 500000ULL;
+	dSPIN_StepClock_Stats st;
+	int stck_ok = dSPIN_StepClock_Start(FWD, table, 200, 0) == dSPIN_STATUS_GOOD;
+	dSPIN_StepClock_Wait();
+	dSPIN_StepClock_GetStats(&st);
+	printf("step clock: %lu pulses, lateness max %.1fus\n", st.pulses, st.max_ns / 1000.0);
+
+	int got_rt = dSPIN_RT_Latency(dSPIN_RT_CONTROL, period, samples, &rt);
+	printf("%-10s %5s %5s %8s %8s %8s %8s %8s %8s %8s\n", "", "fifo", "cpu", "wakeups",
+	       "min us", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+	rt_row("plain", got_plain, &plain);
+	rt_row("real-time", got_rt, &rt);
+	printf("real-time histogram past p99 (us: count):");
+	for(int b = rt.p99_ns / 1000 + 1; b < dSPIN_RT_HIST_BINS; b++)
+		if(rt.hist[b]) printf(" %d%s:%lu", b, b == dSPIN_RT_HIST_BINS - 1 ? "+" : "", rt.hist[b]);
+	printf("\n");
+
+	// What the system grants depends on privileges; what was granted has to hold.
+	int ok = got_plain == 0 && got_rt >= 0 && rt_sane(&plain, samples) && rt_sane(&rt, samples)
+	         && (got & dSPIN_RT_GOT_STACK) && stck_ok && st.pulses == 200
+	         && (!(got & dSPIN_RT_GOT_LOCK) || locked > 0)
+	         && (!(got & dSPIN_RT_GOT_HEAP) || faults < 16);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** trigger ********************/
+
+#define TRIG_PIN 5
+
+struct trig_truth {
+	long long start;
+	long long at[dSPIN_TRIG_MAX];    // microsteps moved when each one fired
+	int pin[dSPIN_TRIG_MAX];
+};
+
+static void trig_fired(int i, void *arg){
+	struct trig_truth *t = (struct trig_truth *)arg;
+	dSPIN_Sim_State s;
+	dSPIN_Sim_Peek(0, &s);
+	t->at[i] = s.phys_pos - t->start;
+	t->pin[i] = digitalRead(TRIG_PIN);
+}
+
+int bench_trigger(int argc, char* argv[]){
+	int n = argc>1 ? atoi(argv[1]) : 8;
+	double osc = argc>2 ? atof(argv[2]) : 1.03;
+	if(n < 1 || n > dSPIN_TRIG_MAX - 1) n = 8;
+	unsigned long move = 400000;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+	// The chip's oscillator is off and nobody has calibrated for it, so the
+	//  profile alone gets every crossing time wrong by a few percent.
+	dSPIN_Sim_SetOscillator(0, osc);
+	dSPIN_HardHiZ();
+	dSPIN_SetParam(dSPIN_STEP_MODE, 7);
+	dSPIN_SetParam(dSPIN_ACC, 0x40);
+	dSPIN_SetParam(dSPIN_DEC, 0x40);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, 0x60);
+
+	// Thresholds along the acceleration, the cruise and the deceleration, and
+	//  one past the end of the move.
+	dSPIN_TrigEvent ev[dSPIN_TRIG_MAX];
+	struct trig_truth truth;
+	long start = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	for(int i=0; i<n; i++) ev[i].pos = start + (long)(move * (i + 0.5) / n);
+	ev[n].pos = start + (long)move + 1000;
+	dSPIN_Sim_State s;
+	dSPIN_Sim_Peek(0, &s);
+	truth.start = s.phys_pos;
+
+	int missed = dSPIN_Trigger_Move(FWD, move, ev, n + 1, TRIG_PIN, trig_fired, &truth);
+	printf("trigger: %d thresholds on a %lu microstep move, chip oscillator at %.3f\n", n, move, osc);
+	printf("%8s %6s %5s %14s %12s %14s\n", "ABS_POS", "result", "reads", "profile err us",
+	       "error us", "miss usteps");
+	double worst_profile = 0, worst = 0;
+	long worst_steps = 0;
+	int fired = 0, pins = 0;
+	for(int i=0; i<=n; i++){
+		if(ev[i].result != dSPIN_TRIG_FIRED){
+			printf("%8ld %6s\n", ev[i].pos, "never");
+			continue;
+		}
+		fired++;
+		pins += truth.pin[i] == HIGH;
+		unsigned long long crossing = ev[i].fired_ns - ev[i].error_ns;
+		double profile_us = ((long long)ev[i].predicted_ns - (long long)crossing) / 1000.0;
+		double err_us = ev[i].error_ns / 1000.0;
+		long steps = (long)(truth.at[i] - (ev[i].pos - start));
+		printf("%8ld %6s %5d %14.1f %12.1f %14ld\n", ev[i].pos, "fired", ev[i].reads,
+		       profile_us, err_us, steps);
+		if(fabs(profile_us) > worst_profile) worst_profile = fabs(profile_us);
+		if(fabs(err_us) > worst) worst = fabs(err_us);
+		if(labs(steps) > worst_steps) worst_steps = labs(steps);
+	}
+	printf("worst: profile only %.1fus, refined %.1fus, %ld microsteps off at the edge\n",
+	       worst_profile, worst, worst_steps);
+
+	// With the oscillator on time the profile alone is as good as a read, and
+	//  there's nothing for the reads to win.
+	int ok = missed == 1 && fired == n && pins == n && ev[n].result == dSPIN_TRIG_UNREACHED
+	         && worst < 50 && (fabs(osc - 1) < 0.005 || worst < worst_profile) && worst_steps <= 16
+	         && digitalRead(TRIG_PIN) == LOW;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** journal ********************/
+
+static const char *journal_result[] = { "ok", "moving", "no record", "power", "alarm", "config",
+                                        "position" };
+
+// Note the selected axis as a status poll would.
+static void journal_note(dSPIN_Journal *j, int axis){
+	dSPIN_Select(axis);
+	unsigned int st = dSPIN_GetStatus();
+	dSPIN_Journal_Note(j, axis, st, (long)dSPIN_GetParam(dSPIN_ABS_POS), (long)dSPIN_GetParam(dSPIN_MARK));
+}
+
+int bench_journal(int argc, char* argv[]){
+	long updates = argc>1 ? atol(argv[1]) : 1000000;
+	if(updates < 1) updates = 1000000;
+	const int axes = 5;
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/dSPIN_bench_journal_%d.jnl", (int)getpid());
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<axes; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	dSPIN_Profile prof;
+	dSPIN_GetStatus();
+	dSPIN_Profile_Read(&prof);
+	prof.max_speed = MaxSpdCalc(800);
+	prof.acc = prof.dec = AccCalc(3000);
+	prof.kval_run = prof.kval_acc = prof.kval_dec = 0x50;
+	unsigned long hash = dSPIN_Profile_Hash(&prof);
+
+	// Axes 0-3 are configured and homed; axis 4 never is.
+	dSPIN_Journal *j = dSPIN_Journal_Open(path, axes);
+	if(j == NULL){
+		fprintf(stderr, "journal: can't open %s\n", path);
+		return 1;
+	}
+	for(int i=0; i<axes; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+		dSPIN_Profile_Apply(&prof);
+		dSPIN_ResetPos();
+		if(i < 4) dSPIN_Journal_Homed(j, i, hash);
+	}
+
+	// What it costs to keep it up to date.
+	dSPIN_Select(0);
+	unsigned int st = dSPIN_GetStatus();
+	unsigned long long t0 = mono_ns();
+	for(long k=0; k<updates; k++) dSPIN_Journal_Note(j, 0, st, 0, 0);
+	double note_ns = (double)(mono_ns() - t0) / updates;
+
+	// Axis 0 finishes a move and is seen to; axis 1 is in the middle of one.
+	//  Axis 2's chip loses power, and axis 3's position is set behind the
+	//  journal's back.
+	dSPIN_Journal_Moving(j, 0, 5000);
+	dSPIN_Select(0);
+	dSPIN_GoTo(5000);
+	while(dSPIN_Busy()) delay(1);
+	journal_note(j, 0);
+	dSPIN_Journal_Moving(j, 1, 80000);
+	dSPIN_Select(1);
+	dSPIN_GoTo(80000);
+	journal_note(j, 2);
+	dSPIN_Select(2);
+	dSPIN_ResetDev();
+	journal_note(j, 3);
+	dSPIN_Select(3);
+	dSPIN_SetParam(dSPIN_ABS_POS, 1234);
+
+	// A writer killed at a random point in an update must leave a record.
+	dSPIN_JournalRec before, after;
+	dSPIN_Journal_Read(j, 0, &before);
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0){
+		for(;;) dSPIN_Journal_Note(j, 0, before.status, before.abs_pos, before.mark);
+	}
+	srand(getpid());
+	usleep(20000 + rand() % 20000);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	// The process restarts.
+	dSPIN_Journal_Close(j);
+	j = dSPIN_Journal_Open(path, axes);
+	int kept = dSPIN_Journal_Read(j, 0, &after) && after.seq > before.seq
+	           && after.abs_pos == before.abs_pos && (after.flags & dSPIN_JOURNAL_HOMED);
+	printf("journal: %.0f ns an update; writer killed after %u updates, record %s\n", note_ns,
+	       after.seq - before.seq, kept ? "intact" : "LOST");
+
+	int want[axes] = { dSPIN_JOURNAL_OK, dSPIN_JOURNAL_MOVING_NOW, dSPIN_JOURNAL_POWER,
+	                   dSPIN_JOURNAL_POSITION, dSPIN_JOURNAL_NO_RECORD };
+	int wrong = 0;
+	printf("%5s %6s %10s %10s %12s\n", "axis", "epoch", "ABS_POS", "found", "expected");
+	for(int i=0; i<axes; i++){
+		dSPIN_JournalRec rec;
+		dSPIN_Journal_Read(j, i, &rec);
+		int r = dSPIN_Journal_Check(j, i);
+		dSPIN_Select(i);
+		printf("%5d %6u %10ld %10s %12s\n", i, rec.epoch, (long)dSPIN_GetParam(dSPIN_ABS_POS),
+		       journal_result[r], journal_result[want[i]]);
+		wrong += r != want[i];
+	}
+	// Axis 1's move ends while we wait: then it checks out.
+	dSPIN_Select(1);
+	while(dSPIN_Busy()) delay(1);
+	int r = dSPIN_Journal_Check(j, 1);
+	printf("axis 1 once idle: %s\n", journal_result[r]);
+	wrong += r != dSPIN_JOURNAL_OK;
+
+	dSPIN_Journal_Close(j);
+	unlink(path);
+	int ok = wrong == 0 && kept && note_ns < 5000;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** encoder ********************/
+
+#define ENC_PERIOD_US 1000
+#define ENC_DEADBAND  32
+
+// Let the axis finish: with the loop closed, until a pass finds it idle and
+//  leaves it be.
+static void enc_settle(dSPIN_Encoder *e){
+	for(int i=0; i<1000; i++){
+		if(e) dSPIN_Encoder_Run(e, ENC_PERIOD_US, 10);
+		else delay(10);
+		if(!dSPIN_Busy() && (e == NULL || dSPIN_Encoder_Step(e) == 0)) return;
+	}
+}
+
+// The same moves, slipping part way through each, with the loop open (e
+//  NULL) and closed. final[k] is how far the shaft ends up from where the
+//  moves so far should have taken it.
+static void enc_moves(dSPIN_Encoder *e, int moves, long n, long slip, long *slipped, long *final){
+	dSPIN_Sim_State s;
+	dSPIN_Sim_Peek(0, &s);
+	long long want = s.shaft_pos;
+	for(int k=0; k<moves; k++){
+		byte dir = k % 2 ? REV : FWD;
+		// Every fourth move runs clean; the others lose up to three times slip.
+		slipped[k] = k % 4 == 3 ? 0 : slip * (1 + k % 3);
+		dSPIN_Move(dir, n);
+		if(e) dSPIN_Encoder_Run(e, ENC_PERIOD_US, 200);
+		else delay(200);
+		dSPIN_Sim_Slip(0, dir == FWD ? -slipped[k] : slipped[k]);
+		enc_settle(e);
+		want += dir == FWD ? n : -n;
+		dSPIN_Sim_Peek(0, &s);
+		final[k] = (long)(s.shaft_pos - want);
+	}
+}
+
+int bench_encoder(int argc, char* argv[]){
+	int moves = argc>1 ? atoi(argv[1]) : 12;
+	long slip = argc>2 ? atol(argv[2]) : 800;
+	if(moves < 1 || moves > 64) moves = 12;
+	long n = 100000;
+
+	// A file source reads the count afresh each time.
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/dSPIN_bench_encoder_%d", (int)getpid());
+	FILE *f = fopen(path, "w");
+	fprintf(f, "-1234\n");
+	fflush(f);
+	dSPIN_EncoderSource fsrc;
+	long c0 = 0, c1 = 0;
+	int file_ok = dSPIN_Encoder_File(path, 1, &fsrc) == 0 && fsrc.read(fsrc.arg, &c0) == 0;
+	rewind(f);
+	fprintf(f, "5678\n");
+	fclose(f);
+	file_ok = file_ok && fsrc.read(fsrc.arg, &c1) == 0 && c0 == -1234 && c1 == 5678;
+	if(file_ok) dSPIN_Encoder_FileClose(&fsrc);
+	unlink(path);
+	printf("file source: read %ld then %ld\n", c0, c1);
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+	dSPIN_SetParam(dSPIN_STEP_MODE, 7);
+	dSPIN_SetParam(dSPIN_ACC, 0x200);
+	dSPIN_SetParam(dSPIN_DEC, 0x200);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, 0x60);
+
+	long slipped[64], open_final[64], closed_final[64];
+	enc_moves(NULL, moves, n, slip, slipped, open_final);
+
+	dSPIN_EncoderSource src = { dSPIN_Sim_EncoderRead, (void *)(intptr_t)0, dSPIN_SIM_ENC_USTEPS };
+	long abs0 = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	dSPIN_Encoder *e = dSPIN_Encoder_Open(0, &src, ENC_DEADBAND);
+	enc_moves(e, moves, n, slip, slipped, closed_final);
+	long abs1 = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	dSPIN_EncoderStats st;
+	dSPIN_Encoder_GetStats(e, &st);
+	dSPIN_Encoder_Close(e);
+
+	printf("encoder: %d moves of %ld microsteps, one count per %d, deadband %d, %d Hz\n", moves, n,
+	       dSPIN_SIM_ENC_USTEPS, ENC_DEADBAND, 1000000 / ENC_PERIOD_US);
+	printf("%5s %4s %8s %14s %14s\n", "move", "dir", "slip", "open err", "closed err");
+	int slips = 0, drift_ok = 1;
+	long worst = 0;
+	long lost = 0;
+	for(int k=0; k<moves; k++){
+		printf("%5d %4s %8ld %14ld %14ld\n", k, k % 2 ? "REV" : "FWD", slipped[k], open_final[k],
+		       closed_final[k]);
+		slips += slipped[k] != 0;
+		if(labs(closed_final[k]) > worst) worst = labs(closed_final[k]);
+		lost += k % 2 ? slipped[k] : -slipped[k];
+		drift_ok = drift_ok && open_final[k] == lost;
+	}
+	double mean = st.passes ? (double)st.err_abs_sum / st.passes : 0;
+	double rms = st.passes ? sqrt(st.err_sq_sum / st.passes) : 0;
+	printf("%lu passes, %lu late, %lu read errors; %lu corrections making up %llu microsteps\n",
+	       st.passes, st.late, st.read_errors, st.corrections, st.corrected_usteps);
+	printf("error: mean %.1f rms %.1f max %ld microsteps; latency mean %.1fus max %.1fus\n", mean,
+	       rms, st.err_max, st.passes ? st.lat_ns_sum / 1000.0 / st.passes : 0, st.lat_ns_max / 1000.0);
+
+	// Open loop the slip piles up; closed, each move ends within the deadband
+	//  (give or take a count) and ABS_POS where the moves put it. Slips
+	//  smaller than the deadband may add up to a correction on a later move.
+	int ok = file_ok && drift_ok && worst <= ENC_DEADBAND + dSPIN_SIM_ENC_USTEPS
+	         && st.corrections <= (unsigned long)slips
+	         && (slip <= ENC_DEADBAND + dSPIN_SIM_ENC_USTEPS || st.corrections == (unsigned long)slips)
+	         && st.read_errors == 0 && ((abs1 - abs0 - (moves % 2 ? n : 0)) & 0x3FFFFF) == 0;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** limits ********************/
+
+static const char *limit_result[] = { "ok", "range", "zone", "coupled", "room" };
+
+// The same check done the slow way, over zones that don't touch.
+static int limits_linear(const dSPIN_Zone *z, int n, long from, long to, long other, long min, long max){
+	if(to == from) return dSPIN_LIMIT_OK;
+	long lo = to > from ? from + 1 : to, hi = to > from ? to : from - 1;
+	if(to > from ? (to > max && from <= max) : (to < min && from >= min)) return dSPIN_LIMIT_RANGE;
+	int r = dSPIN_LIMIT_OK;
+	for(int i=0; i<n; i++){
+		if(z[i].hi < lo || z[i].lo > hi || (z[i].lo <= from && z[i].hi >= from)) continue;
+		if(z[i].other < 0) return dSPIN_LIMIT_ZONE;
+		if(other >= z[i].other_lo && other <= z[i].other_hi) r = dSPIN_LIMIT_COUPLED;
+	}
+	return r;
+}
+
+// n zones spread over +-1000000, every tenth coupled to axis 1 (at other),
+//  half of those where axis 1 is.
+static void limits_zones(dSPIN_Zone *z, int n, long other){
+	long w = 2000000 / n;
+	for(int k=0; k<n; k++){
+		z[k].lo = -1000000 + k * w + w / 4 + rand() % (w / 4);
+		z[k].hi = z[k].lo + 1 + rand() % (w / 4);
+		z[k].id = k;
+		z[k].other = k % 10 == 9 ? 1 : -1;
+		z[k].other_lo = k % 20 == 9 ? other - 100 : other + 500;
+		z[k].other_hi = k % 20 == 9 ? other + 100 : other + 900;
+	}
+}
+
+static int limits_expect(const char *what, int want, int want_id){
+	int id, r = dSPIN_Limits_Last(&id);
+	int ok = r == want && (want == dSPIN_LIMIT_OK || want == dSPIN_LIMIT_RANGE || id == want_id);
+	printf("  %-44s %-8s id %2d  %s\n", what, limit_result[r], id, ok ? "" : "WRONG");
+	return ok;
+}
+
+static void limits_idle(int axis){
+	dSPIN_Select(axis);
+	while(dSPIN_Busy()) delay(1);
+}
+
+int bench_limits(int argc, char* argv[]){
+	int most = argc>1 ? atoi(argv[1]) : 10000;
+	if(most < 10) most = 10000;
+	const long other = 50000;
+
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	for(int i=1; i<3; i++){
+		dSPIN_Sim_AddDevice(100 + i, dSPIN_NO_PIN, dSPIN_NO_PIN);
+		dSPIN_AddAxis(100 + i, dSPIN_NO_PIN);
+	}
+	for(int i=0; i<3; i++){
+		dSPIN_Select(i);
+		dSPIN_GetStatus();
+		dSPIN_SetParam(dSPIN_STEP_MODE, 7);
+		dSPIN_SetParam(dSPIN_ACC, 0x40);
+		dSPIN_SetParam(dSPIN_DEC, 0x40);
+		dSPIN_SetParam(dSPIN_MAX_SPEED, 0x60);
+	}
+	dSPIN_Select(1);
+	dSPIN_SetParam(dSPIN_ABS_POS, other);
+	dSPIN_Select(0);
+
+	// Check cost against the number of zones, and agreement with a linear scan.
+	srand(1);
+	dSPIN_Zone *zones = (dSPIN_Zone *)malloc(most * sizeof(dSPIN_Zone));
+	printf("limits: path checks, index against a linear scan\n");
+	printf("%8s %10s %12s %12s %10s\n", "zones", "checks", "index ns", "linear ns", "mismatch");
+	double first_ns = 0, last_ns = 0;
+	int mismatches = 0;
+	for(int n = 10; n <= most; n *= 10){
+		limits_zones(zones, n, other);
+		dSPIN_Limits_Set(0, zones, n);
+		dSPIN_Limits_Range(0, -1050000, 1050000);
+		const int m = 100000;
+		static long from[100000], to[100000];
+		static int got[100000];
+		long w = 2000000 / n;
+		for(int i=0; i<m; i++){
+			from[i] = rand() % 2200000 - 1100000;
+			to[i] = from[i] + rand() % (4 * w) - 2 * w;
+		}
+		unsigned long long t0 = mono_ns();
+		for(int i=0; i<m; i++) got[i] = dSPIN_Limits_Check(0, from[i], to[i], NULL);
+		double ns = (mono_ns() - t0) / (double)m;
+		int lm = n >= 10000 ? m / 10 : m, bad = 0;
+		t0 = mono_ns();
+		for(int i=0; i<lm; i++)
+			bad += limits_linear(zones, n, from[i], to[i], other, -1050000, 1050000) != got[i];
+		double lns = (mono_ns() - t0) / (double)lm;
+		printf("%8d %10d %12.1f %12.1f %10d\n", n, m, ns, lns, bad);
+		mismatches += bad;
+		if(n == 10) first_ns = ns;
+		last_ns = ns;
+	}
+	free(zones);
+
+	// Commands on the simulated chips.
+	dSPIN_Zone z[4] = {
+		{ 100000, 120000, 1, -1, 0, 0 },
+		{ -300000, -250000, 2, -1, 0, 0 },
+		{ 30000, 40000, 3, 1, 0, 1000 },      // while axis 1 is near its home
+		{ 600000, 700000, 4, -1, 0, 0 },
+	};
+	dSPIN_Select(0);
+	dSPIN_ResetPos();
+	dSPIN_Limits_Set(0, z, 4);
+	dSPIN_Limits_Range(0, -500000, 900000);
+	printf("commands on axis 0 (zones 1-4, range -500000..900000; zone 3 while axis 1 is at 0..1000)\n");
+	int ok = 1;
+	dSPIN_GoTo(110000);
+	ok &= limits_expect("GoTo(110000): into zone 1", dSPIN_LIMIT_ZONE, 1);
+	dSPIN_GoTo(150000);
+	ok &= limits_expect("GoTo(150000): through zone 1", dSPIN_LIMIT_ZONE, 1);
+	ok &= !dSPIN_Busy() && dSPIN_GetParam(dSPIN_ABS_POS) == 0;
+	dSPIN_Move(FWD, 50000);
+	ok &= limits_expect("Move(FWD, 50000): past zone 3, axis 1 away", dSPIN_LIMIT_OK, -1);
+	limits_idle(0);
+	dSPIN_Select(1);
+	dSPIN_GoTo(500);
+	limits_idle(1);
+	dSPIN_Select(0);
+	dSPIN_GoTo(20000);
+	ok &= limits_expect("GoTo(20000): axis 1 now at 500", dSPIN_LIMIT_COUPLED, 3);
+	dSPIN_Select(1);
+	dSPIN_GoTo(other);
+	limits_idle(1);
+	dSPIN_Select(0);
+	dSPIN_GoTo(20000);
+	ok &= limits_expect("GoTo(20000): axis 1 sent away, not seen to stop", dSPIN_LIMIT_COUPLED, 3);
+	dSPIN_Limits_Poll(dSPIN_LIMITS_PERIOD_US);
+	dSPIN_GoTo(0);
+	ok &= limits_expect("GoTo(0): once a poll has seen it stop", dSPIN_LIMIT_OK, -1);
+	limits_idle(0);
+	dSPIN_GoTo_DIR(FWD, 60000);
+	ok &= limits_expect("GoTo_DIR(FWD, 60000): past zone 3", dSPIN_LIMIT_OK, -1);
+	delay(20);
+	dSPIN_Sim_State gs;
+	dSPIN_Sim_Peek(0, &gs);
+	ok &= gs.abs_pos > 0;
+	limits_idle(0);
+	dSPIN_GoTo_DIR(FWD, 0);
+	ok &= limits_expect("GoTo_DIR(FWD, 0): the long way round", dSPIN_LIMIT_RANGE, -1);
+	dSPIN_GoTo_DIR(REV, 0);
+	ok &= limits_expect("GoTo_DIR(REV, 0)", dSPIN_LIMIT_OK, -1);
+	limits_idle(0);
+	dSPIN_Move(REV, 600000);
+	ok &= limits_expect("Move(REV, 600000): out of range", dSPIN_LIMIT_RANGE, -1);
+
+	// A Run towards zone 2, stopped by the watchdog polling every 5ms.
+	unsigned long spd = SpdCalc(1000);
+	dSPIN_Limits_ResetStats();
+	dSPIN_Run(REV, spd);
+	ok &= limits_expect("Run(REV, 1000 steps/s): zone 2 far enough", dSPIN_LIMIT_OK, -1);
+	int polls = 0;
+	dSPIN_Sim_State st;
+	do{
+		dSPIN_Limits_Poll(dSPIN_LIMITS_PERIOD_US);
+		delayMicroseconds(dSPIN_LIMITS_PERIOD_US);
+		dSPIN_Sim_Peek(0, &st);
+		polls++;
+	}while(st.mode != dSPIN_SIM_STOPPED && polls < 10000);
+	dSPIN_LimitStats ls;
+	dSPIN_Limits_GetStats(&ls);
+	long rest = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	if(rest & 0x200000) rest -= 0x400000;
+	printf("  watchdog: %d polls, %lu stop, came to rest at %ld, %ld short of zone 2\n", polls,
+	       ls.stops, rest, rest - (-250000));
+	ok &= ls.stops == 1 && rest > -250000 && rest - (-250000) < 20000;
+	dSPIN_Run(REV, spd);
+	ok &= limits_expect("Run(REV) again: no room to stop", dSPIN_LIMIT_ROOM, 2);
+
+	// Running at speed, a command that's fine where it ends can still be
+	//  refused for where the motor goes while it brakes.
+	dSPIN_Run(FWD, spd);
+	limits_idle(0);
+	for(int i=0; i<10000; i++){
+		dSPIN_Sim_Peek(0, &st);
+		if(st.abs_pos > 100000 - 30000) break;
+		delay(1);
+	}
+	dSPIN_Move(FWD, 1);
+	ok &= limits_expect("Move(FWD, 1) at speed 30000 short of zone 1", dSPIN_LIMIT_ZONE, 1);
+	dSPIN_HardStop();
+	limits_idle(0);
+	ok &= (long)dSPIN_GetParam(dSPIN_ABS_POS) < 100000;
+
+	// Already inside a zone: it can be driven out.
+	dSPIN_SetParam(dSPIN_ABS_POS, 110000);
+	dSPIN_Move(REV, 20000);
+	ok &= limits_expect("Move(REV, 20000) out of zone 1", dSPIN_LIMIT_OK, -1);
+	limits_idle(0);
+
+	// A compiled program and the templated driver are held to them too.
+	const char *bc_path = "/tmp/dspin_limits.bc";
+	char text[] = "goto 95000\ngoto 150000\ngoto 0\n";
+	FILE *in = fmemopen(text, strlen(text), "r"), *out = fopen(bc_path, "w");
+	int line;
+	int compiled = dSPIN_Compile(in, out, &line);
+	fclose(in);
+	fclose(out);
+	dSPIN_Bytecode *bc = compiled == dSPIN_STATUS_GOOD ? dSPIN_Bytecode_Open(bc_path) : NULL;
+	int played = bc ? dSPIN_Bytecode_Run(bc) : -1;
+	ok &= limits_expect("compiled goto 150000: through zone 1", dSPIN_LIMIT_ZONE, 1);
+	ok &= played == dSPIN_STATUS_FATAL && !dSPIN_Busy() && dSPIN_GetParam(dSPIN_ABS_POS) == 95000;
+	if(bc) dSPIN_Bytecode_Close(bc);
+	remove(bc_path);
+	fast_sim::go_to(150000);
+	ok &= limits_expect("dSPIN_Fast<>::go_to(150000)", dSPIN_LIMIT_ZONE, 1);
+	ok &= !dSPIN_Busy();
+	fast_sim::move(REV, 5000);
+	ok &= limits_expect("dSPIN_Fast<>::move(REV, 5000)", dSPIN_LIMIT_OK, -1);
+	limits_idle(0);
+	ok &= dSPIN_GetParam(dSPIN_ABS_POS) == 90000;
+
+	// Callers that go through the commands hear of a refusal.
+	dSPIN_TrigEvent ev = { 105000 };
+	int missed = dSPIN_Trigger_GoTo(150000, &ev, 1, dSPIN_NO_PIN, NULL, NULL);
+	printf("  triggered GoTo(150000): %d missed, result %d\n", missed, ev.result);
+	ok &= missed == 1 && ev.result == dSPIN_TRIG_REFUSED;
+	dSPIN_Ring *owner = dSPIN_Ring_Create("/dSPIN_limits_bench", 1, 3);
+	dSPIN_Ring *client = owner ? dSPIN_Ring_Attach("/dSPIN_limits_bench") : NULL;
+	dSPIN_RingDone rd[2];
+	int reaped = 0;
+	if(client){
+		dSPIN_Ring_Submit(client, dSPIN_RING_GOTO, 0, FWD, 150000);
+		dSPIN_Ring_Submit(client, dSPIN_RING_MOVE, 0, REV, 1000);
+		dSPIN_Ring_Serve(owner, 100);
+		reaped = dSPIN_Ring_Reap(client, rd, 2, 100);
+		dSPIN_Ring_Close(client);
+	}
+	if(owner) dSPIN_Ring_Close(owner);
+	printf("  ring GoTo(150000), Move(REV, 1000): results %d, %d\n", reaped > 0 ? rd[0].result : -1,
+	       reaped > 1 ? rd[1].result : -1);
+	ok &= reaped == 2 && rd[0].result == dSPIN_RING_LIMITED && rd[1].result == dSPIN_RING_DONE;
+	limits_idle(0);
+
+	// The watchdog's period is host time. A chip on a fast oscillator covers
+	//  more ground in it at the same SPEED, so it needs more room to be let
+	//  run: find the least it's given, nominal and at 1.5 times.
+	long room[2];
+	for(int k=0; k<2; k++){
+		dSPIN_Select(0);
+		dSPIN_SetOsc(k ? 1.5f : 0);
+		long lo = 0, hi = 200000;
+		while(hi - lo > 1){
+			long d = (lo + hi) / 2;
+			dSPIN_ResetPos();
+			dSPIN_Limits_Range(0, -d, 900000);
+			dSPIN_Run(REV, spd);
+			if(dSPIN_Limits_Last(NULL) == dSPIN_LIMIT_OK){
+				hi = d;
+				dSPIN_HardStop();
+				limits_idle(0);
+			}
+			else lo = d;
+		}
+		room[k] = hi;
+	}
+	dSPIN_SetOsc(0);
+	dSPIN_ResetPos();
+	dSPIN_Limits_Range(0, -500000, 900000);
+	printf("  Run(REV, 1000 steps/s) needs %ld microsteps of room, %ld on a 1.5x oscillator\n",
+	       room[0], room[1]);
+	ok &= room[1] > room[0];
+
+	// What the check adds to a command: axis 0 has limits, axis 2 has none.
+	double cmd_us[2];
+	for(int k=0; k<2; k++){
+		dSPIN_Select(k ? 0 : 2);
+		unsigned long long t0 = mono_ns();
+		for(int i=0; i<2000; i++) dSPIN_GoTo((i % 2) * 1000);
+		cmd_us[k] = (mono_ns() - t0) / 2000.0 / 1000;
+		limits_idle(k ? 0 : 2);
+	}
+	printf("GoTo: %.1fus without limits, %.1fus with (check %.0fns at %d zones)\n", cmd_us[0],
+	       cmd_us[1], last_ns, most);
+
+	ok = ok && mismatches == 0 && last_ns < 20 * first_ns + 200;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+/******************** path ********************/
+
+// A 10kHz toolpath in microsteps: ramps at several speeds, stops, and a
+//  sine stretch, with noise a quarter of the tolerance on every sample.
+static void path_write(FILE *f, long n, double tol){
+	double x = 0;
+	for(long i=0; i<n; i++){
+		double t = i / 10000.0;
+		double phase = fmod(t, 12.0);
+		double v;
+		if(phase < 2) v = 8000;
+		else if(phase < 3) v = 0;
+		else if(phase < 5) v = -5000;
+		else if(phase < 9) v = 6000 * M_PI / 2 * cos(M_PI / 2 * (phase - 5));
+		else if(phase < 10) v = 0;
+		else v = -2500;
+		x += v / 10000.0;
+		double noise = (rand() / (double)RAND_MAX - 0.5) * tol / 2;
+		fprintf(f, "%.4f %.2f\n", t, x + noise);
+	}
+}
+
+static int path_same(const char *a, const char *b){
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+	int same = fa && fb;
+	while(same){
+		int ca = fgetc(fa), cb = fgetc(fb);
+		if(ca != cb) same = 0;
+		if(ca == EOF) break;
+	}
+	if(fa) fclose(fa);
+	if(fb) fclose(fb);
+	return same;
+}
+
+int bench_path(int argc, char* argv[]){
+	long n = argc>1 ? atol(argv[1]) : 200000;
+	double tol = argc>2 ? atof(argv[2]) : 16;
+	const char *in_path = "/tmp/dspin_path.txt";
+	const char *out_path[2] = { "/tmp/dspin_path_1.prog", "/tmp/dspin_path_n.prog" };
+	int ms = 8;
+	srand(11);
+	FILE *f = fopen(in_path, "w");
+	if(!f){
+		perror(in_path);
+		return 1;
+	}
+	path_write(f, n, tol);
+	fclose(f);
+
+	// One worker, then four (however many cores there are), over the same
+	//  chunks.
+	dSPIN_PathConfig cfg = { tol, ms, 8192, 1 };
+	dSPIN_PathStats st[2];
+	int err = 0;
+	for(int k=0; k<2; k++){
+		cfg.threads = k ? 4 : 1;
+		FILE *in = fopen(in_path, "r"), *out = fopen(out_path[k], "w");
+		err |= dSPIN_Path_Simplify(in, out, &cfg, &st[k]);
+		fclose(in);
+		fclose(out);
+	}
+	printf("path: %lu samples (%.1fs), tolerance %.0f microsteps, %lu chunks\n", st[0].points,
+	       n / 10000.0, tol, st[0].chunks);
+	printf("%8s %10s %10s %10s %12s\n", "threads", "vertices", "commands", "ms", "samples/s");
+	for(int k=0; k<2; k++)
+		printf("%8d %10lu %10lu %10.1f %12.0f\n", st[k].threads, st[k].vertices, st[k].commands,
+		       st[k].elapsed_ns / 1e6, st[k].points / (st[k].elapsed_ns / 1e9));
+	int same = path_same(out_path[0], out_path[1]);
+	printf("%.0fx fewer commands than a GoTo per sample; max deviation %.2f microsteps; "
+	       "outputs %s\n", (double)st[0].points / st[0].commands, st[0].max_dev,
+	       same ? "identical" : "DIFFER");
+
+	// Played back on the simulator.
+	dSPIN_Sim_SetClock(dSPIN_SIM_CLOCK_VIRTUAL);
+	dSPIN_init();
+	dSPIN_GetStatus();
+	dSPIN_HardHiZ();
+	dSPIN_SetParam(dSPIN_STEP_MODE, dSPIN_STEP_SEL_1_8);
+	dSPIN_SetParam(dSPIN_MAX_SPEED, MaxSpdCalc(2000));
+	dSPIN_SetParam(dSPIN_ACC, AccCalc(20000));
+	dSPIN_SetParam(dSPIN_DEC, DecCalc(20000));
+	FILE *prog = fopen(out_path[1], "r");
+	unsigned long long v0 = dSPIN_Now();
+	dSPIN_Program *p = dSPIN_Program_Open(prog, dSPIN_PROGRAM_LOOKAHEAD);
+	int run = dSPIN_Program_Run(p);
+	dSPIN_ProgramStats ps;
+	dSPIN_Program_GetStats(p, &ps);
+	dSPIN_Program_Close(p);
+	fclose(prog);
+	long pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+	if(pos & 0x200000) pos -= 0x400000;
+	printf("played back: %lu commands, %lu blended chains, %.1fs of motion; "
+	       "ABS_POS %ld, path ends at %ld\n", ps.executed, ps.blended, (dSPIN_Now() - v0) / 1e9,
+	       pos, st[1].end);
+
+	// A line that isn't a sample, and time going backwards, stop it there.
+	char bad[] = "0 0\n0.001 5\n# note\n0.002 5 7\n";
+	char back[] = "0 0\n0.002 5\n0.001 6\n";
+	dSPIN_PathStats bst[2];
+	char *text[2] = { bad, back };
+	int bad_err = 1;
+	for(int k=0; k<2; k++){
+		FILE *in = fmemopen(text[k], strlen(text[k]), "r");
+		FILE *out = fopen("/dev/null", "w");
+		bad_err &= dSPIN_Path_Simplify(in, out, &cfg, &bst[k]) == -1;
+		fclose(in);
+		fclose(out);
+	}
+	printf("bad input: extra field at line %lu, time backwards at line %lu\n", bst[0].bad_line,
+	       bst[1].bad_line);
+	remove(in_path);
+	remove(out_path[0]);
+	remove(out_path[1]);
+
+	int ok = err == 0 && same && st[0].points == (unsigned long)n && st[0].max_dev <= tol
+	         && st[0].commands * 20 < st[0].points && run == dSPIN_STATUS_GOOD && pos == st[1].end
+	         && bad_err && bst[0].bad_line == 4 && bst[1].bad_line == 3;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#include <string.h>
+#include "dSPIN.h"
+
+//dSPIN_blend.c - Segment blending. A chain of moves in one direction done
+//   with dSPIN_Move() comes to a stop at every boundary (and the errata in
+//   dSPIN.h asks for a soft stop in between besides). Here the chain is
+//   driven with dSPIN_Run() instead, changing speed at each boundary as
+//   ABS_POS reaches it, and the last segment is a dSPIN_GoTo() to where the
+//   chain ends, so the end position is exact whatever the timing was like.
+//
+// Speed changes are timed from ABS_POS: a slower segment starts braking early
+//  enough to be down to its speed at the boundary, a faster one speeds up once
+//  it's crossed. Between reads the host extrapolates from the last position at
+//  the segment speed, so a switch lands within a read's worth of travel of
+//  where it should.
+//
+// The last switch is the GoTo itself, with MAX_SPEED set to the last
+//  segment's speed; the chip changes speed on its way there. It's sent no
+//  later than where the motor, which may still be finishing the speed change
+//  before, could stop short of the end, so the GoTo never has to overshoot.
+//
+// With limits on the axis (see dSPIN_limits.c), a Run is only checked for
+//  room to stop, so a chain is first checked as a whole, as the GoTo it comes
+//  to. Any of the Runs or the GoTo can still be refused on the way. The motor
+//  would carry on with the Run before it, so the chain is soft stopped there
+//  and dSPIN_Blend() gives up.
+
+static long blend_pos()
+{
+  long p = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  if (p & 0x200000) p -= 0x400000;
+  return p;
+}
+
+// a - b on the 22-bit ABS_POS circle.
+static long blend_diff(long a, long b)
+{
+  long d = (a - b) & 0x3FFFFF;
+  return d & 0x200000 ? d - 0x400000 : d;
+}
+
+static void blend_wait()
+{
+  while (dSPIN_Busy()) delayMicroseconds(dSPIN_BLEND_POLL_US);
+}
+
+// Microsteps needed to brake from MAX_SPEED value r1 to r2 with DEC value dec:
+//  (v1^2 - v2^2) / 2dec, with v in 2^-18 and dec in 2^-40 steps/tick.
+static long blend_brake(unsigned long r1, unsigned long r2, unsigned long dec, int ms)
+{
+  if (r2 >= r1) return 0;
+  return (long)((8.0 * ((double)r1 * r1 - (double)r2 * r2) / dec) * ms) + 1;
+}
+
+// Whether the command just sent got past the limits. If not, stop what the
+//  motor was doing before it and put MAX_SPEED back.
+static int blend_sent(unsigned long max_reg)
+{
+  if (dSPIN_Limits_Last(NULL) == dSPIN_LIMIT_OK) return 1;
+  dSPIN_SoftStop();
+  blend_wait();
+  dSPIN_SetParam(dSPIN_MAX_SPEED, max_reg);
+  return 0;
+}
+
+// Drive one same-direction chain of n > 1 segments, starting from rest.
+//  Returns dSPIN_STATUS_GOOD, or dSPIN_STATUS_FATAL if the limits refused a
+//  command.
+static int blend_chain(const dSPIN_Segment *seg, int n, unsigned long max_reg,
+                        dSPIN_BlendStats *st)
+{
+  unsigned long acc = dSPIN_GetParam(dSPIN_ACC);
+  unsigned long dec = dSPIN_GetParam(dSPIN_DEC);
+  int ms = 1 << (dSPIN_GetParam(dSPIN_STEP_MODE) & dSPIN_STEP_MODE_STEP_SEL);
+  byte dir = seg[0].dir;
+  long sgn = dir == FWD ? 1 : -1;
+  unsigned long top = 0;
+  for (int k = 0; k < n; k++)
+  {
+    unsigned long r = seg[k].speed ? seg[k].speed : max_reg;
+    if (r > top) top = r;
+  }
+
+  long start = blend_pos();
+  long end = 0;
+  for (int k = 0; k < n; k++) end += seg[k].steps;
+  dSPIN_Bus_Begin();
+  int clear = dSPIN_Limits_Allow(dSPIN_GOTO, (unsigned long)(start + sgn * end) & 0x3FFFFF);
+  dSPIN_Bus_End();
+  if (!clear) return dSPIN_STATUS_FATAL;
+
+  // Run speeds are capped at MAX_SPEED when the command lands.
+  dSPIN_SetParam(dSPIN_MAX_SPEED, top);
+  unsigned long cur = seg[0].speed ? seg[0].speed : max_reg;
+  dSPIN_Run(dir, cur << 10);
+  st->commands += 2;
+  if (!blend_sent(max_reg)) return dSPIN_STATUS_FATAL;
+
+  unsigned long prev = 0;
+  long boundary = 0;
+  for (int k = 1; k < n; k++)
+  {
+    unsigned long next = seg[k].speed ? seg[k].speed : max_reg;
+    boundary += seg[k - 1].steps;
+    long at = boundary - blend_brake(cur, next, dec, ms);
+    float usteps_per_us = cur * 15.2588f * dSPIN_Osc() * ms / 1e6f;
+    if (k == n - 1)
+    {
+      // The GoTo is refused while busy, so it waits for the motor to be up
+      //  to cur if it isn't yet, a poll late at worst. From there it has to
+      //  be able to stop by the end.
+      unsigned long v = prev > cur ? prev : cur;
+      long last = end - blend_brake(v, 0, dec, ms) - blend_brake(cur, prev, acc, ms)
+                  - (long)(v * 15.2588f * dSPIN_Osc() * ms / 1e6f * dSPIN_BLEND_POLL_US) - 1;
+      if (at > last) at = last;
+    }
+
+    // Wait for ABS_POS to reach the switch point. Close in by halves until
+    //  the rest is less than two reads' worth, then sleep it off. A segment
+    //  too short to brake in switches straight away.
+    int timed = 0;
+    for (;;)
+    {
+      long left = at - sgn * blend_diff(blend_pos(), start);
+      st->reads++;
+      if (left <= 0) break;
+      timed = 1;
+      float us = left / usteps_per_us;
+      if (us < 2 * dSPIN_BLEND_POLL_US)
+      {
+        delayMicroseconds((unsigned int)us);
+        break;
+      }
+      delayMicroseconds((unsigned int)(us / 2));
+    }
+
+    long err = sgn * blend_diff(blend_pos(), start) - at;
+    if (err < 0) err = -err;
+    if (timed && err > st->switch_err) st->switch_err = err;
+    if (k < n - 1)
+    {
+      dSPIN_Run(dir, next << 10);
+      st->commands++;
+    }
+    else
+    {
+      blend_wait();
+      dSPIN_SetParam(dSPIN_MAX_SPEED, next);
+      dSPIN_GoTo((unsigned long)(start + sgn * end) & 0x3FFFFF);
+      st->commands += 2;
+    }
+    if (!blend_sent(max_reg)) return dSPIN_STATUS_FATAL;
+    prev = cur;
+    cur = next;
+  }
+  blend_wait();
+  long err = blend_diff(blend_pos(), start + sgn * end);
+  if (err < 0) err = -err;
+  if (err > st->end_err) st->end_err = err;
+  dSPIN_SetParam(dSPIN_MAX_SPEED, max_reg);
+  st->chains++;
+  return dSPIN_STATUS_GOOD;
+}
+
+// Move through n segments, blending runs of segments in the same direction.
+//  A change of direction still stops in between. The motor should be stopped
+//  when this is called; MAX_SPEED is left as it was found. Returns
+//  dSPIN_STATUS_GOOD, or dSPIN_STATUS_FATAL if the limits refused a command,
+//  in which case the motor has been stopped there and dSPIN_Limits_Last()
+//  says why.
+int dSPIN_Blend(const dSPIN_Segment *seg, int n, dSPIN_BlendStats *st)
+{
+  unsigned long max_reg = dSPIN_GetParam(dSPIN_MAX_SPEED);
+  memset(st, 0, sizeof(*st));
+  for (int i = 0; i < n;)
+  {
+    int j = i + 1;
+    while (j < n && seg[j].dir == seg[i].dir) j++;
+    blend_wait();
+    dSPIN_SoftStop();
+    blend_wait();
+    if (j - i > 1)
+    {
+      if (blend_chain(seg + i, j - i, max_reg, st) != dSPIN_STATUS_GOOD) return dSPIN_STATUS_FATAL;
+    }
+    else
+    {
+      dSPIN_SetParam(dSPIN_MAX_SPEED, seg[i].speed ? seg[i].speed : max_reg);
+      dSPIN_Move(seg[i].dir, seg[i].steps);
+      st->commands += 2;
+      if (!blend_sent(max_reg)) return dSPIN_STATUS_FATAL;
+      blend_wait();
+      dSPIN_SetParam(dSPIN_MAX_SPEED, max_reg);
+      st->commands++;
+    }
+    i = j;
+  }
+  blend_wait();
+  return dSPIN_STATUS_GOOD;
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dSPIN.h"
+
+//dSPIN_board.c - Status board in POSIX shared memory. The process that owns
+//   the bus publishes each axis' decoded state (position, speed, STATUS and
+//   when it was read) into a named segment; any number of other processes
+//   (an HMI, a logger, a safety monitor) attach to it read-only and take
+//   snapshots without ever touching the bus.
+//
+// Every axis has its own seqlock: the writer makes the sequence number odd,
+//  updates the slot and makes it even again, and a reader copies the slot and
+//  tries again if the number was odd or changed meanwhile. Readers don't write
+//  anything shared, so there are no syscalls or locks on their side, and how
+//  many there are makes no difference to the writer. Slots are a cache line
+//  each so that axes don't share one.
+
+#define BOARD_VERSION 1
+
+typedef struct
+{
+  unsigned int magic;      // written last, once the board is set up
+  unsigned int version;
+  unsigned int axes;
+  unsigned int slot_size;
+} BoardHeader;
+
+typedef struct
+{
+  unsigned int seq;        // odd while the writer is in the middle of an update
+  dSPIN_AxisState st;
+} __attribute__((aligned(64))) BoardSlot;
+
+struct dSPIN_Board
+{
+  char name[64];
+  int owner;               // created it, rather than attached
+  size_t size;
+  BoardHeader *hdr;
+  BoardSlot *slot;
+};
+
+static size_t board_size(int axes)
+{
+  return sizeof(BoardSlot) + (size_t)axes * sizeof(BoardSlot);
+}
+
+// Create the board name (e.g. dSPIN_BOARD_NAME) with room for axes axes, all
+//  unpublished. Replaces a board of the same name left behind by an owner that
+//  died. Returns NULL if the segment can't be made.
+dSPIN_Board *dSPIN_Board_Create(const char *name, int axes)
+{
+  if (axes < 1 || axes > dSPIN_MAX_AXES || strlen(name) >= sizeof(((dSPIN_Board *)0)->name))
+    return NULL;
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) return NULL;
+  size_t size = board_size(axes);
+  void *m = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  dSPIN_Board *b = m == MAP_FAILED ? NULL : (dSPIN_Board *)calloc(1, sizeof(*b));
+  if (b == NULL)
+  {
+    if (m != MAP_FAILED) munmap(m, size);
+    shm_unlink(name);
+    return NULL;
+  }
+  strcpy(b->name, name);
+  b->owner = 1;
+  b->size = size;
+  b->hdr = (BoardHeader *)m;
+  b->slot = (BoardSlot *)m + 1;
+  b->hdr->version = BOARD_VERSION;
+  b->hdr->axes = axes;
+  b->hdr->slot_size = sizeof(BoardSlot);
+  __atomic_store_n(&b->hdr->magic, dSPIN_BOARD_MAGIC, __ATOMIC_RELEASE);
+  return b;
+}
+
+// Attach to a board another process created, read-only. Returns NULL if there
+//  isn't one, or it isn't set up yet or was built differently.
+dSPIN_Board *dSPIN_Board_Attach(const char *name)
+{
+  if (strlen(name) >= sizeof(((dSPIN_Board *)0)->name)) return NULL;
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return NULL;
+  struct stat sb;
+  void *m = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(BoardSlot))
+    m = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return NULL;
+  BoardHeader *h = (BoardHeader *)m;
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != dSPIN_BOARD_MAGIC
+      || h->version != BOARD_VERSION || h->slot_size != sizeof(BoardSlot)
+      || h->axes < 1 || board_size(h->axes) > (size_t)sb.st_size)
+  {
+    munmap(m, sb.st_size);
+    return NULL;
+  }
+  dSPIN_Board *b = (dSPIN_Board *)calloc(1, sizeof(*b));
+  if (b == NULL)
+  {
+    munmap(m, sb.st_size);
+    return NULL;
+  }
+  strcpy(b->name, name);
+  b->size = sb.st_size;
+  b->hdr = h;
+  b->slot = (BoardSlot *)m + 1;
+  return b;
+}
+
+int dSPIN_Board_Axes(const dSPIN_Board *b)
+{
+  return b->hdr->axes;
+}
+
+// Fill st from raw register values.
+void dSPIN_Board_Decode(dSPIN_AxisState *st, unsigned int status, long abs_pos,
+                        unsigned long speed, unsigned long long stamp_ns)
+{
+  st->abs_pos = abs_pos;
+  st->speed = speed;
+  st->status = status;
+  st->mot_status = (status & dSPIN_STATUS_MOT_STATUS) >> 5;
+  st->dir = status & dSPIN_STATUS_DIR ? FWD : REV;
+  st->busy = !(status & dSPIN_STATUS_BUSY);
+  st->hiz = (status & dSPIN_STATUS_HIZ) != 0;
+  // The fault flags are active low.
+  st->alarms = (~status & (dSPIN_STATUS_UVLO | dSPIN_STATUS_TH_WRN | dSPIN_STATUS_TH_SD
+                           | dSPIN_STATUS_OCD | dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B))
+               | (status & (dSPIN_STATUS_NOTPERF_CMD | dSPIN_STATUS_WRONG_CMD | dSPIN_STATUS_SW_EVN));
+  st->stamp_ns = stamp_ns;
+}
+
+// Publish st for axis. Only the owner can; several of its threads may publish
+//  at once, even for the same axis. The update count is kept by the board.
+void dSPIN_Board_Publish(dSPIN_Board *b, int axis, const dSPIN_AxisState *st)
+{
+  if (!b->owner || axis < 0 || axis >= (int)b->hdr->axes) return;
+  BoardSlot *s = &b->slot[axis];
+  unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+  do
+  {
+    while (seq & 1) seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  unsigned long updates = s->st.updates;
+  s->st = *st;
+  s->st.updates = updates + 1;
+  __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Read STATUS, ABS_POS and SPEED from axis in one go and publish them.
+//  Leaves the axis this thread has selected as it was.
+void dSPIN_Board_Sample(dSPIN_Board *b, int axis)
+{
+  int was = dSPIN_Selected();
+  dSPIN_Select(axis);
+  dSPIN_Bus_Begin();
+  unsigned int status = dSPIN_GetParam(dSPIN_STATUS);
+  long pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  unsigned long speed = dSPIN_GetParam(dSPIN_SPEED);
+  dSPIN_Bus_End();
+  dSPIN_Select(was);
+  if (pos & 0x200000) pos -= 0x400000;
+
+  dSPIN_AxisState st;
+  dSPIN_Board_Decode(&st, status, pos, speed, dSPIN_Now());
+  dSPIN_Board_Publish(b, axis, &st);
+}
+
+// Take a consistent snapshot of axis. Returns how many times the copy had to
+//  be retried because the writer was busy with that axis, or -1 for an axis
+//  the board doesn't have. st->stamp_ns is 0 for an axis never published.
+int dSPIN_Board_Read(const dSPIN_Board *b, int axis, dSPIN_AxisState *st)
+{
+  if (axis < 0 || axis >= (int)b->hdr->axes) return -1;
+  const BoardSlot *s = &b->slot[axis];
+  for (int tries = 0;; tries++)
+  {
+    unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1))
+    {
+      memcpy(st, (const void *)&s->st, sizeof(*st));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) return tries;
+    }
+  }
+}
+
+// Detach, or for the owner, take the board down too. Readers still attached
+//  keep their mapping but see no more updates.
+void dSPIN_Board_Close(dSPIN_Board *b)
+{
+  munmap(b->hdr, b->size);
+  if (b->owner) shm_unlink(b->name);
+  free(b);
+}
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dSPIN.h"
+
+//dSPIN_bytecode.c - Compiled motion programs. A job that runs over and over
+//   needn't be parsed, converted to register units and encoded into command
+//   frames every cycle: dSPIN_Compile() does all of that once and writes the
+//   frames out as the exact bytes dSPIN_Xfer() has to send, along with the
+//   waits and dwells between them. dSPIN_Bytecode_Open() maps a compiled file
+//   into memory (faulting it all in up front) and checks it once, so that
+//   dSPIN_Bytecode_Run() only has to walk the records and send bytes, with no
+//   conversion, allocation or file access per cycle.
+//
+// The compiler takes the same text as dSPIN_program.c and plays it back the
+//  same way, soft stop before every positioning command included, except that
+//  blending and per-move speeds are refused: their speed changes are timed
+//  from ABS_POS while the motor runs and can't be worked out ahead of time.
+
+#define BC_HEADER 8
+
+// The frame bytes of commands not yet written out, kept to merge into one
+//  XFER record.
+struct bc_out
+{
+  FILE *f;
+  byte xfer[255];
+  int n;
+  int waited;            // nothing has been sent since the last wait
+};
+
+static void bc_flush(struct bc_out *o)
+{
+  if (o->n == 0) return;
+  putc(dSPIN_BC_XFER, o->f);
+  putc(o->n, o->f);
+  fwrite(o->xfer, 1, o->n, o->f);
+  o->n = 0;
+}
+
+static void bc_record(struct bc_out *o, byte kind, const byte *payload, byte len)
+{
+  bc_flush(o);
+  putc(kind, o->f);
+  putc(len, o->f);
+  if (len) fwrite(payload, 1, len, o->f);
+  // A dwell waits before it pauses.
+  o->waited = kind == dSPIN_BC_WAIT || kind == dSPIN_BC_DWELL;
+}
+
+static void bc_frame(struct bc_out *o, const byte *b, int len)
+{
+  if (o->n + len > (int)sizeof(o->xfer)) bc_flush(o);
+  memcpy(o->xfer + o->n, b, len);
+  o->n += len;
+  o->waited = 0;
+}
+
+static void bc_cmd(struct bc_out *o, byte cmd)
+{
+  bc_frame(o, &cmd, 1);
+}
+
+// A command with a 3-byte argument, clamped to max as dSPIN_commands.c does.
+static void bc_cmd3(struct bc_out *o, byte cmd, unsigned long v, unsigned long max)
+{
+  if (v > max) v = max;
+  byte b[4] = { cmd, (byte)(v >> 16), (byte)(v >> 8), (byte)v };
+  bc_frame(o, b, 4);
+}
+
+static void bc_wait(struct bc_out *o)
+{
+  if (!o->waited) bc_record(o, dSPIN_BC_WAIT, NULL, 0);
+}
+
+static void bc_settle(struct bc_out *o)
+{
+  bc_wait(o);
+  bc_cmd(o, dSPIN_SOFT_STOP);
+  bc_wait(o);
+}
+
+// SetParam frame, encoded the way dSPIN_ParamHandler() sends it.
+static void bc_set(struct bc_out *o, byte param, unsigned long value)
+{
+  const dSPIN_RegInfo &r = dSPIN_RegFor(param);
+  value = dSPIN_RegEncode(r, value);
+  byte b[4];
+  int n = 0;
+  b[n++] = dSPIN_SET_PARAM | param;
+  for (int k = r.bytes - 1; k >= 0; k--) b[n++] = (byte)(value >> (8 * k));
+  bc_frame(o, b, n);
+}
+
+static int bc_compile(FILE *in, FILE *out, int *line)
+{
+  struct bc_out o;
+  char text[dSPIN_PROGRAM_LINE];
+  dSPIN_ProgOp op;
+  memset(&o, 0, sizeof(o));
+  o.f = out;
+  *line = 0;
+
+  byte header[BC_HEADER] = { 0 };
+  memcpy(header, dSPIN_BYTECODE_MAGIC, 4);
+  header[4] = dSPIN_BYTECODE_VERSION;
+  fwrite(header, 1, BC_HEADER, out);
+
+  while (fgets(text, sizeof(text), in))
+  {
+    (*line)++;
+    size_t len = strlen(text);
+    if (len == sizeof(text) - 1 && text[len - 1] != '\n') return dSPIN_STATUS_FATAL;
+    int r = dSPIN_Program_Parse(text, &op);
+    if (r == 0) continue;
+    if (r < 0) return dSPIN_STATUS_FATAL;
+    switch (op.op)
+    {
+      case dSPIN_OP_AXIS:
+      {
+        // dSPIN_Select() would ignore it, and the frames go to whichever axis
+        //  was selected before.
+        if (op.value >= (unsigned long)dSPIN_Axes()) return dSPIN_STATUS_FATAL;
+        byte axis = (byte)op.value;
+        bc_record(&o, dSPIN_BC_AXIS, &axis, 1);
+        dSPIN_Select(axis);
+        break;
+      }
+      case dSPIN_OP_MOVE:
+        if (op.speed) return dSPIN_STATUS_FATAL;
+        bc_settle(&o);
+        bc_cmd3(&o, dSPIN_MOVE | op.dir, op.value, 0x3FFFFF);
+        break;
+      case dSPIN_OP_GOTO:
+        bc_settle(&o);
+        bc_cmd3(&o, dSPIN_GOTO, op.value, 0x3FFFFF);
+        break;
+      case dSPIN_OP_HOME:    bc_settle(&o); bc_cmd(&o, dSPIN_GO_HOME); break;
+      case dSPIN_OP_MARK:    bc_settle(&o); bc_cmd(&o, dSPIN_GO_MARK); break;
+      case dSPIN_OP_UNTIL:
+        bc_settle(&o);
+        bc_cmd3(&o, dSPIN_GO_UNTIL | op.act | op.dir, op.value, 0xFFFFF);
+        break;
+      case dSPIN_OP_RELEASE:
+        bc_settle(&o);
+        bc_cmd(&o, dSPIN_RELEASE_SW | op.act | op.dir);
+        break;
+      case dSPIN_OP_RUN:     bc_cmd3(&o, dSPIN_RUN | op.dir, op.value, 0xFFFFF); break;
+      case dSPIN_OP_ZERO:    bc_cmd(&o, dSPIN_RESET_POS); break;
+      case dSPIN_OP_STOP:    bc_cmd(&o, dSPIN_SOFT_STOP); break;
+      case dSPIN_OP_HARDSTOP: bc_cmd(&o, dSPIN_HARD_STOP); break;
+      case dSPIN_OP_SOFTHIZ: bc_cmd(&o, dSPIN_SOFT_HIZ); break;
+      case dSPIN_OP_HIZ:     bc_cmd(&o, dSPIN_HARD_HIZ); break;
+      case dSPIN_OP_WAIT:    bc_wait(&o); break;
+      case dSPIN_OP_DWELL:
+      {
+        unsigned long ms = op.value;
+        byte b[4] = { (byte)(ms >> 24), (byte)(ms >> 16), (byte)(ms >> 8), (byte)ms };
+        bc_wait(&o);
+        bc_record(&o, dSPIN_BC_DWELL, b, 4);
+        break;
+      }
+      case dSPIN_OP_SET:     bc_set(&o, op.param, op.value); break;
+      case dSPIN_OP_BLEND:
+        if (op.value) return dSPIN_STATUS_FATAL;
+        break;
+    }
+  }
+  // Like the interpreter, finish with the motor done.
+  bc_wait(&o);
+  bc_record(&o, dSPIN_BC_END, NULL, 0);
+  if (fflush(out) != 0 || ferror(out))
+  {
+    *line = 0;
+    return dSPIN_STATUS_FATAL;
+  }
+  return dSPIN_STATUS_GOOD;
+}
+
+// Compile the program text read from in into out. Returns dSPIN_STATUS_GOOD,
+//  or dSPIN_STATUS_FATAL with the offending line in *line (0 if writing out
+//  failed). out is left open. Units are converted with the oscillator
+//  calibration of each axis the program addresses, so a compiled file belongs
+//  to the chips it was compiled for.
+int dSPIN_Compile(FILE *in, FILE *out, int *line)
+{
+  int was = dSPIN_Selected();
+  int r = bc_compile(in, out, line);
+  dSPIN_Select(was);
+  return r;
+}
+
+// Length of the frame that starts with command byte c, for the frames
+//  bc_compile() writes.
+static int bc_frame_len(byte c)
+{
+  if ((c & 0xE0) == dSPIN_SET_PARAM) return 1 + dSPIN_RegFor(c).bytes;
+  if ((c & 0xFE) == dSPIN_RUN || (c & 0xFE) == dSPIN_MOVE || c == dSPIN_GOTO
+      || (c & 0xFE) == dSPIN_GOTO_DIR || (c & 0xF6) == dSPIN_GO_UNTIL)
+    return 4;
+  return 1;
+}
+
+// Whether the frame starting with c is one dSPIN_Limits_Allow() checks.
+static int bc_motion(byte c)
+{
+  return (c & 0xFE) == dSPIN_RUN || (c & 0xFE) == dSPIN_MOVE || c == dSPIN_GOTO
+         || (c & 0xFE) == dSPIN_GOTO_DIR || c == dSPIN_GO_HOME || c == dSPIN_GO_MARK;
+}
+
+struct dSPIN_Bytecode
+{
+  const byte *map;
+  size_t size;
+  dSPIN_BytecodeStats stats;
+};
+
+// Check a mapped file from end to end, so running it needn't check anything.
+static int bc_check(dSPIN_Bytecode *bc)
+{
+  const byte *m = bc->map;
+  if (bc->size < BC_HEADER || memcmp(m, dSPIN_BYTECODE_MAGIC, 4)
+      || m[4] != dSPIN_BYTECODE_VERSION)
+    return 0;
+  for (size_t at = BC_HEADER; at + 2 <= bc->size;)
+  {
+    byte kind = m[at], len = m[at + 1];
+    const byte *d = m + at + 2;
+    if (at + 2 + len > bc->size) return 0;
+    bc->stats.records++;
+    switch (kind)
+    {
+      case dSPIN_BC_END:
+        return len == 0 && at + 2 == bc->size;
+      case dSPIN_BC_XFER:
+      {
+        // Whole frames only, so they can be picked out when it's run.
+        int i = 0;
+        while (i < len) i += bc_frame_len(d[i]);
+        if (len == 0 || i != len) return 0;
+        bc->stats.spi_bytes += len;
+        break;
+      }
+      case dSPIN_BC_WAIT:
+        if (len != 0) return 0;
+        bc->stats.waits++;
+        break;
+      case dSPIN_BC_AXIS:
+        if (len != 1 || d[0] >= dSPIN_Axes()) return 0;
+        break;
+      case dSPIN_BC_DWELL:
+        if (len != 4) return 0;
+        break;
+      default:
+        return 0;
+    }
+    at += 2 + len;
+  }
+  return 0;
+}
+
+// Map a compiled program. Every axis it selects must have been added by now.
+//  Returns NULL if the file can't be read or isn't a whole, valid program.
+dSPIN_Bytecode *dSPIN_Bytecode_Open(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat sb;
+  dSPIN_Bytecode *bc = NULL;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0
+      && (bc = (dSPIN_Bytecode *)calloc(1, sizeof(*bc))) != NULL)
+  {
+    bc->size = sb.st_size;
+    bc->stats.size = sb.st_size;
+    void *m = mmap(NULL, bc->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    bc->map = m == MAP_FAILED ? NULL : (const byte *)m;
+    if (bc->map == NULL || !bc_check(bc))
+    {
+      if (bc->map) munmap((void *)bc->map, bc->size);
+      free(bc);
+      bc = NULL;
+    }
+  }
+  close(fd);
+  return bc;
+}
+
+// Play the program through once. Can be called again for the next cycle.
+//  Motion commands are checked against the limits (see dSPIN_limits.c) as
+//  they go out; one that's refused soft stops the motor and ends the program
+//  there with dSPIN_STATUS_FATAL, and dSPIN_Limits_Last() says why.
+int dSPIN_Bytecode_Run(const dSPIN_Bytecode *bc)
+{
+  const byte *r = bc->map + BC_HEADER;
+  for (;;)
+  {
+    byte len = r[1];
+    const byte *d = r + 2;
+    switch (r[0])
+    {
+      case dSPIN_BC_END:
+        return dSPIN_STATUS_GOOD;
+      case dSPIN_BC_XFER:
+        // A record can hold several frames; an emergency stop waits for the
+        //  end of the record rather than of the frame.
+        dSPIN_Bus_Begin();
+        for (int i = 0; i < len;)
+        {
+          int n = bc_frame_len(d[i]);
+          unsigned long arg = n == 4 ? (unsigned long)d[i + 1] << 16 | d[i + 2] << 8 | d[i + 3] : 0;
+          if (bc_motion(d[i]) && !dSPIN_Limits_Allow(d[i], arg))
+          {
+            dSPIN_Bus_End();
+            dSPIN_SoftStop();
+            return dSPIN_STATUS_FATAL;
+          }
+          for (int k = 0; k < n; k++) dSPIN_Xfer(d[i + k]);
+          i += n;
+        }
+        dSPIN_Bus_End();
+        break;
+      case dSPIN_BC_WAIT:
+        while (dSPIN_Busy()) delayMicroseconds(dSPIN_PROGRAM_POLL_US);
+        break;
+      case dSPIN_BC_AXIS:
+        dSPIN_Select(d[0]);
+        break;
+      case dSPIN_BC_DWELL:
+        delay((unsigned int)d[0] << 24 | (unsigned int)d[1] << 16 | d[2] << 8 | d[3]);
+        break;
+    }
+    r = d + len;
+  }
+}
+
+void dSPIN_Bytecode_GetStats(const dSPIN_Bytecode *bc, dSPIN_BytecodeStats *stats)
+{
+  *stats = bc->stats;
+}
+
+void dSPIN_Bytecode_Close(dSPIN_Bytecode *bc)
+{
+  munmap((void *)bc->map, bc->size);
+  free(bc);
+}
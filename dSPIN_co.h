@@ -0,0 +1,323 @@
+//dSPIN_co.h - Coroutine API (C++20, build with -std=c++20). A motion
+//   sequence written against the blocking calls is a chain of commands and
+//   busy-waits, so each one needs a thread of its own. Here a sequence is a
+//   coroutine returning dSPIN_Task, and co_await suspends it instead:
+//
+//     dSPIN_Task shuttle(dSPIN_CoAxis a)
+//     {
+//       co_await a.move(FWD, 200);      // sent, then resumed once BUSYN rises
+//       co_await a.loop.sleep_us(5000);
+//       co_await a.go_to(0);
+//       co_return dSPIN_STATUS_GOOD;
+//     }
+//
+//  A dSPIN_Loop resumes its sequences from one thread: it sleeps in
+//  dSPIN_Edge_Wait() until a BUSYN line rises or the next timer is due, then
+//  resumes whichever sequences that was for. Axes with no BUSYN line are
+//  polled every dSPIN_CO_POLL_US. Sequences can co_await each other.
+//
+// A frame on the bit-banged bus is over in tens of microseconds, so register
+//  reads and writes complete in place: they are awaitable so a sequence reads
+//  the same throughout, but never suspend. Motion commands go out when they
+//  are called, and the awaitable they return waits for the axis to be idle.
+//  Everything runs on the loop's thread; each command selects its axis first.
+#ifndef dSPIN_CO_H
+#define dSPIN_CO_H
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <queue>
+#include <vector>
+#include "dSPIN.h"
+
+// How often an axis without a BUSYN line is polled while a sequence waits on it.
+#define dSPIN_CO_POLL_US 2000
+
+/***************** tasks ***********************/
+
+// A sequence. It starts when handed to dSPIN_Loop::spawn() or awaited by
+//  another sequence, and its co_return value is what the awaiter gets.
+struct dSPIN_Task
+{
+  struct promise_type
+  {
+    int result = 0;
+    std::coroutine_handle<> cont;   // the sequence awaiting this one, if any
+
+    dSPIN_Task get_return_object()
+    {
+      return dSPIN_Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    struct Final
+    {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+      {
+        if (h.promise().cont) return h.promise().cont;
+        return std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    Final final_suspend() noexcept { return {}; }
+    void return_value(int v) { result = v; }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  typedef std::coroutine_handle<promise_type> handle;
+  handle h;
+
+  explicit dSPIN_Task(handle h) : h(h) {}
+  dSPIN_Task(dSPIN_Task &&o) : h(o.h) { o.h = nullptr; }
+  dSPIN_Task(const dSPIN_Task &) = delete;
+  dSPIN_Task &operator=(const dSPIN_Task &) = delete;
+  ~dSPIN_Task() { if (h) h.destroy(); }
+
+  // Run it to completion as part of the awaiting sequence.
+  bool await_ready() { return !h || h.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c)
+  {
+    h.promise().cont = c;
+    return h;
+  }
+  int await_resume() { return h.promise().result; }
+};
+
+// A value that's already there: what register commands return.
+template <class T>
+struct dSPIN_CoNow
+{
+  T value;
+  bool await_ready() { return true; }
+  void await_suspend(std::coroutine_handle<>) {}
+  T await_resume() { return value; }
+};
+
+/***************** the loop ***********************/
+
+class dSPIN_Loop
+{
+  struct Idle
+  {
+    int axis;
+    byte pin;
+    int irq;                       // BUSYN is armed
+    unsigned long long poll_ns;    // next STATUS read if it isn't
+    std::coroutine_handle<> h;
+  };
+  struct Timer
+  {
+    unsigned long long at;
+    unsigned long seq;             // keeps equal times first come, first served
+    std::coroutine_handle<> h;
+    bool operator>(const Timer &o) const { return at != o.at ? at > o.at : seq > o.seq; }
+  };
+
+  std::vector<Idle> idle;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > timers;
+  std::vector<std::coroutine_handle<> > ready;
+  std::vector<dSPIN_Task::handle> tasks;
+  std::vector<int> results;
+  unsigned long seq = 0;
+  unsigned long wakeups = 0;
+
+public:
+  ~dSPIN_Loop()
+  {
+    for (auto h : tasks) if (h) h.destroy();
+  }
+
+  // Hand a sequence to the loop; it starts on the next run(). Returns its id.
+  int spawn(dSPIN_Task &&t)
+  {
+    tasks.push_back(t.h);
+    results.push_back(0);
+    ready.push_back(t.h);
+    t.h = nullptr;
+    return (int)tasks.size() - 1;
+  }
+
+  // What sequence id returned, once run() is back.
+  int result(int id) const { return results[id]; }
+
+  // Times the loop went to sleep and was woken.
+  unsigned long wakes() const { return wakeups; }
+
+  // Awaitable: resume when the axis is idle.
+  struct IdleWait
+  {
+    dSPIN_Loop *loop;
+    int axis;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+      dSPIN_Select(axis);
+      byte pin = dSPIN_BusyPin();
+      loop->idle.push_back(Idle{ axis, pin, dSPIN_Edge_Arm(pin), 0, h });
+    }
+    void await_resume() {}
+  };
+
+  // Awaitable: resume once dSPIN_Now() reaches at.
+  struct Sleep
+  {
+    dSPIN_Loop *loop;
+    unsigned long long at;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) { loop->timers.push(Timer{ at, loop->seq++, h }); }
+    void await_resume() {}
+  };
+
+  Sleep sleep_until(unsigned long long ns) { return Sleep{ this, ns }; }
+  Sleep sleep_us(unsigned long us) { return Sleep{ this, dSPIN_Now() + us * 1000ULL }; }
+
+  // Run until every spawned sequence has finished.
+  void run()
+  {
+    int prev = dSPIN_Selected();
+    size_t live = 0;
+    for (auto h : tasks) live += h && !h.done();
+    while (live > 0)
+    {
+      while (!ready.empty())
+      {
+        std::vector<std::coroutine_handle<> > now_ready;
+        now_ready.swap(ready);
+        for (auto h : now_ready) h.resume();
+      }
+      live = 0;
+      for (size_t i = 0; i < tasks.size(); i++)
+      {
+        if (!tasks[i]) continue;
+        if (!tasks[i].done()) { live++; continue; }
+        results[i] = tasks[i].promise().result;
+        tasks[i].destroy();
+        tasks[i] = nullptr;
+      }
+      if (live == 0) break;
+
+      // Read the edge count before the lines, so no edge is slept through.
+      unsigned long seen = dSPIN_Edge_Count();
+      unsigned long long now = dSPIN_Now();
+      unsigned long long wake = now + 1000000000ULL;
+      for (size_t i = 0; i < idle.size();)
+      {
+        Idle &w = idle[i];
+        dSPIN_Select(w.axis);
+        int busy;
+        if (w.irq) busy = digitalRead(w.pin) == LOW;
+        else if (now < w.poll_ns) busy = 1;
+        else
+        {
+          busy = dSPIN_Busy();
+          w.poll_ns = now + dSPIN_CO_POLL_US * 1000ULL;
+        }
+        if (!busy)
+        {
+          ready.push_back(w.h);
+          idle[i] = idle.back();
+          idle.pop_back();
+          continue;
+        }
+        if (!w.irq && w.poll_ns < wake) wake = w.poll_ns;
+        i++;
+      }
+      while (!timers.empty() && timers.top().at <= now)
+      {
+        ready.push_back(timers.top().h);
+        timers.pop();
+      }
+      if (!ready.empty()) continue;
+      if (!timers.empty() && timers.top().at < wake) wake = timers.top().at;
+      dSPIN_Edge_Wait(seen, wake);
+      wakeups++;
+    }
+    dSPIN_Select(prev);
+  }
+};
+
+/***************** axes ***********************/
+
+// One axis as seen from a sequence. Cheap to copy; pass it by value.
+struct dSPIN_CoAxis
+{
+  dSPIN_Loop &loop;
+  int axis;
+
+  dSPIN_CoAxis(dSPIN_Loop &loop, int axis) : loop(loop), axis(axis) {}
+
+  dSPIN_Loop::IdleWait until_idle() { return dSPIN_Loop::IdleWait{ &loop, axis }; }
+
+  // Motion: the command goes out now, and awaiting it waits for BUSYN.
+  dSPIN_Loop::IdleWait move(byte dir, unsigned long n)
+  {
+    dSPIN_Select(axis);
+    dSPIN_Move(dir, n);
+    return until_idle();
+  }
+  dSPIN_Loop::IdleWait go_to(unsigned long pos)
+  {
+    dSPIN_Select(axis);
+    dSPIN_GoTo(pos);
+    return until_idle();
+  }
+  // Resumed once the motor is at speed.
+  dSPIN_Loop::IdleWait run(byte dir, unsigned long spd)
+  {
+    dSPIN_Select(axis);
+    dSPIN_Run(dir, spd);
+    return until_idle();
+  }
+  dSPIN_Loop::IdleWait go_until(byte act, byte dir, unsigned long spd)
+  {
+    dSPIN_Select(axis);
+    dSPIN_GoUntil(act, dir, spd);
+    return until_idle();
+  }
+  dSPIN_Loop::IdleWait release_sw(byte act, byte dir)
+  {
+    dSPIN_Select(axis);
+    dSPIN_ReleaseSW(act, dir);
+    return until_idle();
+  }
+  dSPIN_Loop::IdleWait go_home()
+  {
+    dSPIN_Select(axis);
+    dSPIN_GoHome();
+    return until_idle();
+  }
+  dSPIN_Loop::IdleWait soft_stop()
+  {
+    dSPIN_Select(axis);
+    dSPIN_SoftStop();
+    return until_idle();
+  }
+  dSPIN_Loop::IdleWait hard_stop()
+  {
+    dSPIN_Select(axis);
+    dSPIN_HardStop();
+    return until_idle();
+  }
+
+  // Registers.
+  dSPIN_CoNow<unsigned long> get(byte param)
+  {
+    dSPIN_Select(axis);
+    return dSPIN_CoNow<unsigned long>{ dSPIN_GetParam(param) };
+  }
+  dSPIN_CoNow<unsigned long> set(byte param, unsigned long value)
+  {
+    dSPIN_Select(axis);
+    dSPIN_SetParam(param, value);
+    return dSPIN_CoNow<unsigned long>{ value };
+  }
+  // GetStatus(): returns STATUS and clears its flags.
+  dSPIN_CoNow<int> status()
+  {
+    dSPIN_Select(axis);
+    return dSPIN_CoNow<int>{ dSPIN_GetStatus() };
+  }
+};
+
+#endif
@@ -0,0 +1,40 @@
+//dSPIN_compile.c - Compiles a motion program (see dSPIN_program.c) into a
+//										file of ready-made command frames for play to run.
+//  usage: compile <program|-> <output>
+#include <stdio.h>
+#include <string.h>
+
+#include "dSPIN.h"
+
+int main(int argc, char* argv[]){
+	if(argc<3){
+		fprintf(stderr, "usage: %s <program|-> <output>\n", argv[0]);
+		return 1;
+	}
+	FILE *in = stdin;
+	if(strcmp(argv[1], "-")){
+		in = fopen(argv[1], "r");
+		if(in == NULL){
+			perror(argv[1]);
+			return 1;
+		}
+	}
+	FILE *out = fopen(argv[2], "wb");
+	if(out == NULL){
+		perror(argv[2]);
+		return 1;
+	}
+	int line;
+	int err = dSPIN_Compile(in, out, &line);
+	if(fclose(out) != 0 && err == dSPIN_STATUS_GOOD){
+		err = dSPIN_STATUS_FATAL;
+		line = 0;
+	}
+	if(err != dSPIN_STATUS_GOOD){
+		if(line) fprintf(stderr, "%s line %d: can't compile it\n", argv[1], line);
+		else perror(argv[2]);
+		remove(argv[2]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dSPIN.h"
+
+//dSPIN_encoder.c - Closed-loop position correction. The chip counts the steps
+//   it puts out, not the ones the motor takes: a heavy axis that stalls for a
+//   moment under load comes to rest short of where ABS_POS says it is, and
+//   nothing on the bus says so. An encoder on the shaft does. The loop reads
+//   one, through a source interface (a counter device or file, or the
+//   simulator's), at a fixed rate, and holds it against ABS_POS.
+//
+// The encoder is zeroed against ABS_POS when the loop is opened, so its
+//  counts turn into microsteps in the chip's frame. While the axis moves the
+//  error is only recorded: the chip refuses both a GoTo and a write to
+//  ABS_POS until the move ends. Once it's idle, an error past the deadband
+//  is corrected: ABS_POS is set to where the encoder says the motor is, and
+//  a GoTo takes it back to where the chip thought it was, which is where the
+//  last command meant it to be.
+//
+// Each pass takes two reads and, when it corrects, two more frames; their
+//  time from the first read to the last frame out is the loop latency. The
+//  bus is held for the whole pass, so no other thread can start a move
+//  between the reads and the correction.
+
+static unsigned long long enc_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ABS_POS is a 22-bit two's complement counter.
+static long enc_wrap(long d)
+{
+  d &= 0x3FFFFF;
+  if (d & 0x200000) d -= 0x400000;
+  return d;
+}
+
+struct dSPIN_Encoder
+{
+  int axis;
+  dSPIN_EncoderSource src;
+  long deadband;
+  double zero;                   // ABS_POS at count 0, in microsteps
+  volatile int stop;
+  dSPIN_EncoderStats stats;
+};
+
+/***************** sources ***********************/
+
+static int enc_file_read(void *arg, long *counts)
+{
+  char buf[32];
+  ssize_t n = pread((int)(intptr_t)arg, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) return -1;
+  buf[n] = 0;
+  char *end;
+  *counts = strtol(buf, &end, 10);
+  return end == buf ? -1 : 0;
+}
+
+// Fill in src for a counter read as decimal text from the start of the file
+//  at path, on every pass: a Linux counter device's count attribute (such as
+//  /sys/bus/counter/devices/counter0/count0/count for a quadrature decoder),
+//  or a file another process keeps up to date. Returns -1 if it can't be
+//  opened.
+int dSPIN_Encoder_File(const char *path, float usteps_per_count, dSPIN_EncoderSource *src)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  src->read = enc_file_read;
+  src->arg = (void *)(intptr_t)fd;
+  src->usteps_per_count = usteps_per_count;
+  return 0;
+}
+
+void dSPIN_Encoder_FileClose(dSPIN_EncoderSource *src)
+{
+  close((int)(intptr_t)src->arg);
+}
+
+/***************** the loop ***********************/
+
+// Close the loop on axis with src, correcting errors larger than deadband
+//  microsteps. The encoder is zeroed against ABS_POS as it stands, so the
+//  motor must be where the chip thinks it is. Returns NULL if src can't be
+//  read.
+dSPIN_Encoder *dSPIN_Encoder_Open(int axis, const dSPIN_EncoderSource *src, long deadband)
+{
+  long counts;
+  if (src->read(src->arg, &counts) != 0) return NULL;
+  int prev = dSPIN_Selected();
+  dSPIN_Select(axis);
+  long abs = enc_wrap((long)dSPIN_GetParam(dSPIN_ABS_POS));
+  dSPIN_Select(prev);
+
+  dSPIN_Encoder *e = (dSPIN_Encoder *)calloc(1, sizeof(dSPIN_Encoder));
+  if (e == NULL) return NULL;
+  e->axis = axis;
+  e->src = *src;
+  e->deadband = deadband;
+  e->zero = abs - counts * (double)src->usteps_per_count;
+  return e;
+}
+
+// One pass: read the axis and the encoder and correct if it's called for.
+//  Returns 1 if a correction went out, 0 if none was needed (or the axis was
+//  busy or in HiZ, or the limits refused the GoTo back), -1 if the encoder
+//  couldn't be read.
+int dSPIN_Encoder_Step(dSPIN_Encoder *e)
+{
+  dSPIN_EncoderStats *s = &e->stats;
+  int prev = dSPIN_Selected();
+  int cls = dSPIN_Bus_Class();
+  dSPIN_Select(e->axis);
+  dSPIN_Bus_SetClass(dSPIN_BUS_HIGH);
+  dSPIN_Bus_Begin();
+
+  unsigned long long t0 = enc_now();
+  // GetParam leaves STATUS' flags latched, for whoever polls it.
+  unsigned long status = dSPIN_GetParam(dSPIN_STATUS);
+  long abs = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  long counts;
+  int done = -1;
+  if (e->src.read(e->src.arg, &counts) != 0) s->read_errors++;
+  else
+  {
+    long shaft = lround(counts * (double)e->src.usteps_per_count + e->zero);
+    long err = enc_wrap(shaft - abs);
+    long mag = err < 0 ? -err : err;
+    s->passes++;
+    s->err_last = err;
+    s->err_abs_sum += mag;
+    s->err_sq_sum += (double)err * err;
+    if (mag > s->err_max) s->err_max = mag;
+
+    done = 0;
+    if (mag > e->deadband && (status & dSPIN_STATUS_BUSY) && !(status & dSPIN_STATUS_HIZ))
+    {
+      dSPIN_SetParam(dSPIN_ABS_POS, (unsigned long)shaft & 0x3FFFFF);
+      // ABS_POS stays corrected either way: it's where the motor is.
+      dSPIN_GoTo((unsigned long)abs & 0x3FFFFF);
+      if (dSPIN_Limits_Last(NULL) != dSPIN_LIMIT_OK) s->refused++;
+      else
+      {
+        s->corrections++;
+        s->corrected_usteps += mag;
+        done = 1;
+      }
+    }
+    unsigned long long lat = enc_now() - t0;
+    s->lat_ns_sum += lat;
+    if (lat > s->lat_ns_max) s->lat_ns_max = lat;
+  }
+
+  dSPIN_Bus_End();
+  dSPIN_Bus_SetClass(cls);
+  dSPIN_Select(prev);
+  return done;
+}
+
+// Run a pass every period_us on the dSPIN_Now() clock for ms milliseconds
+//  (until dSPIN_Encoder_Stop() if ms is 0). A pass that starts a period or
+//  more late is counted and the schedule restarts from then, rather than
+//  bunching up the passes that were missed.
+void dSPIN_Encoder_Run(dSPIN_Encoder *e, unsigned long period_us, unsigned long ms)
+{
+  unsigned long long next = dSPIN_Now();
+  unsigned long long end = next + ms * 1000000ULL;
+  e->stop = 0;
+  while (!e->stop && (ms == 0 || next < end))
+  {
+    dSPIN_Encoder_Step(e);
+    next += period_us * 1000ULL;
+    unsigned long long now = dSPIN_Now();
+    if (now >= next + period_us * 1000ULL)
+    {
+      e->stats.late++;
+      next = now;
+    }
+    else if (now < next) dSPIN_SleepUntil(next);
+  }
+}
+
+// Make dSPIN_Encoder_Run() return after the pass it's on, from another thread.
+void dSPIN_Encoder_Stop(dSPIN_Encoder *e)
+{
+  e->stop = 1;
+}
+
+void dSPIN_Encoder_GetStats(const dSPIN_Encoder *e, dSPIN_EncoderStats *stats)
+{
+  *stats = e->stats;
+}
+
+void dSPIN_Encoder_ResetStats(dSPIN_Encoder *e)
+{
+  memset(&e->stats, 0, sizeof(e->stats));
+}
+
+// Does not close the source.
+void dSPIN_Encoder_Close(dSPIN_Encoder *e)
+{
+  free(e);
+}
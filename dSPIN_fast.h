@@ -0,0 +1,220 @@
+//dSPIN_fast.h - Compile-time specialized driver. dSPIN_Xfer() and friends
+//   look everything up at run time: the chip select in the axis table, the
+//   register's entry in dSPIN_Regs, and each pin change goes through a
+//   wiringPi call. For one chip whose wiring is known when the program is
+//   built, dSPIN_Fast<> takes the backend, the pins and the clock timing as
+//   template parameters, and the register entry is looked up when the
+//   template is instantiated, so a dSPIN_Fast<...>::get<dSPIN_ABS_POS>()
+//   compiles down to a straight run of pin writes with no branches on the
+//   register or the configuration.
+//
+// It talks the same frames as dSPIN_commands.c and, unless told otherwise,
+//  holds the bus with dSPIN_Bus_Begin()/dSPIN_Bus_End() for each one, so it
+//  can be mixed freely with the C-style API (dSPIN_init() still does the pin
+//  setup). Its motion commands are checked against the limits of the axis on
+//  its chip select, as dSPIN_Run() and the rest are (see dSPIN_limits.c).
+//  Nothing here is compiled unless it's used.
+#ifndef dSPIN_FAST_H
+#define dSPIN_FAST_H
+
+#include "dSPIN.h"
+#ifndef dSPIN_SIM
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/***************** register traits ***********************/
+
+// How a register goes over the wire, from its dSPIN_Regs entry: bits is its
+//  width and bytes the length of its frame. Values are encoded and decoded
+//  with dSPIN_RegEncode()/dSPIN_RegDecode(), as dSPIN_ParamHandler() does.
+template <byte Param>
+struct dSPIN_Reg
+{
+  static_assert(Param < dSPIN_REG_COUNT, "not a register");
+  enum
+  {
+    bits = dSPIN_Regs[Param].bits,
+    bytes = dSPIN_Regs[Param].bytes,
+    read_only = dSPIN_Regs[Param].access == dSPIN_REG_RO
+  };
+};
+
+/***************** backends ***********************/
+
+// Whatever dSPIN.h was built against: wiringPi, or the simulator.
+struct dSPIN_WiringPi
+{
+  static inline void write(int pin, int value) { digitalWrite(pin, value); }
+  static inline int read(int pin) { return digitalRead(pin); }
+  static inline void wait_us(unsigned int us) { delayMicroseconds(us); }
+};
+
+#ifndef dSPIN_SIM
+// The BCM283x GPIO registers mapped through /dev/gpiomem: a pin change is one
+//  store. Call open() once, after dSPIN_init() has set the pin modes.
+struct dSPIN_GpioMem
+{
+  static inline volatile unsigned int *&regs()
+  {
+    static volatile unsigned int *r = 0;
+    return r;
+  }
+  // Returns 0, or -1 if the registers can't be mapped.
+  static int open()
+  {
+    int fd = ::open("/dev/gpiomem", O_RDWR | O_SYNC);
+    if (fd < 0) return -1;
+    void *m = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    regs() = (volatile unsigned int *)m;
+    return 0;
+  }
+  // GPSET0/GPCLR0/GPLEV0 are words 7, 10 and 13.
+  static inline void write(int pin, int value)
+  {
+    regs()[(value ? 7 : 10) + pin / 32] = 1u << (pin % 32);
+  }
+  static inline int read(int pin) { return (regs()[13 + pin / 32] >> (pin % 32)) & 1; }
+  static inline void wait_us(unsigned int us) { delayMicroseconds(us); }
+};
+#endif
+
+/***************** pins and the driver ***********************/
+
+template <int CS, int CLK = dSPIN_CLK, int MOSI = dSPIN_MOSI, int MISO = dSPIN_MISO,
+          int BUSY = dSPIN_BUSYN>
+struct dSPIN_PinMap
+{
+  enum { cs = CS, clk = CLK, mosi = MOSI, miso = MISO, busy = BUSY };
+};
+
+typedef dSPIN_PinMap<dSPIN_CS> dSPIN_DefaultPins;
+
+// Backend is one of the structs above (or anything with the same three
+//  functions), Pins a dSPIN_PinMap<>, HalfUs the delay after each clock edge
+//  and GapUs the one after chip select goes back up, as in dSPIN_Xfer().
+//  With Locked false the bus isn't taken, for a program that only ever
+//  talks to the chip from one thread.
+template <class Backend, class Pins = dSPIN_DefaultPins,
+          unsigned int HalfUs = dSPIN_SPI_CLOCK_DELAY / 2,
+          unsigned int GapUs = dSPIN_SPI_CLOCK_DELAY, bool Locked = true>
+struct dSPIN_Fast
+{
+  static inline byte xfer(byte data)
+  {
+    Backend::write(Pins::cs, LOW);
+#pragma GCC unroll 8
+    for (int i = 0; i < 8; i++)
+    {
+      Backend::write(Pins::clk, LOW);
+      Backend::write(Pins::mosi, data & 0x80 ? HIGH : LOW);
+      if (HalfUs) Backend::wait_us(HalfUs);
+      data <<= 1;
+      if (Backend::read(Pins::miso)) data |= 1;
+      Backend::write(Pins::clk, HIGH);
+      if (HalfUs) Backend::wait_us(HalfUs);
+    }
+    Backend::write(Pins::cs, HIGH);
+    if (GapUs) Backend::wait_us(GapUs);
+    return data;
+  }
+
+  static inline void begin() { if (Locked) dSPIN_Bus_Begin(); }
+  static inline void end() { if (Locked) dSPIN_Bus_End(); }
+
+  // The value bytes of a register frame, MSB first.
+  template <byte Param>
+  static inline unsigned long value(unsigned long v)
+  {
+    constexpr const dSPIN_RegInfo &r = dSPIN_Regs[Param];
+    v = dSPIN_RegEncode(r, v);
+    unsigned long in = 0;
+#pragma GCC unroll 3
+    for (int k = dSPIN_Reg<Param>::bytes - 1; k >= 0; k--)
+      in = (in << 8) | xfer((byte)(v >> (8 * k)));
+    return dSPIN_RegDecode(r, in);
+  }
+
+  template <byte Param>
+  static inline unsigned long get()
+  {
+    begin();
+    xfer(dSPIN_GET_PARAM | Param);
+    unsigned long v = value<Param>(0);
+    end();
+    return v;
+  }
+
+  template <byte Param>
+  static inline void set(unsigned long v)
+  {
+    begin();
+    xfer(dSPIN_SET_PARAM | Param);
+    value<Param>(v);
+    end();
+  }
+
+  // A command with a 3-byte argument, clamped to max.
+  static inline void cmd3(byte cmd, unsigned long v, unsigned long max)
+  {
+    if (v > max) v = max;
+    begin();
+    xfer(cmd);
+    xfer((byte)(v >> 16));
+    xfer((byte)(v >> 8));
+    xfer((byte)v);
+    end();
+  }
+
+  static inline void cmd(byte c)
+  {
+    begin();
+    xfer(c);
+    end();
+  }
+
+  // A motion command, sent only if the limits let it: the check's reads go
+  //  through the C-style API, under the same hold as the frame.
+  static inline void motion(byte cmd, unsigned long v, unsigned long max)
+  {
+    begin();
+    int axis = dSPIN_Limits_Active() ? dSPIN_AxisOnPin(Pins::cs) : -1;
+    int ok = 1;
+    if (axis >= 0)
+    {
+      int prev = dSPIN_Selected();
+      dSPIN_Select(axis);
+      ok = dSPIN_Limits_Allow(cmd, v);
+      dSPIN_Select(prev);
+    }
+    if (ok) cmd3(cmd, v, max);
+    end();
+  }
+
+  static inline void run(byte dir, unsigned long spd) { motion(dSPIN_RUN | dir, spd, 0xFFFFF); }
+  static inline void move(byte dir, unsigned long n) { motion(dSPIN_MOVE | dir, n, 0x3FFFFF); }
+  static inline void go_to(unsigned long pos) { motion(dSPIN_GOTO, pos, 0x3FFFFF); }
+  static inline void soft_stop() { cmd(dSPIN_SOFT_STOP); }
+  static inline void hard_stop() { cmd(dSPIN_HARD_STOP); }
+
+  static inline int get_status()
+  {
+    begin();
+    xfer(dSPIN_GET_STATUS);
+    int s = xfer(0) << 8;
+    s |= xfer(0);
+    end();
+    return s;
+  }
+
+  static inline int busy()
+  {
+    if (Pins::busy != dSPIN_NO_PIN) return Backend::read(Pins::busy) == LOW;
+    return !(get<dSPIN_STATUS>() & dSPIN_STATUS_BUSY);
+  }
+};
+
+#endif
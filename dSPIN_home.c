@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dSPIN.h"
+
+//dSPIN_home.c - Homing engine. Homing an axis is a short chain of commands
+//   that each end when the chip stops on its own (GoUntil when the switch
+//   closes, ReleaseSW when it opens again, a back-off Move when it's done), so
+//   the engine starts every axis' first step back to back and then sleeps
+//   until a BUSYN line rises. Whichever axes are no longer busy get their next
+//   step, and the rest sleep on; a machine homes in the time of its slowest
+//   axis rather than the sum of them all.
+//
+// The BUSYN lines are armed with dSPIN_Edge_Arm(); an edge on any of them
+//  wakes the engine, which then reads the BUSYN lines of the axes in flight
+//  to find the one that finished. An axis without a BUSYN line (or whose
+//  interrupt can't be set up) is polled every dSPIN_HOME_POLL_US instead.
+//  STATUS is only read between steps, to check the switch and the alarms and
+//  to clear SW_EVN.
+
+// Alarms that end homing: STATUS bits that are active low.
+#define HOME_ALARMS (dSPIN_STATUS_UVLO | dSPIN_STATUS_TH_SD | dSPIN_STATUS_OCD | \
+                     dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B)
+
+// MIN_SPEED's low speed optimization bit, kept as it was across the release.
+#define HOME_LSPD_OPT 0x1000
+
+typedef struct
+{
+  int axis;
+  const dSPIN_HomeConfig *cfg;
+  dSPIN_HomeResult *res;
+  int step;                      // dSPIN_HOME_* step in progress
+  int active;
+  int irq;                       // BUSYN is armed
+  byte pin;
+  unsigned long min_speed;       // MIN_SPEED to put back after the release,
+  int min_saved;                 //  if it was changed
+  unsigned long long start_ns, deadline_ns, poll_ns;
+} HomeAxis;
+
+static void home_restore(HomeAxis *h)
+{
+  if (!h->min_saved) return;
+  dSPIN_SetParam(dSPIN_MIN_SPEED, h->min_speed);
+  h->min_saved = 0;
+}
+
+static void home_end(HomeAxis *h, int result, unsigned int status)
+{
+  if (result != dSPIN_HOME_OK && dSPIN_Busy()) dSPIN_HardStop();
+  home_restore(h);
+  h->active = 0;
+  h->res->result = result;
+  h->res->step = h->step;
+  h->res->status = status;
+  long pos = (long)dSPIN_GetParam(h->cfg->act == ACTION_COPY ? dSPIN_MARK : dSPIN_ABS_POS);
+  if (pos & 0x200000) pos -= 0x400000;
+  h->res->pos = pos;
+  h->res->ns = dSPIN_Now() - h->start_ns;
+}
+
+// Issue the first step from step on that the configuration asks for, or
+//  finish if there are none left. Returns 1 if a command went out.
+static int home_issue(HomeAxis *h, int step)
+{
+  const dSPIN_HomeConfig *c = h->cfg;
+  byte away = c->dir == FWD ? REV : FWD;
+  for (h->step = step; h->step < dSPIN_HOME_DONE; h->step++)
+  {
+    unsigned int st;
+    switch (h->step)
+    {
+      case dSPIN_HOME_SEEK:
+        if (c->seek_speed <= 0) break;
+        st = dSPIN_GetStatus();
+        // Already on the switch: GoUntil would wait for an edge that never
+        //  comes, so go straight to backing off.
+        if (st & dSPIN_STATUS_SW_F) break;
+        dSPIN_GoUntil(c->act, c->dir, SpdCalc(c->seek_speed));
+        return 1;
+      case dSPIN_HOME_BACKOFF:
+        if (c->backoff == 0) break;
+        dSPIN_Move(away, c->backoff);
+        return 1;
+      case dSPIN_HOME_SLOW:
+        if (c->slow_speed <= 0) break;
+        st = dSPIN_GetStatus();
+        if (st & dSPIN_STATUS_SW_F) { home_end(h, dSPIN_HOME_ON_SWITCH, st); return 0; }
+        dSPIN_GoUntil(c->act, c->dir, SpdCalc(c->slow_speed));
+        return 1;
+      case dSPIN_HOME_RELEASE:
+        if (c->release_speed <= 0) break;
+        st = dSPIN_GetStatus();
+        // ReleaseSW on an open switch acts at once, wherever the motor is.
+        if (!(st & dSPIN_STATUS_SW_F)) { home_end(h, dSPIN_HOME_NO_SWITCH, st); return 0; }
+        h->min_speed = dSPIN_GetParam(dSPIN_MIN_SPEED);
+        h->min_saved = 1;
+        dSPIN_SetParam(dSPIN_MIN_SPEED, (h->min_speed & HOME_LSPD_OPT) | MinSpdCalc(c->release_speed));
+        dSPIN_ReleaseSW(c->act, away);
+        return 1;
+    }
+  }
+  home_end(h, dSPIN_HOME_OK, dSPIN_GetStatus());
+  return 0;
+}
+
+// The step in progress has ended: check it, and go on to the next.
+static int home_next(HomeAxis *h)
+{
+  unsigned int st = dSPIN_GetStatus();
+  if ((~st & HOME_ALARMS) || (st & (dSPIN_STATUS_NOTPERF_CMD | dSPIN_STATUS_WRONG_CMD)))
+  {
+    home_end(h, dSPIN_HOME_ALARM, st);
+    return 0;
+  }
+  if ((h->step == dSPIN_HOME_SEEK || h->step == dSPIN_HOME_SLOW) && !(st & dSPIN_STATUS_SW_EVN))
+  {
+    home_end(h, dSPIN_HOME_NO_SWITCH, st);
+    return 0;
+  }
+  if (h->step == dSPIN_HOME_RELEASE) home_restore(h);
+  return home_issue(h, h->step + 1);
+}
+
+// Home n axes at once, axes[i] with cfg[i], and fill in res[i]. Returns the
+//  number of axes that failed.
+int dSPIN_Home(const int *axes, const dSPIN_HomeConfig *cfg, dSPIN_HomeResult *res, int n)
+{
+  int prev = dSPIN_Selected();
+  HomeAxis *ha = (HomeAxis *)calloc(n, sizeof(HomeAxis));
+  int active = 0, issued = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    HomeAxis *h = &ha[i];
+    h->axis = axes[i];
+    h->cfg = &cfg[i];
+    h->res = &res[i];
+    memset(h->res, 0, sizeof(*h->res));
+    h->active = 1;
+    dSPIN_Select(h->axis);
+    h->pin = dSPIN_BusyPin();
+    h->irq = dSPIN_Edge_Arm(h->pin);
+    h->start_ns = dSPIN_Now();
+    h->deadline_ns = cfg[i].timeout_ms ? h->start_ns + cfg[i].timeout_ms * 1000000ULL : ~0ULL;
+    h->poll_ns = h->start_ns;
+    issued |= home_issue(h, dSPIN_HOME_SEEK);
+    active += h->active;
+  }
+
+  while (active > 0)
+  {
+    unsigned long seen = dSPIN_Edge_Count();
+    unsigned long long now = dSPIN_Now();
+    // A step can be over before its BUSYN edge could be seen, so look at the
+    //  axes again straight after issuing anything.
+    if (!issued)
+    {
+      unsigned long long wake = now + 1000000000ULL;
+      for (int i = 0; i < n; i++)
+      {
+        HomeAxis *h = &ha[i];
+        if (!h->active) continue;
+        if (h->deadline_ns < wake) wake = h->deadline_ns;
+        if (!h->irq && h->poll_ns < wake) wake = h->poll_ns;
+      }
+      dSPIN_Edge_Wait(seen, wake);
+      now = dSPIN_Now();
+    }
+    issued = 0;
+    active = 0;
+    for (int i = 0; i < n; i++)
+    {
+      HomeAxis *h = &ha[i];
+      if (!h->active) continue;
+      dSPIN_Select(h->axis);
+      int busy;
+      if (h->irq) busy = digitalRead(h->pin) == LOW;
+      else if (now < h->poll_ns) busy = 1;
+      else
+      {
+        busy = dSPIN_Busy();
+        h->poll_ns = now + dSPIN_HOME_POLL_US * 1000ULL;
+      }
+      if (!busy) issued |= home_next(h);
+      else if (now >= h->deadline_ns) home_end(h, dSPIN_HOME_TIMEOUT, dSPIN_GetStatus());
+      active += h->active;
+    }
+  }
+
+  int failed = 0;
+  for (int i = 0; i < n; i++) failed += res[i].result != dSPIN_HOME_OK;
+  free(ha);
+  dSPIN_Select(prev);
+  return failed;
+}
@@ -0,0 +1,298 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dSPIN.h"
+
+//dSPIN_journal.c - Position journal. The chips keep counting steps whatever
+//   happens to the process driving them, so after a crash or an upgrade the
+//   only thing lost is the knowledge of whether ABS_POS can be trusted; the
+//   safe answer without it is to home again. The journal is a small file,
+//   mapped into memory, holding for each axis what that answer depends on:
+//   that it was homed (and how many times), the configuration it was homed
+//   with, where it was last seen and where it was last sent, and whether
+//   its supply has dropped since.
+//
+// Each axis has two record slots. An update fills in whichever slot doesn't
+//  hold the latest record, with the next sequence number and a checksum over
+//  the lot, so a process killed mid-update (or a torn page) leaves the
+//  previous record intact: a reader takes the valid slot with the highest
+//  sequence number. An update is a few stores into the page cache, with no
+//  system call and no bus traffic; dSPIN_Journal_Sync() flushes it to disk
+//  for when the host itself might lose power.
+//
+// On restart dSPIN_Journal_Check() holds the record against the chip: no
+//  undervoltage or step loss latched in STATUS, the registers hashing the
+//  same, and ABS_POS and MARK where they were left (or at the target of the
+//  move that was running). Only then is homing skipped.
+
+#define JOURNAL_MAGIC   0x644A726EU
+#define JOURNAL_VERSION 1
+
+typedef struct
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned int axes;
+  unsigned int slot_size;
+} JournalHeader;
+
+typedef struct
+{
+  unsigned int seq;
+  unsigned int epoch;
+  unsigned int flags;
+  unsigned int config_hash;
+  int abs_pos, mark, target;
+  unsigned int status;
+  unsigned long long wall_ns;
+  unsigned int sum;              // over everything above
+  unsigned int pad;
+} JournalSlot;
+
+struct dSPIN_Journal
+{
+  int fd;
+  size_t size;
+  JournalHeader *hdr;
+  JournalSlot *slot;             // axes * 2
+  int axes;
+  unsigned int *seq;             // latest per axis, 0 if none
+};
+
+// FNV-1a over the slot up to its checksum.
+static unsigned int journal_sum(const JournalSlot *s)
+{
+  const unsigned char *b = (const unsigned char *)s;
+  unsigned int h = 2166136261U;
+  for (size_t i = 0; i < offsetof(JournalSlot, sum); i++) h = (h ^ b[i]) * 16777619U;
+  return h;
+}
+
+// The latest valid slot of an axis, or NULL.
+static const JournalSlot *journal_latest(const dSPIN_Journal *j, int axis)
+{
+  const JournalSlot *best = NULL;
+  for (int k = 0; k < 2; k++)
+  {
+    const JournalSlot *s = &j->slot[axis * 2 + k];
+    if (s->seq == 0 || s->sum != journal_sum(s)) continue;
+    if (best == NULL || (int)(s->seq - best->seq) > 0) best = s;
+  }
+  return best;
+}
+
+static int journal_sext(unsigned long v)
+{
+  long p = (long)(v & 0x3FFFFF);
+  if (p & 0x200000) p -= 0x400000;
+  return (int)p;
+}
+
+// Write rec as the axis' next record.
+static void journal_put(dSPIN_Journal *j, int axis, const dSPIN_JournalRec *rec)
+{
+  unsigned int seq = j->seq[axis] + 1;
+  if (seq == 0) seq = 1;
+  JournalSlot s;
+  memset(&s, 0, sizeof(s));
+  s.seq = seq;
+  s.epoch = rec->epoch;
+  s.flags = rec->flags;
+  s.config_hash = rec->config_hash;
+  s.abs_pos = (int)rec->abs_pos;
+  s.mark = (int)rec->mark;
+  s.target = (int)rec->target;
+  s.status = rec->status;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s.wall_ns = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  s.sum = journal_sum(&s);
+  j->slot[axis * 2 + (seq & 1)] = s;
+  j->seq[axis] = seq;
+}
+
+// Open the journal at path for axes axes, creating it if it isn't there. A
+//  journal written for a different number of axes is started afresh, which
+//  costs every axis a homing. Returns NULL if the file can't be mapped.
+dSPIN_Journal *dSPIN_Journal_Open(const char *path, int axes)
+{
+  if (axes < 1) return NULL;
+  dSPIN_Journal *j = (dSPIN_Journal *)calloc(1, sizeof(*j));
+  if (j == NULL) return NULL;
+  j->axes = axes;
+  j->seq = (unsigned int *)calloc(axes, sizeof(unsigned int));
+  j->size = sizeof(JournalHeader) + axes * 2 * sizeof(JournalSlot);
+  j->fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat sb;
+  if (j->seq == NULL || j->fd < 0 || fstat(j->fd, &sb) != 0)
+  {
+    dSPIN_Journal_Close(j);
+    return NULL;
+  }
+  if ((size_t)sb.st_size != j->size && ftruncate(j->fd, 0) != 0) j->size = 0;
+  if (j->size == 0 || ftruncate(j->fd, j->size) != 0)
+  {
+    dSPIN_Journal_Close(j);
+    return NULL;
+  }
+  void *m = mmap(NULL, j->size, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+  if (m == MAP_FAILED)
+  {
+    dSPIN_Journal_Close(j);
+    return NULL;
+  }
+  j->hdr = (JournalHeader *)m;
+  j->slot = (JournalSlot *)(j->hdr + 1);
+  if (j->hdr->magic != JOURNAL_MAGIC || j->hdr->version != JOURNAL_VERSION ||
+      j->hdr->axes != (unsigned int)axes || j->hdr->slot_size != sizeof(JournalSlot))
+  {
+    memset(m, 0, j->size);
+    j->hdr->version = JOURNAL_VERSION;
+    j->hdr->axes = axes;
+    j->hdr->slot_size = sizeof(JournalSlot);
+    j->hdr->magic = JOURNAL_MAGIC;
+  }
+  for (int a = 0; a < axes; a++)
+  {
+    const JournalSlot *s = journal_latest(j, a);
+    j->seq[a] = s ? s->seq : 0;
+  }
+  return j;
+}
+
+// The latest record of an axis. Returns 0 if it has none.
+int dSPIN_Journal_Read(const dSPIN_Journal *j, int axis, dSPIN_JournalRec *rec)
+{
+  memset(rec, 0, sizeof(*rec));
+  if (axis < 0 || axis >= j->axes) return 0;
+  const JournalSlot *s = journal_latest(j, axis);
+  if (s == NULL) return 0;
+  rec->seq = s->seq;
+  rec->epoch = s->epoch;
+  rec->flags = s->flags;
+  rec->config_hash = s->config_hash;
+  rec->abs_pos = s->abs_pos;
+  rec->mark = s->mark;
+  rec->target = s->target;
+  rec->status = s->status;
+  rec->wall_ns = s->wall_ns;
+  return 1;
+}
+
+// The axis has just been homed with a configuration hashing to config_hash
+//  (dSPIN_Profile_Hash()): start a new homing epoch from where it is now.
+//  Reads ABS_POS, MARK and STATUS from the axis.
+void dSPIN_Journal_Homed(dSPIN_Journal *j, int axis, unsigned long config_hash)
+{
+  if (axis < 0 || axis >= j->axes) return;
+  dSPIN_JournalRec rec;
+  dSPIN_Journal_Read(j, axis, &rec);
+  int prev = dSPIN_Selected();
+  dSPIN_Select(axis);
+  rec.status = dSPIN_GetStatus();
+  rec.abs_pos = journal_sext(dSPIN_GetParam(dSPIN_ABS_POS));
+  rec.mark = journal_sext(dSPIN_GetParam(dSPIN_MARK));
+  dSPIN_Select(prev);
+  rec.epoch++;
+  rec.flags = dSPIN_JOURNAL_HOMED;
+  rec.config_hash = (unsigned int)config_hash;
+  rec.target = rec.abs_pos;
+  journal_put(j, axis, &rec);
+}
+
+// A positioning command (GoTo, Move, GoHome, GoMark) ending at ABS_POS target
+//  is about to go out. No bus traffic.
+void dSPIN_Journal_Moving(dSPIN_Journal *j, int axis, long target)
+{
+  if (axis < 0 || axis >= j->axes) return;
+  dSPIN_JournalRec rec;
+  if (!dSPIN_Journal_Read(j, axis, &rec)) return;
+  rec.flags |= dSPIN_JOURNAL_MOVING;
+  rec.target = journal_sext((unsigned long)target);
+  journal_put(j, axis, &rec);
+}
+
+// Something else is about to move the axis (Run, GoUntil, step clock) or set
+//  its position, so where it ends up can't be known ahead. No bus traffic.
+void dSPIN_Journal_Free(dSPIN_Journal *j, int axis)
+{
+  if (axis < 0 || axis >= j->axes) return;
+  dSPIN_JournalRec rec;
+  if (!dSPIN_Journal_Read(j, axis, &rec)) return;
+  rec.flags |= dSPIN_JOURNAL_MOVING | dSPIN_JOURNAL_UNKNOWN;
+  journal_put(j, axis, &rec);
+}
+
+// Record what a status poll found: STATUS as dSPIN_GetStatus() returned it
+//  (which clears the latched flags, so they have to be caught here), ABS_POS
+//  and MARK. An undervoltage or step loss ends the homing epoch; an idle axis
+//  is no longer moving. No bus traffic.
+void dSPIN_Journal_Note(dSPIN_Journal *j, int axis, unsigned int status, long abs_pos, long mark)
+{
+  if (axis < 0 || axis >= j->axes) return;
+  dSPIN_JournalRec rec;
+  if (!dSPIN_Journal_Read(j, axis, &rec)) return;
+  if (~status & (dSPIN_STATUS_UVLO | dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B |
+                 dSPIN_STATUS_OCD | dSPIN_STATUS_TH_SD))
+    rec.flags &= ~dSPIN_JOURNAL_HOMED;
+  if (status & dSPIN_STATUS_BUSY) rec.flags &= ~(dSPIN_JOURNAL_MOVING | dSPIN_JOURNAL_UNKNOWN);
+  rec.status = status;
+  rec.abs_pos = journal_sext((unsigned long)abs_pos);
+  rec.mark = journal_sext((unsigned long)mark);
+  journal_put(j, axis, &rec);
+}
+
+// After a restart, before anything else talks to the axis: can its position
+//  be trusted without homing? Reads STATUS without clearing it, ABS_POS, MARK
+//  and the configuration registers. Returns dSPIN_JOURNAL_OK if so (and then
+//  notes the axis as found), and otherwise the first reason why not.
+int dSPIN_Journal_Check(dSPIN_Journal *j, int axis)
+{
+  dSPIN_JournalRec rec;
+  if (!dSPIN_Journal_Read(j, axis, &rec) || !(rec.flags & dSPIN_JOURNAL_HOMED))
+    return dSPIN_JOURNAL_NO_RECORD;
+
+  int prev = dSPIN_Selected();
+  dSPIN_Select(axis);
+  unsigned int status = dSPIN_GetParam(dSPIN_STATUS);
+  dSPIN_Profile live;
+  dSPIN_Profile_Read(&live);
+  int abs_pos = journal_sext(dSPIN_GetParam(dSPIN_ABS_POS));
+  int mark = journal_sext(dSPIN_GetParam(dSPIN_MARK));
+  dSPIN_Select(prev);
+
+  int result = dSPIN_JOURNAL_OK;
+  if (~status & dSPIN_STATUS_UVLO) result = dSPIN_JOURNAL_POWER;
+  else if (~status & (dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B | dSPIN_STATUS_OCD |
+                      dSPIN_STATUS_TH_SD))
+    result = dSPIN_JOURNAL_ALARM;
+  else if (dSPIN_Profile_Hash(&live) != rec.config_hash) result = dSPIN_JOURNAL_CONFIG;
+  else if (rec.flags & dSPIN_JOURNAL_UNKNOWN) result = dSPIN_JOURNAL_POSITION;
+  else if (!(status & dSPIN_STATUS_BUSY)) result = dSPIN_JOURNAL_MOVING_NOW;
+  else if (mark != rec.mark) result = dSPIN_JOURNAL_POSITION;
+  else if (abs_pos != (rec.flags & dSPIN_JOURNAL_MOVING ? rec.target : rec.abs_pos))
+    result = dSPIN_JOURNAL_POSITION;
+  if (result == dSPIN_JOURNAL_OK) dSPIN_Journal_Note(j, axis, status, abs_pos, mark);
+  return result;
+}
+
+// Flush the journal to disk. Only needed if the host can lose power while the
+//  chips keep theirs; a crashed process leaves its updates in the page cache.
+void dSPIN_Journal_Sync(dSPIN_Journal *j)
+{
+  if (j->hdr) msync(j->hdr, j->size, MS_SYNC);
+}
+
+void dSPIN_Journal_Close(dSPIN_Journal *j)
+{
+  if (j == NULL) return;
+  if (j->hdr) munmap(j->hdr, j->size);
+  if (j->fd >= 0) close(j->fd);
+  free(j->seq);
+  free(j);
+}
@@ -0,0 +1,608 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dSPIN.h"
+
+//dSPIN_limits.c - Soft limits and keep-out zones. Once an axis has limits,
+//   every Run, Move, GoTo, GoTo_DIR, GoHome and GoMark sent to it through
+//   the functions in dSPIN_commands.c, a compiled program (dSPIN_bytecode.c)
+//   or dSPIN_Fast<> is checked before it goes out: the path from where the
+//   motor is to where the command ends must not leave the axis' range or
+//   enter any of its zones. A command that would is dropped, and
+//   dSPIN_Limits_Last() says why. GoUntil and ReleaseSW are left alone, since
+//   homing has to be free to look for its switch; so are frames put together
+//   by hand with dSPIN_Xfer().
+//
+// An axis' zones are kept sorted. Those that always apply are merged into
+//  disjoint intervals, so whether a path enters one is a binary search. A
+//  zone coupled to another axis only applies while that axis may be inside a
+//  given interval; those are sorted by their low end, with the highest high
+//  end so far alongside, so a search only visits the ones that overlap the
+//  path. Where another axis may be is kept up to date from the commands sent
+//  to it and from dSPIN_Limits_Poll().
+//
+// A motor can't stop on the spot. A command sent while it's moving is
+//  checked over the stopping distance from its present SPEED as well, worked
+//  out from DEC the way the chip brakes. Run has no end to check, so it's
+//  only sent if there's room to stop before the nearest limit; after that
+//  dSPIN_Limits_Poll(), called every period, sends a SoftStop once the
+//  motor is within a stopping distance (plus a period's travel) of it.
+//
+// Checking costs three reads (four for GoMark) on axes with limits or with
+//  zones coupled to them, and nothing at all anywhere else.
+
+#define LIM_MIN (-0x200000L)         // ABS_POS range
+#define LIM_MAX 0x1FFFFFL
+
+#define LIM_IDLE   0
+#define LIM_MOVING 1                 // positioning or stopping
+#define LIM_RUN    2
+
+typedef struct
+{
+  long lo, hi;
+  int id;
+} LimZone;
+
+typedef struct
+{
+  int on;                        // has limits of its own
+  int tracked;                   //  or other axes' zones are coupled to it
+  long min, max;                 // soft range
+  LimZone *fixed;                // disjoint, in order
+  int n_fixed;
+  dSPIN_Zone *coupled;           // by lo
+  long *reach;                   // reach[i]: highest hi in coupled[0..i]
+  int n_coupled;
+  unsigned long dec;             // what stopping distances are worked out from
+  int ms;                        // microsteps per step
+  float osc;                     // dSPIN_Osc(), for travel over host time
+
+  int mode;                      // LIM_IDLE etc.: what it was last sent
+  byte dir;                      // for a Run, its direction
+  unsigned long spd;             //  and target speed
+  long span_lo, span_hi;         // where it may be until it's next seen idle
+} LimAxis;
+
+static LimAxis lim_ax[dSPIN_MAX_AXES];
+static int lim_any = 0;
+static unsigned long lim_period_us = dSPIN_LIMITS_PERIOD_US;
+static dSPIN_LimitStats lim_stats;
+static pthread_mutex_t lim_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int lim_last = dSPIN_LIMIT_OK;
+static __thread int lim_last_id = -1;
+
+static long lim_sext(unsigned long v)
+{
+  long p = (long)(v & 0x3FFFFF);
+  if (p & 0x200000) p -= 0x400000;
+  return p;
+}
+
+static long lim_wrap(long d)
+{
+  return lim_sext((unsigned long)d);
+}
+
+/***************** stopping distances ***********************/
+
+// Microsteps to stop from SPEED register value speed. SPEED is steps/tick in
+//  units of 2^-28, DEC steps/tick/tick in units of 2^-40; the tick's length
+//  cancels out.
+static long lim_stop_dist(const LimAxis *a, unsigned long speed)
+{
+  if (speed == 0) return 0;
+  long double v = (long double)speed * 4096;
+  long double d = a->dec ? a->dec : 1;
+  return (long)(v * v / (2 * d) / 1099511627776.0L * a->ms) + 1;
+}
+
+// Microsteps covered at speed in us microseconds of host time, on the axis'
+//  own oscillator.
+static long lim_travel(const LimAxis *a, unsigned long speed, unsigned long us)
+{
+  return (long)((long double)speed / 268435456.0L * (us * 1000.0L / dSPIN_TICK_NS * a->osc) * a->ms) + 1;
+}
+
+// How close to a limit a motor at speed may get before it has to be stopped:
+//  its stopping distance, plus what it covers until the next poll can look.
+static long lim_need(const LimAxis *a, unsigned long speed)
+{
+  return lim_stop_dist(a, speed) + lim_travel(a, speed, lim_period_us + dSPIN_LIMITS_SLACK_US);
+}
+
+/***************** the index ***********************/
+
+// First fixed zone whose high end is at or above x.
+static int lim_fixed_from(const LimAxis *a, long x)
+{
+  int lo = 0, hi = a->n_fixed;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (a->fixed[mid].hi < x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// First coupled zone whose low end is above x.
+static int lim_coupled_after(const LimAxis *a, long x)
+{
+  int lo = 0, hi = a->n_coupled;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (a->coupled[mid].lo <= x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// A coupled zone applies while the other axis may be inside its interval.
+static int lim_active(const dSPIN_Zone *z)
+{
+  const LimAxis *b = &lim_ax[z->other];
+  return b->span_hi >= z->other_lo && b->span_lo <= z->other_hi;
+}
+
+// Check the path from from (where the motor is, so not itself checked) to to,
+//  both within the ABS_POS range. A zone the motor is already in doesn't
+//  stop it moving, so it can be driven out.
+static int lim_leg(const LimAxis *a, long from, long to, int *id)
+{
+  if (to == from) return dSPIN_LIMIT_OK;
+  int fwd = to > from;
+  long lo = fwd ? from + 1 : to, hi = fwd ? to : from - 1;
+
+  *id = -1;
+  if (fwd ? (to > a->max && from <= a->max) : (to < a->min && from >= a->min))
+    return dSPIN_LIMIT_RANGE;
+
+  // The first zone reaching into the path, unless it's the one we're in.
+  int i = lim_fixed_from(a, lo);
+  if (i < a->n_fixed && a->fixed[i].lo <= from && a->fixed[i].hi >= from) i += fwd ? 1 : a->n_fixed;
+  if (i < a->n_fixed && a->fixed[i].lo <= hi)
+  {
+    *id = a->fixed[i].id;
+    return dSPIN_LIMIT_ZONE;
+  }
+
+  for (int j = lim_coupled_after(a, hi) - 1; j >= 0 && a->reach[j] >= lo; j--)
+  {
+    const dSPIN_Zone *z = &a->coupled[j];
+    if (z->hi < lo || (z->lo <= from && z->hi >= from)) continue;
+    if (lim_active(z))
+    {
+      *id = z->id;
+      return dSPIN_LIMIT_COUPLED;
+    }
+  }
+  return dSPIN_LIMIT_OK;
+}
+
+// The same for a path that may run past the end of ABS_POS and carry on from
+//  the other end.
+static int lim_path(const LimAxis *a, long from, long to, int *id)
+{
+  if (to > LIM_MAX)
+  {
+    int r = lim_leg(a, from, LIM_MAX, id);
+    return r != dSPIN_LIMIT_OK ? r : lim_leg(a, LIM_MIN - 1, to - 0x400000, id);
+  }
+  if (to < LIM_MIN)
+  {
+    int r = lim_leg(a, from, LIM_MIN, id);
+    return r != dSPIN_LIMIT_OK ? r : lim_leg(a, LIM_MAX + 1, to + 0x400000, id);
+  }
+  return lim_leg(a, from, to, id);
+}
+
+// Microsteps from from to the first one dir may not enter, LONG_MAX if none;
+//  the zone it belongs to in *id. Looks once round the end of ABS_POS.
+static long lim_room(const LimAxis *a, long from, byte dir, int *id, int wrapped)
+{
+  long best = LONG_MAX;
+  *id = -1;
+  if (dir == FWD)
+  {
+    if (a->max < LIM_MAX && from <= a->max) best = a->max + 1 - from;
+    int i = lim_fixed_from(a, from + 1);
+    if (i < a->n_fixed && a->fixed[i].lo <= from) i++;
+    if (i < a->n_fixed && a->fixed[i].lo - from < best)
+    {
+      best = a->fixed[i].lo - from;
+      *id = a->fixed[i].id;
+    }
+    for (int j = lim_coupled_after(a, from); j < a->n_coupled; j++)
+    {
+      if (a->coupled[j].lo - from >= best) break;
+      if (lim_active(&a->coupled[j]))
+      {
+        best = a->coupled[j].lo - from;
+        *id = a->coupled[j].id;
+        break;
+      }
+    }
+    if (best == LONG_MAX && !wrapped)
+    {
+      long more = lim_room(a, LIM_MIN - 1, FWD, id, 1);
+      if (more != LONG_MAX) best = LIM_MAX - from + more;
+    }
+  }
+  else
+  {
+    if (a->min > LIM_MIN && from >= a->min) best = from - (a->min - 1);
+    int i = lim_fixed_from(a, from);
+    if (i > 0 && from - a->fixed[i - 1].hi < best)
+    {
+      best = from - a->fixed[i - 1].hi;
+      *id = a->fixed[i - 1].id;
+    }
+    for (int j = lim_coupled_after(a, from - 1) - 1; j >= 0 && from - a->reach[j] < best; j--)
+    {
+      const dSPIN_Zone *z = &a->coupled[j];
+      if (z->hi < from && from - z->hi < best && lim_active(z))
+      {
+        best = from - z->hi;
+        *id = z->id;
+      }
+    }
+    if (best == LONG_MAX && !wrapped)
+    {
+      long more = lim_room(a, LIM_MAX + 1, REV, id, 1);
+      if (more != LONG_MAX) best = from - LIM_MIN + more;
+    }
+  }
+  return best;
+}
+
+static int lim_zone_cmp(const void *x, const void *y)
+{
+  long a = ((const dSPIN_Zone *)x)->lo, b = ((const dSPIN_Zone *)y)->lo;
+  return a < b ? -1 : a > b;
+}
+
+/***************** setting up ***********************/
+
+// Read what stopping distances and spans depend on for axis.
+static void lim_read(int axis, unsigned long *dec, int *ms, float *osc, long *pos, int *busy)
+{
+  int prev = dSPIN_Selected();
+  dSPIN_Select(axis);
+  *osc = dSPIN_Osc();
+  *dec = dSPIN_GetParam(dSPIN_DEC);
+  *ms = 1 << (dSPIN_GetParam(dSPIN_STEP_MODE) & dSPIN_STEP_MODE_STEP_SEL);
+  *busy = !(dSPIN_GetParam(dSPIN_STATUS) & dSPIN_STATUS_BUSY);
+  *pos = lim_sext(dSPIN_GetParam(dSPIN_ABS_POS));
+  dSPIN_Select(prev);
+}
+
+// Re-read axis' DEC and STEP_MODE, which stopping distances are worked out
+//  from, its oscillator and where it is. Setting limits does this; do it
+//  again after changing either register or calling dSPIN_SetOsc().
+void dSPIN_Limits_Refresh(int axis)
+{
+  if (axis < 0 || axis >= dSPIN_Axes()) return;
+  unsigned long dec;
+  int ms, busy;
+  float osc;
+  long pos;
+  lim_read(axis, &dec, &ms, &osc, &pos, &busy);
+
+  pthread_mutex_lock(&lim_lock);
+  LimAxis *a = &lim_ax[axis];
+  if (!a->on && !a->tracked)
+  {
+    a->min = LIM_MIN;
+    a->max = LIM_MAX;
+  }
+  a->dec = dec;
+  a->ms = ms;
+  a->osc = osc;
+  a->mode = busy ? LIM_MOVING : LIM_IDLE;
+  a->span_lo = busy ? LIM_MIN : pos;
+  a->span_hi = busy ? LIM_MAX : pos;
+  // Read without the lock by the command hook, so set last.
+  __atomic_store_n(&a->tracked, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&lim_any, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lim_lock);
+}
+
+// Give axis the n keep-out zones in zones[], replacing any it had. The array
+//  is copied. Returns 0, or -1 if axis doesn't exist or there's no memory.
+int dSPIN_Limits_Set(int axis, const dSPIN_Zone *zones, int n)
+{
+  if (axis < 0 || axis >= dSPIN_Axes() || n < 0) return -1;
+  dSPIN_Zone *sorted = (dSPIN_Zone *)malloc((n ? n : 1) * sizeof(dSPIN_Zone));
+  LimZone *fixed = (LimZone *)malloc((n ? n : 1) * sizeof(LimZone));
+  dSPIN_Zone *coupled = (dSPIN_Zone *)malloc((n ? n : 1) * sizeof(dSPIN_Zone));
+  long *reach = (long *)malloc((n ? n : 1) * sizeof(long));
+  if (sorted == NULL || fixed == NULL || coupled == NULL || reach == NULL)
+  {
+    free(sorted);
+    free(fixed);
+    free(coupled);
+    free(reach);
+    return -1;
+  }
+  memcpy(sorted, zones, n * sizeof(dSPIN_Zone));
+  qsort(sorted, n, sizeof(dSPIN_Zone), lim_zone_cmp);
+
+  // Fixed zones that overlap or touch become one, under the first one's id.
+  int n_fixed = 0, n_coupled = 0;
+  for (int i = 0; i < n; i++)
+  {
+    const dSPIN_Zone *z = &sorted[i];
+    if (z->hi < z->lo) continue;
+    if (z->other >= 0 && z->other < dSPIN_Axes())
+    {
+      coupled[n_coupled] = *z;
+      reach[n_coupled] = n_coupled && reach[n_coupled - 1] > z->hi ? reach[n_coupled - 1] : z->hi;
+      n_coupled++;
+    }
+    else if (n_fixed && z->lo <= fixed[n_fixed - 1].hi + 1)
+    {
+      if (z->hi > fixed[n_fixed - 1].hi) fixed[n_fixed - 1].hi = z->hi;
+    }
+    else
+    {
+      fixed[n_fixed].lo = z->lo;
+      fixed[n_fixed].hi = z->hi;
+      fixed[n_fixed].id = z->id;
+      n_fixed++;
+    }
+  }
+  free(sorted);
+
+  // Whatever the coupled zones hang on has to be followed too.
+  for (int i = 0; i < n_coupled; i++)
+    if (!__atomic_load_n(&lim_ax[coupled[i].other].tracked, __ATOMIC_ACQUIRE)) dSPIN_Limits_Refresh(coupled[i].other);
+  dSPIN_Limits_Refresh(axis);
+
+  pthread_mutex_lock(&lim_lock);
+  LimAxis *a = &lim_ax[axis];
+  LimZone *old_fixed = a->fixed;
+  dSPIN_Zone *old_coupled = a->coupled;
+  long *old_reach = a->reach;
+  a->fixed = fixed;
+  a->n_fixed = n_fixed;
+  a->coupled = coupled;
+  a->reach = reach;
+  a->n_coupled = n_coupled;
+  a->on = 1;
+  pthread_mutex_unlock(&lim_lock);
+  free(old_fixed);
+  free(old_coupled);
+  free(old_reach);
+  return 0;
+}
+
+// Keep axis between ABS_POS lo and hi inclusive.
+void dSPIN_Limits_Range(int axis, long lo, long hi)
+{
+  if (axis < 0 || axis >= dSPIN_Axes()) return;
+  dSPIN_Limits_Refresh(axis);
+  pthread_mutex_lock(&lim_lock);
+  lim_ax[axis].min = lo;
+  lim_ax[axis].max = hi;
+  lim_ax[axis].on = 1;
+  pthread_mutex_unlock(&lim_lock);
+}
+
+// Take axis' range and zones away. Zones on other axes coupled to it still
+//  follow where it goes.
+void dSPIN_Limits_Clear(int axis)
+{
+  if (axis < 0 || axis >= dSPIN_Axes()) return;
+  pthread_mutex_lock(&lim_lock);
+  LimAxis *a = &lim_ax[axis];
+  free(a->fixed);
+  free(a->coupled);
+  free(a->reach);
+  a->fixed = NULL;
+  a->coupled = NULL;
+  a->reach = NULL;
+  a->n_fixed = a->n_coupled = 0;
+  a->min = LIM_MIN;
+  a->max = LIM_MAX;
+  a->on = 0;
+  pthread_mutex_unlock(&lim_lock);
+}
+
+// Check a path on axis from ABS_POS from to to (unwrapped: past the end of
+//  ABS_POS carries on from the other end) against its limits, with no bus
+//  traffic. Returns dSPIN_LIMIT_OK, or why not, with the zone's id in *id
+//  (-1 for the range).
+int dSPIN_Limits_Check(int axis, long from, long to, int *id)
+{
+  int dummy;
+  if (id == NULL) id = &dummy;
+  *id = -1;
+  if (axis < 0 || axis >= dSPIN_Axes()) return dSPIN_LIMIT_OK;
+  pthread_mutex_lock(&lim_lock);
+  int r = lim_ax[axis].on ? lim_path(&lim_ax[axis], from, to, id) : dSPIN_LIMIT_OK;
+  pthread_mutex_unlock(&lim_lock);
+  return r;
+}
+
+/***************** the command hook ***********************/
+
+// Called by the motion commands with their opcode (direction included) and
+//  argument, on the selected axis, holding the bus until the command is sent
+//  so nothing can move the axis in between. Non-zero lets the command go out.
+int dSPIN_Limits_Allow(byte op, unsigned long arg)
+{
+  lim_last = dSPIN_LIMIT_OK;
+  lim_last_id = -1;
+  if (!__atomic_load_n(&lim_any, __ATOMIC_ACQUIRE)) return 1;
+  LimAxis *a = &lim_ax[dSPIN_Selected()];
+  if (!__atomic_load_n(&a->tracked, __ATOMIC_ACQUIRE)) return 1;
+
+  unsigned long status = dSPIN_GetParam(dSPIN_STATUS);
+  unsigned long speed = dSPIN_GetParam(dSPIN_SPEED);
+  long pos = lim_sext(dSPIN_GetParam(dSPIN_ABS_POS));
+  byte cur = (status & dSPIN_STATUS_DIR) ? FWD : REV;
+  byte dir = op & 0x01;
+  long to = pos;
+  switch (op & 0xFE)
+  {
+    case dSPIN_MOVE:
+      if (arg > 0x3FFFFF) arg = 0x3FFFFF;
+      to = dir == FWD ? pos + (long)arg : pos - (long)arg;
+      break;
+    case dSPIN_GOTO:
+      to = pos + lim_wrap(lim_sext(arg) - pos);
+      break;
+    case dSPIN_GO_HOME:
+      to = pos + lim_wrap(-pos);
+      break;
+    case dSPIN_GO_MARK:
+      to = pos + lim_wrap(lim_sext(dSPIN_GetParam(dSPIN_MARK)) - pos);
+      break;
+    case dSPIN_GOTO_DIR:
+      if (dir == FWD) to = pos + (long)((lim_sext(arg) - pos) & 0x3FFFFF);
+      else to = pos - (long)((pos - lim_sext(arg)) & 0x3FFFFF);
+      break;
+  }
+  int run = (op & 0xFE) == dSPIN_RUN;
+
+  pthread_mutex_lock(&lim_lock);
+  int r = dSPIN_LIMIT_OK, id = -1;
+  // Wherever it's sent, it brakes from its present speed first.
+  long stop = lim_stop_dist(a, speed);
+  long coast = cur == FWD ? pos + stop : pos - stop;
+  long room = LONG_MAX;
+  if (a->on)
+  {
+    lim_stats.checks++;
+    r = lim_path(a, pos, coast, &id);
+    if (r == dSPIN_LIMIT_OK && run)
+    {
+      room = lim_room(a, pos, dir, &id, 0);
+      if (room <= lim_need(a, arg > speed || cur != dir ? arg : speed)) r = dSPIN_LIMIT_ROOM;
+    }
+    else if (r == dSPIN_LIMIT_OK) r = lim_path(a, pos, to, &id);
+    if (r != dSPIN_LIMIT_OK) lim_stats.refused++;
+    else id = -1;
+  }
+  if (r == dSPIN_LIMIT_OK)
+  {
+    // Where it may be until it's seen to stop.
+    if (run)
+    {
+      to = room == LONG_MAX ? (dir == FWD ? LIM_MAX + 1 : LIM_MIN - 1) : dir == FWD ? pos + room : pos - room;
+      a->dir = dir;
+      a->spd = arg;
+    }
+    long lo = pos, hi = pos;
+    if (coast < lo) lo = coast;
+    if (coast > hi) hi = coast;
+    if (to < lo) lo = to;
+    if (to > hi) hi = to;
+    a->span_lo = lo < LIM_MIN || hi > LIM_MAX ? LIM_MIN : lo;
+    a->span_hi = lo < LIM_MIN || hi > LIM_MAX ? LIM_MAX : hi;
+    a->mode = run ? LIM_RUN : LIM_MOVING;
+  }
+  pthread_mutex_unlock(&lim_lock);
+
+  lim_last = r;
+  lim_last_id = id;
+  return r == dSPIN_LIMIT_OK;
+}
+
+// Non-zero once any axis has limits, or is followed for another's; until
+//  then there's nothing to check.
+int dSPIN_Limits_Active()
+{
+  return __atomic_load_n(&lim_any, __ATOMIC_ACQUIRE);
+}
+
+// What this thread's last motion command ran into: dSPIN_LIMIT_OK if it went
+//  out, with the zone's id (-1 for the range) in *id unless it's NULL.
+int dSPIN_Limits_Last(int *id)
+{
+  if (id != NULL) *id = lim_last_id;
+  return lim_last;
+}
+
+/***************** the watchdog ***********************/
+
+// Look at every axis that's running or moving, to be called every period_us:
+//  stop a Run that's come within a stopping distance (plus a period's
+//  travel) of a limit, and note axes that have come to rest. Returns how many
+//  SoftStops it sent.
+int dSPIN_Limits_Poll(unsigned long period_us)
+{
+  if (!__atomic_load_n(&lim_any, __ATOMIC_ACQUIRE)) return 0;
+  pthread_mutex_lock(&lim_lock);
+  lim_period_us = period_us;
+  pthread_mutex_unlock(&lim_lock);
+  int stops = 0;
+  int prev = dSPIN_Selected();
+  for (int axis = 0; axis < dSPIN_Axes(); axis++)
+  {
+    LimAxis *a = &lim_ax[axis];
+    if (!__atomic_load_n(&a->tracked, __ATOMIC_ACQUIRE)) continue;
+    pthread_mutex_lock(&lim_lock);
+    int idle = a->mode == LIM_IDLE;
+    pthread_mutex_unlock(&lim_lock);
+    if (idle) continue;
+    // Held from the reads to the SoftStop, as a command would be.
+    dSPIN_Select(axis);
+    dSPIN_Bus_Begin();
+    unsigned long status = dSPIN_GetParam(dSPIN_STATUS);
+    unsigned long speed = dSPIN_GetParam(dSPIN_SPEED);
+    long pos = lim_sext(dSPIN_GetParam(dSPIN_ABS_POS));
+
+    int stop = 0;
+    pthread_mutex_lock(&lim_lock);
+    if (a->mode == LIM_RUN && speed != 0 && a->on)
+    {
+      // It may speed up before the next look, and it has to be stopped in time
+      //  from whatever speed it's reached.
+      int id;
+      long room = lim_room(a, pos, a->dir, &id, 0);
+      if (room <= lim_need(a, a->spd > speed ? a->spd : speed))
+      {
+        stop = 1;
+        long end = a->dir == FWD ? pos + lim_stop_dist(a, speed) : pos - lim_stop_dist(a, speed);
+        a->span_lo = pos < end ? pos : end;
+        a->span_hi = pos < end ? end : pos;
+        a->mode = LIM_MOVING;
+        lim_stats.stops++;
+      }
+    }
+    // A Run holds BUSY only until it's up to speed.
+    else if ((status & dSPIN_STATUS_BUSY) && (a->mode != LIM_RUN || speed == 0))
+    {
+      a->mode = LIM_IDLE;
+      a->span_lo = a->span_hi = pos;
+    }
+    pthread_mutex_unlock(&lim_lock);
+
+    if (stop)
+    {
+      dSPIN_SoftStop();
+      stops++;
+    }
+    dSPIN_Bus_End();
+  }
+  dSPIN_Select(prev);
+  return stops;
+}
+
+void dSPIN_Limits_GetStats(dSPIN_LimitStats *stats)
+{
+  pthread_mutex_lock(&lim_lock);
+  *stats = lim_stats;
+  pthread_mutex_unlock(&lim_lock);
+}
+
+void dSPIN_Limits_ResetStats()
+{
+  pthread_mutex_lock(&lim_lock);
+  memset(&lim_stats, 0, sizeof(lim_stats));
+  pthread_mutex_unlock(&lim_lock);
+}
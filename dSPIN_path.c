@@ -0,0 +1,334 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dSPIN.h"
+
+//dSPIN_path.c - Path simplification. A toolpath sampled densely (a position
+//   every millisecond or less) is mostly straight stretches: sent as one
+//   GoTo per sample it keeps the bus saturated and the motor stopping and
+//   starting at every one. Here the samples are cut down to the few vertices
+//   the path can't do without, and written out as a motion program (see
+//   dSPIN_program.c): a goto to the start, then one blended move per
+//   straight stretch at the speed that covers it in the time it took, and a
+//   dwell where it stands still. dSPIN_Blend() drives each chain of moves as
+//   a Run with speed changes and a GoTo to where it ends.
+//
+// Simplification is Ramer-Douglas-Peucker on position against time: between
+//  two kept samples, the one furthest from the straight line joining them is
+//  kept too if it's further than the tolerance, and so on down until every
+//  sample is within the tolerance of its stretch. The distance is in
+//  position at the sample's time, since that's the error the motor shows.
+//
+// The input is read incrementally and cut into chunks that share their end
+//  samples, so each chunk can be simplified on its own and the pieces join
+//  up. Worker threads (one per core unless told otherwise) take chunks as
+//  they're read; they're written out in order, with only a few chunks per
+//  worker held in memory at once. Since the cuts don't depend on the number
+//  of workers, neither does the output. Each worker measures the real
+//  deviation of every sample from the simplified path as it finishes.
+//
+// Input lines are "TIME POSITION": seconds and microsteps, time increasing;
+//  '#' starts a comment.
+
+static unsigned long long path_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct PathChunk
+{
+  double *t, *x;
+  int n;
+  unsigned char *keep;
+  double max_dev;
+  int done;
+  struct PathChunk *next;        // in the work queue
+} PathChunk;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t work, finished;
+  PathChunk *head, *tail;        // waiting for a worker
+  int quit;
+  double tol;
+} PathPool;
+
+// Distance of sample i from the line through samples a and b, in position.
+static double path_dev(const PathChunk *c, int a, int b, int i)
+{
+  double x = c->x[a] + (c->x[b] - c->x[a]) * (c->t[i] - c->t[a]) / (c->t[b] - c->t[a]);
+  return fabs(c->x[i] - x);
+}
+
+// Mark the samples of c to keep, without recursion: a stack of stretches
+//  still to look at.
+static void path_rdp(PathChunk *c, double tol)
+{
+  memset(c->keep, 0, c->n);
+  c->keep[0] = c->keep[c->n - 1] = 1;
+  int *stack = (int *)malloc(2 * c->n * sizeof(int));
+  int sp = 0;
+  stack[sp++] = 0;
+  stack[sp++] = c->n - 1;
+  while (sp > 0)
+  {
+    int b = stack[--sp], a = stack[--sp];
+    double worst = -1;
+    int at = -1;
+    for (int i = a + 1; i < b; i++)
+    {
+      double d = path_dev(c, a, b, i);
+      if (d > worst)
+      {
+        worst = d;
+        at = i;
+      }
+    }
+    if (at < 0 || worst <= tol) continue;
+    c->keep[at] = 1;
+    stack[sp++] = a;
+    stack[sp++] = at;
+    stack[sp++] = at;
+    stack[sp++] = b;
+  }
+  free(stack);
+
+  // What's left out is measured against what's kept.
+  c->max_dev = 0;
+  for (int a = 0, b = 1; b < c->n; b++)
+  {
+    if (!c->keep[b]) continue;
+    for (int i = a + 1; i < b; i++)
+    {
+      double d = path_dev(c, a, b, i);
+      if (d > c->max_dev) c->max_dev = d;
+    }
+    a = b;
+  }
+}
+
+static void *path_worker(void *arg)
+{
+  PathPool *pool = (PathPool *)arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (pool->head == NULL && !pool->quit) pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->head == NULL) break;
+    PathChunk *c = pool->head;
+    pool->head = c->next;
+    if (pool->head == NULL) pool->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    path_rdp(c, pool->tol);
+
+    pthread_mutex_lock(&pool->lock);
+    c->done = 1;
+    pthread_cond_broadcast(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static PathChunk *path_chunk(int size)
+{
+  PathChunk *c = (PathChunk *)calloc(1, sizeof(PathChunk));
+  if (c == NULL) return NULL;
+  c->t = (double *)malloc(size * sizeof(double));
+  c->x = (double *)malloc(size * sizeof(double));
+  c->keep = (unsigned char *)malloc(size);
+  if (c->t == NULL || c->x == NULL || c->keep == NULL)
+  {
+    free(c->t);
+    free(c->x);
+    free(c->keep);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static void path_free(PathChunk *c)
+{
+  free(c->t);
+  free(c->x);
+  free(c->keep);
+  free(c);
+}
+
+// Write the program for the kept samples of c, the first of which has been
+//  dealt with already.
+static void path_emit(const PathChunk *c, FILE *out, int usteps, dSPIN_PathStats *st)
+{
+  if (c->max_dev > st->max_dev) st->max_dev = c->max_dev;
+  for (int a = 0, b = 1; b < c->n; b++)
+  {
+    if (!c->keep[b]) continue;
+    st->vertices++;
+    long steps = lround(c->x[b]) - lround(c->x[a]);
+    double secs = c->t[b] - c->t[a];
+    if (steps == 0)
+    {
+      long ms = lround(secs * 1000);
+      if (ms > 0)
+      {
+        fprintf(out, "dwell %ld\n", ms);
+        st->commands++;
+      }
+    }
+    else
+    {
+      fprintf(out, "move %s %ld %.2f\n", steps > 0 ? "FWD" : "REV", labs(steps),
+              labs(steps) / secs / usteps);
+      st->commands++;
+    }
+    a = b;
+  }
+}
+
+// Read a dense path from in and write the motion program that follows it to
+//  within cfg->tolerance microsteps to out. Fills in st; returns 0, or -1 if
+//  a line can't be read as a sample (st->bad_line says which) or memory or
+//  threads run out.
+int dSPIN_Path_Simplify(FILE *in, FILE *out, const dSPIN_PathConfig *cfg, dSPIN_PathStats *st)
+{
+  int size = cfg->chunk > 2 ? cfg->chunk : dSPIN_PATH_CHUNK;
+  int threads = cfg->threads > 0 ? cfg->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+  if (threads > dSPIN_PATH_MAX_THREADS) threads = dSPIN_PATH_MAX_THREADS;
+  int usteps = cfg->usteps > 0 ? cfg->usteps : 1;
+  memset(st, 0, sizeof(*st));
+
+  PathPool pool;
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.finished, NULL);
+  pool.tol = cfg->tolerance;
+  pthread_t worker[dSPIN_PATH_MAX_THREADS];
+  int started = 0;
+  while (started < threads && pthread_create(&worker[started], NULL, path_worker, &pool) == 0)
+    started++;
+  st->threads = started;
+
+  // Chunks in order, oldest first; a few per worker in flight.
+  PathChunk *order[4 * dSPIN_PATH_MAX_THREADS];
+  int first = 0, count = 0, cap = 4 * (started > 0 ? started : 1);
+  int err = started == 0;
+  PathChunk *cur = NULL;
+  char line[dSPIN_PROGRAM_LINE];
+  double last_t = 0;
+  int have_last = 0;
+  unsigned long long t0 = path_now();
+
+  for (;;)
+  {
+    int eof = err || fgets(line, sizeof(line), in) == NULL;
+    if (!eof)
+    {
+      st->lines++;
+      char *c = strchr(line, '#');
+      if (c) *c = '\0';
+      double t, x;
+      char extra;
+      int got = sscanf(line, "%lf %lf %c", &t, &x, &extra);
+      if (got <= 0) continue;
+      if (got != 2 || (have_last && t <= last_t))
+      {
+        st->bad_line = st->lines;
+        err = 1;
+        eof = 1;
+      }
+      else
+      {
+        if (!have_last)
+        {
+          fprintf(out, "goto %ld\nwait\nblend on\n", lround(x));
+          st->commands++;
+          st->start = lround(x);
+        }
+        have_last = 1;
+        last_t = t;
+        st->end = lround(x);
+        st->points++;
+        if (cur == NULL && (cur = path_chunk(size)) == NULL) err = eof = 1;
+        else
+        {
+          cur->t[cur->n] = t;
+          cur->x[cur->n] = x;
+          cur->n++;
+        }
+      }
+    }
+
+    // Hand over a full chunk (or what's left at the end), carrying its last
+    //  sample over as the first of the next.
+    if (cur != NULL && (cur->n == size || (eof && cur->n > 1)))
+    {
+      PathChunk *next = NULL;
+      if (!eof && (next = path_chunk(size)) == NULL) err = eof = 1;
+      if (next != NULL)
+      {
+        next->t[0] = cur->t[cur->n - 1];
+        next->x[0] = cur->x[cur->n - 1];
+        next->n = 1;
+      }
+      pthread_mutex_lock(&pool.lock);
+      // Wait for room, writing out finished chunks in order.
+      while (count == cap || (count > 0 && order[first]->done))
+      {
+        while (!order[first]->done) pthread_cond_wait(&pool.finished, &pool.lock);
+        PathChunk *done = order[first];
+        first = (first + 1) % cap;
+        count--;
+        pthread_mutex_unlock(&pool.lock);
+        path_emit(done, out, usteps, st);
+        path_free(done);
+        pthread_mutex_lock(&pool.lock);
+      }
+      if (pool.tail) pool.tail->next = cur;
+      else pool.head = cur;
+      pool.tail = cur;
+      order[(first + count++) % cap] = cur;
+      st->chunks++;
+      pthread_cond_signal(&pool.work);
+      pthread_mutex_unlock(&pool.lock);
+      cur = next;
+    }
+    if (eof) break;
+  }
+  if (cur != NULL) path_free(cur);
+
+  // Drain what's still with the workers, then let them go.
+  pthread_mutex_lock(&pool.lock);
+  while (count > 0)
+  {
+    while (!order[first]->done) pthread_cond_wait(&pool.finished, &pool.lock);
+    PathChunk *done = order[first];
+    first = (first + 1) % cap;
+    count--;
+    pthread_mutex_unlock(&pool.lock);
+    path_emit(done, out, usteps, st);
+    path_free(done);
+    pthread_mutex_lock(&pool.lock);
+  }
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  for (int i = 0; i < started; i++) pthread_join(worker[i], NULL);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.work);
+  pthread_cond_destroy(&pool.finished);
+
+  if (have_last && !err) fprintf(out, "blend off\nwait\n");
+  fflush(out);
+  st->elapsed_ns = path_now() - t0;
+  return err ? -1 : 0;
+}
@@ -0,0 +1,76 @@
+//dSPIN_play.c - Runs a motion program (see dSPIN_program.c) from a file, or
+//										from stdin so another process can pipe one in, or
+//										one compiled by compile, any number of times over.
+//  usage: play [program|-] [lookahead]
+//         play <compiled> [cycles]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dSPIN.h"
+
+// Whether path is a compiled program rather than program text.
+static int compiled(const char *path){
+	char magic[4];
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) return 0;
+	int yes = fread(magic, 1, 4, f) == 4 && !memcmp(magic, dSPIN_BYTECODE_MAGIC, 4);
+	fclose(f);
+	return yes;
+}
+
+static int play_compiled(const char *path, int cycles){
+	dSPIN_init();
+	// Clears UVLO, set at power up.
+	dSPIN_GetStatus();
+
+	dSPIN_Bytecode *bc = dSPIN_Bytecode_Open(path);
+	if(bc == NULL){
+		fprintf(stderr, "%s: not a valid compiled program\n", path);
+		return 1;
+	}
+	int done = 0;
+	while(done<cycles && dSPIN_Bytecode_Run(bc) == dSPIN_STATUS_GOOD) done++;
+	if(done<cycles){
+		int id;
+		int why = dSPIN_Limits_Last(&id);
+		fprintf(stderr, "%s: refused by the limits (%d, zone %d) in cycle %d\n", path, why, id, done+1);
+	}
+	dSPIN_BytecodeStats st;
+	dSPIN_Bytecode_GetStats(bc, &st);
+	dSPIN_Bytecode_Close(bc);
+	printf("%d cycles of %lu records, %lu SPI bytes each\n", done, st.records, st.spi_bytes);
+	return done == cycles ? 0 : 1;
+}
+
+int main(int argc, char* argv[]){
+	if(argc>1 && compiled(argv[1]))
+		return play_compiled(argv[1], argc>2 ? atoi(argv[2]) : 1);
+
+	FILE *in = stdin;
+	if(argc>1 && strcmp(argv[1], "-")){
+		in = fopen(argv[1], "r");
+		if(in == NULL){
+			perror(argv[1]);
+			return 1;
+		}
+	}
+	int lookahead = argc>2 ? atoi(argv[2]) : dSPIN_PROGRAM_LOOKAHEAD;
+
+	dSPIN_init();
+	// Clears UVLO, set at power up.
+	dSPIN_GetStatus();
+
+	dSPIN_Program *p = dSPIN_Program_Open(in, lookahead);
+	if(p == NULL){
+		fprintf(stderr, "can't start the program reader\n");
+		return 1;
+	}
+	int err = dSPIN_Program_Run(p);
+	dSPIN_ProgramStats st;
+	dSPIN_Program_GetStats(p, &st);
+	dSPIN_Program_Close(p);
+	printf("%lu commands executed, lookahead peak %d/%d, waited for the reader %lu times\n",
+	       st.executed, st.peak, lookahead, st.starved);
+	return err == dSPIN_STATUS_GOOD ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+#include <string.h>
+#include "dSPIN.h"
+
+//dSPIN_poll.c - Status polling scheduler. Reading STATUS, ABS_POS and SPEED
+//   from every axis at a fixed rate spends most of the bus on axes that are
+//   sitting still or cruising. Instead, each axis gets a staleness bound it is
+//   guaranteed to be read within, and the rest of the bus budget goes where
+//   something is about to happen: dSPIN_Poll_Expect() hands the scheduler a
+//   dSPIN_Prediction for the command just issued, and reads bunch up around
+//   the predicted end of the move, then back off again once it's confirmed.
+//
+// Scheduling is earliest-due-first, except that an axis about to overrun its
+//  staleness bound always goes ahead of a merely "interesting" one. The
+//  routine reads that keep the bound come round on a fixed period per axis,
+//  with the axes' phases spread out as they're added, so they don't bunch up
+//  and crowd out the reads around an event.
+
+typedef struct
+{
+  int on;
+  unsigned long long stale_ns;   // guaranteed maximum age of the snapshot
+  unsigned long long period_ns;  // routine read period, and its phase
+  unsigned long long phase_ns;
+  unsigned long long due_ns;     // when the scheduler wants the next read
+  unsigned long long event_ns;   // predicted event not yet confirmed, or 0
+  dSPIN_PollState st;
+} PollAxis;
+
+static PollAxis poll_axis[dSPIN_MAX_AXES];
+static unsigned long long poll_spacing_ns = 1000000;  // 1 / budget
+static unsigned long long poll_next_ns = 0;           // bus free for polling again
+static double poll_load = 0;                          // sum of spacing / period_ns
+static int poll_added = 0;
+static dSPIN_PollStats poll_stats;
+
+// Set the bus' polling budget, in reads (STATUS, ABS_POS, SPEED and STATUS
+//  again) per second, and forget any axes registered before.
+void dSPIN_Poll_Setup(float polls_per_sec)
+{
+  memset(poll_axis, 0, sizeof(poll_axis));
+  memset(&poll_stats, 0, sizeof(poll_stats));
+  poll_spacing_ns = (unsigned long long)(1e9 / polls_per_sec);
+  poll_next_ns = 0;
+  poll_load = 0;
+  poll_added = 0;
+}
+
+// Add an axis to the schedule with a maximum staleness of max_stale_us.
+//  Refuses (dSPIN_STATUS_FATAL) if the guarantees already given plus this one
+//  would leave less than dSPIN_POLL_RESERVE of the budget for event polling.
+int dSPIN_Poll_Axis(int axis, unsigned long max_stale_us)
+{
+  if (axis < 0 || axis >= dSPIN_MAX_AXES) return dSPIN_STATUS_FATAL;
+  PollAxis *a = &poll_axis[axis];
+  unsigned long long stale = max_stale_us * 1000ULL;
+  if (stale <= 2 * dSPIN_POLL_SLACK * poll_spacing_ns) return dSPIN_STATUS_FATAL;
+  unsigned long long period = stale - dSPIN_POLL_SLACK * poll_spacing_ns;
+  double load = poll_load - (a->on ? (double)poll_spacing_ns / a->period_ns : 0)
+                + (double)poll_spacing_ns / period;
+  if (load > 1.0 - dSPIN_POLL_RESERVE) return dSPIN_STATUS_FATAL;
+  poll_load = load;
+  a->on = 1;
+  a->stale_ns = stale;
+  // Leave a few reads' worth of slack so the bound holds even if the bus is
+  //  busy around an event when the slot comes up.
+  a->period_ns = period;
+  // Golden ratio phases stay evenly spread however many axes there are.
+  double frac = poll_added++ * 0.6180339887;
+  frac -= (long)frac;
+  a->phase_ns = dSPIN_Now() + (unsigned long long)(frac * a->period_ns);
+  a->due_ns = dSPIN_Now();
+  return dSPIN_STATUS_GOOD;
+}
+
+// Tell the scheduler a command with profile p was just issued on axis.
+int dSPIN_Poll_Expect(int axis, const dSPIN_Prediction *p)
+{
+  if (axis < 0 || axis >= dSPIN_MAX_AXES) return dSPIN_STATUS_FATAL;
+  int prev = dSPIN_Selected();
+  dSPIN_Select(axis);
+  unsigned long long ns = dSPIN_TicksToNs(p->busy_ticks);
+  dSPIN_Select(prev);
+  return dSPIN_Poll_Event(axis, dSPIN_Now() + ns);
+}
+
+// Tell the scheduler something is expected to happen on axis at time at_ns
+//  (dSPIN_Now() time base), e.g. a switch about to be reached.
+int dSPIN_Poll_Event(int axis, unsigned long long at_ns)
+{
+  if (axis < 0 || axis >= dSPIN_MAX_AXES) return dSPIN_STATUS_FATAL;
+  PollAxis *a = &poll_axis[axis];
+  a->event_ns = at_ns;
+  unsigned long long now = dSPIN_Now();
+  unsigned long long lead = at_ns > now ? at_ns - now : 0;
+  // Read once soon to pick up the new motion, then let the event drive things.
+  unsigned long long soon = now + (lead / 2 < a->stale_ns ? lead / 2 : a->stale_ns);
+  if (soon < a->due_ns) a->due_ns = soon;
+  return dSPIN_STATUS_GOOD;
+}
+
+// Work out when to read axis a next, given what it just reported.
+static void poll_plan(PollAxis *a, unsigned long long now)
+{
+  // The next routine slot.
+  unsigned long long due = a->phase_ns;
+  if (now >= due) due += ((now - due) / a->period_ns + 1) * a->period_ns;
+  unsigned long long dense = dSPIN_POLL_DENSE_NS > poll_spacing_ns ?
+                             dSPIN_POLL_DENSE_NS : poll_spacing_ns;
+  int busy = !(a->st.status & dSPIN_STATUS_BUSY);
+
+  if (a->event_ns)
+  {
+    if (!busy)
+    {
+      // Event confirmed. Record how late we noticed.
+      unsigned long long late = now > a->event_ns ? now - a->event_ns : 0;
+      poll_stats.events++;
+      poll_stats.detect_ns_sum += late;
+      if (late > poll_stats.detect_ns_max) poll_stats.detect_ns_max = late;
+      a->event_ns = 0;
+    }
+    else if (now + dSPIN_POLL_WINDOW_NS < a->event_ns)
+    {
+      // Still well ahead. The prediction is tick exact, so there's nothing
+      //  to learn before the window opens beyond what routine reads show.
+      unsigned long long t = a->event_ns - dSPIN_POLL_WINDOW_NS;
+      if (t < due) due = t;
+    }
+    else if (now < a->event_ns + 4 * dSPIN_POLL_WINDOW_NS)
+    {
+      // Inside the window: poll densely until the event shows up.
+      unsigned long long t = now + dense;
+      if (t < due) due = t;
+    }
+    else
+    {
+      // The event never came; the prediction was wrong. Fall back.
+      poll_stats.missed_events++;
+      a->event_ns = 0;
+    }
+  }
+  a->due_ns = due;
+}
+
+// Read a snapshot of axis. It takes a GetParam per register, so STATUS is
+//  read again after ABS_POS and SPEED, and the lot reread (up to
+//  dSPIN_POLL_RETRIES times) if it changed in between, e.g. a move ending:
+//  the position and speed then go with the status they're stored with. The
+//  bus is held throughout so no command goes out in the middle.
+static void poll_read(int axis, PollAxis *a)
+{
+  int prev = dSPIN_Selected();
+  dSPIN_Select(axis);
+  dSPIN_Bus_Begin();
+  unsigned int status = dSPIN_GetParam(dSPIN_STATUS);
+  for (int i = 0;; i++)
+  {
+    long pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+    if (pos & 0x200000) pos -= 0x400000;
+    a->st.abs_pos = pos;
+    a->st.speed = dSPIN_GetParam(dSPIN_SPEED);
+    unsigned int again = dSPIN_GetParam(dSPIN_STATUS);
+    a->st.status = again;
+    if (again == status || i == dSPIN_POLL_RETRIES) break;
+    status = again;
+    poll_stats.retries++;
+  }
+  dSPIN_Bus_End();
+  dSPIN_Select(prev);
+}
+
+// Wait for the next read the schedule calls for, do it, and return the axis
+//  that was read (or -1 if no axis is scheduled).
+int dSPIN_Poll_Once()
+{
+  int pick = -1, rescue = -1;
+  unsigned long long now = dSPIN_Now();
+  unsigned long long start = now > poll_next_ns ? now : poll_next_ns;
+  for (int i = 0; i < dSPIN_MAX_AXES; i++)
+  {
+    PollAxis *a = &poll_axis[i];
+    if (!a->on) continue;
+    if (pick < 0 || a->due_ns < poll_axis[pick].due_ns) pick = i;
+    unsigned long long deadline = a->st.stamp_ns + a->stale_ns;
+    if (deadline <= start + poll_spacing_ns
+        && (rescue < 0 || deadline < poll_axis[rescue].st.stamp_ns + poll_axis[rescue].stale_ns))
+      rescue = i;
+  }
+  if (pick < 0) return -1;
+  if (rescue >= 0) pick = rescue;
+
+  PollAxis *a = &poll_axis[pick];
+  unsigned long long when = a->due_ns > start ? a->due_ns : start;
+  dSPIN_SleepUntil(when);
+  unsigned long long t0 = dSPIN_Now();
+  poll_read(pick, a);
+  unsigned long long t1 = dSPIN_Now();
+
+  if (a->st.stamp_ns)
+  {
+    unsigned long long age = t1 - a->st.stamp_ns;
+    if (age > a->st.max_age_ns) a->st.max_age_ns = age;
+    if (age > a->stale_ns) poll_stats.misses++;
+  }
+  a->st.stamp_ns = t1;
+  a->st.polls++;
+  poll_stats.polls++;
+  poll_stats.bus_ns += t1 - t0;
+  poll_next_ns = t0 + poll_spacing_ns;
+  poll_plan(a, t1);
+  return pick;
+}
+
+// The latest snapshot of axis.
+int dSPIN_Poll_Get(int axis, dSPIN_PollState *state)
+{
+  if (axis < 0 || axis >= dSPIN_MAX_AXES) return dSPIN_STATUS_FATAL;
+  *state = poll_axis[axis].st;
+  return dSPIN_STATUS_GOOD;
+}
+
+void dSPIN_Poll_GetStats(dSPIN_PollStats *stats)
+{
+  *stats = poll_stats;
+}
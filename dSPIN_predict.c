@@ -0,0 +1,368 @@
+#include <limits.h>
+#include "dSPIN.h"
+
+//dSPIN_predict.c - Host-side model of the dSPIN's profile generator. Given the
+//   register contents and a motion command, it works out the same trapezoid
+//   (or triangle) the chip will run, tick for tick, so callers can tell when a
+//   move will end, where the motor will be at any time and how fast it will
+//   get without polling BUSYN or SPEED.
+//
+// The chip keeps speed in steps/tick with 2^-40 resolution: ACC and DEC are
+//  added to it once per tick, MAX_SPEED is that speed shifted up by 22 bits and
+//  MIN_SPEED by 16. Positioning commands accelerate until the stopping distance
+//  at the current speed reaches the distance left, then decelerate down to
+//  the larger of MIN_SPEED and 5 steps/s and finish the last few microsteps at
+//  that speed. All the arithmetic below is done in those same fixed-point
+//  units so the tick counts come out exact rather than approximately right.
+
+#define PRED_FRAC_BITS 40
+#define PRED_INF_ACC   (1ULL << PRED_FRAC_BITS)  // ACC = 0xFFF
+#define PRED_FLOOR_SPD 1374390ULL                // 5 steps/s, 2^-40 steps/tick
+#define PRED_FOREVER   (ULLONG_MAX / 4)
+
+typedef struct
+{
+  unsigned long long a, d;           // speed change per tick
+  unsigned long long vmax, vmin, fl; // speed limits
+  int ms;                            // microsteps per step
+} PredUnits;
+
+static void pred_units(const dSPIN_MotionState *st, PredUnits *u)
+{
+  if (st->acc == 0xFFF) u->a = u->d = PRED_INF_ACC;
+  else
+  {
+    u->a = st->acc ? st->acc : 1;
+    u->d = st->dec ? st->dec : 1;
+  }
+  u->vmax = (unsigned long long)(st->max_speed & 0x3FF) << 22;
+  u->vmin = (unsigned long long)(st->min_speed & 0xFFF) << 16;
+  u->fl = u->vmin > PRED_FLOOR_SPD ? u->vmin : PRED_FLOOR_SPD;
+  u->ms = 1 << (st->step_mode & dSPIN_STEP_MODE_STEP_SEL);
+}
+
+// Distance (2^-40 microsteps) covered in n ticks starting from speed v, when
+//  the speed changes by s before each tick.
+static __int128 pred_travel(unsigned long long v, long long s, unsigned long long n, int ms)
+{
+  return ((__int128)n * v + (__int128)n * (n + 1) / 2 * s) * ms;
+}
+
+static long double pred_stop_dist(const PredUnits *u, unsigned long long v)
+{
+  return (long double)v * v / (2.0L * u->d) * u->ms;
+}
+
+static void pred_clear(dSPIN_Prediction *p, byte dir, const PredUnits *u)
+{
+  p->ticks = 0;
+  p->busy_ticks = 0;
+  p->distance = 0;
+  p->peak_speed = 0;
+  p->triangular = 0;
+  p->dir = dir;
+  p->ms = u->ms;
+  p->n_seg = 0;
+}
+
+static void pred_add(dSPIN_Prediction *p, unsigned long long n, unsigned long long v,
+                     long long s, int sign)
+{
+  if (n == 0 || p->n_seg == dSPIN_PREDICT_SEGMENTS) return;
+  p->seg[p->n_seg].n = n;
+  p->seg[p->n_seg].v = v;
+  p->seg[p->n_seg].s = s;
+  p->seg[p->n_seg].sign = sign;
+  p->n_seg++;
+  unsigned long long top = s > 0 ? v + s * (long long)n : v;
+  if ((top >> 12) > p->peak_speed) p->peak_speed = (unsigned long)(top >> 12);
+}
+
+// Speed and distance after k ticks of the acceleration/cruise part of a
+//  positioning profile that starts at v0 with x0 already covered.
+static void pred_ramp_state(const PredUnits *u, unsigned long long v0, __int128 x0,
+                            unsigned long long kc, unsigned long long k,
+                            unsigned long long *v, __int128 *x)
+{
+  if (kc == 0)
+  {
+    *v = v0;
+    *x = x0 + pred_travel(v0, 0, k, u->ms);
+  }
+  else if (k < kc)
+  {
+    *v = v0 + k * u->a;
+    *x = x0 + pred_travel(v0, u->a, k, u->ms);
+  }
+  else
+  {
+    *v = u->vmax;
+    *x = x0 + pred_travel(v0, u->a, kc - 1, u->ms) + pred_travel(u->vmax, 0, k - kc + 1, u->ms);
+  }
+}
+
+// Has the deceleration point been reached at the start of tick k+1?
+static int pred_trigger(const PredUnits *u, unsigned long long v0, __int128 x0,
+                        unsigned long long kc, unsigned long long k, __int128 goal)
+{
+  unsigned long long v;
+  __int128 x;
+  pred_ramp_state(u, v0, x0, kc, k, &v, &x);
+  __int128 rem = goal - x;
+  return rem <= 0 || pred_stop_dist(u, v) >= (long double)rem;
+}
+
+// Distance covered in the first m ticks of the final ramp from speed vk.
+static __int128 pred_decel_travel(const PredUnits *u, unsigned long long vk,
+                                  unsigned long long j, unsigned long long m)
+{
+  if (m <= j) return pred_travel(vk, -(long long)u->d, m, u->ms);
+  return pred_travel(vk, -(long long)u->d, j, u->ms) + pred_travel(u->fl, 0, m - j, u->ms);
+}
+
+// Positioning profile over dist microsteps, starting at speed v0 with x0
+//  (2^-40 microsteps) of the distance already behind it.
+static void pred_position(dSPIN_Prediction *p, const PredUnits *u, unsigned long long v0,
+                          __int128 x0, unsigned long long dist)
+{
+  __int128 goal = (__int128)dist << PRED_FRAC_BITS;
+  if (x0 >= goal) return;
+  if (v0 > u->vmax) v0 = u->vmax;
+  unsigned long long kc = v0 < u->vmax ? (u->vmax - v0 + u->a - 1) / u->a : 0;
+
+  // Find the first tick that starts the final ramp. The trigger condition only
+  //  ever goes from false to true, so search for the edge.
+  unsigned long long k = 0;
+  if (!pred_trigger(u, v0, x0, kc, 0, goal))
+  {
+    unsigned long long hi = 1;
+    while (!pred_trigger(u, v0, x0, kc, hi, goal)) hi *= 2;
+    unsigned long long lo = hi / 2;   // known false
+    while (hi - lo > 1)
+    {
+      unsigned long long mid = lo + (hi - lo) / 2;
+      if (pred_trigger(u, v0, x0, kc, mid, goal)) hi = mid;
+      else lo = mid;
+    }
+    k = hi;
+  }
+  unsigned long long vk;
+  __int128 xk;
+  pred_ramp_state(u, v0, x0, kc, k, &vk, &xk);
+
+  // Ticks of the final ramp: j ticks shedding DEC, then the floor speed until
+  //  the target is reached.
+  unsigned long long j = vk > u->fl ? (vk - u->fl - 1) / u->d : 0;
+  unsigned long long m = 0;
+  if (xk < goal)
+  {
+    unsigned long long lo = 0;                  // known short of the goal
+    unsigned long long hi = j + (unsigned long long)((goal - xk) / ((__int128)u->fl * u->ms)) + 1;
+    while (hi - lo > 1)
+    {
+      unsigned long long mid = lo + (hi - lo) / 2;
+      if (xk + pred_decel_travel(u, vk, j, mid) >= goal) hi = mid;
+      else lo = mid;
+    }
+    m = hi;
+  }
+
+  if (kc == 0) pred_add(p, k, v0, 0, 1);
+  else
+  {
+    pred_add(p, k < kc - 1 ? k : kc - 1, v0, u->a, 1);
+    if (k >= kc) pred_add(p, k - kc + 1, u->vmax, 0, 1);
+  }
+  pred_add(p, m < j ? m : j, vk, -(long long)u->d, 1);
+  if (m > j) pred_add(p, m - j, u->fl, 0, 1);
+
+  p->triangular = k < kc;
+  p->ticks += k + m;
+  p->busy_ticks = p->ticks;
+}
+
+// Ticks spent braking from v0 to a standstill, as SoftStop does it.
+static unsigned long long pred_brake(dSPIN_Prediction *p, const PredUnits *u,
+                                     unsigned long long v0, int sign)
+{
+  unsigned long long j = v0 > u->d ? (v0 - 1) / u->d : 0;
+  pred_add(p, j, v0, -(long long)u->d, sign);
+  return j;
+}
+
+// Read the registers the profile generator uses, plus the current speed,
+//  direction and position, from the chip.
+void dSPIN_GetMotionState(dSPIN_MotionState *st)
+{
+  st->acc = dSPIN_GetParam(dSPIN_ACC);
+  st->dec = dSPIN_GetParam(dSPIN_DEC);
+  st->max_speed = dSPIN_GetParam(dSPIN_MAX_SPEED);
+  st->min_speed = dSPIN_GetParam(dSPIN_MIN_SPEED);
+  st->fs_spd = dSPIN_GetParam(dSPIN_FS_SPD);
+  st->step_mode = dSPIN_GetParam(dSPIN_STEP_MODE);
+  st->speed = dSPIN_GetParam(dSPIN_SPEED);
+  long pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  if (pos & 0x200000) pos -= 0x400000;
+  st->abs_pos = pos;
+  st->dir = (dSPIN_GetParam(dSPIN_STATUS) & dSPIN_STATUS_DIR) ? FWD : REV;
+}
+
+// MOVE n_step microsteps in direction dir.
+void dSPIN_PredictMove(const dSPIN_MotionState *st, byte dir, unsigned long n_step,
+                       dSPIN_Prediction *p)
+{
+  PredUnits u;
+  pred_units(st, &u);
+  pred_clear(p, dir, &u);
+  if (n_step > 0x3FFFFF) n_step = 0x3FFFFF;
+  p->distance = dir == FWD ? (long)n_step : -(long)n_step;
+  if (n_step == 0 && st->speed == 0) return;
+
+  unsigned long long v0 = (unsigned long long)st->speed << 12;
+  __int128 x0 = 0;
+  unsigned long long dist = n_step;
+  if (v0 && st->dir != dir)
+  {
+    // The chip brakes to a standstill, then turns round at MIN_SPEED.
+    unsigned long long j = pred_brake(p, &u, v0, -1);
+    long long back = (long long)(pred_travel(v0, -(long long)u.d, j, u.ms) >> PRED_FRAC_BITS);
+    dist += back;
+    p->ticks = j + 1;
+    pred_add(p, 1, u.vmin, 0, 1);
+    v0 = u.vmin;
+    x0 = pred_travel(v0, 0, 1, u.ms);
+  }
+  else if (v0 == 0) v0 = u.vmin;
+  pred_position(p, &u, v0, x0, dist);
+}
+
+// GOTO the absolute position pos, by the shortest path.
+void dSPIN_PredictGoTo(const dSPIN_MotionState *st, unsigned long pos, dSPIN_Prediction *p)
+{
+  long diff = ((long)(pos & 0x3FFFFF) - st->abs_pos) & 0x3FFFFF;
+  if (diff & 0x200000) diff -= 0x400000;
+  if (diff >= 0) dSPIN_PredictMove(st, FWD, diff, p);
+  else dSPIN_PredictMove(st, REV, -diff, p);
+}
+
+// RUN in direction dir at spd (SpdCalc() units). The motor keeps going, so
+//  ticks is open-ended; busy_ticks is when the target speed is reached.
+void dSPIN_PredictRun(const dSPIN_MotionState *st, byte dir, unsigned long spd,
+                      dSPIN_Prediction *p)
+{
+  PredUnits u;
+  pred_units(st, &u);
+  pred_clear(p, dir, &u);
+  unsigned long long tv = (unsigned long long)(spd & 0xFFFFF) << 12;
+  if (tv > u.vmax) tv = u.vmax;
+  if (tv < u.vmin) tv = u.vmin;
+  unsigned long long v0 = (unsigned long long)st->speed << 12;
+  unsigned long long t = 0;
+  if (v0 && st->dir != dir)
+  {
+    t = pred_brake(p, &u, v0, -1) + 1;
+    v0 = u.vmin < tv ? u.vmin : tv;
+    pred_add(p, 1, v0, 0, 1);
+  }
+  else if (v0 == 0) v0 = u.vmin < tv ? u.vmin : tv;
+  if (v0 < tv)
+  {
+    unsigned long long j = (tv - v0 - 1) / u.a;
+    pred_add(p, j, v0, u.a, 1);
+    t += j + 1;
+  }
+  else if (v0 > tv)
+  {
+    unsigned long long j = (v0 - tv - 1) / u.d;
+    pred_add(p, j, v0, -(long long)u.d, 1);
+    t += j + 1;
+  }
+  pred_add(p, PRED_FOREVER, tv, 0, 1);
+  p->busy_ticks = t;
+  p->ticks = PRED_FOREVER;
+  p->distance = dir == FWD ? LONG_MAX : -LONG_MAX;
+}
+
+// SoftStop from the current speed.
+void dSPIN_PredictSoftStop(const dSPIN_MotionState *st, dSPIN_Prediction *p)
+{
+  PredUnits u;
+  pred_units(st, &u);
+  pred_clear(p, st->dir, &u);
+  unsigned long long v0 = (unsigned long long)st->speed << 12;
+  if (v0 == 0) return;
+  p->ticks = p->busy_ticks = pred_brake(p, &u, v0, 1) + 1;
+  long d = (long)(pred_travel(v0, -(long long)u.d, p->ticks - 1, u.ms) >> PRED_FRAC_BITS);
+  p->distance = st->dir == FWD ? d : -d;
+}
+
+// Microsteps moved (signed, FWD positive) tick ticks after the command.
+long dSPIN_PredictPosAt(const dSPIN_Prediction *p, unsigned long long tick)
+{
+  __int128 x = 0;
+  for (int i = 0; i < p->n_seg && tick > 0; i++)
+  {
+    unsigned long long n = p->seg[i].n < tick ? p->seg[i].n : tick;
+    __int128 t = pred_travel(p->seg[i].v, p->seg[i].s, n, p->ms);
+    x += p->seg[i].sign > 0 ? t : -t;
+    tick -= n;
+  }
+  long steps = (long)(x >> PRED_FRAC_BITS);
+  long whole = p->distance >= 0 ? p->distance : -p->distance;
+  if (steps > whole) steps = whole;
+  return p->dir == FWD ? steps : -steps;
+}
+
+// Speed, in SPEED register units, tick ticks after the command.
+unsigned long dSPIN_PredictSpeedAt(const dSPIN_Prediction *p, unsigned long long tick)
+{
+  if (tick == 0 || tick > p->ticks) return 0;
+  for (int i = 0; i < p->n_seg; i++)
+  {
+    if (tick <= p->seg[i].n)
+      return (unsigned long)((p->seg[i].v + p->seg[i].s * (long long)tick) >> 12);
+    tick -= p->seg[i].n;
+  }
+  return 0;
+}
+
+// First tick at which the motor has moved at least offset microsteps (signed,
+//  FWD positive) from where the command started, or ULLONG_MAX if it never
+//  gets there.
+unsigned long long dSPIN_PredictTimeTo(const dSPIN_Prediction *p, long offset)
+{
+  long want = p->dir == FWD ? offset : -offset;
+  long end = dSPIN_PredictPosAt(p, p->ticks);
+  if (p->dir != FWD) end = -end;
+  if (want <= 0) return 0;
+  if (want > end) return ULLONG_MAX;
+  unsigned long long lo = 0, hi = p->ticks;
+  while (hi - lo > 1)
+  {
+    unsigned long long mid = lo + (hi - lo) / 2;
+    long at = dSPIN_PredictPosAt(p, mid);
+    if (p->dir != FWD) at = -at;
+    if (at >= want) hi = mid;
+    else lo = mid;
+  }
+  return hi;
+}
+
+// Convert a SPEED register value (or SpdCalc() result) back to steps/s, on
+//  the selected axis' oscillator.
+float dSPIN_StepsPerSec(unsigned long spd)
+{
+  return spd / 67.106f * dSPIN_Osc();
+}
+
+// Convert the selected axis' chip ticks to seconds.
+float dSPIN_TicksToSec(unsigned long long ticks)
+{
+  return ticks * (dSPIN_TICK_NS * 1e-9f) / dSPIN_Osc();
+}
+
+// Convert the selected axis' chip ticks to nanoseconds.
+unsigned long long dSPIN_TicksToNs(unsigned long long ticks)
+{
+  return (unsigned long long)(ticks * (double)dSPIN_TICK_NS / dSPIN_Osc());
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "dSPIN.h"
+
+//dSPIN_program.c - Motion program interpreter. A program is plain text, one
+//   command per line, read incrementally from any FILE (a file, a pipe,
+//   stdin) by a reader thread. The reader parses each line and converts its
+//   units to register values ahead of time into a bounded lookahead ring,
+//   so the executor only ever pops a ready-made command and talks to the
+//   chip; a long program never has to fit in memory, and parsing never holds
+//   up motion.
+//
+// Commands (case doesn't matter; '#' or ';' starts a comment):
+//   axis N                  direct the following commands at axis N
+//   move [FWD|REV] STEPS [SPEED]   relative move, negative STEPS means REV;
+//                           with SPEED (steps/s) in place of MAX_SPEED
+//   goto POS                absolute move, POS -2097152 to 2097151
+//   run [FWD|REV] SPEED     run at SPEED steps/s, negative means REV
+//   until [FWD|REV] SPEED [copy]   GoUntil; ABS_POS reset unless "copy"
+//   release FWD|REV [copy]  ReleaseSW
+//   home / mark             GoHome / GoMark
+//   zero                    ResetPos
+//   stop / hardstop / softhiz / hiz
+//   wait                    wait for the motor to finish what it's doing
+//   dwell MS                wait, then pause MS milliseconds
+//   blend on|off            blend consecutive moves (see dSPIN_blend.c)
+//   set REG VALUE           SetParam; MAX_SPEED, MIN_SPEED and FS_SPD take
+//                           steps/s, ACC and DEC steps/s/s, the rest raw values
+//
+// A negative value only gives the direction where FWD or REV isn't written
+//  out. Step counts and positions are whole numbers, and positions (goto, set
+//  ABS_POS and MARK) have to fit ABS_POS rather than wrap round.
+//
+// Like dSPIN_test.c, every positioning command waits for the one before it to
+//  finish and puts a soft stop in between (see the errata in dSPIN.h). A run
+//  has to be stopped before a positioning command will be accepted. With
+//  blending on, a move and the moves straight after it in the lookahead go
+//  to dSPIN_Blend() together instead; so does a move with a SPEED, which
+//  then runs to completion before the next command.
+//
+// A move, goto, run, home or mark the limits refuse (see dSPIN_limits.c)
+//  ends the program there, with the motor soft stopped.
+
+struct dSPIN_Program
+{
+  FILE *in;
+  pthread_t reader;
+  pthread_mutex_t lock;
+  pthread_cond_t more, room;
+  dSPIN_ProgOp *ring;
+  int size, head, count;
+  int done;             // the reader has queued its last command
+  int quit;             // dSPIN_Program_Close() wants the reader gone
+  int blend;            // "blend on" is in effect
+  int axis;             // the axis selected when it was opened
+  dSPIN_ProgramStats stats;
+};
+
+static const struct
+{
+  const char *name;
+  int op;
+} prog_words[] = {
+  { "axis", dSPIN_OP_AXIS },       { "move", dSPIN_OP_MOVE },
+  { "goto", dSPIN_OP_GOTO },       { "run", dSPIN_OP_RUN },
+  { "until", dSPIN_OP_UNTIL },     { "release", dSPIN_OP_RELEASE },
+  { "home", dSPIN_OP_HOME },       { "mark", dSPIN_OP_MARK },
+  { "zero", dSPIN_OP_ZERO },       { "stop", dSPIN_OP_STOP },
+  { "hardstop", dSPIN_OP_HARDSTOP }, { "softhiz", dSPIN_OP_SOFTHIZ },
+  { "hiz", dSPIN_OP_HIZ },         { "wait", dSPIN_OP_WAIT },
+  { "dwell", dSPIN_OP_DWELL },     { "set", dSPIN_OP_SET },
+  { "blend", dSPIN_OP_BLEND },
+};
+
+// Registers "set" knows, and how to convert a value for them.
+#define PROG_RAW 0
+#define PROG_MAX_SPD 1
+#define PROG_MIN_SPD 2
+#define PROG_FS_SPD 3
+#define PROG_ACC 4
+
+static const struct
+{
+  const char *name;
+  byte param;
+  int units;
+} prog_regs[] = {
+  { "ABS_POS", dSPIN_ABS_POS, PROG_RAW },     { "MARK", dSPIN_MARK, PROG_RAW },
+  { "ACC", dSPIN_ACC, PROG_ACC },             { "DEC", dSPIN_DEC, PROG_ACC },
+  { "MAX_SPEED", dSPIN_MAX_SPEED, PROG_MAX_SPD },
+  { "MIN_SPEED", dSPIN_MIN_SPEED, PROG_MIN_SPD },
+  { "FS_SPD", dSPIN_FS_SPD, PROG_FS_SPD },
+  { "KVAL_HOLD", dSPIN_KVAL_HOLD, PROG_RAW }, { "KVAL_RUN", dSPIN_KVAL_RUN, PROG_RAW },
+  { "KVAL_ACC", dSPIN_KVAL_ACC, PROG_RAW },   { "KVAL_DEC", dSPIN_KVAL_DEC, PROG_RAW },
+  { "OCD_TH", dSPIN_OCD_TH, PROG_RAW },       { "STALL_TH", dSPIN_STALL_TH, PROG_RAW },
+  { "STEP_MODE", dSPIN_STEP_MODE, PROG_RAW }, { "ALARM_EN", dSPIN_ALARM_EN, PROG_RAW },
+  { "CONFIG", dSPIN_CONFIG, PROG_RAW },
+};
+
+#define N_ENTRIES(a) (sizeof(a) / sizeof(a[0]))
+
+static int prog_number(const char *tok, double *v)
+{
+  char *end;
+  if (tok == NULL) return 0;
+  *v = strtod(tok, &end);
+  return end != tok && *end == '\0';
+}
+
+// [FWD|REV] VALUE, or a signed VALUE. Leaves *i past what it used.
+static int prog_dir_value(char **tok, int n, int *i, byte *dir, double *v)
+{
+  int given = 1;
+  *dir = FWD;
+  if (*i < n && !strcasecmp(tok[*i], "fwd")) (*i)++;
+  else if (*i < n && !strcasecmp(tok[*i], "rev")) { *dir = REV; (*i)++; }
+  else given = 0;
+  if (*i >= n || !prog_number(tok[*i], v)) return 0;
+  (*i)++;
+  if (*v < 0 && given) return 0;
+  if (*v < 0) { *v = -*v; *dir = REV; }
+  return 1;
+}
+
+// A whole number that fits ABS_POS, as its 22-bit two's complement.
+static int prog_position(double v, unsigned long *reg)
+{
+  if (v < -0x200000 || v > 0x1FFFFF || v != (double)(long)v) return 0;
+  *reg = (unsigned long)(long)v & 0x3FFFFF;
+  return 1;
+}
+
+// Parse one line into op, converting its units to register values. Returns 0
+//  for a blank line, 1 for a command, and -1 with op->op == dSPIN_OP_ERROR
+//  for something that isn't one. The line is cut up in the process.
+int dSPIN_Program_Parse(char *line, dSPIN_ProgOp *op)
+{
+  char *tok[8];
+  int n = 0, i = 1;
+  double v;
+  unsigned w;
+  char *c = strpbrk(line, "#;");
+  if (c) *c = '\0';
+  for (char *save, *t = strtok_r(line, " \t\r\n", &save); t && n < 8; t = strtok_r(NULL, " \t\r\n", &save))
+    tok[n++] = t;
+  if (n == 0) return 0;
+
+  for (w = 0; w < N_ENTRIES(prog_words); w++)
+    if (!strcasecmp(tok[0], prog_words[w].name)) break;
+  if (w == N_ENTRIES(prog_words)) goto bad;
+  op->op = prog_words[w].op;
+  op->dir = FWD;
+  op->act = ACTION_RESET;
+  op->param = 0;
+  op->value = 0;
+  op->speed = 0;
+
+  switch (op->op)
+  {
+    case dSPIN_OP_AXIS:
+      if (!prog_number(i < n ? tok[i++] : NULL, &v) || v < 0 || v >= dSPIN_MAX_AXES) goto bad;
+      op->value = (unsigned long)v;
+      break;
+    case dSPIN_OP_MOVE:
+      if (!prog_dir_value(tok, n, &i, &op->dir, &v) || v > 0x3FFFFF || v != (double)(long)v) goto bad;
+      op->value = (unsigned long)v;
+      if (i < n)
+      {
+        if (!prog_number(tok[i++], &v) || v <= 0) goto bad;
+        op->speed = MaxSpdCalc(v);
+        if (op->speed == 0) op->speed = 1;
+      }
+      break;
+    case dSPIN_OP_GOTO:
+      if (!prog_number(i < n ? tok[i++] : NULL, &v) || !prog_position(v, &op->value)) goto bad;
+      break;
+    case dSPIN_OP_RUN:
+    case dSPIN_OP_UNTIL:
+      if (!prog_dir_value(tok, n, &i, &op->dir, &v)) goto bad;
+      op->value = SpdCalc(v);
+      if (op->op == dSPIN_OP_UNTIL && i < n && !strcasecmp(tok[i], "copy")) { op->act = ACTION_COPY; i++; }
+      break;
+    case dSPIN_OP_RELEASE:
+      if (i < n && !strcasecmp(tok[i], "fwd")) op->dir = FWD;
+      else if (i < n && !strcasecmp(tok[i], "rev")) op->dir = REV;
+      else goto bad;
+      i++;
+      if (i < n && !strcasecmp(tok[i], "copy")) { op->act = ACTION_COPY; i++; }
+      break;
+    case dSPIN_OP_BLEND:
+      if (i < n && !strcasecmp(tok[i], "on")) op->value = 1;
+      else if (i >= n || strcasecmp(tok[i], "off")) goto bad;
+      i++;
+      break;
+    case dSPIN_OP_DWELL:
+      if (!prog_number(i < n ? tok[i++] : NULL, &v) || v < 0) goto bad;
+      op->value = (unsigned long)v;
+      break;
+    case dSPIN_OP_SET:
+    {
+      unsigned r;
+      if (i >= n) goto bad;
+      for (r = 0; r < N_ENTRIES(prog_regs); r++)
+        if (!strcasecmp(tok[i], prog_regs[r].name)) break;
+      if (r == N_ENTRIES(prog_regs) || !prog_number(i + 1 < n ? tok[i + 1] : NULL, &v)) goto bad;
+      i += 2;
+      op->param = prog_regs[r].param;
+      // ABS_POS and MARK are two's complement, as goto's POS is; nothing else
+      //  goes below zero, and saturating it to full scale would be worse.
+      int is_pos = op->param == dSPIN_ABS_POS || op->param == dSPIN_MARK;
+      if (is_pos && !prog_position(v, &op->value)) goto bad;
+      if (v < 0 && !is_pos) goto bad;
+      switch (prog_regs[r].units)
+      {
+        case PROG_MAX_SPD: op->value = MaxSpdCalc(v); break;
+        case PROG_MIN_SPD: op->value = MinSpdCalc(v); break;
+        case PROG_FS_SPD:  op->value = FSCalc(v); break;
+        case PROG_ACC:     op->value = AccCalc(v); break;
+        default:
+          if (!is_pos) op->value = (unsigned long)v;
+          break;
+      }
+      break;
+    }
+  }
+  if (i != n) goto bad;
+  return 1;
+
+bad:
+  op->op = dSPIN_OP_ERROR;
+  return -1;
+}
+
+static void prog_push(dSPIN_Program *p, const dSPIN_ProgOp *op)
+{
+  pthread_mutex_lock(&p->lock);
+  while (p->count == p->size && !p->quit) pthread_cond_wait(&p->room, &p->lock);
+  if (!p->quit)
+  {
+    p->ring[(p->head + p->count) % p->size] = *op;
+    p->count++;
+    if (p->count > p->stats.peak) p->stats.peak = p->count;
+    p->stats.ops++;
+    pthread_cond_signal(&p->more);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void *prog_reader(void *arg)
+{
+  dSPIN_Program *p = (dSPIN_Program *)arg;
+  char line[dSPIN_PROGRAM_LINE];
+  dSPIN_ProgOp op;
+  int n = 0;
+  // Units are converted for the axis the commands go to (see dSPIN_SetOsc()),
+  //  so the reader follows the "axis" commands too.
+  dSPIN_Select(p->axis);
+  while (!p->quit && fgets(line, sizeof(line), p->in))
+  {
+    n++;
+    size_t len = strlen(line);
+    if (len == sizeof(line) - 1 && line[len - 1] != '\n')
+    {
+      // Too long: report it and skip the rest of it.
+      int ch;
+      while ((ch = fgetc(p->in)) != EOF && ch != '\n');
+      op.op = dSPIN_OP_ERROR;
+    }
+    else if (dSPIN_Program_Parse(line, &op) == 0) continue;
+    else if (op.op == dSPIN_OP_AXIS) dSPIN_Select((int)op.value);
+    op.line = n;
+    prog_push(p, &op);
+    if (op.op == dSPIN_OP_ERROR) break;
+  }
+  op.op = dSPIN_OP_END;
+  op.line = n;
+  prog_push(p, &op);
+  pthread_mutex_lock(&p->lock);
+  p->stats.lines = n;
+  p->done = 1;
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// Start reading a program from in, keeping up to lookahead commands parsed
+//  ahead of the one executing. Returns NULL if the reader can't be started.
+dSPIN_Program *dSPIN_Program_Open(FILE *in, int lookahead)
+{
+  dSPIN_Program *p = (dSPIN_Program *)calloc(1, sizeof(*p));
+  if (p == NULL) return NULL;
+  p->in = in;
+  p->axis = dSPIN_Selected();
+  p->size = lookahead > 0 ? lookahead : dSPIN_PROGRAM_LOOKAHEAD;
+  p->ring = (dSPIN_ProgOp *)calloc(p->size, sizeof(dSPIN_ProgOp));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->more, NULL);
+  pthread_cond_init(&p->room, NULL);
+  if (p->ring == NULL || pthread_create(&p->reader, NULL, prog_reader, p) != 0)
+  {
+    free(p->ring);
+    free(p);
+    return NULL;
+  }
+  return p;
+}
+
+// Take the next command, waiting for the reader if it's fallen behind.
+static void prog_pop(dSPIN_Program *p, dSPIN_ProgOp *op)
+{
+  pthread_mutex_lock(&p->lock);
+  if (p->count == 0)
+  {
+    unsigned long long t = dSPIN_Now();
+    p->stats.starved++;
+    while (p->count == 0) pthread_cond_wait(&p->more, &p->lock);
+    p->stats.starved_ns += dSPIN_Now() - t;
+  }
+  *op = p->ring[p->head];
+  p->head = (p->head + 1) % p->size;
+  p->count--;
+  pthread_cond_signal(&p->room);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Look at the command k places after the next one to be popped, waiting for
+//  the reader to get that far. k must be less than the lookahead.
+static void prog_peek(dSPIN_Program *p, int k, dSPIN_ProgOp *op)
+{
+  pthread_mutex_lock(&p->lock);
+  while (p->count <= k && !p->done) pthread_cond_wait(&p->more, &p->lock);
+  if (p->count > k) *op = p->ring[(p->head + k) % p->size];
+  else op->op = dSPIN_OP_END;
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void prog_wait()
+{
+  while (dSPIN_Busy()) delayMicroseconds(dSPIN_PROGRAM_POLL_US);
+}
+
+// Let a positioning command finish before the next one, with the soft stop
+//  the errata calls for in between.
+static void prog_settle()
+{
+  prog_wait();
+  dSPIN_SoftStop();
+  prog_wait();
+}
+
+// A command on line the limits refused: stop whatever the motor is still
+//  doing, and say why.
+static int prog_refused(int line)
+{
+  int id;
+  int why = dSPIN_Limits_Last(&id);
+  dSPIN_SoftStop();
+  prog_wait();
+  if (id >= 0) fprintf(stderr, "program line %d: refused by the limits (%d, zone %d)\n", line, why, id);
+  else fprintf(stderr, "program line %d: refused by the limits (%d)\n", line, why);
+  return -1;
+}
+
+// Execute the next command. Returns 1 while there's more to do, 0 at the end
+//  of the program, and -1 on a bad line or a refused command (reported on
+//  stderr).
+int dSPIN_Program_Step(dSPIN_Program *p)
+{
+  dSPIN_ProgOp op;
+  prog_pop(p, &op);
+  switch (op.op)
+  {
+    case dSPIN_OP_END:
+      prog_wait();
+      return 0;
+    case dSPIN_OP_ERROR:
+      fprintf(stderr, "program line %d: can't make sense of it\n", op.line);
+      return -1;
+    case dSPIN_OP_AXIS:
+      if ((int)op.value >= dSPIN_Axes())
+      {
+        fprintf(stderr, "program line %d: no axis %lu\n", op.line, op.value);
+        return -1;
+      }
+      dSPIN_Select((int)op.value);
+      break;
+    case dSPIN_OP_MOVE:
+      if (p->blend || op.speed)
+      {
+        // Take the moves queued up behind this one along too.
+        dSPIN_Segment seg[dSPIN_BLEND_MAX];
+        dSPIN_BlendStats bst;
+        int n = 0;
+        seg[n].dir = op.dir;
+        seg[n].steps = op.value;
+        seg[n++].speed = op.speed;
+        while (p->blend && n < dSPIN_BLEND_MAX)
+        {
+          dSPIN_ProgOp next;
+          prog_peek(p, 0, &next);
+          if (next.op != dSPIN_OP_MOVE) break;
+          prog_pop(p, &next);
+          seg[n].dir = next.dir;
+          seg[n].steps = next.value;
+          seg[n++].speed = next.speed;
+        }
+        int r = dSPIN_Blend(seg, n, &bst);
+        p->stats.blended += bst.chains;
+        if (r != dSPIN_STATUS_GOOD) return prog_refused(op.line);
+        p->stats.executed += n - 1;
+      }
+      else
+      {
+        prog_settle();
+        dSPIN_Move(op.dir, op.value);
+      }
+      break;
+    case dSPIN_OP_GOTO:    prog_settle(); dSPIN_GoTo(op.value); break;
+    case dSPIN_OP_HOME:    prog_settle(); dSPIN_GoHome(); break;
+    case dSPIN_OP_MARK:    prog_settle(); dSPIN_GoMark(); break;
+    case dSPIN_OP_UNTIL:   prog_settle(); dSPIN_GoUntil(op.act, op.dir, op.value); break;
+    case dSPIN_OP_RELEASE: prog_settle(); dSPIN_ReleaseSW(op.act, op.dir); break;
+    case dSPIN_OP_RUN:     dSPIN_Run(op.dir, op.value); break;
+    case dSPIN_OP_ZERO:    dSPIN_ResetPos(); break;
+    case dSPIN_OP_STOP:    dSPIN_SoftStop(); break;
+    case dSPIN_OP_HARDSTOP: dSPIN_HardStop(); break;
+    case dSPIN_OP_SOFTHIZ: dSPIN_SoftHiZ(); break;
+    case dSPIN_OP_HIZ:     dSPIN_HardHiZ(); break;
+    case dSPIN_OP_WAIT:    prog_wait(); break;
+    case dSPIN_OP_DWELL:   prog_wait(); delay(op.value); break;
+    case dSPIN_OP_SET:     dSPIN_SetParam(op.param, op.value); break;
+    case dSPIN_OP_BLEND:   p->blend = (int)op.value; break;
+  }
+  switch (op.op)
+  {
+    case dSPIN_OP_MOVE:
+    case dSPIN_OP_GOTO:
+    case dSPIN_OP_HOME:
+    case dSPIN_OP_MARK:
+    case dSPIN_OP_RUN:
+      if (dSPIN_Limits_Last(NULL) != dSPIN_LIMIT_OK) return prog_refused(op.line);
+      break;
+  }
+  p->stats.executed++;
+  return 1;
+}
+
+// Execute the whole program. Returns dSPIN_STATUS_GOOD if it ran to the end.
+int dSPIN_Program_Run(dSPIN_Program *p)
+{
+  int r;
+  while ((r = dSPIN_Program_Step(p)) > 0);
+  return r == 0 ? dSPIN_STATUS_GOOD : dSPIN_STATUS_FATAL;
+}
+
+void dSPIN_Program_GetStats(dSPIN_Program *p, dSPIN_ProgramStats *stats)
+{
+  pthread_mutex_lock(&p->lock);
+  *stats = p->stats;
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Stop the reader and free the program. If the program didn't run to the end,
+//  this waits for the reader to finish the line it's reading. Doesn't close
+//  the FILE.
+void dSPIN_Program_Close(dSPIN_Program *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->room);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->reader, NULL);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->more);
+  pthread_cond_destroy(&p->room);
+  free(p->ring);
+  free(p);
+}
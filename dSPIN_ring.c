@@ -0,0 +1,486 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "dSPIN.h"
+
+//dSPIN_ring.c - Command rings in POSIX shared memory. The process that owns
+//   the bus creates a segment with a pair of rings for each client it will
+//   take: one carries commands from the client, the other carries back a
+//   completion record for each. A client in another process attaches, claims
+//   a free pair and from then on submits a Run, Move, GoTo or stop by writing
+//   a fixed-size record and bumping an index, with no socket or pipe between
+//   it and the bus.
+//
+// Each ring has one writer and one reader, so the indices need no locks:
+//  the writer fills a slot and then publishes the index that covers it, and
+//  the reader takes slots up to the index it sees. A side that has nothing
+//  to do sleeps on a futex in the segment; before going to sleep it says so
+//  in a flag, and the other side only makes the wake call when the flag is
+//  set, so a busy ring costs no system calls. The owner sleeps on one
+//  doorbell for all of its clients. With more than one CPU it spins for
+//  dSPIN_RING_SPIN_NS before sleeping, which saves a wake up when commands
+//  come close together.
+//
+// Commands are checked when they're submitted, and again by the owner, since
+//  a client's memory can't be trusted. The owner only takes a command when
+//  there's room for its completion, so a client that stops reaping is
+//  stopped too, and nobody else is held up.
+//
+// A client can queue setpoints faster than the bus can send them. The owner
+//  takes everything that's waiting at once, and a Run that a later Run for
+//  the same axis supersedes (or a GoTo that a later GoTo does) is dropped
+//  instead of sent, and completed as dSPIN_RING_COALESCED; the latest always
+//  goes out. Anything else on the axis is a barrier that nothing is merged
+//  across, as is a Run or GoTo submitted with dSPIN_RING_BARRIER.
+//
+// A motion command the axis' limits refuse (see dSPIN_limits.c) is completed
+//  as dSPIN_RING_LIMITED rather than dSPIN_RING_DONE.
+
+#define RING_VERSION 1
+
+typedef struct
+{
+  unsigned int magic;            // written last, once the segment is set up
+  unsigned int version;
+  unsigned int clients;
+  unsigned int axes;
+  unsigned int slots;
+  unsigned int cmd_size, done_size;
+  unsigned int bell __attribute__((aligned(64)));   // futex the owner sleeps on
+  unsigned int owner_waiting;
+} __attribute__((aligned(64))) RingHeader;
+
+// The indices count up forever; slot i is at i % dSPIN_RING_SLOTS. Each is
+//  written by one side only and has a cache line to itself.
+typedef struct
+{
+  int pid __attribute__((aligned(64)));              // client that claimed it, 0 if free
+  unsigned int seq;                                  // next sequence number
+  unsigned int cmd_tail __attribute__((aligned(64)));    // client
+  unsigned int cmd_head __attribute__((aligned(64)));    // owner
+  unsigned int done_tail __attribute__((aligned(64)));   // owner; the client sleeps on it
+  unsigned int done_head __attribute__((aligned(64)));   // client
+  unsigned int client_waiting;
+  dSPIN_RingCmd cmd[dSPIN_RING_SLOTS] __attribute__((aligned(64)));
+  dSPIN_RingDone done[dSPIN_RING_SLOTS];
+} RingPair;
+
+struct dSPIN_Ring
+{
+  char name[64];
+  int owner;
+  size_t size;
+  RingHeader *hdr;
+  RingPair *pair;
+  RingPair *mine;                // a client's pair
+  unsigned int first_seq;        //  and the first sequence number it had
+  long spin_ns;
+  unsigned long served;
+  dSPIN_RingStats stats;
+};
+
+static size_t ring_size(int clients)
+{
+  return sizeof(RingHeader) + (size_t)clients * sizeof(RingPair);
+}
+
+static unsigned long long ring_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Sleep while *addr is val, for at most ms milliseconds (forever if < 0).
+//  The segment is shared between processes, so these aren't private futexes.
+static void ring_sleep(unsigned int *addr, unsigned int val, int ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void ring_wake(unsigned int *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Whether c is a command the owner will carry out: a known operation on an
+//  axis it takes, with an argument no larger than the command's field.
+static int ring_check(const dSPIN_RingCmd *c, unsigned int axes)
+{
+  if (c->axis >= axes || (c->dir != FWD && c->dir != REV)) return 0;
+  switch (c->op & ~dSPIN_RING_BARRIER)
+  {
+    case dSPIN_RING_RUN:  return c->arg <= 0xFFFFF;
+    case dSPIN_RING_MOVE: return c->arg <= 0x3FFFFF;
+    case dSPIN_RING_GOTO: return c->arg <= 0x3FFFFF;
+    case dSPIN_RING_SOFT_STOP:
+    case dSPIN_RING_HARD_STOP:
+    case dSPIN_RING_SOFT_HIZ:
+    case dSPIN_RING_HARD_HIZ:
+      return 1;
+  }
+  return 0;
+}
+
+// Create the segment name (e.g. dSPIN_RING_NAME) with a pair of rings for
+//  each of clients clients, taking commands for axes 0 to axes - 1. Replaces
+//  a segment of the same name left behind by an owner that died. Returns
+//  NULL if the segment can't be made.
+dSPIN_Ring *dSPIN_Ring_Create(const char *name, int clients, int axes)
+{
+  if (clients < 1 || axes < 1 || axes > dSPIN_MAX_AXES
+      || strlen(name) >= sizeof(((dSPIN_Ring *)0)->name))
+    return NULL;
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+  if (fd < 0) return NULL;
+  size_t size = ring_size(clients);
+  void *m = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  dSPIN_Ring *r = m == MAP_FAILED ? NULL : (dSPIN_Ring *)calloc(1, sizeof(*r));
+  if (r == NULL)
+  {
+    if (m != MAP_FAILED) munmap(m, size);
+    shm_unlink(name);
+    return NULL;
+  }
+  strcpy(r->name, name);
+  r->owner = 1;
+  r->size = size;
+  r->hdr = (RingHeader *)m;
+  r->pair = (RingPair *)(r->hdr + 1);
+  r->spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? dSPIN_RING_SPIN_NS : 0;
+  r->hdr->version = RING_VERSION;
+  r->hdr->clients = clients;
+  r->hdr->axes = axes;
+  r->hdr->slots = dSPIN_RING_SLOTS;
+  r->hdr->cmd_size = sizeof(dSPIN_RingCmd);
+  r->hdr->done_size = sizeof(dSPIN_RingDone);
+  __atomic_store_n(&r->hdr->magic, dSPIN_RING_MAGIC, __ATOMIC_RELEASE);
+  return r;
+}
+
+// Attach to a segment the bus owner created and claim a free pair of rings,
+//  or one whose client has died. Returns NULL if there isn't a segment, it
+//  was built differently, or every pair is taken. Completions still due to a
+//  dead client are skipped by the one that takes its place.
+dSPIN_Ring *dSPIN_Ring_Attach(const char *name)
+{
+  if (strlen(name) >= sizeof(((dSPIN_Ring *)0)->name)) return NULL;
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) return NULL;
+  struct stat sb;
+  void *m = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(RingHeader))
+    m = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return NULL;
+  RingHeader *h = (RingHeader *)m;
+  dSPIN_Ring *r = NULL;
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == dSPIN_RING_MAGIC
+      && h->version == RING_VERSION && h->slots == dSPIN_RING_SLOTS
+      && h->cmd_size == sizeof(dSPIN_RingCmd) && h->done_size == sizeof(dSPIN_RingDone)
+      && h->clients >= 1 && ring_size(h->clients) <= (size_t)sb.st_size)
+    r = (dSPIN_Ring *)calloc(1, sizeof(*r));
+  if (r == NULL)
+  {
+    munmap(m, sb.st_size);
+    return NULL;
+  }
+  strcpy(r->name, name);
+  r->size = sb.st_size;
+  r->hdr = h;
+  r->pair = (RingPair *)(h + 1);
+  r->spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? dSPIN_RING_SPIN_NS : 0;
+  int me = (int)getpid();
+  for (unsigned int i = 0; i < h->clients && r->mine == NULL; i++)
+  {
+    RingPair *p = &r->pair[i];
+    int pid = __atomic_load_n(&p->pid, __ATOMIC_ACQUIRE);
+    if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) continue;
+    if (__atomic_compare_exchange_n(&p->pid, &pid, me, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      r->mine = p;
+  }
+  if (r->mine == NULL)
+  {
+    munmap(m, r->size);
+    free(r);
+    return NULL;
+  }
+  r->first_seq = r->mine->seq;
+  return r;
+}
+
+int dSPIN_Ring_Axes(const dSPIN_Ring *r)
+{
+  return r->hdr->axes;
+}
+
+// Client: queue a command for the owner; a Run or GoTo that must be sent even
+//  if a later one supersedes it has dSPIN_RING_BARRIER or'ed into op. Returns
+//  its sequence number, which its completion will carry, or -1 if the command
+//  isn't valid (an axis the owner doesn't take, an unknown operation, an
+//  argument out of range) and -2 if the ring is full.
+int dSPIN_Ring_Submit(dSPIN_Ring *r, byte op, int axis, byte dir, unsigned long arg)
+{
+  RingPair *p = r->mine;
+  if (p == NULL || axis < 0) return -1;
+  unsigned int tail = p->cmd_tail;
+  if (tail - __atomic_load_n(&p->cmd_head, __ATOMIC_ACQUIRE) >= dSPIN_RING_SLOTS) return -2;
+  dSPIN_RingCmd *c = &p->cmd[tail % dSPIN_RING_SLOTS];
+  c->op = op;
+  c->dir = dir;
+  c->axis = (unsigned short)axis;
+  c->arg = (unsigned int)arg;
+  if (axis > 0xFFFF || arg > 0xFFFFFFFFUL || !ring_check(c, r->hdr->axes)) return -1;
+  c->seq = p->seq++ & 0x7FFFFFFF;
+  c->submit_ns = ring_now();
+  __atomic_store_n(&p->cmd_tail, tail + 1, __ATOMIC_RELEASE);
+  // Pairs with the owner setting owner_waiting and then looking at the rings.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->hdr->owner_waiting, __ATOMIC_RELAXED))
+  {
+    __atomic_add_fetch(&r->hdr->bell, 1, __ATOMIC_RELEASE);
+    ring_wake(&r->hdr->bell);
+  }
+  return (int)c->seq;
+}
+
+// Take up to max completions that are ready into done[]; the ones a dead
+//  client left are dropped.
+static int ring_reap(dSPIN_Ring *r, dSPIN_RingDone *done, int max)
+{
+  RingPair *p = r->mine;
+  unsigned int head = p->done_head;
+  unsigned int tail = __atomic_load_n(&p->done_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+  while (head != tail && n < max)
+  {
+    const dSPIN_RingDone *d = &p->done[head++ % dSPIN_RING_SLOTS];
+    // Sequence numbers are 31 bits; older than first_seq is a dead client's.
+    if ((int)((d->seq - r->first_seq) << 1) >= 0) done[n++] = *d;
+  }
+  __atomic_store_n(&p->done_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+// Client: collect completions, up to max of them, in submission order.
+//  Waits up to timeout_ms for the first one (forever if < 0, not at all if
+//  0). Returns how many were collected.
+int dSPIN_Ring_Reap(dSPIN_Ring *r, dSPIN_RingDone *done, int max, int timeout_ms)
+{
+  RingPair *p = r->mine;
+  if (p == NULL || max < 1) return 0;
+  int n = ring_reap(r, done, max);
+  if (n > 0 || timeout_ms == 0) return n;
+  unsigned long long start = ring_now();
+  while (ring_now() - start < (unsigned long long)r->spin_ns)
+    if ((n = ring_reap(r, done, max)) > 0) return n;
+  for (;;)
+  {
+    unsigned int tail = __atomic_load_n(&p->done_tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->client_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->done_tail, __ATOMIC_RELAXED) == p->done_head)
+    {
+      int left = timeout_ms;
+      if (timeout_ms > 0)
+      {
+        long long spent = (long long)((ring_now() - start) / 1000000ULL);
+        if (spent >= timeout_ms) left = 0;
+        else left = timeout_ms - (int)spent;
+      }
+      if (left != 0) ring_sleep(&p->done_tail, tail, left);
+    }
+    __atomic_store_n(&p->client_waiting, 0, __ATOMIC_RELAXED);
+    if ((n = ring_reap(r, done, max)) > 0) return n;
+    if (timeout_ms >= 0 && ring_now() - start >= timeout_ms * 1000000ULL) return 0;
+  }
+}
+
+// Carry out one command on the bus and fill in its completion.
+static void ring_exec(const dSPIN_RingCmd *c, dSPIN_RingDone *d, unsigned int axes)
+{
+  d->seq = c->seq;
+  d->axis = c->axis;
+  d->op = c->op;
+  d->submit_ns = c->submit_ns;
+  d->bus_ns = ring_now();
+  if (!ring_check(c, axes))
+  {
+    d->result = dSPIN_RING_INVALID;
+    return;
+  }
+  d->result = dSPIN_RING_DONE;
+  dSPIN_Select(c->axis);
+  switch (c->op & ~dSPIN_RING_BARRIER)
+  {
+    case dSPIN_RING_RUN:       dSPIN_Run(c->dir, c->arg); break;
+    case dSPIN_RING_MOVE:      dSPIN_Move(c->dir, c->arg); break;
+    case dSPIN_RING_GOTO:      dSPIN_GoTo(c->arg); break;
+    case dSPIN_RING_SOFT_STOP: dSPIN_SoftStop(); break;
+    case dSPIN_RING_HARD_STOP: dSPIN_HardStop(); break;
+    case dSPIN_RING_SOFT_HIZ:  dSPIN_SoftHiZ(); break;
+    case dSPIN_RING_HARD_HIZ:  dSPIN_HardHiZ(); break;
+  }
+  byte op = c->op & ~dSPIN_RING_BARRIER;
+  if ((op == dSPIN_RING_RUN || op == dSPIN_RING_MOVE || op == dSPIN_RING_GOTO)
+      && dSPIN_Limits_Last(NULL) != dSPIN_LIMIT_OK)
+    d->result = dSPIN_RING_LIMITED;
+}
+
+// What a command supersedes: 1 for Run, 2 for GoTo, 0 if it's a barrier.
+static int ring_class(const dSPIN_RingCmd *c)
+{
+  if (c->op == dSPIN_RING_RUN) return 1;
+  if (c->op == dSPIN_RING_GOTO) return 2;
+  return 0;
+}
+
+// Mark in drop[] the commands of batch[] that a later one of the same class
+//  on the same axis supersedes, with no barrier between them. Newest first:
+//  last[] holds the class of the newest command seen on each axis since its
+//  last barrier.
+static void ring_coalesce(const dSPIN_RingCmd *batch, int n, byte *drop, unsigned int axes)
+{
+  byte last[dSPIN_MAX_AXES];
+  memset(last, 0, sizeof(last));
+  for (int k = n - 1; k >= 0; k--)
+  {
+    const dSPIN_RingCmd *c = &batch[k];
+    drop[k] = 0;
+    if (!ring_check(c, axes)) continue;
+    int cls = ring_class(c);
+    drop[k] = cls != 0 && last[c->axis] == cls;
+    last[c->axis] = cls;
+  }
+}
+
+// Complete a superseded command without sending it.
+static void ring_drop(const dSPIN_RingCmd *c, dSPIN_RingDone *d)
+{
+  d->seq = c->seq;
+  d->axis = c->axis;
+  d->op = c->op;
+  d->submit_ns = c->submit_ns;
+  d->bus_ns = 0;
+  d->result = dSPIN_RING_COALESCED;
+}
+
+// Carry out whatever every client has queued. Returns how many commands.
+static int ring_drain(dSPIN_Ring *r)
+{
+  int n = 0;
+  for (unsigned int i = 0; i < r->hdr->clients; i++)
+  {
+    RingPair *p = &r->pair[i];
+    unsigned int head = p->cmd_head;
+    unsigned int tail = __atomic_load_n(&p->cmd_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) continue;
+    unsigned int dtail = p->done_tail;
+    unsigned int room = dSPIN_RING_SLOTS - (dtail - __atomic_load_n(&p->done_head, __ATOMIC_ACQUIRE));
+    unsigned int took = tail - head;
+    if (took > room) took = room;
+    if (took == 0) continue;
+    // A client's memory can't be trusted: copy the commands before checking them.
+    dSPIN_RingCmd batch[dSPIN_RING_SLOTS];
+    byte drop[dSPIN_RING_SLOTS];
+    for (unsigned int k = 0; k < took; k++) batch[k] = p->cmd[(head + k) % dSPIN_RING_SLOTS];
+    ring_coalesce(batch, took, drop, r->hdr->axes);
+    for (unsigned int k = 0; k < took; k++)
+    {
+      dSPIN_RingDone *d = &p->done[dtail++ % dSPIN_RING_SLOTS];
+      if (drop[k])
+      {
+        ring_drop(&batch[k], d);
+        r->stats.coalesced++;
+        continue;
+      }
+      ring_exec(&batch[k], d, r->hdr->axes);
+      byte op = batch[k].op & ~dSPIN_RING_BARRIER;
+      if (d->result == dSPIN_RING_DONE && (op == dSPIN_RING_RUN || op == dSPIN_RING_GOTO))
+      {
+        unsigned long long age = d->bus_ns > d->submit_ns ? d->bus_ns - d->submit_ns : 0;
+        r->stats.setpoints++;
+        r->stats.age_ns_sum += age;
+        if (age > r->stats.age_ns_max) r->stats.age_ns_max = age;
+      }
+    }
+    head += took;
+    __atomic_store_n(&p->cmd_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&p->done_tail, dtail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->client_waiting, __ATOMIC_RELAXED)) ring_wake(&p->done_tail);
+    n += took;
+  }
+  return n;
+}
+
+// Owner: wait up to timeout_ms (forever if < 0, not at all if 0) for
+//  commands, and carry out all that have come in. Returns how many there
+//  were. Leaves the axis this thread has selected as it was.
+int dSPIN_Ring_Serve(dSPIN_Ring *r, int timeout_ms)
+{
+  if (!r->owner) return 0;
+  int was = dSPIN_Selected();
+  int n = ring_drain(r);
+  if (n == 0 && timeout_ms != 0)
+  {
+    unsigned long long start = ring_now();
+    while (n == 0 && ring_now() - start < (unsigned long long)r->spin_ns) n = ring_drain(r);
+    if (n == 0)
+    {
+      unsigned int bell = __atomic_load_n(&r->hdr->bell, __ATOMIC_RELAXED);
+      __atomic_store_n(&r->hdr->owner_waiting, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      n = ring_drain(r);
+      if (n == 0) ring_sleep(&r->hdr->bell, bell, timeout_ms);
+      __atomic_store_n(&r->hdr->owner_waiting, 0, __ATOMIC_RELAXED);
+      if (n == 0) n = ring_drain(r);
+    }
+  }
+  dSPIN_Select(was);
+  r->served += n;
+  return n;
+}
+
+// Commands carried out by the owner so far, coalesced ones included.
+unsigned long dSPIN_Ring_Served(const dSPIN_Ring *r)
+{
+  return r->served;
+}
+
+// Owner: how many setpoints were coalesced away, and how old the ones sent
+//  were when they went out.
+void dSPIN_Ring_GetStats(const dSPIN_Ring *r, dSPIN_RingStats *stats)
+{
+  *stats = r->stats;
+  stats->served = r->served;
+}
+
+void dSPIN_Ring_ResetStats(dSPIN_Ring *r)
+{
+  memset(&r->stats, 0, sizeof(r->stats));
+  r->served = 0;
+}
+
+// Detach and give the pair of rings back, or for the owner, take the
+//  segment down too.
+void dSPIN_Ring_Close(dSPIN_Ring *r)
+{
+  if (r->mine) __atomic_store_n(&r->mine->pid, 0, __ATOMIC_RELEASE);
+  munmap(r->hdr, r->size);
+  if (r->owner) shm_unlink(r->name);
+  free(r);
+}
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "dSPIN.h"
+
+//dSPIN_rt.c - Real-time mode. The bus is bit-banged, so a frame is only as
+//   even as the thread clocking it out: a page fault or a preemption halfway
+//   through a byte stretches SCK by however long the kernel takes, and an
+//   emergency stop or a step clock edge waits just as long. Real-time mode
+//   takes the usual steps against that, once, up front:
+//
+//   - the process' memory is locked, so nothing it touches is paged out;
+//   - heap is faulted in ahead of time and malloc is told never to give it
+//     back or to mmap(), so later allocations land on pages already there;
+//   - each real-time thread faults in its stack and moves to SCHED_FIFO on
+//     the configured CPUs as it starts.
+//
+// The bus stopper and the step clock generator join by themselves; any thread
+//  of the application's that drives the bus or streams setpoints joins with
+//  dSPIN_RT_Thread(dSPIN_RT_CONTROL). Whatever the system refuses is left as
+//  it was and reported, so the same program runs unprivileged, just without
+//  the guarantees. dSPIN_RT_Latency() measures what a thread of a given role
+//  actually gets: how late it wakes from an absolute sleep, as a histogram.
+
+static dSPIN_RTConfig rt_cfg;
+static int rt_on = 0;
+
+static unsigned long long rt_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Touch kb of stack below this frame, so the thread never faults on it later.
+static __attribute__((noinline)) void rt_prefault_stack(unsigned long kb)
+{
+  volatile char *p = (volatile char *)__builtin_alloca(kb * 1024);
+  for (unsigned long i = 0; i < kb * 1024; i += 4096) p[i] = 0;
+}
+
+// Turn real-time mode on as cfg says, for this process and the real-time
+//  threads started from now on. Call it before dSPIN_init(), which starts the
+//  bus stopper. Returns the dSPIN_RT_GOT_* for what was granted.
+int dSPIN_RT_Setup(const dSPIN_RTConfig *cfg)
+{
+  int got = 0;
+  rt_cfg = *cfg;
+  rt_on = 1;
+
+  if (cfg->lock)
+  {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) got |= dSPIN_RT_GOT_LOCK;
+    else fprintf(stderr, "real-time: mlockall refused (%s)\n", strerror(errno));
+  }
+  if (cfg->heap_kb > 0)
+  {
+    // Freed memory stays in the arena and big blocks come from it too,
+    //  so what's faulted in here is what later allocations get.
+    int kept = mallopt(M_TRIM_THRESHOLD, -1) && mallopt(M_MMAP_MAX, 0);
+    char *p = (char *)malloc(cfg->heap_kb * 1024);
+    if (p != NULL)
+    {
+      for (unsigned long i = 0; i < cfg->heap_kb * 1024; i += 4096) p[i] = 0;
+      free(p);
+      if (kept) got |= dSPIN_RT_GOT_HEAP;
+    }
+  }
+  return got | dSPIN_RT_Thread(dSPIN_RT_CONTROL);
+}
+
+// Non-zero once dSPIN_RT_Setup() has been called.
+int dSPIN_RT_Enabled()
+{
+  return rt_on;
+}
+
+// Make the calling thread a real-time thread of the given role: fault in its
+//  stack, pin it to the configured CPUs and move it to SCHED_FIFO at the
+//  role's priority, unless it already runs higher. Does nothing until
+//  dSPIN_RT_Setup(). Returns the dSPIN_RT_GOT_* for what was granted.
+int dSPIN_RT_Thread(int role)
+{
+  if (!rt_on) return 0;
+  int got = 0;
+
+  if (rt_cfg.stack_kb > 0)
+  {
+    rt_prefault_stack(rt_cfg.stack_kb);
+    got |= dSPIN_RT_GOT_STACK;
+  }
+
+  if (rt_cfg.cpus != 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c = 0; c < (int)(8 * sizeof(rt_cfg.cpus)) && c < CPU_SETSIZE; c++)
+      if (rt_cfg.cpus & (1UL << c)) CPU_SET(c, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) got |= dSPIN_RT_GOT_CPUS;
+    else fprintf(stderr, "real-time: CPU affinity refused\n");
+  }
+
+  if (rt_cfg.priority > 0)
+  {
+    int prio = rt_cfg.priority + role;
+    if (prio > sched_get_priority_max(SCHED_FIFO)) prio = sched_get_priority_max(SCHED_FIFO);
+    int policy;
+    struct sched_param sp;
+    pthread_getschedparam(pthread_self(), &policy, &sp);
+    if (policy == SCHED_FIFO && sp.sched_priority >= prio) got |= dSPIN_RT_GOT_FIFO;
+    else
+    {
+      sp.sched_priority = prio;
+      if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0) got |= dSPIN_RT_GOT_FIFO;
+      else fprintf(stderr, "real-time: SCHED_FIFO refused, running at normal priority\n");
+    }
+  }
+  return got;
+}
+
+/***************** wakeup latency ***********************/
+
+typedef struct
+{
+  int role;
+  unsigned long period_us, samples;
+  dSPIN_RTLatency *lat;
+  int got;
+} RTMeasure;
+
+// Percentile q of the histogram, to the bin; past the last bin, the maximum.
+static long rt_percentile(const dSPIN_RTLatency *lat, double q)
+{
+  unsigned long want = (unsigned long)(q * lat->samples), n = 0;
+  for (int b = 0; b < dSPIN_RT_HIST_BINS - 1; b++)
+  {
+    n += lat->hist[b];
+    if (n > want) return b * 1000L;
+  }
+  return lat->max_ns;
+}
+
+static void *rt_measure(void *arg)
+{
+  RTMeasure *m = (RTMeasure *)arg;
+  dSPIN_RTLatency *lat = m->lat;
+  m->got = dSPIN_RT_Thread(m->role);
+
+  double sum = 0;
+  unsigned long long next = rt_now();
+  for (unsigned long i = 0; i < m->samples; i++)
+  {
+    next += m->period_us * 1000ULL;
+    struct timespec ts;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    long late = (long)(rt_now() - next);
+    if (late < 0) late = 0;
+    if (lat->samples == 0 || late < lat->min_ns) lat->min_ns = late;
+    if (late > lat->max_ns) lat->max_ns = late;
+    long b = late / 1000;
+    if (b >= dSPIN_RT_HIST_BINS - 1)
+    {
+      b = dSPIN_RT_HIST_BINS - 1;
+      lat->overflow++;
+    }
+    lat->hist[b]++;
+    lat->samples++;
+    sum += late;
+    // Running behind: start over from now rather than firing a burst of
+    //  wakeups that were never slept for.
+    if (late > (long)(m->period_us * 1000)) next = rt_now();
+  }
+  if (lat->samples) lat->mean_ns = sum / lat->samples;
+  lat->p50_ns = rt_percentile(lat, 0.5);
+  lat->p99_ns = rt_percentile(lat, 0.99);
+  lat->p999_ns = rt_percentile(lat, 0.999);
+  return NULL;
+}
+
+// Measure wakeup latency as a thread of the given role sees it: samples
+//  absolute sleeps of period_us each, from a thread made real-time with
+//  dSPIN_RT_Thread(role) (an ordinary one if real-time mode is off). Fills in
+//  lat and returns the dSPIN_RT_GOT_* the thread was granted, or -1 if it
+//  couldn't be started.
+int dSPIN_RT_Latency(int role, unsigned long period_us, unsigned long samples,
+                     dSPIN_RTLatency *lat)
+{
+  memset(lat, 0, sizeof(*lat));
+  RTMeasure m = { role, period_us > 0 ? period_us : 1, samples, lat, 0 };
+  pthread_t t;
+  if (pthread_create(&t, NULL, rt_measure, &m) != 0) return -1;
+  pthread_join(t, NULL);
+  return m.got;
+}
@@ -0,0 +1,1145 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "dSPIN.h"
+
+//dSPIN_sim.c - Simulated L6470 chips behind the wiringPi calls the library
+//   makes. See dSPIN_sim.h for the public side. Everything in here runs under
+//   one lock, so the library can be driven from several threads (or a step
+//   clock thread can toggle STCK while the main thread talks SPI).
+//
+// The motion engine mirrors what the datasheet describes: speed is kept in
+//  steps/tick with 2^-40 resolution (so ACC and DEC are added as-is each tick),
+//  the position accumulator counts microsteps according to STEP_MODE, and
+//  positioning commands start decelerating as soon as the stopping distance
+//  at the current speed reaches the remaining distance. Long stretches of
+//  constant acceleration are applied in closed form so an idle or cruising
+//  chip costs nothing to keep up to date.
+
+#define SIM_MAX_DEVICES 256
+#define SIM_MAX_PINS    256
+#define SIM_FRAC_BITS   40
+#define SIM_FRAC_MASK   ((1ULL << SIM_FRAC_BITS) - 1)
+#define SIM_TICK_NS     250        // nominal 16MHz oscillator, 250ns tick
+#define SIM_INF_ACC     (1ULL << SIM_FRAC_BITS)  // ACC = 0xFFF: one tick to any speed
+#define SIM_SPD_5       1374390ULL // 5 steps/s in 2^-40 steps/tick; the floor
+                                   //  speed for ReleaseSW and final approach
+
+// Latched active-low alarm bits of STATUS.
+#define SIM_ALARMS (dSPIN_STATUS_UVLO | dSPIN_STATUS_TH_WRN | dSPIN_STATUS_TH_SD | \
+                    dSPIN_STATUS_OCD | dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B)
+// Latched active-high bits of STATUS.
+#define SIM_LATCHED (dSPIN_STATUS_SW_EVN | dSPIN_STATUS_NOTPERF_CMD | dSPIN_STATUS_WRONG_CMD)
+
+// Register widths, access classes and power-on values come from dSPIN_Regs
+//  in dSPIN.h, as the driver's frames do.
+
+typedef struct
+{
+  int cs, busy_pin, stck;
+
+  // SPI shift registers and command decoding.
+  byte in, out;
+  int bits;
+  byte cmd;
+  byte arg[3];
+  int arg_need, arg_have;
+  byte tx[3];
+  int tx_len, tx_pos;
+
+  unsigned long reg[dSPIN_REG_COUNT];
+  unsigned int latched;      // SIM_LATCHED bits currently set
+  unsigned int alarms;       // SIM_ALARMS bits currently active (read as 0)
+
+  // Motion engine.
+  int mode;
+  byte dir;                  // direction of travel
+  byte want_dir;             // direction the current command needs
+  int hiz, hiz_after_stop;
+  int decel;                 // positioning command is in its final ramp
+  int slope;                 // +1 accelerating, -1 decelerating, 0 constant
+  unsigned long long v;      // speed, 2^-40 full steps per tick
+  unsigned long long frac;   // fractional microstep, 2^-40 units
+  unsigned long long run_v;  // target speed for Run/GoUntil/ReleaseSW
+  long long phys;            // physical position in microsteps
+  long long origin;          // phys at which ABS_POS reads zero
+  long long slip;            // shaft position less phys: steps the motor missed
+  long long target;          // phys target of a positioning command
+  byte act;                  // GoUntil/ReleaseSW action
+
+  int sw_on;
+  long long sw_lo, sw_hi;
+  int sw_closed;
+
+  dSPIN_Sim_StallModel stall;
+  void *stall_arg;
+
+  unsigned long long epoch_ns;   // when the oscillator was at epoch_ticks
+  unsigned long long epoch_ticks;
+  double tick_ns;                // oscillator period, SIM_TICK_NS unless trimmed
+  unsigned long long ticks;
+  unsigned long long start_tick;
+  long start_pos;
+  unsigned long long stop_tick;
+  unsigned long long stck_edges;
+} SimDev;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static SimDev sim_dev[SIM_MAX_DEVICES];
+static int sim_ndev = 0;
+static byte sim_pin[SIM_MAX_PINS];
+static int sim_clock = dSPIN_SIM_CLOCK_REAL;
+static unsigned long long sim_vclock = 0;
+static unsigned long long sim_epoch = 0;
+
+static unsigned long long sim_mono()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long sim_now()
+{
+  if (sim_clock == dSPIN_SIM_CLOCK_VIRTUAL) return sim_vclock;
+  if (sim_epoch == 0) sim_epoch = sim_mono();
+  return sim_mono() - sim_epoch;
+}
+
+/******************** motion engine ********************/
+
+static unsigned long long sim_max_v(SimDev *d) { return (unsigned long long)d->reg[dSPIN_MAX_SPEED] << 22; }
+static unsigned long long sim_min_v(SimDev *d) { return (unsigned long long)(d->reg[dSPIN_MIN_SPEED] & 0xFFF) << 16; }
+static int sim_ms(SimDev *d) { return 1 << (d->reg[dSPIN_STEP_MODE] & dSPIN_STEP_MODE_STEP_SEL); }
+
+static unsigned long long sim_acc(SimDev *d)
+{
+  if (d->reg[dSPIN_ACC] == 0xFFF) return SIM_INF_ACC;
+  return d->reg[dSPIN_ACC] ? d->reg[dSPIN_ACC] : 1;
+}
+
+static unsigned long long sim_dec(SimDev *d)
+{
+  if (d->reg[dSPIN_ACC] == 0xFFF) return SIM_INF_ACC;
+  return d->reg[dSPIN_DEC] ? d->reg[dSPIN_DEC] : 1;
+}
+
+// Lowest speed a positioning command decelerates to before it creeps the rest
+//  of the way to its target.
+static unsigned long long sim_floor_v(SimDev *d)
+{
+  unsigned long long m = sim_min_v(d);
+  return m > SIM_SPD_5 ? m : SIM_SPD_5;
+}
+
+static long sim_abs_pos(SimDev *d)
+{
+  long p = (long)((d->phys - d->origin) & 0x3FFFFF);
+  if (p & 0x200000) p -= 0x400000;
+  return p;
+}
+
+// Microsteps left to the target of a positioning command, when travelling
+//  towards it.
+static long long sim_remaining(SimDev *d)
+{
+  return d->dir ? d->target - d->phys : d->phys - d->target;
+}
+
+// Distance (2^-40 microsteps) needed to stop from speed v.
+static long double sim_stop_dist(SimDev *d, unsigned long long v)
+{
+  return (long double)v * v / (2.0L * sim_dec(d)) * sim_ms(d);
+}
+
+// Distance covered in n ticks when the speed changes by s before each tick.
+static __int128 sim_travel(unsigned long long v, long long s, unsigned long long n, int ms)
+{
+  __int128 sum = (__int128)n * v + (__int128)n * (n + 1) / 2 * s;
+  return sum * ms;
+}
+
+static int sim_busy(SimDev *d)
+{
+  switch (d->mode)
+  {
+    case dSPIN_SIM_POSITION:
+    case dSPIN_SIM_STOPPING:
+    case dSPIN_SIM_GO_UNTIL:
+    case dSPIN_SIM_RELEASE_SW:
+      return 1;
+    case dSPIN_SIM_RUN:
+      return d->v != d->run_v || d->dir != d->want_dir;
+  }
+  return 0;
+}
+
+static void sim_stop(SimDev *d)
+{
+  d->mode = dSPIN_SIM_STOPPED;
+  d->v = 0;
+  d->frac = 0;
+  d->slope = 0;
+  d->decel = 0;
+  d->stop_tick = d->ticks;
+  if (d->hiz_after_stop) d->hiz = 1;
+  d->hiz_after_stop = 0;
+}
+
+static void sim_act(SimDev *d)
+{
+  if (d->act) d->reg[dSPIN_MARK] = sim_abs_pos(d) & 0x3FFFFF;
+  else d->origin = d->phys;
+}
+
+// Called whenever the position changes; handles switch edges.
+static void sim_switch(SimDev *d)
+{
+  if (!d->sw_on) return;
+  long long at = d->phys + d->slip;
+  int closed = at >= d->sw_lo && at <= d->sw_hi;
+  if (closed == d->sw_closed) return;
+  d->sw_closed = closed;
+  if (closed)
+  {
+    d->latched |= dSPIN_STATUS_SW_EVN;
+    int hard = !(d->reg[dSPIN_CONFIG] & dSPIN_CONFIG_SW_MODE);
+    if (d->mode == dSPIN_SIM_GO_UNTIL)
+    {
+      sim_act(d);
+      if (hard) sim_stop(d);
+      else { d->mode = dSPIN_SIM_STOPPING; d->slope = -1; }
+    }
+    else if (hard && d->mode != dSPIN_SIM_STOPPED && d->mode != dSPIN_SIM_STEP_CLOCK)
+      sim_stop(d);
+  }
+  else if (d->mode == dSPIN_SIM_RELEASE_SW)
+  {
+    sim_act(d);
+    sim_stop(d);
+  }
+}
+
+// Add travel (2^-40 microsteps) in the current direction.
+static void sim_apply(SimDev *d, __int128 travel)
+{
+  unsigned __int128 f = (unsigned __int128)d->frac + travel;
+  long long k = (long long)(f >> SIM_FRAC_BITS);
+  d->frac = (unsigned long long)(f & SIM_FRAC_MASK);
+  if (k == 0) return;
+  if (d->mode == dSPIN_SIM_POSITION && d->dir == d->want_dir && k >= sim_remaining(d))
+  {
+    d->phys = d->target;
+    sim_stop(d);
+    sim_switch(d);
+    return;
+  }
+  d->phys += d->dir ? k : -k;
+  sim_switch(d);
+}
+
+// Target speed for the speed-holding modes, taking a pending reversal into
+//  account (the chip brakes to zero before turning around).
+static unsigned long long sim_hold_v(SimDev *d)
+{
+  if (d->dir != d->want_dir) return 0;
+  return d->run_v;
+}
+
+// Reached zero speed while braking for a reversal.
+static void sim_reverse(SimDev *d)
+{
+  d->dir = d->want_dir;
+  d->frac = 0;
+  unsigned long long m = sim_min_v(d);
+  d->v = (d->mode == dSPIN_SIM_POSITION || m < d->run_v) ? m : d->run_v;
+}
+
+// One tick of the motion engine: update the speed, then move.
+static void sim_tick(SimDev *d)
+{
+  unsigned long long acc = sim_acc(d), dec = sim_dec(d);
+  switch (d->mode)
+  {
+    case dSPIN_SIM_RUN:
+    case dSPIN_SIM_GO_UNTIL:
+    case dSPIN_SIM_RELEASE_SW:
+    {
+      unsigned long long tv = sim_hold_v(d);
+      if (d->v < tv)
+      {
+        d->v = (tv - d->v > acc) ? d->v + acc : tv;
+        d->slope = 1;
+      }
+      else if (d->v > tv)
+      {
+        d->slope = -1;
+        if (d->v - tv > dec) d->v -= dec;
+        else
+        {
+          d->v = tv;
+          if (tv == 0) sim_reverse(d);
+        }
+      }
+      else d->slope = 0;
+      break;
+    }
+    case dSPIN_SIM_POSITION:
+    {
+      if (d->dir != d->want_dir)
+      {
+        d->slope = -1;
+        if (d->v > dec) d->v -= dec;
+        else sim_reverse(d);
+        break;
+      }
+      __int128 rem = ((__int128)sim_remaining(d) << SIM_FRAC_BITS) - d->frac;
+      unsigned long long vmax = sim_max_v(d);
+      if (d->decel || sim_stop_dist(d, d->v) >= (long double)rem)
+      {
+        unsigned long long fl = sim_floor_v(d);
+        d->decel = 1;
+        d->slope = -1;
+        if (d->v > fl + dec) d->v -= dec;
+        else { d->v = fl; d->slope = 0; }
+      }
+      else if (d->v < vmax)
+      {
+        d->v = (vmax - d->v > acc) ? d->v + acc : vmax;
+        d->slope = 1;
+      }
+      else if (d->v > vmax)
+      {
+        d->v = (d->v - vmax > dec) ? d->v - dec : vmax;
+        d->slope = -1;
+      }
+      else d->slope = 0;
+      break;
+    }
+    case dSPIN_SIM_STOPPING:
+      d->slope = -1;
+      if (d->v > dec) d->v -= dec;
+      else { sim_stop(d); return; }
+      break;
+    default:
+      return;
+  }
+  sim_apply(d, sim_travel(d->v, 0, 1, sim_ms(d)));
+}
+
+// Microsteps before the next switch edge in the direction of travel, or -1.
+static long long sim_switch_dist(SimDev *d)
+{
+  if (!d->sw_on) return -1;
+  long long at = d->phys + d->slip;
+  if (d->dir)
+  {
+    if (at < d->sw_lo) return d->sw_lo - at;
+    if (at <= d->sw_hi) return d->sw_hi + 1 - at;
+  }
+  else
+  {
+    if (at > d->sw_hi) return at - d->sw_hi;
+    if (at >= d->sw_lo) return at - (d->sw_lo - 1);
+  }
+  return -1;
+}
+
+// Does a jump of n ticks at slope s stay clear of every per-tick decision?
+static int sim_jump_ok(SimDev *d, long long s, unsigned long long n, int accel_check)
+{
+  int ms = sim_ms(d);
+  __int128 t = sim_travel(d->v, s, n, ms);
+  long long e = sim_switch_dist(d);
+  if (e >= 0 && (__int128)d->frac + t >= ((__int128)e << SIM_FRAC_BITS)) return 0;
+  if (d->mode == dSPIN_SIM_POSITION && d->dir == d->want_dir)
+  {
+    __int128 rem = ((__int128)sim_remaining(d) << SIM_FRAC_BITS) - d->frac - t;
+    if (rem <= 0) return 0;
+    if (accel_check)
+    {
+      unsigned long long vn = d->v + s * (long long)n;
+      if (sim_stop_dist(d, vn) >= (long double)rem) return 0;
+    }
+  }
+  return 1;
+}
+
+// Work out how many ticks can be applied in closed form from the current
+//  state (0 means take a single tick) and the slope to apply them with.
+static unsigned long long sim_plan(SimDev *d, unsigned long long left, long long *slope)
+{
+  unsigned long long acc = sim_acc(d), dec = sim_dec(d);
+  unsigned long long nmax = left;
+  int accel_check = 0;
+  long long s = 0;
+  switch (d->mode)
+  {
+    case dSPIN_SIM_RUN:
+    case dSPIN_SIM_GO_UNTIL:
+    case dSPIN_SIM_RELEASE_SW:
+    {
+      unsigned long long tv = sim_hold_v(d);
+      if (d->v < tv) { s = acc; nmax = (tv - d->v - 1) / acc; }
+      else if (d->v > tv) { s = -(long long)dec; nmax = (d->v - tv - 1) / dec; }
+      break;
+    }
+    case dSPIN_SIM_POSITION:
+    {
+      if (d->dir != d->want_dir)
+      {
+        if (d->v <= dec) return 0;
+        s = -(long long)dec;
+        nmax = (d->v - 1) / dec;
+        break;
+      }
+      unsigned long long vmax = sim_max_v(d);
+      __int128 rem = ((__int128)sim_remaining(d) << SIM_FRAC_BITS) - d->frac;
+      if (!d->decel && sim_stop_dist(d, d->v) >= (long double)rem) return 0;
+      if (d->decel)
+      {
+        unsigned long long fl = sim_floor_v(d);
+        if (d->v > fl) { s = -(long long)dec; nmax = (d->v - fl - 1) / dec; }
+        else if (d->v < fl) return 0;
+      }
+      else
+      {
+        accel_check = 1;
+        if (d->v < vmax) { s = acc; nmax = (vmax - d->v - 1) / acc; }
+        else if (d->v > vmax) return 0;
+      }
+      break;
+    }
+    case dSPIN_SIM_STOPPING:
+      if (d->v <= dec) return 0;
+      s = -(long long)dec;
+      nmax = (d->v - 1) / dec;
+      break;
+    default:
+      *slope = 0;
+      return left;
+  }
+  if (nmax > left) nmax = left;
+  *slope = s;
+  if (nmax == 0 || sim_jump_ok(d, s, nmax, accel_check)) return nmax;
+  unsigned long long lo = 0, hi = nmax;
+  while (hi - lo > 1)
+  {
+    unsigned long long mid = lo + (hi - lo) / 2;
+    if (sim_jump_ok(d, s, mid, accel_check)) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Ask the device's stall model about the stretch just run, from speed v0 to
+//  v1 with the speed changing by s each tick, and raise what it reports.
+static void sim_load(SimDev *d, unsigned long long v0, unsigned long long v1, long long s)
+{
+  const double tps = 1e9 / d->tick_ns;
+  const double unit = (double)(1ULL << SIM_FRAC_BITS);
+  dSPIN_Sim_Load op;
+  op.speed = (v0 > v1 ? v0 : v1) * tps / unit;
+  op.accel = s * tps * tps / unit;
+  op.kval = d->reg[s > 0 ? dSPIN_KVAL_ACC : (s < 0 ? dSPIN_KVAL_DEC : dSPIN_KVAL_RUN)];
+  op.ocd_th = d->reg[dSPIN_OCD_TH];
+  op.stall_th = d->reg[dSPIN_STALL_TH];
+  unsigned int bits = d->stall((int)(d - sim_dev), &op, d->stall_arg) & SIM_ALARMS;
+  if (!bits) return;
+  d->alarms |= bits;
+  if ((bits & dSPIN_STATUS_TH_SD)
+      || ((bits & dSPIN_STATUS_OCD) && (d->reg[dSPIN_CONFIG] & dSPIN_CONFIG_OC_SD)))
+  {
+    sim_stop(d);
+    d->hiz = 1;
+  }
+}
+
+// Bring a device up to the current time.
+static void sim_sync(SimDev *d)
+{
+  unsigned long long now = sim_now();
+  if (now < d->epoch_ns) return;
+  unsigned long long goal = d->epoch_ticks + (unsigned long long)((now - d->epoch_ns) / d->tick_ns);
+  while (d->ticks < goal)
+  {
+    long long s;
+    unsigned long long left = goal - d->ticks;
+    unsigned long long n = sim_plan(d, left, &s);
+    int moving = d->mode != dSPIN_SIM_STOPPED && d->mode != dSPIN_SIM_STEP_CLOCK;
+    unsigned long long v0 = d->v;
+    if (n == 0)
+    {
+      d->ticks++;
+      sim_tick(d);
+      if (moving && d->stall)
+        sim_load(d, v0, d->v, d->slope > 0 ? (long long)sim_acc(d) :
+                              (d->slope < 0 ? -(long long)sim_dec(d) : 0));
+      continue;
+    }
+    if (moving)
+    {
+      __int128 t = sim_travel(d->v, s, n, sim_ms(d));
+      d->v += s * (long long)n;
+      d->slope = s > 0 ? 1 : (s < 0 ? -1 : 0);
+      sim_apply(d, t);
+      if (d->stall) sim_load(d, v0, d->v, s);
+    }
+    d->ticks += n;
+  }
+}
+
+/******************** registers and commands ********************/
+
+static unsigned int sim_status(SimDev *d)
+{
+  unsigned int st = 0;
+  if (d->hiz) st |= dSPIN_STATUS_HIZ;
+  if (!sim_busy(d)) st |= dSPIN_STATUS_BUSY;
+  if (d->sw_closed) st |= dSPIN_STATUS_SW_F;
+  if (d->dir) st |= dSPIN_STATUS_DIR;
+  st |= d->latched;
+  if (d->mode != dSPIN_SIM_STOPPED && d->mode != dSPIN_SIM_STEP_CLOCK)
+  {
+    if (d->slope > 0) st |= 1 << 5;
+    else if (d->slope < 0) st |= 2 << 5;
+    else st |= 3 << 5;
+  }
+  st |= SIM_ALARMS & ~d->alarms;
+  if (d->mode == dSPIN_SIM_STEP_CLOCK) st |= dSPIN_STATUS_SCK_MOD;
+  return st;
+}
+
+static unsigned long sim_get(SimDev *d, byte param)
+{
+  switch (param)
+  {
+    case dSPIN_ABS_POS: return sim_abs_pos(d) & 0x3FFFFF;
+    case dSPIN_SPEED:   return (unsigned long)(d->v >> 12) & 0xFFFFF;
+    case dSPIN_ADC_OUT: return 0x10;
+    case dSPIN_STATUS:  return sim_status(d);
+  }
+  return d->reg[param];
+}
+
+static void sim_reset(SimDev *d)
+{
+  for (int i = 0; i < dSPIN_REG_COUNT; i++) d->reg[i] = dSPIN_Regs[i].reset;
+  d->arg_need = d->arg_have = 0;
+  d->tx_len = d->tx_pos = 0;
+  d->latched = 0;
+  d->alarms = dSPIN_STATUS_UVLO;
+  d->hiz_after_stop = 0;
+  sim_stop(d);
+  d->hiz = 1;
+  d->dir = d->want_dir = FWD;
+  d->origin = d->phys;
+}
+
+static int sim_stopped(SimDev *d) { return d->mode == dSPIN_SIM_STOPPED; }
+
+static void sim_notperf(SimDev *d) { d->latched |= dSPIN_STATUS_NOTPERF_CMD; }
+
+static void sim_set(SimDev *d, byte param, unsigned long value)
+{
+  if (param == 0) return;
+  const dSPIN_RegInfo &r = dSPIN_Regs[param];
+  if (r.access == dSPIN_REG_RO) { d->latched |= dSPIN_STATUS_WRONG_CMD; return; }
+  if (r.access == dSPIN_REG_WS && !sim_stopped(d)) { sim_notperf(d); return; }
+  if (r.access == dSPIN_REG_WH && !(sim_stopped(d) && d->hiz)) { sim_notperf(d); return; }
+  value &= dSPIN_RegMask(r) & ~r.reserved;
+  if (param == dSPIN_ABS_POS)
+  {
+    long p = (long)value;
+    if (p & 0x200000) p -= 0x400000;
+    d->origin = d->phys - p;
+    return;
+  }
+  d->reg[param] = value;
+}
+
+static void sim_start_hold(SimDev *d, int mode, byte dir, unsigned long long v)
+{
+  d->start_tick = d->ticks;
+  d->start_pos = sim_abs_pos(d);
+  d->mode = mode;
+  d->hiz = 0;
+  d->hiz_after_stop = 0;
+  d->decel = 0;
+  unsigned long long vmin = sim_min_v(d), vmax = sim_max_v(d);
+  if (mode != dSPIN_SIM_RELEASE_SW)
+  {
+    if (v > vmax) v = vmax;
+    if (v < vmin) v = vmin;
+  }
+  d->run_v = v;
+  d->want_dir = dir;
+  if (d->v == 0)
+  {
+    d->dir = dir;
+    d->frac = 0;
+    d->v = vmin < v ? vmin : v;
+  }
+}
+
+static void sim_start_position(SimDev *d, long long target, byte dir)
+{
+  d->start_tick = d->ticks;
+  d->start_pos = sim_abs_pos(d);
+  d->target = target;
+  d->want_dir = dir;
+  d->hiz = 0;
+  d->hiz_after_stop = 0;
+  d->decel = 0;
+  if (target == d->phys && d->v == 0) { sim_stop(d); return; }
+  d->mode = dSPIN_SIM_POSITION;
+  if (d->v == 0)
+  {
+    d->dir = dir;
+    d->frac = 0;
+    d->v = sim_min_v(d);
+  }
+}
+
+// Absolute positions are 22-bit two's complement; travel the short way round
+//  unless a direction is forced.
+static void sim_goto(SimDev *d, unsigned long pos, int forced_dir)
+{
+  long cur = sim_abs_pos(d);
+  long diff = ((long)pos - cur) & 0x3FFFFF;
+  byte dir;
+  if (forced_dir >= 0)
+  {
+    dir = forced_dir;
+    if (dir == REV && diff) diff -= 0x400000;
+  }
+  else
+  {
+    if (diff & 0x200000) diff -= 0x400000;
+    dir = diff >= 0 ? FWD : REV;
+  }
+  if (diff == 0) dir = d->dir;
+  sim_start_position(d, d->phys + diff, dir);
+}
+
+static void sim_execute(SimDev *d)
+{
+  unsigned long a = 0;
+  for (int i = 0; i < d->arg_have; i++) a = (a << 8) | d->arg[i];
+  byte c = d->cmd;
+  byte dir = c & 0x01;
+
+  if ((c & 0xE0) == dSPIN_SET_PARAM) { sim_set(d, c & 0x1F, a); return; }
+  if ((c & 0xFE) == dSPIN_RUN)
+  {
+    sim_start_hold(d, dSPIN_SIM_RUN, dir, (unsigned long long)(a & 0xFFFFF) << 12);
+    return;
+  }
+  if ((c & 0xFE) == dSPIN_MOVE)
+  {
+    if (!sim_stopped(d)) { sim_notperf(d); return; }
+    long long n = a & 0x3FFFFF;
+    sim_start_position(d, d->phys + (dir ? n : -n), dir);
+    return;
+  }
+  if (c == dSPIN_GOTO || (c & 0xFE) == dSPIN_GOTO_DIR)
+  {
+    if (sim_busy(d)) { sim_notperf(d); return; }
+    sim_goto(d, a & 0x3FFFFF, c == dSPIN_GOTO ? -1 : dir);
+    return;
+  }
+  if ((c & 0xF6) == dSPIN_GO_UNTIL)
+  {
+    d->act = (c >> 3) & 1;
+    sim_start_hold(d, dSPIN_SIM_GO_UNTIL, dir, (unsigned long long)(a & 0xFFFFF) << 12);
+    return;
+  }
+}
+
+// Decode the first byte of a frame. Commands without arguments run here.
+static void sim_command(SimDev *d, byte c)
+{
+  d->cmd = c;
+  d->arg_have = 0;
+  d->arg_need = 0;
+  byte dir = c & 0x01;
+
+  if ((c & 0xE0) == dSPIN_SET_PARAM)
+  {
+    byte p = c & 0x1F;
+    if (p >= dSPIN_REG_COUNT) { d->latched |= dSPIN_STATUS_WRONG_CMD; return; }
+    d->arg_need = dSPIN_Regs[p].bytes;
+    return;
+  }
+  if ((c & 0xE0) == dSPIN_GET_PARAM)
+  {
+    byte p = c & 0x1F;
+    if (p == 0 || p >= dSPIN_REG_COUNT) { d->latched |= dSPIN_STATUS_WRONG_CMD; return; }
+    unsigned long v = sim_get(d, p);
+    d->tx_len = dSPIN_Regs[p].bytes;
+    for (int i = 0; i < d->tx_len; i++)
+      d->tx[i] = (byte)(v >> (8 * (d->tx_len - 1 - i)));
+    d->tx_pos = 0;
+    return;
+  }
+  if ((c & 0xFE) == dSPIN_RUN || (c & 0xFE) == dSPIN_MOVE || c == dSPIN_GOTO
+      || (c & 0xFE) == dSPIN_GOTO_DIR || (c & 0xF6) == dSPIN_GO_UNTIL)
+  {
+    d->arg_need = 3;
+    return;
+  }
+  if ((c & 0xFE) == dSPIN_STEP_CLOCK)
+  {
+    if (!sim_stopped(d)) { sim_notperf(d); return; }
+    d->mode = dSPIN_SIM_STEP_CLOCK;
+    d->dir = d->want_dir = dir;
+    d->hiz = 0;
+    return;
+  }
+  if ((c & 0xF6) == dSPIN_RELEASE_SW)
+  {
+    d->act = (c >> 3) & 1;
+    if (!d->sw_closed) { sim_act(d); sim_stop(d); d->hiz = 0; return; }
+    unsigned long long vmin = sim_min_v(d);
+    sim_start_hold(d, dSPIN_SIM_RELEASE_SW, dir, vmin > SIM_SPD_5 ? vmin : SIM_SPD_5);
+    return;
+  }
+  switch (c)
+  {
+    case dSPIN_GO_HOME:
+      if (sim_busy(d)) sim_notperf(d);
+      else sim_goto(d, 0, -1);
+      break;
+    case dSPIN_GO_MARK:
+      if (sim_busy(d)) sim_notperf(d);
+      else sim_goto(d, d->reg[dSPIN_MARK], -1);
+      break;
+    case dSPIN_RESET_POS:
+      if (sim_stopped(d)) d->origin = d->phys;
+      else sim_notperf(d);
+      break;
+    case dSPIN_RESET_DEVICE:
+      sim_reset(d);
+      break;
+    case dSPIN_SOFT_STOP:
+    case dSPIN_SOFT_HIZ:
+      if (d->mode == dSPIN_SIM_STOPPED || d->mode == dSPIN_SIM_STEP_CLOCK)
+      {
+        sim_stop(d);
+        if (c == dSPIN_SOFT_HIZ) d->hiz = 1;
+      }
+      else
+      {
+        d->start_tick = d->ticks;
+        d->start_pos = sim_abs_pos(d);
+        d->mode = dSPIN_SIM_STOPPING;
+        d->hiz_after_stop = (c == dSPIN_SOFT_HIZ);
+      }
+      break;
+    case dSPIN_HARD_STOP:
+      sim_stop(d);
+      d->hiz = 0;
+      break;
+    case dSPIN_HARD_HIZ:
+      sim_stop(d);
+      d->hiz = 1;
+      break;
+    case dSPIN_GET_STATUS:
+    {
+      unsigned int st = sim_status(d);
+      d->tx[0] = (byte)(st >> 8);
+      d->tx[1] = (byte)st;
+      d->tx_len = 2;
+      d->tx_pos = 0;
+      d->latched = 0;
+      d->alarms = 0;
+      break;
+    }
+    default:
+      d->latched |= dSPIN_STATUS_WRONG_CMD;
+      break;
+  }
+}
+
+static void sim_byte(SimDev *d, byte b)
+{
+  sim_sync(d);
+  if (d->arg_need > d->arg_have)
+  {
+    d->arg[d->arg_have++] = b;
+    if (d->arg_have == d->arg_need)
+    {
+      d->arg_need = 0;
+      sim_execute(d);
+    }
+    return;
+  }
+  sim_command(d, b);
+}
+
+/******************** wiringPi stand-ins ********************/
+
+static SimDev *sim_find(int pin, int which)
+{
+  for (int i = 0; i < sim_ndev; i++)
+  {
+    SimDev *d = &sim_dev[i];
+    if ((which == 0 && d->cs == pin) || (which == 1 && d->busy_pin == pin)
+        || (which == 2 && d->stck == pin)) return d;
+  }
+  return NULL;
+}
+
+static SimDev *sim_selected()
+{
+  for (int i = 0; i < sim_ndev; i++)
+    if (sim_pin[sim_dev[i].cs & 0xFF] == LOW) return &sim_dev[i];
+  return NULL;
+}
+
+static int sim_add(int cs, int busy, int stck)
+{
+  if (sim_ndev == SIM_MAX_DEVICES) return -1;
+  SimDev *d = &sim_dev[sim_ndev];
+  memset(d, 0, sizeof(*d));
+  d->cs = cs;
+  d->busy_pin = busy;
+  d->stck = stck;
+  d->epoch_ns = sim_now();
+  d->tick_ns = SIM_TICK_NS;
+  sim_pin[cs & 0xFF] = HIGH;
+  sim_reset(d);
+  return sim_ndev++;
+}
+
+int wiringPiSetupGpio(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  if (sim_ndev == 0) sim_add(dSPIN_CS, dSPIN_BUSYN, dSPIN_STCK);
+  pthread_mutex_unlock(&sim_lock);
+  return 0;
+}
+
+void pinMode(int pin, int mode)
+{
+}
+
+// dSPIN_Sim_SetLoopback(): MOSI as last written, read back on MISO.
+static volatile int sim_loop = 0;
+static volatile int sim_loop_line = LOW;
+
+void dSPIN_Sim_SetLoopback(int on)
+{
+  sim_loop = on;
+}
+
+void digitalWrite(int pin, int value)
+{
+  if (sim_loop)
+  {
+    if (pin == dSPIN_MOSI) sim_loop_line = value;
+    return;
+  }
+  pthread_mutex_lock(&sim_lock);
+  int old = sim_pin[pin & 0xFF];
+  sim_pin[pin & 0xFF] = value ? HIGH : LOW;
+  if (old != sim_pin[pin & 0xFF])
+  {
+    SimDev *d;
+    if (pin == dSPIN_CLK && value)
+    {
+      if ((d = sim_selected()) != NULL)
+      {
+        d->in = (d->in << 1) | (sim_pin[dSPIN_MOSI] ? 1 : 0);
+        d->out <<= 1;
+        d->bits++;
+      }
+    }
+    else if ((d = sim_find(pin, 0)) != NULL)
+    {
+      if (!value)
+      {
+        d->bits = 0;
+        d->out = d->tx_pos < d->tx_len ? d->tx[d->tx_pos++] : 0;
+        if (d->tx_pos >= d->tx_len) d->tx_len = d->tx_pos = 0;
+      }
+      else if (d->bits == 8) sim_byte(d, d->in);
+    }
+    else if (pin == dSPIN_RESET && !value)
+    {
+      for (int i = 0; i < sim_ndev; i++)
+      {
+        sim_sync(&sim_dev[i]);
+        sim_reset(&sim_dev[i]);
+      }
+    }
+    if ((d = sim_find(pin, 2)) != NULL && value)
+    {
+      sim_sync(d);
+      d->stck_edges++;
+      if (d->mode == dSPIN_SIM_STEP_CLOCK)
+      {
+        d->phys += d->dir ? 1 : -1;
+        sim_switch(d);
+      }
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+}
+
+int digitalRead(int pin)
+{
+  if (sim_loop) return sim_loop_line;
+  pthread_mutex_lock(&sim_lock);
+  int v = sim_pin[pin & 0xFF];
+  SimDev *d;
+  if (pin == dSPIN_MISO)
+    v = ((d = sim_selected()) != NULL && (d->out & 0x80)) ? HIGH : LOW;
+  else if ((d = sim_find(pin, 1)) != NULL)
+  {
+    sim_sync(d);
+    v = sim_busy(d) ? LOW : HIGH;
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return v;
+}
+
+/******************** interrupts ********************/
+
+// Edge callbacks registered with wiringPiISR(). Only BUSYN lines can change
+//  on their own, so those are the only pins checked. In REAL mode a thread
+//  looks for edges every SIM_ISR_NS, as wiringPi's own interrupt thread would
+//  be woken; in VIRTUAL mode sleeps step the clock SIM_ISR_NS at a time and
+//  look in between, so callbacks run on the sleeping thread.
+#define SIM_ISR_NS 20000
+
+static void (*sim_isr_fn[SIM_MAX_PINS])(void);
+static int sim_isr_edge[SIM_MAX_PINS];
+static int sim_isr_level[SIM_MAX_PINS];
+static int sim_isr_pins[SIM_MAX_PINS];   // the armed pins, in the order armed
+static SimDev *sim_isr_dev[SIM_MAX_PINS]; // and the chips on them, once found
+static int sim_nisr = 0;
+static pthread_t sim_isr_thread;
+
+// Run the callbacks of pins whose level changed since the last look.
+static void sim_isr_check()
+{
+  void (*fire[SIM_MAX_PINS])(void);
+  int n = 0;
+  pthread_mutex_lock(&sim_lock);
+  for (int i = 0; i < sim_nisr; i++)
+  {
+    int pin = sim_isr_pins[i];
+    SimDev *d = sim_isr_dev[pin];
+    if (d == NULL && (d = sim_isr_dev[pin] = sim_find(pin, 1)) == NULL) continue;
+    sim_sync(d);
+    int v = sim_busy(d) ? LOW : HIGH;
+    if (v == sim_isr_level[pin]) continue;
+    sim_isr_level[pin] = v;
+    int want = v ? INT_EDGE_RISING : INT_EDGE_FALLING;
+    if (sim_isr_edge[pin] == want || sim_isr_edge[pin] == INT_EDGE_BOTH)
+      fire[n++] = sim_isr_fn[pin];
+  }
+  pthread_mutex_unlock(&sim_lock);
+  for (int i = 0; i < n; i++) fire[i]();
+}
+
+static void *sim_isr_main(void *arg)
+{
+  struct timespec ts = { 0, SIM_ISR_NS };
+  for (;;)
+  {
+    if (sim_clock == dSPIN_SIM_CLOCK_REAL) sim_isr_check();
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+int wiringPiISR(int pin, int edgeType, void (*function)(void))
+{
+  pthread_mutex_lock(&sim_lock);
+  int first = sim_nisr == 0;
+  if (sim_isr_fn[pin & 0xFF] == NULL) sim_isr_pins[sim_nisr++] = pin & 0xFF;
+  SimDev *d = sim_find(pin, 1);
+  if (d != NULL) sim_sync(d);
+  sim_isr_level[pin & 0xFF] = d != NULL && sim_busy(d) ? LOW : HIGH;
+  sim_isr_edge[pin & 0xFF] = edgeType;
+  sim_isr_fn[pin & 0xFF] = function;
+  pthread_mutex_unlock(&sim_lock);
+  if (first && pthread_create(&sim_isr_thread, NULL, sim_isr_main, NULL) == 0)
+    pthread_detach(sim_isr_thread);
+  return 0;
+}
+
+static void sim_sleep_ns(unsigned long long ns)
+{
+  if (sim_clock == dSPIN_SIM_CLOCK_VIRTUAL)
+  {
+    while (ns)
+    {
+      unsigned long long step = sim_nisr && ns > SIM_ISR_NS ? SIM_ISR_NS : ns;
+      pthread_mutex_lock(&sim_lock);
+      sim_vclock += step;
+      pthread_mutex_unlock(&sim_lock);
+      ns -= step;
+      if (sim_nisr) sim_isr_check();
+    }
+    return;
+  }
+  // Like wiringPi: spin for short delays, sleep for long ones.
+  if (ns < 100000)
+  {
+    unsigned long long end = sim_mono() + ns;
+    while (sim_mono() < end);
+    return;
+  }
+  struct timespec ts = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+  nanosleep(&ts, NULL);
+}
+
+void delay(unsigned int howLong) { sim_sleep_ns(howLong * 1000000ULL); }
+void delayMicroseconds(unsigned int howLong) { if (howLong && !sim_loop) sim_sleep_ns(howLong * 1000ULL); }
+
+unsigned int millis(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  unsigned int ms = (unsigned int)(sim_now() / 1000000ULL);
+  pthread_mutex_unlock(&sim_lock);
+  return ms;
+}
+
+unsigned int micros(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  unsigned int us = (unsigned int)(sim_now() / 1000ULL);
+  pthread_mutex_unlock(&sim_lock);
+  return us;
+}
+
+/******************** simulator control ********************/
+
+int dSPIN_Sim_AddDevice(int cs_pin, int busy_pin, int stck_pin)
+{
+  pthread_mutex_lock(&sim_lock);
+  int i = sim_add(cs_pin, busy_pin, stck_pin);
+  pthread_mutex_unlock(&sim_lock);
+  return i;
+}
+
+int dSPIN_Sim_Devices()
+{
+  return sim_ndev;
+}
+
+void dSPIN_Sim_SetClock(int mode)
+{
+  pthread_mutex_lock(&sim_lock);
+  for (int i = 0; i < sim_ndev; i++) sim_sync(&sim_dev[i]);
+  unsigned long long now = sim_now();
+  sim_clock = mode;
+  // Keep the timeline continuous across the switch.
+  if (mode == dSPIN_SIM_CLOCK_VIRTUAL) sim_vclock = now;
+  else sim_epoch = sim_mono() - now;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+unsigned long long dSPIN_Sim_Now()
+{
+  pthread_mutex_lock(&sim_lock);
+  unsigned long long now = sim_now();
+  pthread_mutex_unlock(&sim_lock);
+  return now;
+}
+
+void dSPIN_Sim_Advance(unsigned long long ns)
+{
+  if (sim_clock == dSPIN_SIM_CLOCK_VIRTUAL) sim_sleep_ns(ns);
+}
+
+void dSPIN_Sim_SetSwitch(int dev, long long lo, long long hi)
+{
+  pthread_mutex_lock(&sim_lock);
+  SimDev *d = &sim_dev[dev];
+  sim_sync(d);
+  d->sw_on = 1;
+  d->sw_lo = lo;
+  d->sw_hi = hi;
+  d->sw_closed = d->phys + d->slip >= lo && d->phys + d->slip <= hi;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void dSPIN_Sim_ClearSwitch(int dev)
+{
+  pthread_mutex_lock(&sim_lock);
+  sim_sync(&sim_dev[dev]);
+  sim_dev[dev].sw_on = 0;
+  sim_dev[dev].sw_closed = 0;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void dSPIN_Sim_SetStallModel(int dev, dSPIN_Sim_StallModel fn, void *arg)
+{
+  pthread_mutex_lock(&sim_lock);
+  sim_sync(&sim_dev[dev]);
+  sim_dev[dev].stall = fn;
+  sim_dev[dev].stall_arg = arg;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void dSPIN_Sim_Slip(int dev, long usteps)
+{
+  pthread_mutex_lock(&sim_lock);
+  SimDev *d = &sim_dev[dev];
+  sim_sync(d);
+  d->slip += usteps;
+  sim_switch(d);
+  pthread_mutex_unlock(&sim_lock);
+}
+
+// Counts of a simulated encoder on the shaft of device (intptr_t)arg.
+int dSPIN_Sim_EncoderRead(void *arg, long *counts)
+{
+  pthread_mutex_lock(&sim_lock);
+  SimDev *d = &sim_dev[(intptr_t)arg];
+  sim_sync(d);
+  long long at = d->phys + d->slip;
+  // Round towards minus infinity, as a counter does.
+  *counts = (long)(at >= 0 ? at / dSPIN_SIM_ENC_USTEPS
+                           : -((-at + dSPIN_SIM_ENC_USTEPS - 1) / dSPIN_SIM_ENC_USTEPS));
+  pthread_mutex_unlock(&sim_lock);
+  return 0;
+}
+
+void dSPIN_Sim_SetOscillator(int dev, double ratio)
+{
+  pthread_mutex_lock(&sim_lock);
+  SimDev *d = &sim_dev[dev];
+  sim_sync(d);
+  // Carry on from where the chip is now at the new rate.
+  d->epoch_ns = sim_now();
+  d->epoch_ticks = d->ticks;
+  d->tick_ns = SIM_TICK_NS / ratio;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void dSPIN_Sim_Peek(int dev, dSPIN_Sim_State *state)
+{
+  pthread_mutex_lock(&sim_lock);
+  SimDev *d = &sim_dev[dev];
+  sim_sync(d);
+  state->phys_pos = d->phys;
+  state->shaft_pos = d->phys + d->slip;
+  state->abs_pos = sim_abs_pos(d);
+  state->speed = (unsigned long)(d->v >> 12) & 0xFFFFF;
+  state->mode = d->mode;
+  state->busy = sim_busy(d);
+  state->status = sim_status(d);
+  state->ticks = d->ticks;
+  state->start_tick = d->start_tick;
+  state->start_pos = d->start_pos;
+  state->stop_tick = d->stop_tick;
+  state->stck_edges = d->stck_edges;
+  pthread_mutex_unlock(&sim_lock);
+}
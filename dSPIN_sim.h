@@ -0,0 +1,124 @@
+//dSPIN_sim.h - Stand-in for wiringPi that connects the library to simulated
+//   L6470 chips instead of real GPIO. dSPIN.h includes this file in place of
+//   <wiringPi.h> when the code is built with -DdSPIN_SIM, so everything above
+//   dSPIN_Xfer() runs unchanged: the simulated chip decodes the bit-banged SPI
+//   frames, keeps the register file and runs the motion engine tick by tick.
+#ifndef dSPIN_SIM_H
+#define dSPIN_SIM_H
+
+// The subset of wiringPi.h the library uses.
+#define LOW     0
+#define HIGH    1
+#define INPUT   0
+#define OUTPUT  1
+
+int  wiringPiSetupGpio(void);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int  digitalRead(int pin);
+void delay(unsigned int howLong);
+void delayMicroseconds(unsigned int howLong);
+unsigned int millis(void);
+unsigned int micros(void);
+
+// Edge interrupts, on BUSYN pins only.
+#define INT_EDGE_SETUP   0
+#define INT_EDGE_FALLING 1
+#define INT_EDGE_RISING  2
+#define INT_EDGE_BOTH    3
+
+int  wiringPiISR(int pin, int edgeType, void (*function)(void));
+
+// Clock modes. In REAL mode chip time follows CLOCK_MONOTONIC, so threads and
+//  sleeps behave as they would on the Pi. In VIRTUAL mode chip time only moves
+//  when delay()/delayMicroseconds() or dSPIN_Sim_Advance() are called, which
+//  makes runs deterministic and lets long moves finish instantly.
+#define dSPIN_SIM_CLOCK_REAL     0
+#define dSPIN_SIM_CLOCK_VIRTUAL  1
+
+// Motion engine states reported in dSPIN_Sim_State.mode.
+#define dSPIN_SIM_STOPPED    0
+#define dSPIN_SIM_RUN        1   // Run: hold a target speed
+#define dSPIN_SIM_POSITION   2   // Move/GoTo/GoHome/GoMark
+#define dSPIN_SIM_STOPPING   3   // SoftStop/SoftHiZ deceleration
+#define dSPIN_SIM_GO_UNTIL   4
+#define dSPIN_SIM_RELEASE_SW 5
+#define dSPIN_SIM_STEP_CLOCK 6
+
+// Snapshot of one simulated chip, for checking the library against the model.
+typedef struct
+{
+  long long phys_pos;        // microsteps from power up, never reset or wrapped
+  long long shaft_pos;       // where the motor really is: phys_pos plus any slip
+  long abs_pos;              // ABS_POS as signed 22-bit value
+  unsigned long speed;       // SPEED register (steps/tick * 2^28)
+  int mode;                  // dSPIN_SIM_* motion state
+  int busy;                  // 1 while the BUSYN line is pulled low
+  unsigned int status;       // STATUS as GetParam would return it
+  unsigned long long ticks;  // chip oscillator ticks since power up
+  unsigned long long start_tick;   // tick at which the last motion command ran
+  long start_pos;                  // ABS_POS at that tick
+  unsigned long long stop_tick;    // tick at which the last motion ended
+  unsigned long long stck_edges;   // rising edges seen on STCK
+} dSPIN_Sim_State;
+
+// Add a simulated chip wired to the given chip select, BUSYN and STCK pins
+//  and return its index. wiringPiSetupGpio() adds device 0 on the pins from
+//  dSPIN.h if nothing has been added before it.
+int dSPIN_Sim_AddDevice(int cs_pin, int busy_pin, int stck_pin);
+int dSPIN_Sim_Devices();
+
+void dSPIN_Sim_SetClock(int mode);
+// Nanoseconds since the simulator started, on the clock selected above.
+unsigned long long dSPIN_Sim_Now();
+// Move the virtual clock forward. Ignored in REAL mode.
+void dSPIN_Sim_Advance(unsigned long long ns);
+
+// Model a limit/home switch that is closed while the motor's physical position
+//  (dSPIN_Sim_State.shaft_pos) is between lo and hi inclusive.
+void dSPIN_Sim_SetSwitch(int dev, long long lo, long long hi);
+void dSPIN_Sim_ClearSwitch(int dev);
+
+// Run device dev's oscillator at ratio times its nominal 16MHz (1.03 is 3%
+//  fast), as real chips do within the tolerance in the dSPIN.h errata.
+void dSPIN_Sim_SetOscillator(int dev, double ratio);
+
+void dSPIN_Sim_Peek(int dev, dSPIN_Sim_State *state);
+
+// Disconnect the chips and wire MISO straight to MOSI, with the clock delays
+//  skipped, so a bench can time the library's own side of dSPIN_Xfer() with
+//  no simulator behind it. 0 connects them again.
+void dSPIN_Sim_SetLoopback(int on);
+
+// Make device dev's motor slip: its shaft moves usteps microsteps (negative
+//  is REV) that the chip never stepped, so ABS_POS no longer says where it is.
+void dSPIN_Sim_Slip(int dev, long usteps);
+
+// An encoder on the shaft with one count every dSPIN_SIM_ENC_USTEPS
+//  microsteps (1600 counts a turn at 128 microsteps), read through the
+//  closed-loop source interface in dSPIN.h: pass (void *)(intptr_t)dev as arg.
+#define dSPIN_SIM_ENC_USTEPS 16
+int dSPIN_Sim_EncoderRead(void *arg, long *counts);
+
+// What the motor is being asked to do over a stretch of motion, for a stall
+//  model to judge.
+typedef struct
+{
+  float speed;               // highest speed over the stretch, full steps/s
+  float accel;               // full steps/s/s, negative while decelerating
+  unsigned char kval;        // KVAL_ACC, KVAL_DEC or KVAL_RUN, whichever applies
+  unsigned char ocd_th;      // OCD_TH and STALL_TH register values
+  unsigned char stall_th;
+} dSPIN_Sim_Load;
+
+// A stall model returns the STATUS alarm bits (STEP_LOSS_A/B, OCD, TH_WRN,
+//  TH_SD) the chip should raise for load op. It's called with the simulator
+//  locked, so it must not call back into the library or the simulator. OCD
+//  shuts the bridges down if CONFIG says so, TH_SD always does.
+typedef unsigned int (*dSPIN_Sim_StallModel)(int dev, const dSPIN_Sim_Load *op, void *arg);
+
+// Give device dev a stall model, or take it away with NULL. Without one the
+//  motor follows the chip whatever it's asked to do.
+void dSPIN_Sim_SetStallModel(int dev, dSPIN_Sim_StallModel fn, void *arg);
+
+#endif
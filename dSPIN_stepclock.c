@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "dSPIN.h"
+
+//dSPIN_stepclock.c - Software step clock generator. dSPIN_Step_Clock() hands
+//   the STCK line control of the motor: every rising edge moves it one
+//   (micro)step in the chosen direction. This file drives that line from a
+//   table of step times, so any velocity curve or cam profile can be played
+//   out, including shapes the chip's own trapezoid generator can't make.
+
+static pthread_t stck_thread;
+static const unsigned long long *stck_table;
+static unsigned long stck_n;
+static volatile int stck_running = 0;
+static volatile int stck_abort = 0;
+static int stck_joined = 1;
+static dSPIN_StepClock_Stats stck_stats;
+static unsigned int stck_seq = 0;  // odd while stck_stats is being written
+static double stck_sq_sum;         // the generator's own
+
+static unsigned long long stck_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stck_sleep_until(unsigned long long ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+// The statistics have one writer at a time: the generator thread while it
+//  runs, dSPIN_StepClock_Start() before. Readers copy them under a sequence
+//  count rather than a lock, so no reader, whatever its priority, can hold
+//  up the next edge.
+static void stck_write_begin()
+{
+  __atomic_store_n(&stck_seq, stck_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stck_write_end()
+{
+  __atomic_store_n(&stck_seq, stck_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void stck_record(long late, int overrun)
+{
+  stck_write_begin();
+  dSPIN_StepClock_Stats *s = &stck_stats;
+  if (s->pulses == 0 || late < s->min_ns) s->min_ns = late;
+  if (s->pulses == 0 || late > s->max_ns) s->max_ns = late;
+  s->pulses++;
+  s->mean_ns += (late - s->mean_ns) / s->pulses;
+  stck_sq_sum += (double)late * late;
+  s->rms_ns = sqrt(stck_sq_sum / s->pulses);
+  if (overrun) s->overruns++;
+  long bin = late < 0 ? 0 : late / 1000;
+  if (bin >= dSPIN_STCK_HIST_BINS) bin = dSPIN_STCK_HIST_BINS - 1;
+  s->hist[bin]++;
+  stck_write_end();
+}
+
+static void *stck_main(void *arg)
+{
+  dSPIN_RT_Thread(dSPIN_RT_STEPCLOCK);
+  unsigned long long start = stck_now() + dSPIN_STCK_SPIN_NS;
+  for (unsigned long i = 0; i < stck_n && !stck_abort; i++)
+  {
+    unsigned long long deadline = start + stck_table[i];
+    unsigned long long now = stck_now();
+    int overrun = now > deadline - dSPIN_STCK_SPIN_NS;
+    // Coarse wait: absolute-deadline sleep, so a late wakeup never accumulates
+    //  into the following pulses.
+    if (!overrun) stck_sleep_until(deadline - dSPIN_STCK_SPIN_NS);
+    // Fine wait: spin the rest of the way.
+    while ((now = stck_now()) < deadline);
+    digitalWrite(dSPIN_STCK, HIGH);
+    stck_record((long)(now - deadline), overrun);
+    while (stck_now() < now + dSPIN_STCK_PULSE_NS);
+    digitalWrite(dSPIN_STCK, LOW);
+  }
+  stck_running = 0;
+  return NULL;
+}
+
+// Fill table[] with the times (ns from start) of each step of a velocity curve
+//  given in steps/s as a function of seconds, for duration seconds. The curve
+//  is integrated numerically; a step is due each time the integral crosses the
+//  next whole step. Returns the number of entries written (at most max).
+unsigned long dSPIN_StepClock_Table(float (*stepsPerSec)(float t, void *arg), void *arg,
+                                    float duration, unsigned long long *table,
+                                    unsigned long max)
+{
+  const double dt = 1e-6;          // integrate in 1us slices
+  double steps = 0, t = 0;
+  double prev = stepsPerSec(0, arg);
+  unsigned long n = 0;
+  while (t < duration && n < max)
+  {
+    double next = stepsPerSec((float)(t + dt), arg);
+    double inc = (prev + next) * 0.5 * dt;   // trapezoidal rule
+    // Interpolate inside the slice for the exact crossing time.
+    while (inc > 0 && steps + inc >= n + 1 && n < max)
+    {
+      double frac = (n + 1 - steps) / inc;
+      table[n++] = (unsigned long long)((t + frac * dt) * 1e9);
+    }
+    steps += inc;
+    prev = next;
+    t += dt;
+  }
+  return n;
+}
+
+// Put the chip in step clock mode in direction dir and start the generator
+//  thread. A non-zero priority asks for SCHED_FIFO at that priority; if that
+//  isn't permitted the thread runs at normal priority and the jitter statistics
+//  will show it.
+int dSPIN_StepClock_Start(byte dir, const unsigned long long *table, unsigned long n,
+                          int priority)
+{
+  if (stck_running) return dSPIN_STATUS_FATAL;
+  if (!stck_joined) pthread_join(stck_thread, NULL);
+  stck_joined = 1;
+
+  pinMode(dSPIN_STCK, OUTPUT);
+  digitalWrite(dSPIN_STCK, LOW);
+  dSPIN_Step_Clock(dir);
+
+  stck_write_begin();
+  memset(&stck_stats, 0, sizeof(stck_stats));
+  stck_write_end();
+  stck_sq_sum = 0;
+  stck_table = table;
+  stck_n = n;
+  stck_abort = 0;
+  stck_running = 1;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (priority > 0)
+  {
+    struct sched_param sp;
+    sp.sched_priority = priority;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &sp);
+  }
+  int err = pthread_create(&stck_thread, &attr, stck_main, NULL);
+  if (err != 0 && priority > 0)
+  {
+    fprintf(stderr, "step clock: SCHED_FIFO refused, running at normal priority\n");
+    err = pthread_create(&stck_thread, NULL, stck_main, NULL);
+  }
+  pthread_attr_destroy(&attr);
+  if (err != 0)
+  {
+    stck_running = 0;
+    return dSPIN_STATUS_FATAL;
+  }
+  stck_joined = 0;
+  return dSPIN_STATUS_GOOD;
+}
+
+// Non-zero while the generator is still emitting pulses.
+int dSPIN_StepClock_Busy()
+{
+  return stck_running;
+}
+
+// Block until every pulse in the table has been sent.
+void dSPIN_StepClock_Wait()
+{
+  if (stck_joined) return;
+  pthread_join(stck_thread, NULL);
+  stck_joined = 1;
+}
+
+// Abandon the rest of the table. The chip stays in step clock mode.
+void dSPIN_StepClock_Stop()
+{
+  stck_abort = 1;
+  dSPIN_StepClock_Wait();
+}
+
+// Copy out the timing statistics gathered so far.
+void dSPIN_StepClock_GetStats(dSPIN_StepClock_Stats *stats)
+{
+  for (;;)
+  {
+    unsigned int seq = __atomic_load_n(&stck_seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1))
+    {
+      memcpy(stats, (const void *)&stck_stats, sizeof(*stats));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&stck_seq, __ATOMIC_RELAXED) == seq) return;
+    }
+  }
+}
@@ -1,5 +1,10 @@
 #include <cstdio>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include "dSPIN.h"
 
 //dSPIN_support.ino - Contains functions used to implement the high-level commands,
@@ -9,6 +14,456 @@
 
 
 
+// Chip select and BUSYN lines of every dSPIN sharing the SPI lines. Axis 0 is
+//  the chip wired per the pin settings in dSPIN.h. The selected axis is kept
+//  per thread, so each thread talks to whichever chip it last selected.
+static dSPIN_AxisPins dSPIN_axes[dSPIN_MAX_AXES] = { { dSPIN_CS, dSPIN_BUSYN } };
+static int dSPIN_n_axes = 1;
+static __thread int dSPIN_axis = 0;
+
+// Each axis' oscillator as measured against its nominal 16MHz, 0 until it's
+//  been calibrated (see dSPIN_CalibrateOsc()).
+static float dSPIN_osc[dSPIN_MAX_AXES];
+
+// Register another dSPIN on its own chip select (and BUSYN, or dSPIN_NO_PIN)
+//  line. Returns the new axis number, or -1 if the table is full.
+int dSPIN_AddAxis(byte cs_pin, byte busy_pin)
+{
+  if (dSPIN_n_axes == dSPIN_MAX_AXES) return -1;
+  dSPIN_axes[dSPIN_n_axes].cs = cs_pin;
+  dSPIN_axes[dSPIN_n_axes].busy = busy_pin;
+  pinMode(cs_pin, OUTPUT);
+  digitalWrite(cs_pin, HIGH);
+  if (busy_pin != dSPIN_NO_PIN) pinMode(busy_pin, INPUT);
+  return dSPIN_n_axes++;
+}
+
+// The axis on chip select line cs_pin, or -1 if none is.
+int dSPIN_AxisOnPin(byte cs_pin)
+{
+  for (int i = 0; i < dSPIN_n_axes; i++)
+    if (dSPIN_axes[i].cs == cs_pin) return i;
+  return -1;
+}
+
+// Number of axes registered, including axis 0.
+int dSPIN_Axes()
+{
+  return dSPIN_n_axes;
+}
+
+// Direct this thread's commands at another axis.
+void dSPIN_Select(int axis)
+{
+  if (axis >= 0 && axis < dSPIN_n_axes) dSPIN_axis = axis;
+}
+
+// The axis this thread's commands go to.
+int dSPIN_Selected()
+{
+  return dSPIN_axis;
+}
+
+// The selected axis' BUSYN pin, or dSPIN_NO_PIN.
+byte dSPIN_BusyPin()
+{
+  return dSPIN_axes[dSPIN_axis].busy;
+}
+
+// Set the selected axis' oscillator frequency as a ratio to the nominal 16MHz
+//  (1.03 for a chip running 3% fast). The unit conversions below and the host
+//  side predictions use it from then on for that axis; 0 goes back to nominal.
+void dSPIN_SetOsc(float ratio)
+{
+  dSPIN_osc[dSPIN_axis] = ratio > 0 ? ratio : 0;
+}
+
+// The selected axis' oscillator as set with dSPIN_SetOsc(), 1 if it never was.
+float dSPIN_Osc()
+{
+  float r = dSPIN_osc[dSPIN_axis];
+  return r > 0 ? r : 1;
+}
+
+// Bracket an ABS_POS read between two dSPIN_Now() readings and return the
+//  middle of them in *ns.
+static long osc_pos(unsigned long long *ns)
+{
+  unsigned long long t0 = dSPIN_Now();
+  long p = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  *ns = (t0 + dSPIN_Now()) / 2;
+  return p;
+}
+
+// Measure the selected axis' oscillator: run the motor at stepsPerSec, as
+//  the nominal 16MHz would have it, and time ABS_POS against the host clock
+//  for ms milliseconds once it's up to speed. The ratio found is stored with
+//  dSPIN_SetOsc() and returned; if the motor didn't keep within 20% of the
+//  speed asked for (stalled, or not in a state to run), 0 is returned and
+//  nothing changes. The motor must be free to turn and is soft stopped after.
+float dSPIN_CalibrateOsc(float stepsPerSec, unsigned int ms)
+{
+  unsigned long spd = (unsigned long)(stepsPerSec * 67.106);
+  if (spd == 0 || spd > 0xFFFFF) return 0;
+  int usteps = 1 << (dSPIN_GetParam(dSPIN_STEP_MODE) & dSPIN_STEP_MODE_STEP_SEL);
+  unsigned long max_speed = dSPIN_GetParam(dSPIN_MAX_SPEED);
+  // Run speeds are capped at MAX_SPEED (SPEED >> 10, rounded up).
+  if (max_speed < (spd >> 10) + 1) dSPIN_SetParam(dSPIN_MAX_SPEED, (spd >> 10) + 1);
+
+  dSPIN_Run(FWD, spd);
+  while (dSPIN_Busy()) delay(1);
+  unsigned long long t0, t1;
+  long p0 = osc_pos(&t0);
+  delay(ms);
+  long p1 = osc_pos(&t1);
+  dSPIN_SoftStop();
+  while (dSPIN_Busy()) delay(1);
+  dSPIN_SetParam(dSPIN_MAX_SPEED, max_speed);
+
+  long moved = (p1 - p0) & 0x3FFFFF;
+  if (t1 <= t0) return 0;
+  double want = spd / 67.106 * usteps;
+  float ratio = (float)(moved / ((t1 - t0) * 1e-9) / want);
+  if (ratio < 0.8f || ratio > 1.2f) return 0;
+  dSPIN_SetOsc(ratio);
+  return ratio;
+}
+
+// State of the selected axis' BUSYN line: non-zero while a command is still
+//  executing. Axes without a BUSYN line are asked over SPI instead.
+int dSPIN_Busy()
+{
+  byte pin = dSPIN_axes[dSPIN_axis].busy;
+  if (pin != dSPIN_NO_PIN) return digitalRead(pin) == LOW;
+  return !(dSPIN_GetParam(dSPIN_STATUS) & dSPIN_STATUS_BUSY);
+}
+
+// Host monotonic time in nanoseconds; the time base for everything the
+//  library schedules on the host side.
+unsigned long long dSPIN_Now()
+{
+#ifdef dSPIN_SIM
+  return dSPIN_Sim_Now();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Sleep until dSPIN_Now() reaches ns.
+void dSPIN_SleepUntil(unsigned long long ns)
+{
+  unsigned long long now = dSPIN_Now();
+  if (ns > now) delayMicroseconds((unsigned int)((ns - now + 999) / 1000));
+}
+
+// BUSYN rising edges. Every armed pin gets the same wiringPiISR() handler,
+//  which only counts the edge and wakes whoever is waiting; the waiter then
+//  reads the BUSYN lines it cares about to see which axis it was.
+static pthread_mutex_t edge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t edge_cond;
+static pthread_once_t edge_once = PTHREAD_ONCE_INIT;
+static unsigned long edge_count = 0;
+static byte edge_armed[256];
+
+#ifdef dSPIN_SIM
+// The simulator's clock may be virtual, and then it only moves while someone
+//  sleeps: dSPIN_Edge_Wait() waits in slices this long.
+#define EDGE_SLICE_US 100
+#endif
+
+static void edge_init()
+{
+  pthread_condattr_t ca;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&edge_cond, &ca);
+  pthread_condattr_destroy(&ca);
+}
+
+static void edge_isr()
+{
+  pthread_mutex_lock(&edge_lock);
+  edge_count++;
+  pthread_cond_broadcast(&edge_cond);
+  pthread_mutex_unlock(&edge_lock);
+}
+
+// Count rising edges on a BUSYN pin from now on. Returns 1 if they will be,
+//  0 for dSPIN_NO_PIN or if the interrupt can't be set up.
+int dSPIN_Edge_Arm(byte pin)
+{
+  if (pin == dSPIN_NO_PIN) return 0;
+  pthread_once(&edge_once, edge_init);
+  pthread_mutex_lock(&edge_lock);
+  if (!edge_armed[pin] && wiringPiISR(pin, INT_EDGE_RISING, edge_isr) >= 0) edge_armed[pin] = 1;
+  int ok = edge_armed[pin];
+  pthread_mutex_unlock(&edge_lock);
+  return ok;
+}
+
+// Edges seen so far on every armed pin.
+unsigned long dSPIN_Edge_Count()
+{
+  pthread_mutex_lock(&edge_lock);
+  unsigned long n = edge_count;
+  pthread_mutex_unlock(&edge_lock);
+  return n;
+}
+
+// Sleep until the edge count is past seen, or until dSPIN_Now() reaches ns.
+//  Read the count before looking at the lines, so an edge in between isn't
+//  slept through.
+void dSPIN_Edge_Wait(unsigned long seen, unsigned long long ns)
+{
+#ifdef dSPIN_SIM
+  while (dSPIN_Edge_Count() == seen && dSPIN_Now() < ns) delayMicroseconds(EDGE_SLICE_US);
+#else
+  pthread_once(&edge_once, edge_init);
+  struct timespec ts = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+  pthread_mutex_lock(&edge_lock);
+  while (edge_count == seen)
+    if (pthread_cond_timedwait(&edge_cond, &edge_lock, &ts) == ETIMEDOUT) break;
+  pthread_mutex_unlock(&edge_lock);
+#endif
+}
+
+// Bus arbitration. Every command frame is sent between dSPIN_Bus_Begin() and
+//  dSPIN_Bus_End(), so frames from different threads can't interleave. While
+//  the bus is busy, waiting threads queue by priority class, first come first
+//  served within a class; nobody holds the bus for longer than one frame (or
+//  one transaction, if a thread nests several frames in its own Begin/End).
+//
+// The bus itself is a priority-inheriting mutex, and only the thread at the
+//  head of the queue waits on it. On a busy CPU a low-priority holder could
+//  otherwise be preempted mid-frame and keep a real-time thread off the bus
+//  for a whole time slice; this way it runs at the waiter's priority until
+//  its frame is out.
+//
+// Hard stops and HiZ don't queue behind that. dSPIN_Emergency() only posts a
+//  request, which makes it safe to call from a signal handler, and wakes a
+//  stopper thread; whichever thread holds the bus sends pending requests at
+//  the end of its current frame, before anything queued, and if the bus is
+//  idle the stopper takes it at emergency priority and sends them itself.
+//
+// Latencies are wall clock (CLOCK_MONOTONIC) even in the simulator, since a
+//  signal handler can't ask the simulator for its time.
+
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bus_free = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t bus_own = PTHREAD_MUTEX_INITIALIZER;   // held for the frame on the wire
+static int bus_head = 0;                      // a thread is waiting on bus_own
+static int bus_queued[dSPIN_BUS_CLASSES];
+static unsigned long bus_next[dSPIN_BUS_CLASSES], bus_turn[dSPIN_BUS_CLASSES];
+static unsigned long long bus_since;          // when the holder got the bus
+static dSPIN_BusStats bus_stats;
+static __thread int bus_depth = 0;
+static __thread int bus_class = dSPIN_BUS_NORMAL;
+
+// Pending emergency commands per axis, when each was asked for, and a count
+//  that's non-zero while any may be pending. Written from signal handlers.
+static byte bus_pending[dSPIN_MAX_AXES];
+static unsigned long long bus_pending_ns[dSPIN_MAX_AXES];
+static int bus_npending = 0;
+static sem_t bus_wake;
+static int bus_stopper_up = 0;
+
+static unsigned long long bus_mono()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static byte bus_xfer(byte cs, byte data);
+
+// Queue a hard stop or HiZ for axis (or every axis, dSPIN_ALL_AXES). HiZ
+//  outranks a stop already pending. Returns 0, or -1 if there's no such
+//  axis. Async-signal-safe.
+static int bus_request(int axis, byte cmd)
+{
+  if (axis != dSPIN_ALL_AXES && (axis < 0 || axis >= dSPIN_n_axes)) return -1;
+  unsigned long long t = bus_mono();
+  int lo = axis < 0 ? 0 : axis, hi = axis < 0 ? dSPIN_n_axes : axis + 1;
+  for (int a = lo; a < hi; a++)
+  {
+    byte old = __atomic_load_n(&bus_pending[a], __ATOMIC_ACQUIRE);
+    do
+    {
+      if (old == cmd || old == dSPIN_HARD_HIZ) break;
+      if (old == 0) __atomic_store_n(&bus_pending_ns[a], t, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&bus_pending[a], &old, cmd, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  }
+  __atomic_add_fetch(&bus_npending, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Send whatever is pending. Only the bus holder calls this, between frames.
+static void bus_service()
+{
+  __atomic_store_n(&bus_npending, 0, __ATOMIC_SEQ_CST);
+  unsigned long long ns[dSPIN_MAX_AXES];
+  int sent = 0;
+  for (int a = 0; a < dSPIN_n_axes; a++)
+  {
+    byte cmd = __atomic_exchange_n(&bus_pending[a], 0, __ATOMIC_ACQ_REL);
+    if (cmd == 0) continue;
+    unsigned long long t0 = __atomic_load_n(&bus_pending_ns[a], __ATOMIC_RELAXED);
+    bus_xfer(dSPIN_axes[a].cs, cmd);
+    ns[sent++] = bus_mono() - t0;
+  }
+  // The stats after the stops are out, so the lock doesn't hold them up.
+  if (sent == 0) return;
+  pthread_mutex_lock(&bus_lock);
+  for (int i = 0; i < sent; i++)
+  {
+    bus_stats.stops++;
+    bus_stats.stop_ns_sum += ns[i];
+    if (ns[i] > bus_stats.stop_ns_max) bus_stats.stop_ns_max = ns[i];
+  }
+  pthread_mutex_unlock(&bus_lock);
+}
+
+static void *bus_stopper(void *arg)
+{
+  bus_class = dSPIN_BUS_EMERGENCY;
+  dSPIN_RT_Thread(dSPIN_RT_BUS);
+  for (;;)
+  {
+    while (sem_wait(&bus_wake) != 0 && errno == EINTR);
+    if (!__atomic_load_n(&bus_npending, __ATOMIC_ACQUIRE)) continue;
+    dSPIN_Bus_Begin();
+    dSPIN_Bus_End();
+  }
+  return NULL;
+}
+
+// Set up the bus mutex and start the stopper thread, at the top SCHED_FIFO
+//  priority if we're allowed.
+static void bus_start()
+{
+  if (bus_stopper_up) return;
+  pthread_mutexattr_t ma;
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_setprotocol(&ma, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&bus_own, &ma);
+  pthread_mutexattr_destroy(&ma);
+  sem_init(&bus_wake, 0, 0);
+
+  pthread_t t;
+  pthread_attr_t attr;
+  struct sched_param sp;
+  pthread_attr_init(&attr);
+  sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &sp);
+  if (pthread_create(&t, &attr, bus_stopper, NULL) != 0)
+    pthread_create(&t, NULL, bus_stopper, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_detach(t);
+  bus_stopper_up = 1;
+}
+
+// Set the priority class (dSPIN_BUS_*) this thread's bus traffic queues in.
+void dSPIN_Bus_SetClass(int cls)
+{
+  if (cls >= 0 && cls < dSPIN_BUS_CLASSES) bus_class = cls;
+}
+
+int dSPIN_Bus_Class()
+{
+  return bus_class;
+}
+
+// Take the bus, waiting behind the current frame and anything queued at a
+//  higher priority or earlier in this thread's class. Nests: only the
+//  outermost Begin/End pair takes and gives up the bus.
+void dSPIN_Bus_Begin()
+{
+  if (bus_depth++ > 0) return;
+  int c = bus_class;
+  unsigned long long t = bus_mono();
+  pthread_mutex_lock(&bus_lock);
+  unsigned long ticket = bus_next[c]++;
+  bus_queued[c]++;
+  for (;;)
+  {
+    int ahead = bus_head || bus_turn[c] != ticket;
+    for (int k = 0; k < c && !ahead; k++) ahead = bus_queued[k] > 0;
+    if (!ahead) break;
+    pthread_cond_wait(&bus_free, &bus_lock);
+  }
+  // At the head of the queue: wait out the frame on the wire.
+  bus_queued[c]--;
+  bus_turn[c]++;
+  bus_head = 1;
+  pthread_mutex_unlock(&bus_lock);
+  pthread_mutex_lock(&bus_own);
+
+  pthread_mutex_lock(&bus_lock);
+  bus_head = 0;
+  bus_since = bus_mono();
+  unsigned long long w = bus_since - t;
+  bus_stats.frames[c]++;
+  if (w > bus_stats.wait_ns_max[c]) bus_stats.wait_ns_max[c] = w;
+  pthread_cond_broadcast(&bus_free);
+  pthread_mutex_unlock(&bus_lock);
+}
+
+// End a frame: send any emergency commands that came in meanwhile, and give
+//  up the bus if this ends the outermost Begin.
+void dSPIN_Bus_End()
+{
+  if (__atomic_load_n(&bus_npending, __ATOMIC_ACQUIRE)) bus_service();
+  if (--bus_depth > 0) return;
+  unsigned long long h = bus_mono() - bus_since;
+  // Under bus_lock like the rest of the stats: 64-bit values tear on the Pi.
+  pthread_mutex_lock(&bus_lock);
+  bus_stats.hold_ns_sum += h;
+  if (h > bus_stats.hold_ns_max) bus_stats.hold_ns_max = h;
+  pthread_mutex_unlock(&bus_lock);
+  pthread_mutex_unlock(&bus_own);
+}
+
+// Ask for cmd (dSPIN_HARD_STOP or dSPIN_HARD_HIZ) on axis, or dSPIN_ALL_AXES,
+//  ahead of all other traffic, and return without waiting for it to be sent.
+//  Returns 0, or -1 if there's no such axis. Safe to call from a signal
+//  handler.
+int dSPIN_Emergency(int axis, byte cmd)
+{
+  if (bus_request(axis, cmd) < 0) return -1;
+  if (bus_stopper_up) sem_post(&bus_wake);
+  return 0;
+}
+
+// dSPIN_Emergency() for the selected axis, returning once cmd has been sent.
+void dSPIN_Bus_Stop(byte cmd)
+{
+  bus_request(dSPIN_axis, cmd);
+  int c = bus_class;
+  bus_class = dSPIN_BUS_EMERGENCY;
+  dSPIN_Bus_Begin();
+  dSPIN_Bus_End();
+  bus_class = c;
+}
+
+void dSPIN_Bus_GetStats(dSPIN_BusStats *stats)
+{
+  pthread_mutex_lock(&bus_lock);
+  *stats = bus_stats;
+  pthread_mutex_unlock(&bus_lock);
+}
+
+void dSPIN_Bus_ResetStats()
+{
+  pthread_mutex_lock(&bus_lock);
+  memset(&bus_stats, 0, sizeof(bus_stats));
+  pthread_mutex_unlock(&bus_lock);
+}
+
 // This simple function shifts a byte out over SPI and receives a byte over
 //  SPI. Unusually for SPI devices, the dSPIN requires a toggling of the
 //  CS (slaveSelect) pin after each byte sent. That makes this function
@@ -17,7 +472,12 @@
 //  MSB is first.
 byte dSPIN_Xfer(byte data)
 {
-	digitalWrite(dSPIN_CS, LOW);	
+  return bus_xfer(dSPIN_axes[dSPIN_axis].cs, data);
+}
+
+static byte bus_xfer(byte cs, byte data)
+{
+	digitalWrite(cs, LOW);	
 
 	for(int i=0; i<8; i++){
 		digitalWrite(dSPIN_CLK, LOW);
@@ -41,19 +501,22 @@ byte dSPIN_Xfer(byte data)
 
 	}
 
-	digitalWrite(dSPIN_CS, HIGH);	
+	digitalWrite(cs, HIGH);	
 	delayMicroseconds( dSPIN_SPI_CLOCK_DELAY );
 
   return data;
 }
 
+// All of these take the tick of the selected axis' oscillator: 250ns at the
+//  nominal 16MHz, scaled by what dSPIN_SetOsc() was told.
+
 // The value in the ACC register is [(steps/s/s)*(tick^2)]/(2^-40) where tick is 
 //  250ns (datasheet value)- 0x08A on boot.
 // Multiply desired steps/s/s by .137438 to get an appropriate value for this register.
 // This is a 12-bit value, so we need to make sure the value is at or below 0xFFF.
 unsigned long AccCalc(float stepsPerSecPerSec)
 {
-  float temp = stepsPerSecPerSec * 0.137438;
+  float temp = stepsPerSecPerSec * 0.137438 / (dSPIN_Osc() * dSPIN_Osc());
   if( (unsigned long) long(temp) > 0x00000FFF) return 0x00000FFF;
   else return (unsigned long) long(temp);
 }
@@ -62,7 +525,7 @@ unsigned long AccCalc(float stepsPerSecPerSec)
 // This is a 12-bit value, so we need to make sure the value is at or below 0xFFF.
 unsigned long DecCalc(float stepsPerSecPerSec)
 {
-  float temp = stepsPerSecPerSec * 0.137438;
+  float temp = stepsPerSecPerSec * 0.137438 / (dSPIN_Osc() * dSPIN_Osc());
   if( (unsigned long) long(temp) > 0x00000FFF) return 0x00000FFF;
   else return (unsigned long) long(temp);
 }
@@ -73,7 +536,7 @@ unsigned long DecCalc(float stepsPerSecPerSec)
 // This is a 10-bit value, so we need to make sure it remains at or below 0x3FF
 unsigned long MaxSpdCalc(float stepsPerSec)
 {
-  float temp = stepsPerSec * .065536;
+  float temp = stepsPerSec * .065536 / dSPIN_Osc();
   if( (unsigned long) long(temp) > 0x000003FF) return 0x000003FF;
   else return (unsigned long) long(temp);
 }
@@ -84,7 +547,7 @@ unsigned long MaxSpdCalc(float stepsPerSec)
 // This is a 12-bit value, so we need to make sure the value is at or below 0xFFF.
 unsigned long MinSpdCalc(float stepsPerSec)
 {
-  float temp = stepsPerSec * 4.1943;
+  float temp = stepsPerSec * 4.1943 / dSPIN_Osc();
   if( (unsigned long) long(temp) > 0x00000FFF) return 0x00000FFF;
   else return (unsigned long) long(temp);
 }
@@ -95,7 +558,7 @@ unsigned long MinSpdCalc(float stepsPerSec)
 // This is a 10-bit value, so we need to make sure the value is at or below 0x3FF.
 unsigned long FSCalc(float stepsPerSec)
 {
-  float temp = (stepsPerSec * .065536)-.5;
+  float temp = (stepsPerSec * .065536 / dSPIN_Osc())-.5;
   if( (unsigned long) long(temp) > 0x000003FF) return 0x000003FF;
   else return (unsigned long) long(temp);
 }
@@ -106,7 +569,7 @@ unsigned long FSCalc(float stepsPerSec)
 // This is a 14-bit value, so we need to make sure the value is at or below 0x3FFF.
 unsigned long IntSpdCalc(float stepsPerSec)
 {
-  float temp = stepsPerSec * 4.1943;
+  float temp = stepsPerSec * 4.1943 / dSPIN_Osc();
   if( (unsigned long) long(temp) > 0x00003FFF) return 0x00003FFF;
   else return (unsigned long) long(temp);
 }
@@ -117,7 +580,7 @@ unsigned long IntSpdCalc(float stepsPerSec)
 // This is a 20-bit value, so we need to make sure the value is at or below 0xFFFFF.
 unsigned long SpdCalc(float stepsPerSec)
 {
-  float temp = stepsPerSec * 67.106;
+  float temp = stepsPerSec * 67.106 / dSPIN_Osc();
   if( (unsigned long) long(temp) > 0x000FFFFF) return 0x000FFFFF;
   else return (unsigned long)temp;
 }
@@ -160,14 +623,16 @@ unsigned long dSPIN_Param(unsigned long value, byte bit_len)
 }
 
 
-// This is the generic initialization function to set up the Arduino to
-//  communicate with the dSPIN chip. 
-int dSPIN_init()
+// Pin and bus setup shared by dSPIN_init() and dSPIN_init_warm().
+static int dSPIN_setup()
 {
 	int err = 0;
 	err = wiringPiSetupGpio();
   // set up the input/output pins for the application.
   pinMode(dSPIN_BUSYN, INPUT);
+  // Latch STBY/RESET high before driving it, or a warm start could glitch
+  //  it low and reset the chips after all.
+  digitalWrite(dSPIN_RESET, HIGH);
   pinMode(dSPIN_RESET, OUTPUT);
 	pinMode(dSPIN_CS, 	 OUTPUT);
 	digitalWrite(dSPIN_CS, HIGH);
@@ -188,6 +653,17 @@ int dSPIN_init()
 	//SPI_MODE3 (clock idle high, latch data on rising edge of clock)  
 	digitalWrite(dSPIN_CLK, HIGH);
 
+  bus_start();
+
+	return 0;
+}
+
+// This is the generic initialization function to set up the Arduino to
+//  communicate with the dSPIN chip. 
+int dSPIN_init()
+{
+  if (dSPIN_setup() != 0) return dSPIN_STATUS_FATAL;
+
   // reset the dSPIN chip. This could also be accomplished by
   //  calling the "dSPIN_ResetDev()" function after SPI is initialized.
   digitalWrite(dSPIN_RESET, HIGH);
@@ -196,7 +672,13 @@ int dSPIN_init()
   delay(2);
   digitalWrite(dSPIN_RESET, HIGH);
   delay(2);
-  
 
 	return 0;
+}
+
+// Set up the pins and the bus like dSPIN_init(), but leave STBY/RESET alone
+//  so the chips keep their configuration and position.
+int dSPIN_init_warm()
+{
+  return dSPIN_setup();
 }
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "dSPIN.h"
+
+//dSPIN_sweep.c - Characterization sweep and configuration profiles. Rather
+//   than pushing MAX_SPEED up by hand until the motor slips, dSPIN_Sweep()
+//   tries every ACC x KVAL_RUN x KVAL_ACC combination of a grid and binary
+//   searches MAX_SPEED for each, running a test move per probe and checking
+//   STATUS for step loss, overcurrent and thermal alarms afterwards. The
+//   combination that makes a reference move fastest (by dSPIN_PredictMove())
+//   wins, derated by a safety margin, and can be saved as a profile.
+//
+// The search assumes that if a speed stalls, every higher speed does too.
+//
+// A saved profile also lets a restarted program pick up chips that kept their
+//  power: dSPIN_Attach() compares the chip's registers with the profile by
+//  hash and only resets and reconfigures it, losing its position, if they
+//  differ.
+
+#define SWEEP_FAULTS (dSPIN_STATUS_STEP_LOSS_A | dSPIN_STATUS_STEP_LOSS_B | dSPIN_STATUS_OCD | \
+                      dSPIN_STATUS_TH_WRN | dSPIN_STATUS_TH_SD)
+
+// The registers a profile holds, and their names in a profile file.
+static const struct
+{
+  const char *name;
+  byte param;
+  size_t off;
+} profile_regs[] = {
+  { "MAX_SPEED", dSPIN_MAX_SPEED, offsetof(dSPIN_Profile, max_speed) },
+  { "MIN_SPEED", dSPIN_MIN_SPEED, offsetof(dSPIN_Profile, min_speed) },
+  { "ACC",       dSPIN_ACC,       offsetof(dSPIN_Profile, acc) },
+  { "DEC",       dSPIN_DEC,       offsetof(dSPIN_Profile, dec) },
+  { "FS_SPD",    dSPIN_FS_SPD,    offsetof(dSPIN_Profile, fs_spd) },
+  { "KVAL_HOLD", dSPIN_KVAL_HOLD, offsetof(dSPIN_Profile, kval_hold) },
+  { "KVAL_RUN",  dSPIN_KVAL_RUN,  offsetof(dSPIN_Profile, kval_run) },
+  { "KVAL_ACC",  dSPIN_KVAL_ACC,  offsetof(dSPIN_Profile, kval_acc) },
+  { "KVAL_DEC",  dSPIN_KVAL_DEC,  offsetof(dSPIN_Profile, kval_dec) },
+  { "OCD_TH",    dSPIN_OCD_TH,    offsetof(dSPIN_Profile, ocd_th) },
+  { "STALL_TH",  dSPIN_STALL_TH,  offsetof(dSPIN_Profile, stall_th) },
+  { "STEP_MODE", dSPIN_STEP_MODE, offsetof(dSPIN_Profile, step_mode) },
+  { "CONFIG",    dSPIN_CONFIG,    offsetof(dSPIN_Profile, config) },
+};
+
+#define PROFILE_REGS (sizeof(profile_regs) / sizeof(profile_regs[0]))
+
+static unsigned long *profile_field(dSPIN_Profile *p, int i)
+{
+  return (unsigned long *)((char *)p + profile_regs[i].off);
+}
+
+// Fill a profile from the chip's current registers and oscillator calibration.
+void dSPIN_Profile_Read(dSPIN_Profile *p)
+{
+  for (unsigned i = 0; i < PROFILE_REGS; i++)
+    *profile_field(p, i) = dSPIN_GetParam(profile_regs[i].param);
+  p->osc = dSPIN_Osc();
+}
+
+// Write a profile to the chip, and set its oscillator calibration. STEP_MODE
+//  can only be written with the bridges off, so this leaves the motor in HiZ.
+void dSPIN_Profile_Apply(const dSPIN_Profile *p)
+{
+  dSPIN_HardHiZ();
+  for (unsigned i = 0; i < PROFILE_REGS; i++)
+    dSPIN_SetParam(profile_regs[i].param, *profile_field((dSPIN_Profile *)p, i));
+  dSPIN_SetOsc((float)p->osc);
+}
+
+// Save a profile as "NAME 0xVALUE" lines, after an optional comment, and the
+//  oscillator calibration as "OSC ratio".
+int dSPIN_Profile_Save(const char *path, const dSPIN_Profile *p, const char *comment)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return dSPIN_STATUS_FATAL;
+  if (comment) fprintf(f, "# %s\n", comment);
+  for (unsigned i = 0; i < PROFILE_REGS; i++)
+    fprintf(f, "%-10s 0x%03lX\n", profile_regs[i].name, *profile_field((dSPIN_Profile *)p, i));
+  fprintf(f, "%-10s %.17g\n", "OSC", p->osc);
+  return fclose(f) == 0 ? dSPIN_STATUS_GOOD : dSPIN_STATUS_FATAL;
+}
+
+// Load a profile saved by dSPIN_Profile_Save(). Registers the file doesn't
+//  mention (and OSC, which older files don't have) keep the value they have
+//  in *p. An unknown name is an error, and so is a value the chip wouldn't
+//  keep as it is: too wide for its register, or with reserved bits set.
+int dSPIN_Profile_Load(const char *path, dSPIN_Profile *p)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return dSPIN_STATUS_FATAL;
+  char line[128], name[32];
+  unsigned long value;
+  int err = dSPIN_STATUS_GOOD;
+  while (fgets(line, sizeof(line), f))
+  {
+    if (line[0] == '#' || sscanf(line, "%31s", name) != 1) continue;
+    if (!strcmp(name, "OSC"))
+    {
+      if (sscanf(line, "%*s %lf", &p->osc) != 1 || p->osc <= 0)
+      {
+        err = dSPIN_STATUS_FATAL;
+        break;
+      }
+      continue;
+    }
+    unsigned i;
+    for (i = 0; i < PROFILE_REGS; i++)
+      if (!strcmp(name, profile_regs[i].name)) break;
+    if (i == PROFILE_REGS || sscanf(line, "%*s %li", (long *)&value) != 1
+        || value != dSPIN_RegEncode(dSPIN_Regs[profile_regs[i].param], value))
+    {
+      err = dSPIN_STATUS_FATAL;
+      break;
+    }
+    *profile_field(p, i) = value;
+  }
+  fclose(f);
+  return err;
+}
+
+// FNV-1a over the register values, three bytes each in the order of
+//  profile_regs. The oscillator calibration isn't on the chip, so it's left
+//  out.
+unsigned long dSPIN_Profile_Hash(const dSPIN_Profile *p)
+{
+  unsigned long h = 2166136261UL;
+  for (unsigned i = 0; i < PROFILE_REGS; i++)
+  {
+    unsigned long v = *profile_field((dSPIN_Profile *)p, i);
+    for (int b = 16; b >= 0; b -= 8)
+      h = ((h ^ ((v >> b) & 0xFF)) * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  return h;
+}
+
+// Take over the selected axis as it is if its registers hash the same as p's
+//  and it hasn't been through a power up (UVLO) since the last GetStatus():
+//  position and motion are left alone and only the oscillator calibration is
+//  taken from p. Otherwise reset the chip, apply p (leaving it in HiZ) and
+//  check it took.
+int dSPIN_Attach(const dSPIN_Profile *p)
+{
+  dSPIN_Profile live;
+  unsigned int status = dSPIN_GetParam(dSPIN_STATUS);
+  dSPIN_Profile_Read(&live);
+  if ((status & dSPIN_STATUS_UVLO) && dSPIN_Profile_Hash(&live) == dSPIN_Profile_Hash(p))
+  {
+    dSPIN_SetOsc((float)p->osc);
+    return dSPIN_ATTACH_WARM;
+  }
+  dSPIN_ResetDev();
+  dSPIN_GetStatus();
+  dSPIN_Profile_Apply(p);
+  dSPIN_Profile_Read(&live);
+  return dSPIN_Profile_Hash(&live) == dSPIN_Profile_Hash(p) ? dSPIN_ATTACH_COLD : dSPIN_ATTACH_FAILED;
+}
+
+// Run one test move with the given MAX_SPEED and return the alarms it raised.
+static unsigned int sweep_probe(const dSPIN_SweepGrid *g, unsigned long max_speed,
+                                unsigned long acc, byte dir)
+{
+  int ms = 1 << (dSPIN_GetParam(dSPIN_STEP_MODE) & dSPIN_STEP_MODE_STEP_SEL);
+  dSPIN_SetParam(dSPIN_MAX_SPEED, max_speed);
+  // Long enough to ramp up to speed, hold it for cruise_steps and ramp down.
+  float v = max_speed / 0.065536f;
+  float a = acc / 0.137438f;
+  float steps = v * v / a + g->cruise_steps;
+  unsigned long n = (unsigned long)(steps * ms);
+  if (n > 0x3FFFFF) n = 0x3FFFFF;
+
+  dSPIN_GetStatus();
+  dSPIN_Move(dir, n);
+  while (dSPIN_Busy()) delay(1);
+  return ~dSPIN_GetStatus() & SWEEP_FAULTS;
+}
+
+// Sweep the grid g. pts gets one entry per combination (n_acc * n_kval_run *
+//  n_kval_acc of them); *best gets the chip's registers with the winning
+//  combination, derated, in place. Returns the index of the winner in pts,
+//  or -1 if no combination ran clean even at the bottom of the speed range.
+int dSPIN_Sweep(const dSPIN_SweepGrid *g, dSPIN_SweepPoint *pts, dSPIN_Profile *best)
+{
+  dSPIN_Profile base;
+  dSPIN_Profile_Read(&base);
+  unsigned long lo_reg = MaxSpdCalc(g->min_speed), hi_reg = MaxSpdCalc(g->max_speed);
+  byte dir = FWD;
+  int n = 0;
+
+  for (int ia = 0; ia < g->n_acc; ia++)
+    for (int ir = 0; ir < g->n_kval_run; ir++)
+      for (int ik = 0; ik < g->n_kval_acc; ik++, n++)
+      {
+        dSPIN_SweepPoint *pt = &pts[n];
+        memset(pt, 0, sizeof(*pt));
+        pt->acc = g->acc[ia];
+        pt->kval_run = g->kval_run[ir];
+        pt->kval_acc = g->kval_acc[ik];
+        unsigned long acc = AccCalc(pt->acc);
+        dSPIN_SetParam(dSPIN_ACC, acc);
+        dSPIN_SetParam(dSPIN_DEC, DecCalc(pt->acc));
+        dSPIN_SetParam(dSPIN_KVAL_RUN, pt->kval_run);
+        dSPIN_SetParam(dSPIN_KVAL_ACC, pt->kval_acc);
+        dSPIN_SetParam(dSPIN_KVAL_DEC, pt->kval_acc);
+
+        // Largest clean MAX_SPEED in [lo_reg, hi_reg]. Alternate direction so
+        //  the sweep doesn't wander off along the axis.
+        unsigned long lo = lo_reg, hi = hi_reg;
+        unsigned int f = sweep_probe(g, lo, acc, dir);
+        dir = dir == FWD ? REV : FWD;
+        pt->tests++;
+        if (f)
+        {
+          pt->fault = f;
+          continue;
+        }
+        f = sweep_probe(g, hi, acc, dir);
+        dir = dir == FWD ? REV : FWD;
+        pt->tests++;
+        if (!f) lo = hi;
+        else
+        {
+          pt->fault = f;
+          while (hi - lo > 1)
+          {
+            unsigned long mid = lo + (hi - lo) / 2;
+            f = sweep_probe(g, mid, acc, dir);
+            dir = dir == FWD ? REV : FWD;
+            pt->tests++;
+            if (f) { hi = mid; pt->fault = f; }
+            else lo = mid;
+          }
+        }
+        pt->max_speed = lo;
+
+        // Rank by how long the reference move takes at the derated speed.
+        dSPIN_MotionState st;
+        dSPIN_Prediction p;
+        memset(&st, 0, sizeof(st));
+        st.acc = acc;
+        st.dec = DecCalc(pt->acc);
+        st.max_speed = (unsigned long)(lo * g->margin);
+        st.min_speed = base.min_speed;
+        st.fs_spd = base.fs_spd;
+        st.step_mode = base.step_mode;
+        int ms = 1 << (base.step_mode & dSPIN_STEP_MODE_STEP_SEL);
+        dSPIN_PredictMove(&st, FWD, g->ref_steps * ms, &p);
+        pt->ref_ticks = p.ticks;
+      }
+
+  int win = -1;
+  for (int i = 0; i < n; i++)
+  {
+    if (pts[i].max_speed == 0) continue;
+    if (win < 0 || pts[i].ref_ticks < pts[win].ref_ticks
+        || (pts[i].ref_ticks == pts[win].ref_ticks
+            && pts[i].kval_run + pts[i].kval_acc < pts[win].kval_run + pts[win].kval_acc))
+      win = i;
+  }
+
+  *best = base;
+  if (win >= 0)
+  {
+    best->max_speed = (unsigned long)(pts[win].max_speed * g->margin);
+    best->acc = AccCalc(pts[win].acc);
+    best->dec = DecCalc(pts[win].acc);
+    best->kval_run = pts[win].kval_run;
+    best->kval_acc = best->kval_dec = pts[win].kval_acc;
+  }
+  // Put the registers back the way they were found.
+  dSPIN_Profile_Apply(&base);
+  dSPIN_GetStatus();
+  return win;
+}
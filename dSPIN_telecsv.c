@@ -0,0 +1,35 @@
+//dSPIN_telecsv.c - Exports a telemetry recording (see dSPIN_telemetry.c) as
+//										CSV, all of it or the samples between two times.
+//  usage: telecsv <recording> [from s] [to s]
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dSPIN.h"
+
+int main(int argc, char* argv[]){
+	if(argc<2){
+		fprintf(stderr, "usage: %s <recording> [from s] [to s]\n", argv[0]);
+		return 2;
+	}
+	unsigned long long from = argc>2 ? (unsigned long long)(atof(argv[2]) * 1e9) : 0;
+	unsigned long long to = argc>3 ? (unsigned long long)(atof(argv[3]) * 1e9) : ~0ULL;
+
+	dSPIN_TeleReader *r = dSPIN_TeleReader_Open(argv[1], from, to);
+	if(r == NULL){
+		fprintf(stderr, "%s: not a telemetry recording\n", argv[1]);
+		return 1;
+	}
+	dSPIN_TeleSample s;
+	int got;
+	printf("t_s,axis,abs_pos,speed,speed_steps_s,status,adc_out\n");
+	while((got = dSPIN_TeleReader_Next(r, &s)) > 0)
+		printf("%llu.%09llu,%d,%ld,%lu,%.3f,0x%04X,%u\n", s.t_ns / 1000000000ULL,
+		       s.t_ns % 1000000000ULL, s.axis, s.abs_pos, s.speed, dSPIN_StepsPerSec(s.speed),
+		       s.status, s.adc);
+	dSPIN_TeleReader_Close(r);
+	if(got < 0){
+		fprintf(stderr, "%s: damaged recording\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
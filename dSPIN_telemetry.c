@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "dSPIN.h"
+
+//dSPIN_telemetry.c - Telemetry recorder. Samples of SPEED, ABS_POS, STATUS and
+//   ADC_OUT go into preallocated chunks of dSPIN_TELEMETRY_CHUNK samples,
+//   stored by column and delta encoded as varints, so a sample of a steadily
+//   moving axis takes a handful of bytes instead of a line of text. Full
+//   chunks are handed to a writer thread, and the sampling thread never waits
+//   for the file: if every chunk is still waiting to be written, samples are
+//   dropped and counted instead.
+//
+// A file is an 8-byte header (dSPIN_TELEMETRY_MAGIC, then the version and
+//  three zero bytes) and a list of chunks, each a header (sample count, first
+//  and last time, and the byte length of each column) followed by its columns:
+//    time     ns since the sample before
+//    axis     axis number
+//    speed    SPEED, less the axis' last SPEED
+//    abs_pos  ABS_POS, less the axis' last ABS_POS (on the 22-bit circle)
+//    status   STATUS, XORed with the axis' last STATUS
+//    adc      ADC_OUT, less the axis' last ADC_OUT
+//  Differences are zigzag encoded so small ones of either sign stay small. At
+//  the start of a chunk every axis' "last" values are 0 and the time is the
+//  chunk's first, so a chunk decodes on its own and a reader can skip to the
+//  range it wants by the chunk headers alone. Values are little endian.
+
+#define TELE_HEADER  8
+#define TELE_COLUMNS 6
+#define TELE_CHUNK_HEADER (4 + 8 + 8 + 4 * TELE_COLUMNS)
+
+// Longest varint of each column: 64-bit time deltas, 7-bit axes, zigzagged
+//  20-bit SPEED, 22-bit ABS_POS and 5-bit ADC_OUT differences, 16-bit STATUS.
+static const int tele_width[TELE_COLUMNS] = { 10, 1, 3, 4, 3, 1 };
+
+struct tele_chunk
+{
+  unsigned long samples;
+  unsigned long long first, last;
+  byte *col[TELE_COLUMNS];
+  unsigned long len[TELE_COLUMNS];
+  struct tele_chunk *next;
+};
+
+// Each axis' last values within the current chunk.
+struct tele_last
+{
+  unsigned long speed;
+  long abs_pos;
+  unsigned int status;
+  byte adc;
+};
+
+struct dSPIN_Telemetry
+{
+  FILE *f;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t full;
+  struct tele_chunk *pool;       // all of them, for freeing
+  struct tele_chunk *free_list;
+  struct tele_chunk *queue, *tail;
+  struct tele_chunk *cur;        // being filled; only the sampling thread touches it
+  struct tele_last last[dSPIN_MAX_AXES];
+  int chunks;
+  int quit;
+  int error;
+  dSPIN_TelemetryStats stats;
+};
+
+static unsigned long tele_zigzag(long v)
+{
+  return ((unsigned long)v << 1) ^ (unsigned long)(v >> (8 * sizeof(long) - 1));
+}
+
+static long tele_unzigzag(unsigned long v)
+{
+  return (long)(v >> 1) ^ -(long)(v & 1);
+}
+
+static void tele_put(struct tele_chunk *c, int col, unsigned long long v)
+{
+  byte *p = c->col[col] + c->len[col];
+  while (v >= 0x80)
+  {
+    *p++ = (byte)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (byte)v;
+  c->len[col] = p - c->col[col];
+}
+
+static void tele_put_le(byte *p, unsigned long long v, int n)
+{
+  for (int i = 0; i < n; i++) p[i] = (byte)(v >> (8 * i));
+}
+
+static unsigned long long tele_get_le(const byte *p, int n)
+{
+  unsigned long long v = 0;
+  for (int i = 0; i < n; i++) v |= (unsigned long long)p[i] << (8 * i);
+  return v;
+}
+
+static void tele_start(dSPIN_Telemetry *t, struct tele_chunk *c)
+{
+  c->samples = 0;
+  memset(c->len, 0, sizeof(c->len));
+  memset(t->last, 0, sizeof(t->last));
+}
+
+static int tele_write(FILE *f, const struct tele_chunk *c)
+{
+  byte h[TELE_CHUNK_HEADER];
+  tele_put_le(h, c->samples, 4);
+  tele_put_le(h + 4, c->first, 8);
+  tele_put_le(h + 12, c->last, 8);
+  for (int k = 0; k < TELE_COLUMNS; k++) tele_put_le(h + 20 + 4 * k, c->len[k], 4);
+  int ok = fwrite(h, 1, sizeof(h), f) == sizeof(h);
+  for (int k = 0; k < TELE_COLUMNS; k++)
+    ok = ok && fwrite(c->col[k], 1, c->len[k], f) == c->len[k];
+  return ok;
+}
+
+static void *tele_writer(void *arg)
+{
+  dSPIN_Telemetry *t = (dSPIN_Telemetry *)arg;
+  pthread_mutex_lock(&t->lock);
+  for (;;)
+  {
+    while (t->queue == NULL && !t->quit) pthread_cond_wait(&t->full, &t->lock);
+    struct tele_chunk *c = t->queue;
+    if (c == NULL) break;
+    t->queue = c->next;
+    if (t->queue == NULL) t->tail = NULL;
+    pthread_mutex_unlock(&t->lock);
+
+    int ok = tele_write(t->f, c);
+    unsigned long bytes = TELE_CHUNK_HEADER;
+    for (int k = 0; k < TELE_COLUMNS; k++) bytes += c->len[k];
+
+    pthread_mutex_lock(&t->lock);
+    if (ok)
+    {
+      t->stats.chunks++;
+      t->stats.bytes += bytes;
+    }
+    else t->error = 1;
+    c->next = t->free_list;
+    t->free_list = c;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return NULL;
+}
+
+// Start recording to path with chunks buffers (at least 2) to spread writes
+//  over. Returns NULL if the file can't be made.
+dSPIN_Telemetry *dSPIN_Telemetry_Create(const char *path, int chunks)
+{
+  if (chunks < 2) chunks = 2;
+  dSPIN_Telemetry *t = (dSPIN_Telemetry *)calloc(1, sizeof(*t));
+  if (t == NULL) return NULL;
+  t->chunks = chunks;
+  t->pool = (struct tele_chunk *)calloc(chunks, sizeof(struct tele_chunk));
+  int ok = t->pool != NULL;
+  for (int i = 0; ok && i < chunks; i++)
+    for (int k = 0; ok && k < TELE_COLUMNS; k++)
+      ok = (t->pool[i].col[k] = (byte *)malloc(dSPIN_TELEMETRY_CHUNK * tele_width[k])) != NULL;
+  if (ok) t->f = fopen(path, "wb");
+  if (t->f)
+  {
+    byte h[TELE_HEADER] = { 0 };
+    memcpy(h, dSPIN_TELEMETRY_MAGIC, 4);
+    h[4] = dSPIN_TELEMETRY_VERSION;
+    ok = fwrite(h, 1, sizeof(h), t->f) == sizeof(h);
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->full, NULL);
+  if (!ok || t->f == NULL || pthread_create(&t->writer, NULL, tele_writer, t) != 0)
+  {
+    if (t->f) fclose(t->f);
+    for (int i = 0; t->pool && i < chunks; i++)
+      for (int k = 0; k < TELE_COLUMNS; k++) free(t->pool[i].col[k]);
+    free(t->pool);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->full);
+    free(t);
+    return NULL;
+  }
+  for (int i = 1; i < chunks; i++)
+  {
+    t->pool[i].next = t->free_list;
+    t->free_list = &t->pool[i];
+  }
+  t->cur = &t->pool[0];
+  tele_start(t, t->cur);
+  return t;
+}
+
+// Queue the current chunk for the writer and take a free one, if there is one.
+static void tele_hand_over(dSPIN_Telemetry *t)
+{
+  pthread_mutex_lock(&t->lock);
+  struct tele_chunk *c = t->cur;
+  if (c && c->samples)
+  {
+    c->next = NULL;
+    if (t->tail) t->tail->next = c;
+    else t->queue = c;
+    t->tail = c;
+    pthread_cond_signal(&t->full);
+    c = NULL;
+  }
+  if (c == NULL && t->free_list)
+  {
+    c = t->free_list;
+    t->free_list = c->next;
+  }
+  pthread_mutex_unlock(&t->lock);
+  t->cur = c;
+  if (c) tele_start(t, c);
+}
+
+// Record one sample. Values are register values and are cut down to the
+//  registers' widths. Samples have to come in time order; only one thread
+//  should add them.
+void dSPIN_Telemetry_Add(dSPIN_Telemetry *t, const dSPIN_TeleSample *s)
+{
+  if (s->axis < 0 || s->axis >= dSPIN_MAX_AXES) return;
+  if (t->cur == NULL) tele_hand_over(t);
+  struct tele_chunk *c = t->cur;
+  if (c == NULL)
+  {
+    t->stats.dropped++;
+    return;
+  }
+
+  struct tele_last *l = &t->last[s->axis];
+  unsigned long speed = s->speed & 0xFFFFF;
+  long pos = s->abs_pos & 0x3FFFFF;
+  unsigned int status = s->status & 0xFFFF;
+  byte adc = s->adc & 0x1F;
+  long dpos = (pos - l->abs_pos) & 0x3FFFFF;
+  if (dpos & 0x200000) dpos -= 0x400000;
+
+  if (c->samples == 0) c->first = c->last = s->t_ns;
+  tele_put(c, 0, s->t_ns - c->last);
+  tele_put(c, 1, s->axis);
+  tele_put(c, 2, tele_zigzag((long)speed - (long)l->speed));
+  tele_put(c, 3, tele_zigzag(dpos));
+  tele_put(c, 4, status ^ l->status);
+  tele_put(c, 5, tele_zigzag((long)adc - (long)l->adc));
+  c->last = s->t_ns;
+  l->speed = speed;
+  l->abs_pos = pos;
+  l->status = status;
+  l->adc = adc;
+  t->stats.samples++;
+  if (++c->samples == dSPIN_TELEMETRY_CHUNK) tele_hand_over(t);
+}
+
+// Read SPEED, ABS_POS, STATUS and ADC_OUT from axis in one go and record
+//  them. Leaves the axis this thread has selected as it was.
+void dSPIN_Telemetry_Sample(dSPIN_Telemetry *t, int axis)
+{
+  dSPIN_TeleSample s;
+  int was = dSPIN_Selected();
+  dSPIN_Select(axis);
+  dSPIN_Bus_Begin();
+  s.speed = dSPIN_GetParam(dSPIN_SPEED);
+  s.abs_pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  s.status = dSPIN_GetParam(dSPIN_STATUS);
+  s.adc = (byte)dSPIN_GetParam(dSPIN_ADC_OUT);
+  dSPIN_Bus_End();
+  dSPIN_Select(was);
+  s.t_ns = dSPIN_Now();
+  s.axis = axis;
+  dSPIN_Telemetry_Add(t, &s);
+}
+
+void dSPIN_Telemetry_GetStats(dSPIN_Telemetry *t, dSPIN_TelemetryStats *stats)
+{
+  pthread_mutex_lock(&t->lock);
+  *stats = t->stats;
+  pthread_mutex_unlock(&t->lock);
+}
+
+// Write out what's left and close the file, with the final counts in stats
+//  unless it's NULL. Returns -1 if anything failed to be written.
+int dSPIN_Telemetry_Close(dSPIN_Telemetry *t, dSPIN_TelemetryStats *stats)
+{
+  tele_hand_over(t);
+  pthread_mutex_lock(&t->lock);
+  t->quit = 1;
+  pthread_cond_signal(&t->full);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->writer, NULL);
+  int err = t->error | (fclose(t->f) != 0);
+  if (stats) *stats = t->stats;
+  for (int i = 0; i < t->chunks; i++)
+    for (int k = 0; k < TELE_COLUMNS; k++) free(t->pool[i].col[k]);
+  free(t->pool);
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->full);
+  free(t);
+  return err ? -1 : 0;
+}
+
+/***************** reading ***********************/
+
+struct dSPIN_TeleReader
+{
+  FILE *f;
+  unsigned long long from, to;
+  byte *buf;
+  const byte *col[TELE_COLUMNS], *end[TELE_COLUMNS];
+  unsigned long left;            // samples still to decode in this chunk
+  unsigned long long t;
+  struct tele_last last[dSPIN_MAX_AXES];
+};
+
+// Open a recording for the samples from from_ns to to_ns (inclusive), by
+//  dSPIN_Now() time. Returns NULL if it isn't one.
+dSPIN_TeleReader *dSPIN_TeleReader_Open(const char *path, unsigned long long from_ns,
+                                        unsigned long long to_ns)
+{
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  byte h[TELE_HEADER];
+  dSPIN_TeleReader *r = NULL;
+  if (fread(h, 1, sizeof(h), f) == sizeof(h) && !memcmp(h, dSPIN_TELEMETRY_MAGIC, 4)
+      && h[4] == dSPIN_TELEMETRY_VERSION && !h[5] && !h[6] && !h[7])
+    r = (dSPIN_TeleReader *)calloc(1, sizeof(*r));
+  unsigned long room = 0;
+  for (int k = 0; k < TELE_COLUMNS; k++) room += dSPIN_TELEMETRY_CHUNK * tele_width[k];
+  if (r) r->buf = (byte *)malloc(room);
+  if (r == NULL || r->buf == NULL)
+  {
+    free(r);
+    fclose(f);
+    return NULL;
+  }
+  r->f = f;
+  r->from = from_ns;
+  r->to = to_ns;
+  return r;
+}
+
+static int tele_get(dSPIN_TeleReader *r, int col, unsigned long long *v)
+{
+  *v = 0;
+  for (int shift = 0; r->col[col] < r->end[col] && shift < 64; shift += 7)
+  {
+    byte b = *r->col[col]++;
+    *v |= (unsigned long long)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return 1;
+  }
+  return 0;
+}
+
+// Load the next chunk that overlaps the range. Returns 1, 0 at the end, or
+//  -1 if the file is damaged.
+static int tele_chunk(dSPIN_TeleReader *r)
+{
+  for (;;)
+  {
+    byte h[TELE_CHUNK_HEADER];
+    size_t got = fread(h, 1, sizeof(h), r->f);
+    if (got == 0 && feof(r->f)) return 0;
+    if (got != sizeof(h)) return -1;
+    unsigned long samples = tele_get_le(h, 4);
+    unsigned long long first = tele_get_le(h + 4, 8), last = tele_get_le(h + 12, 8);
+    unsigned long len[TELE_COLUMNS], total = 0;
+    for (int k = 0; k < TELE_COLUMNS; k++)
+    {
+      len[k] = tele_get_le(h + 20 + 4 * k, 4);
+      if (len[k] > (unsigned long)dSPIN_TELEMETRY_CHUNK * tele_width[k]) return -1;
+      total += len[k];
+    }
+    if (samples == 0 || samples > dSPIN_TELEMETRY_CHUNK || last < first) return -1;
+    // Chunks are in time order: past the range, nothing more can be in it.
+    if (first > r->to) return 0;
+    if (last < r->from)
+    {
+      if (fseek(r->f, total, SEEK_CUR)) return -1;
+      continue;
+    }
+    if (fread(r->buf, 1, total, r->f) != total) return -1;
+    const byte *p = r->buf;
+    for (int k = 0; k < TELE_COLUMNS; k++)
+    {
+      r->col[k] = p;
+      r->end[k] = p += len[k];
+    }
+    r->left = samples;
+    r->t = first;
+    memset(r->last, 0, sizeof(r->last));
+    return 1;
+  }
+}
+
+// Decode the next sample in the range into s. Returns 1, 0 at the end, or -1
+//  if the file is damaged.
+int dSPIN_TeleReader_Next(dSPIN_TeleReader *r, dSPIN_TeleSample *s)
+{
+  for (;;)
+  {
+    if (r->left == 0)
+    {
+      int got = tele_chunk(r);
+      if (got <= 0) return got;
+    }
+    unsigned long long v[TELE_COLUMNS];
+    for (int k = 0; k < TELE_COLUMNS; k++)
+      if (!tele_get(r, k, &v[k])) return -1;
+    if (v[1] >= dSPIN_MAX_AXES) return -1;
+    r->left--;
+
+    struct tele_last *l = &r->last[v[1]];
+    r->t += v[0];
+    l->speed = (l->speed + tele_unzigzag(v[2])) & 0xFFFFF;
+    l->abs_pos = (l->abs_pos + tele_unzigzag(v[3])) & 0x3FFFFF;
+    l->status ^= v[4] & 0xFFFF;
+    l->adc = (l->adc + tele_unzigzag(v[5])) & 0x1F;
+    if (r->t < r->from) continue;
+    if (r->t > r->to) return 0;
+    s->t_ns = r->t;
+    s->axis = (int)v[1];
+    s->speed = l->speed;
+    s->abs_pos = l->abs_pos & 0x200000 ? l->abs_pos - 0x400000 : l->abs_pos;
+    s->status = l->status;
+    s->adc = l->adc;
+    return 1;
+  }
+}
+
+void dSPIN_TeleReader_Close(dSPIN_TeleReader *r)
+{
+  fclose(r->f);
+  free(r->buf);
+  free(r);
+}
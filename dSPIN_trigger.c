@@ -0,0 +1,234 @@
+#include <limits.h>
+#include <string.h>
+#include "dSPIN.h"
+
+//dSPIN_trigger.c - Position triggers. A camera that has to fire as the axis
+//   crosses a given ABS_POS can't wait for a status poll to see it: a read
+//   takes a frame, and the motor covers a good many microsteps between
+//   reads. The profile predictor already knows when the motor will be where,
+//   so each threshold gets a crossing time from the predicted profile as the
+//   move is issued, and a timer is set for it.
+//
+// The prediction is only as good as the chip's oscillator, which can be off
+//  by several percent. As each crossing approaches, ABS_POS is read a few
+//  times (dSPIN_TRIG_LEAD_US ahead, then a quarter of that, and so on). Each
+//  read says where on the predicted profile the motor really is; two of them
+//  say how fast the chip's clock runs against ours. The trigger is timed
+//  from the latest read, scaled by that rate, so the estimate gets better as
+//  the distance left to extrapolate gets shorter.
+//
+// The trigger is a rising edge on a GPIO and/or a callback. ABS_POS is read
+//  once more straight after, which is how the error of each trigger is
+//  measured: where the motor was when the edge went out, turned into time
+//  along the profile.
+
+// Leads shorter than this aren't worth a read: the frame takes about as long.
+#define TRIG_MIN_LEAD_US 200
+
+typedef struct
+{
+  unsigned long long at_ns;      // middle of the frame
+  long off;                      // microsteps from the start, FWD positive
+  double tick;                   // where that is on the predicted profile
+} TrigRead;
+
+typedef struct
+{
+  const dSPIN_Prediction *p;
+  long start;                    // ABS_POS when the command went out
+  unsigned long long t0;         //  and dSPIN_Now() then
+  TrigRead first, last;
+  int n_reads;
+} TrigState;
+
+// ABS_POS is a 22-bit two's complement counter.
+static long trig_wrap(long d)
+{
+  d &= 0x3FFFFF;
+  if (d & 0x200000) d -= 0x400000;
+  return d;
+}
+
+// Where on the profile off was passed: the motor reads off from the tick it
+//  reaches it until the tick it reaches the next microstep, so take the middle.
+static double trig_tick(const dSPIN_Prediction *p, long off)
+{
+  unsigned long long a = dSPIN_PredictTimeTo(p, off);
+  unsigned long long b = dSPIN_PredictTimeTo(p, off + (p->dir == FWD ? 1 : -1));
+  if (a == ULLONG_MAX) return -1;
+  if (b == ULLONG_MAX) return (double)a;
+  return (a + b) / 2.0;
+}
+
+// Read ABS_POS and place it on the profile.
+static void trig_read(TrigState *s)
+{
+  TrigRead r;
+  unsigned long long before = dSPIN_Now();
+  long pos = (long)dSPIN_GetParam(dSPIN_ABS_POS);
+  unsigned long long after = dSPIN_Now();
+  r.at_ns = before + (after - before) / 2;
+  r.off = trig_wrap(pos - s->start);
+  r.tick = trig_tick(s->p, r.off);
+  // Still at the start, or past where the profile ends: no use for timing.
+  if (r.off == 0 || r.tick < 0) return;
+  if (s->n_reads++ == 0) s->first = r;
+  s->last = r;
+}
+
+// Our nanoseconds per predicted nanosecond, from the reads so far.
+static double trig_rate(const TrigState *s)
+{
+  if (s->n_reads < 2 || s->last.tick - s->first.tick < 1000) return 1.0;
+  double rate = (s->last.at_ns - s->first.at_ns) /
+                (double)dSPIN_TicksToNs((unsigned long long)(s->last.tick - s->first.tick));
+  if (rate < 0.8) rate = 0.8;
+  if (rate > 1.25) rate = 1.25;
+  return rate;
+}
+
+// When the motor reaches the microstep at tick, going by the reads so far.
+static unsigned long long trig_when(const TrigState *s, double tick)
+{
+  if (s->n_reads == 0) return s->t0 + dSPIN_TicksToNs((unsigned long long)tick);
+  double d = tick - s->last.tick;
+  double ns = dSPIN_TicksToNs((unsigned long long)(d < 0 ? -d : d)) * trig_rate(s);
+  return d < 0 ? s->last.at_ns - (unsigned long long)ns : s->last.at_ns + (unsigned long long)ns;
+}
+
+// Fire the triggers in ev[] along the motion predicted by p, which was issued
+//  at t0 from ABS_POS start.
+static int trig_run(const dSPIN_Prediction *p, long start, unsigned long long t0,
+                    dSPIN_TrigEvent *ev, int n, byte pin, void (*fire)(int i, void *arg),
+                    void *arg)
+{
+  TrigState s;
+  memset(&s, 0, sizeof(s));
+  s.p = p;
+  s.start = start;
+  s.t0 = t0;
+
+  // Crossing ticks from the profile alone; events are served in that order.
+  double tick[dSPIN_TRIG_MAX];
+  int order[dSPIN_TRIG_MAX], n_order = 0;
+  for (int i = 0; i < n; i++)
+  {
+    ev[i].result = dSPIN_TRIG_UNREACHED;
+    ev[i].reads = 0;
+    ev[i].predicted_ns = ev[i].refined_ns = ev[i].fired_ns = 0;
+    ev[i].error_ns = 0;
+    tick[i] = trig_tick(p, trig_wrap(ev[i].pos - start));
+    if (tick[i] < 0) continue;
+    ev[i].predicted_ns = t0 + dSPIN_TicksToNs((unsigned long long)tick[i]);
+    int k = n_order++;
+    while (k > 0 && tick[order[k - 1]] > tick[i])
+    {
+      order[k] = order[k - 1];
+      k--;
+    }
+    order[k] = i;
+  }
+
+  int missed = n - n_order;
+  for (int j = 0; j < n_order; j++)
+  {
+    int i = order[j];
+    // Refine: read ahead of the crossing at shrinking leads.
+    for (unsigned long lead = dSPIN_TRIG_LEAD_US; lead >= TRIG_MIN_LEAD_US; lead /= 4)
+    {
+      unsigned long long at = trig_when(&s, tick[i]);
+      if (at < dSPIN_Now() + lead * 1000ULL) continue;
+      dSPIN_SleepUntil(at - lead * 1000ULL);
+      trig_read(&s);
+      ev[i].reads++;
+    }
+    // Sleep most of the way and let the last stretch be short enough to be
+    //  busy-waited.
+    unsigned long long at = trig_when(&s, tick[i]);
+    ev[i].refined_ns = at;
+    if (at > dSPIN_Now() + dSPIN_TRIG_SPIN_NS) dSPIN_SleepUntil(at - dSPIN_TRIG_SPIN_NS);
+    dSPIN_SleepUntil(at);
+
+    if (pin != dSPIN_NO_PIN) digitalWrite(pin, HIGH);
+    ev[i].fired_ns = dSPIN_Now();
+    if (fire != NULL) fire(i, arg);
+    ev[i].result = dSPIN_TRIG_FIRED;
+    // Measure it: the read after the edge, less the time from the threshold
+    //  to where that read found the motor.
+    trig_read(&s);
+    if (pin != dSPIN_NO_PIN) digitalWrite(pin, LOW);
+    ev[i].error_ns = (long long)ev[i].fired_ns - (long long)trig_when(&s, tick[i]);
+  }
+  return missed;
+}
+
+// Mark the triggers of a command the limits refused, none of which it reaches.
+static int trig_refused(dSPIN_TrigEvent *ev, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    ev[i].result = dSPIN_TRIG_REFUSED;
+    ev[i].reads = 0;
+    ev[i].predicted_ns = ev[i].refined_ns = ev[i].fired_ns = 0;
+    ev[i].error_ns = 0;
+  }
+  return n;
+}
+
+// Issue dSPIN_Move(dir, n_step) on the selected axis and fire a trigger as it
+//  crosses each ev[i].pos (ABS_POS), n of them, at most dSPIN_TRIG_MAX. Each
+//  trigger raises pin (unless it's dSPIN_NO_PIN) for one ABS_POS read and
+//  calls fire(i, arg) (unless it's NULL). Returns once the last one has gone
+//  out, with the timing of each in ev[]; the return value is how many of them
+//  the move never reaches. If the limits refuse the move (see dSPIN_limits.c)
+//  every trigger is marked dSPIN_TRIG_REFUSED and none fires.
+int dSPIN_Trigger_Move(byte dir, unsigned long n_step, dSPIN_TrigEvent *ev, int n, byte pin,
+                       void (*fire)(int i, void *arg), void *arg)
+{
+  if (n > dSPIN_TRIG_MAX) n = dSPIN_TRIG_MAX;
+  int cls = dSPIN_Bus_Class();
+  dSPIN_Bus_SetClass(dSPIN_BUS_HIGH);
+  if (pin != dSPIN_NO_PIN)
+  {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+
+  dSPIN_MotionState st;
+  dSPIN_Prediction p;
+  dSPIN_GetMotionState(&st);
+  dSPIN_PredictMove(&st, dir, n_step, &p);
+  dSPIN_Move(dir, n_step);
+  int missed;
+  if (dSPIN_Limits_Last(NULL) != dSPIN_LIMIT_OK) missed = trig_refused(ev, n);
+  else missed = trig_run(&p, st.abs_pos, dSPIN_Now(), ev, n, pin, fire, arg);
+
+  dSPIN_Bus_SetClass(cls);
+  return missed;
+}
+
+// The same for dSPIN_GoTo(pos).
+int dSPIN_Trigger_GoTo(unsigned long pos, dSPIN_TrigEvent *ev, int n, byte pin,
+                       void (*fire)(int i, void *arg), void *arg)
+{
+  if (n > dSPIN_TRIG_MAX) n = dSPIN_TRIG_MAX;
+  int cls = dSPIN_Bus_Class();
+  dSPIN_Bus_SetClass(dSPIN_BUS_HIGH);
+  if (pin != dSPIN_NO_PIN)
+  {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+
+  dSPIN_MotionState st;
+  dSPIN_Prediction p;
+  dSPIN_GetMotionState(&st);
+  dSPIN_PredictGoTo(&st, pos, &p);
+  dSPIN_GoTo(pos);
+  int missed;
+  if (dSPIN_Limits_Last(NULL) != dSPIN_LIMIT_OK) missed = trig_refused(ev, n);
+  else missed = trig_run(&p, st.abs_pos, dSPIN_Now(), ev, n, pin, fire, arg);
+
+  dSPIN_Bus_SetClass(cls);
+  return missed;
+}
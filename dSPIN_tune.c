@@ -0,0 +1,63 @@
+//dSPIN_tune.c - Measures the chip's oscillator and finds the fastest settings
+//										the motor runs without stalling, and writes them to a
+//										profile file.
+//  usage: tune <profile> [max steps/s]
+//  The motor must be free to turn several thousand steps either way.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dSPIN.h"
+
+static const float accs[] = { 200, 500, 1000, 2000, 4000 };
+static const byte kval_runs[] = { 0x40, 0x60, 0x80, 0xA0, 0xC0 };
+static const byte kval_accs[] = { 0x60, 0x80, 0xA0, 0xC0, 0xE0 };
+
+#define N(a) (int)(sizeof(a)/sizeof(a[0]))
+
+int main(int argc, char* argv[]){
+	if(argc<2){
+		fprintf(stderr, "usage: %s <profile> [max steps/s]\n", argv[0]);
+		return 1;
+	}
+	dSPIN_SweepGrid g;
+	g.acc = accs;           g.n_acc = N(accs);
+	g.kval_run = kval_runs; g.n_kval_run = N(kval_runs);
+	g.kval_acc = kval_accs; g.n_kval_acc = N(kval_accs);
+	g.min_speed = 50;
+	g.max_speed = argc>2 ? atof(argv[2]) : 1500;
+	g.cruise_steps = 400;
+	g.ref_steps = 2000;
+	g.margin = 0.8f;
+
+	dSPIN_init();
+	// Clears UVLO, set at power up.
+	dSPIN_GetStatus();
+
+	// The oscillator first, so the speeds below are what they say.
+	float osc = dSPIN_CalibrateOsc(200, 2000);
+	if(osc == 0)
+		fprintf(stderr, "oscillator calibration failed, assuming nominal 16MHz\n");
+	else
+		printf("oscillator %.3fMHz (%+.2f%%)\n", 16 * osc, (osc - 1) * 100);
+
+	dSPIN_SweepPoint pts[N(accs) * N(kval_runs) * N(kval_accs)];
+	dSPIN_Profile best;
+	int win = dSPIN_Sweep(&g, pts, &best);
+	printf("%8s %8s %8s %10s %6s %6s\n", "acc", "kval_run", "kval_acc", "max steps/s", "fault", "tests");
+	for(int i=0; i<N(pts); i++)
+		printf("%8.0f %8X %8X %10.0f %6X %6d%s\n", pts[i].acc, pts[i].kval_run, pts[i].kval_acc,
+		       pts[i].max_speed / 0.065536 * dSPIN_Osc(), pts[i].fault, pts[i].tests, i == win ? "  <-" : "");
+	if(win < 0){
+		fprintf(stderr, "no combination ran without faults\n");
+		return 1;
+	}
+	char comment[80];
+	snprintf(comment, sizeof(comment), "dSPIN tune: %.0f steps/s, %.0f steps/s/s, %.0f%% margin",
+	         best.max_speed / 0.065536 * dSPIN_Osc(), pts[win].acc, g.margin * 100);
+	if(dSPIN_Profile_Save(argv[1], &best, comment) != dSPIN_STATUS_GOOD){
+		perror(argv[1]);
+		return 1;
+	}
+	printf("wrote %s\n", argv[1]);
+	return 0;
+}
@@ -0,0 +1,35 @@
+//dSPIN_watch.c - Prints what the bus owner publishes on the status board
+//										(see dSPIN_board.c), without touching the bus.
+//  usage: watch [board] [updates/s]
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dSPIN.h"
+
+static const char *mot[] = { "stopped", "accel", "decel", "cruise" };
+
+int main(int argc, char* argv[]){
+	const char *name = argc>1 ? argv[1] : dSPIN_BOARD_NAME;
+	float rate = argc>2 ? atof(argv[2]) : 10;
+	if(rate <= 0) rate = 10;
+
+	dSPIN_Board *b = dSPIN_Board_Attach(name);
+	if(b == NULL){
+		fprintf(stderr, "%s: no status board\n", name);
+		return 1;
+	}
+	for(;;){
+		for(int i=0; i<dSPIN_Board_Axes(b); i++){
+			dSPIN_AxisState st;
+			dSPIN_Board_Read(b, i, &st);
+			if(st.stamp_ns == 0) continue;
+			printf("axis %3d  pos %9ld  speed %7.1f steps/s %s  %-7s%s%s  alarms %04X\n", i,
+			       st.abs_pos, dSPIN_StepsPerSec(st.speed), st.dir == FWD ? "fwd" : "rev", mot[st.mot_status],
+			       st.busy ? " busy" : "", st.hiz ? " hiz" : "", st.alarms);
+		}
+		printf("\n");
+		fflush(stdout);
+		usleep((useconds_t)(1e6 / rate));
+	}
+}